@@ -30,7 +30,7 @@
  *  起動時に -I オプションを指定することによって、Windows サービスとして
  *  登録することができる。
  *
- *   Usage: sted [ -I | -U ] [ [-i instance] | [-h hub[:port]] | [-p proxy[:port]] ]
+ *   Usage: sted [ -I | -U ] [ [-i instance[,...]] | [-h hub[:port][,...]] | [-p [user:password@]proxy[:port]] | [-t trace] | [-c] | [-s segment[,...]] | [-n name] | [-m mtu] | [-z] | [-k keyfile] | [-u] | [-f] | [-l links] | [-b msec] | [-w standby] ]
  *
  *  引数:
  *  
@@ -43,16 +43,86 @@
  *
  *    -i instance     ste デバイスのインスタンス番号
  *                    指定されなければ、デフォルトで 0(=\\\\.\\STE0)。
+ *                    カンマ(,)で区切って STE_MUX_MAX 個までのデバイスを
+ *                    指定すると、全てのデバイスのフレームを HUB との 1 つの
+ *                    接続に多重化して送受信する。その場合は -s でデバイス毎の
+ *                    セグメント番号を同じ順に指定する。HUB が対応して
+ *                    いなければ最初のデバイスだけ使う。
  *                 
- *    -h hub[:port]   仮想ハブ（stehub）が動作するホストを指定する。
+ *    -h hub[:port][,...]
+ *                    仮想ハブ（stehub）が動作するホストを指定する。
  *                    指定されなければ、デフォルトで localhost:80。
  *                    コロン(:)の後にポート番号が指定されていれば
  *                    そのポート番号に接続にいく。デフォルトは 80。
+ *                    IPv6 のアドレスは [2001:db8::1]:80 のように [] で囲む。
+ *                    接続できなければ、待ち時間を伸ばしながら接続し直す。
+ *                    カンマで区切って STE_HUB_MAX 個まで指定すると、先頭を
+ *                    プライマリとして、接続が切れたら次の HUB に切り替え、
+ *                    プライマリに接続できるようになったら戻る（sted_hb.h 参照）。
  *
- *    -p proxy[:port] 経由するプロキシサーバを指定する。
+ *    -p [user:password@]proxy[:port]
+ *                    経由するプロキシサーバを指定する。
  *                    デフォルトではプロキシサーバは使われない。
  *                    コロン(:)の後にポート番号が指定されていれば
  *                    そのポート番号に接続にいく。デフォルトは 80。
+ *                    @ の前にユーザ名とパスワードが指定されていれば
+ *                    Proxy-Authorization（Basic 認証）を付ける。
+ *
+ *    -t cat=rate,... トレースのカテゴリ毎のサンプリングレート。
+ *                    rate 回に 1 回だけトレースを記録する。0 なら記録しない。
+ *                    カテゴリは ste, sock, hub, dump, all。
+ *
+ *    -c              HUB との間でフレーミング v2 を使う場合に、本体の CRC32C
+ *                    も付けるよう要求する。ヘッダの CRC32C は常に付く。
+ *
+ *    -s segment      セグメント番号。HUB は同じセグメントの sted の間でだけ
+ *                    フレームを転送する。デフォルトは 0。-i で複数のデバイスを
+ *                    指定した場合はカンマで区切ってデバイスの数だけ指定する。
+ *
+ *    -n name         HUB に知らせる識別名(最大 16 文字)。デフォルトはホスト名。
+ *
+ *    -m mtu          ヘッダ込みの最大フレームサイズ。ste ドライバの MaxFrameSize
+ *                    （レジストリ）より大きくはできない。デフォルトはドライバの値。
+ *                    HUB とはリンク毎に小さい方に合わせる。
+ *
+ *    -z              HUB との間でまとめたフレームを LZ4 で圧縮する。帯域の
+ *                    細いリンク（WAN やプロキシ経由）向け。縮まないデータや
+ *                    CPU を使いすぎる場合は自動的に圧縮をやめる。
+ *
+ *    -k keyfile      HUB との間のメッセージを ChaCha20-Poly1305 で暗号化・認証
+ *                    する。keyfile には HUB と共有する 32 byte の鍵を 16 進数
+ *                    64 文字で書いておく。HUB が暗号化に合意しない間は
+ *                    フレームを送受信しない。
+ *
+ *    -u              HUB との間を UDP で送受信する（sted_udp.h 参照）。TCP の上で
+ *                    TCP を運ぶ場合の再送の干渉が無くなる。HUB から返事が無い
+ *                    場合とプロキシ経由の場合は TCP を使う。
+ *
+ *    -f              UDP の場合、データグラムに FEC のパリティを付けて送る
+ *                    （sted_fec.h 参照）。パリティの割合は HUB との間の損失率に
+ *                    合わせて変わり、損失が無ければパリティは送らない。
+ *
+ *    -l links        HUB との間に張るリンク（接続）の数。1 から MAXLINKS まで。
+ *                    デフォルトは 1。フレームはフロー（IP アドレスとポート番号）
+ *                    毎にリンクを選んで送るので、フロー毎の順番は変わらない。
+ *                    1 本の TCP 接続の輻輳ウィンドウや再送で全てのフローが
+ *                    止まることが無くなる。HUB が対応していなければ 1 本だけ使う。
+ *
+ *    -b msec         HUB にハートビート（STE_MSG_PING）を送る間隔。デフォルトは
+ *                    STE_HB_INTERVAL_MSEC。その STE_HB_MISSES 倍の間 HUB から何も
+ *                    受信しなければ、接続が切れたとみなして接続し直す。0 なら
+ *                    送らない（TCP がエラーを返すまで気付かない）。
+ *
+ *    -w standby      Proxy 経由の場合に、予備として張っておくトンネルの数
+ *                    （STE_TUNNEL_STANDBY_MAX まで）。接続が切れたら Proxy への
+ *                    接続と CONNECT を待たずに予備のトンネルに切り替える。
+ *                    デフォルトは 0（張らない）。
+ *
+ *  HUB との接続の統計情報（フレーム数や TCP の RTT, cwnd, 再送数など）は
+ *  STE_STATS_INTERVAL 秒毎に STED_STAT_FILE に書き出す。
+ *
+ *  HUB が対応していれば（sted_proto.h 参照）、ドライバから続けて読めた
+ *  フレームを STE_MSG_AGG にまとめて 1 回の send() で送る。
  *
  *****************************************************************************/
 #include <stdio.h>
@@ -76,6 +146,10 @@
 #include <ndisguid.h> // for GUID_NDIS_LAN_CLASS
 #include "ste.h"
 #include "sted.h"
+#include "sted_trace.h"
+#include "sted_probe.h"
+#include "sted_udp.h"
+#include "sted_tune.h"
 #include "getopt_win.h"
 #include <io.h>
 
@@ -83,11 +157,13 @@ WSAEVENT                  EventArray[2]; // socket と ste ドライバ用の 2
 GUID                      InterfaceGuid; // = GUID_NDIS_LAN_CLASS
 int                       debuglevel;    // デバッグレベル。
 BOOL                      bRunning = TRUE;
-HANDLE                    hStedLog;      // デバッグログ用のファイルハンドル
 SERVICE_STATUS            stedServiceStatus;
 SERVICE_STATUS_HANDLE     stedServiceStatusHandle;
 BOOL                      isTerminal;    // コンソールから起動されたかどうか？
 
+static int parse_list(char *, unsigned int *, int);
+static int encap_frame(stedstat_t *, int, int, unsigned char *, int);
+
 /**************************************************************************
  * main()
  * 
@@ -171,44 +247,106 @@ main(int argc, char *argv[])
  *
  * 引数:
  *
- *    -i instance     ste デバイスのインスタンス番号
+ *    -i instance     ste デバイスのインスタンス番号（カンマで区切って複数）
  *                    指定されなければ、デフォルトで 0(=\\\\.\\STE0)。
  *                 
- *    -h hub[:port]   仮想ハブ（stehub）が動作するホストを指定する。
+ *    -h hub[:port][,...]
+ *                    仮想ハブ（stehub）が動作するホストを指定する。
  *                    指定されなければ、デフォルトで localhost:80。
  *                    コロン(:)の後にポート番号が指定されていれば
  *                    そのポート番号に接続にいく。デフォルトは 80。
+ *                    IPv6 のアドレスは [2001:db8::1]:80 のように [] で囲む。
+ *                    接続できなければ、待ち時間を伸ばしながら接続し直す。
+ *                    カンマで区切って STE_HUB_MAX 個まで指定すると、先頭を
+ *                    プライマリとして、接続が切れたら次の HUB に切り替え、
+ *                    プライマリに接続できるようになったら戻る（sted_hb.h 参照）。
  *
- *    -p proxy[:port] 経由するプロキシサーバを指定する。
+ *    -p [user:password@]proxy[:port]
+ *                    経由するプロキシサーバを指定する。
  *                    デフォルトではプロキシサーバは使われない。
  *                    コロン(:)の後にポート番号が指定されていれば
  *                    そのポート番号に接続にいく。デフォルトは 80。
+ *                    @ の前にユーザ名とパスワードが指定されていれば
+ *                    Proxy-Authorization（Basic 認証）を付ける。
  *                    
  *    -d level        デバッグレベル。1 以上にした場合は フォアグランド
  *                    で実行され、標準エラー出力にデバッグ情報が
  *                    出力される。デフォルトは 0。
+ *
+ *    -t cat=rate,... トレースのカテゴリ毎のサンプリングレート。
+ *
+ *    -c              本体の CRC32C も付ける（フレーミング v2 の場合）。
+ *
+ *    -s segment      セグメント番号（-i のデバイス毎にカンマで区切って）。
+ *
+ *    -n name         HUB に知らせる識別名。
+ *
+ *    -m mtu          ヘッダ込みの最大フレームサイズ。
+ *
+ *    -z              LZ4 で圧縮する。
+ *
+ *    -k keyfile      事前共有鍵のファイル。HUB との間を暗号化する。
+ *
+ *    -u              HUB との間を UDP で送受信する。
+ *
+ *    -f              UDP の場合、FEC のパリティを付けて送る。
+ *
+ *    -l links        HUB との間に張るリンクの数。
+ *
+ *    -b msec         ハートビート（STE_MSG_PING）の間隔。0 なら送らない。
+ *                    デフォルトは STE_HB_INTERVAL_MSEC。
+ *
+ *    -w standby      Proxy 経由の場合に、予備として張っておくトンネルの数。
  * 
  *******************************************************************************/
 void WINAPI
 sted_svc_main(DWORD argc, LPTSTR *argv)
 {
-    int                 sock_fd;
     char               *hub   = NULL;
     char               *proxy = NULL;    
-    int                 instance = 0;
-    stedstat_t          stedstat[1];        
+    unsigned int        instances[STE_MUX_MAX] = { 0 };
+    int                 ninstances = 1;
+    stedstat_t         *stedstat;
+    stedstat_t         *link;
+    int                 nlinks = 1;
+    int                 i;
     struct timeval      timeout;
     int                 Index;
     char                localhost[] = "localhost:80";    
+    char               *trace = NULL;
     int                 c;
+    int                 pcrc = 0;
+    unsigned int        segments[STE_MUX_MAX] = { 0 };
+    int                 nsegments = 1;
+    int                 j;
+    char               *name = NULL;
+    int                 mtu = 0;
+    int                 lz4 = 0;
+    char               *keyfile = NULL;
+    int                 udp = 0;
+    int                 fec = 0;
+    int                 hb_msec = STE_HB_INTERVAL_MSEC;
+    int                 nhubs;
+    char                hub_entry[STE_DIAL_HOSTMAX];
+    int                 nstandby = 0;
+    char                proxy_auth[STE_HTTP_AUTH_MAX] = "";
+    char               *at;
+    DWORD               wait_msec;
+    DWORD               link_msec;
+    long                dial_usec;
+    long                probe_usec;
+    long                tunnel_usec;
+    ste_uint64_t        stats_usec = 0;
+    char                dial_host[STE_DIAL_HOSTMAX];
+    int                 dial_port;
 
     isTerminal = _isatty(_fileno(stdout))? TRUE:FALSE;
 
     if (argc > 1){
-        while((c = getopt(argc, argv, "d:i:h:p:")) != EOF){
+        while((c = getopt(argc, argv, "d:i:h:p:t:cs:n:m:zk:ufl:b:w:")) != EOF){
             switch(c){
                 case 'i':
-                    instance = atoi(optarg);                
+                    ninstances = parse_list(optarg, instances, STE_MUX_MAX);
                     break;
                 case 'h':
                     hub   = optarg;
@@ -219,6 +357,58 @@ sted_svc_main(DWORD argc, LPTSTR *argv)
                 case 'd':
                     debuglevel = atoi(optarg);
                     break;
+                case 't':
+                    trace = optarg;
+                    break;
+                case 'c':
+                    pcrc = 1;
+                    break;
+                case 's':
+                    nsegments = parse_list(optarg, segments, STE_MUX_MAX);
+                    break;
+                case 'n':
+                    name = optarg;
+                    break;
+                case 'm':
+                    mtu = atoi(optarg);
+                    break;
+                case 'z':
+                    lz4 = 1;
+                    break;
+                case 'k':
+                    keyfile = optarg;
+                    break;
+                case 'u':
+                    udp = 1;
+                    break;
+                case 'f':
+                    fec = 1;
+                    break;
+                case 'b':
+                    hb_msec = atoi(optarg);
+                    if(hb_msec < 0)
+                        hb_msec = 0;
+                    break;
+                case 'w':
+                    nstandby = atoi(optarg);
+                    if(nstandby < 0 || nstandby > STE_TUNNEL_STANDBY_MAX){
+                        if(isTerminal == TRUE){
+                            print_usage(argv[0]);
+                            return;
+                        }
+                        nstandby = 0;
+                    }
+                    break;
+                case 'l':
+                    nlinks = atoi(optarg);
+                    if(nlinks < 1 || nlinks > MAXLINKS){
+                        if(isTerminal == TRUE){
+                            print_usage(argv[0]);
+                            return;
+                        }
+                        nlinks = 1;
+                    }
+                    break;
                 default:
                     if(isTerminal == TRUE){
                         print_usage(argv[0]);
@@ -231,22 +421,134 @@ sted_svc_main(DWORD argc, LPTSTR *argv)
         debuglevel = 0;
     }
 
+    /*
+     * 複数の ste デバイスを指定した場合は、デバイス毎に違うセグメントが必要。
+     * HUB はセグメント番号で多重化したフレームを区別するため。
+     */
+    if(ninstances > 1 && nsegments != ninstances)
+        ninstances = -1;
+    for(i = 0 ; i < ninstances ; i++)
+        for(j = i + 1 ; j < ninstances ; j++)
+            if(instances[i] == instances[j] || segments[i] == segments[j])
+                ninstances = -1;
+    if(ninstances < 0 || nsegments < 0 || (ninstances == 1 && nsegments != 1)){
+        if(isTerminal == TRUE){
+            print_usage(argv[0]);
+            return;
+        }
+        ninstances = 1;
+    }
+
     if(hub == NULL)
         hub = localhost;    
 
+    /*
+     * Proxy にユーザ名とパスワードが指定されていれば、Proxy-Authorization の
+     * 値にしておく。ps で見えないように、引数のパスワードは消す。
+     */
+    if(proxy != NULL && (at = strrchr(proxy, '@')) != NULL){
+        *at = '\0';
+        if(ste_http_basic(proxy_auth, sizeof(proxy_auth), proxy) < 0){
+            print_err(LOG_ERR, "proxy user name or password is too long\n");
+            return;
+        }
+        memset(proxy, 0x0, strlen(proxy));
+        proxy = at + 1;
+    }
+
+    /* HUB と Proxy の指定を確認しておく。再接続の度には確認しない */
+    for(nhubs = 0 ; ste_dial_pick(hub, nhubs, hub_entry, sizeof(hub_entry)) == 0 ; nhubs++)
+        if(ste_dial_parse(hub_entry, dial_host, sizeof(dial_host), &dial_port) < 0)
+            break;
+    if(nhubs == 0 || nhubs > STE_HUB_MAX || ste_dial_pick(hub, nhubs, hub_entry, sizeof(hub_entry)) == 0 ||
+       (proxy != NULL && ste_dial_parse(proxy, dial_host, sizeof(dial_host), &dial_port) < 0)){
+        print_err(LOG_ERR, "invalid hub or proxy name\n");
+        if(isTerminal == TRUE)
+            print_usage(argv[0]);
+        return;
+    }
+
+    /* リンク毎の管理用構造体。大きいのでスタックには置かない */
+    if((stedstat = (stedstat_t *)calloc(nlinks, sizeof(stedstat_t))) == NULL){
+        printf("cannot allocate memory for %d links\n", nlinks);
+        return;
+    }
+
+    /* 圧縮用のバッファは HUB と LZ4 を合意した時に確保する */
+    stedstat->sock_fd = -1;
+    ste_dial_init(&stedstat->dial);
+    ste_dial_init(&stedstat->probe);
+    stedstat->nhubs = nhubs;
+    stedstat->hub_index = 0;
+    stedstat->probe_usec = 0;
+    stedstat->probe_ok = 0;
+    ste_hb_init(&stedstat->hb, hb_msec);
+    strcpy(stedstat->proxy_auth, proxy_auth);
+    memset(proxy_auth, 0x0, sizeof(proxy_auth));
+    ste_tunnel_init(&stedstat->tunnel);
+    stedstat->nstandby = (proxy != NULL) ? nstandby : 0;
+    for(i = 0 ; i < STE_TUNNEL_STANDBY_MAX ; i++){
+        ste_dial_init(&stedstat->standby_dial[i]);
+        stedstat->standby_dial[i].quiet = 1;
+        ste_tunnel_init(&stedstat->standby[i]);
+        stedstat->standby[i].quiet = 1;
+    }
+    stedstat->lzc = NULL;
+    stedstat->lzd = NULL;
+    stedstat->aead = NULL;
+    stedstat->fec = NULL;
+    stedstat->replay = NULL;
+    stedstat->credit = NULL;
+    stedstat->has_token = 0;
+    stedstat->use_key = 0;
+    stedstat->use_udp = udp;
+    stedstat->udp = 0;
+
+    /* HUB に送る STE_MSG_HELLO の内容 */
+    memset(&stedstat->hello, 0x0, sizeof(ste_hello_t));
+    stedstat->hello.version = STE_PROTO_VERSION;
+    stedstat->hello.role = STE_ROLE_STED;
+    stedstat->hello.features = STE_CAP_AGG | STE_CAP_SYNC | STE_CAP_COMPACT | STE_CAP_HC;
+    if(hb_msec > 0)
+        stedstat->hello.features |= STE_CAP_PING;
+    if(pcrc)
+        stedstat->hello.features |= STE_CAP_PCRC;
+    if(lz4)
+        stedstat->hello.features |= STE_CAP_LZ4;
+    if(udp && fec)
+        stedstat->hello.features |= STE_CAP_FEC;
+    stedstat->hello.segment = segments[0];
+    stedstat->hello.nsegs = ninstances;
+    for(i = 0 ; i < ninstances ; i++)
+        stedstat->hello.segs[i] = segments[i];
+    if(ninstances > 1)
+        stedstat->hello.features |= STE_CAP_MUX;
+    if(name != NULL)
+        strncpy(stedstat->hello.client_id, name, STE_CLIENTID_MAX);
+    stedstat->hello.nlinks = nlinks;
+    if(nlinks > 1){
+        /* HUB が同じ sted のリンクだとわかるよう、全てのリンクで同じ bundle を送る */
+        if(ste_aead_random((unsigned char *)&stedstat->hello.bundle, sizeof(stedstat->hello.bundle)) < 0 ||
+           stedstat->hello.bundle == 0)
+            stedstat->hello.bundle = (unsigned int)ste_time_usec() | 1;
+        stedstat->hello.features |= STE_CAP_STRIPE;
+    }
+
     /* socket および ste ドライバのデータ受信通知用のイベントオブジェクトを作成 */    
     EventArray[0] = CreateEvent(NULL, FALSE, FALSE, NULL); // Socket 用     
     EventArray[1] = CreateEvent(NULL, FALSE, FALSE, NULL); // ste ドライバ用 
 
-    /* ログファイルをオープン */
-    hStedLog = CreateFile(STED_LOG_FILE,
-                          GENERIC_READ|GENERIC_WRITE,
-                          FILE_SHARE_READ| FILE_SHARE_WRITE,
-                          NULL,
-                          CREATE_ALWAYS,
-                          FILE_ATTRIBUTE_NORMAL,
-                          NULL);
-    SetFilePointer(hStedLog, 0, NULL, FILE_END);
+    /*
+     * ログファイルをオープン。コンソールから起動された場合は標準出力に出す。
+     * データパスのデバッグメッセージはトレースとして drain スレッドが書き出す。
+     */
+    ste_log_open(STED_LOG_FILE, isTerminal ? STE_LOG_DEST_STDOUT : STE_LOG_DEST_FILE);
+    if(trace != NULL && ste_trace_set_sample(trace) < 0){
+        print_err(LOG_ERR, "invalid trace sampling rate: %s\n", trace);
+    }
+    if(ste_trace_init() < 0){
+        print_err(LOG_ERR, "failed to start trace thread\n");
+    }
 
     print_err(LOG_DEBUG, "debuglevel = %d\n", debuglevel);
 
@@ -282,56 +584,136 @@ sted_svc_main(DWORD argc, LPTSTR *argv)
         }
     }
     
+    /* 事前共有鍵を読む。読めなければ平文で動かさずに止める */
+    if(keyfile != NULL){
+        if(ste_aead_load_key(keyfile, stedstat->psk) < 0){
+            print_err(LOG_ERR, "cannot read key file %s (64 hex digits expected)\n", keyfile);
+            goto err;
+        }
+        stedstat->use_key = 1;
+        stedstat->hello.features |= STE_CAP_AEAD;
+    }
 
-    /* 仮想 NIC デバイスをオープン */
-    if( open_ste(stedstat, STEPATH , instance ) < 0){
-        print_err(LOG_ERR,"failed to open STE device\n");
-        goto err;
+    /* 仮想 NIC デバイスをオープン。ドライバの通知用のイベントは全てのデバイスで共有する */
+    for(i = 0 ; i < ninstances ; i++){
+        if( open_ste(stedstat, STEPATH , instances[i] ) < 0){
+            print_err(LOG_ERR,"failed to open STE device\n");
+            goto err;
+        }
+        stedstat->adapter[i].segment = segments[i];
     }
     print_err(LOG_INFO, "Successfully opened STE device\n");    
-  
-    /* HUB との間の Connection をオープン */
-    if ((sock_fd = open_socket(stedstat, hub, proxy)) < 0){
-        print_err(LOG_ERR,"failed to open connection with hub\n");
-        goto err;
+
+    /* HUB に知らせる MTU は全てのドライバの最大フレームサイズまで */
+    stedstat->hello.mtu = stedstat->adapter[0].ste_mtu;
+    for(i = 1 ; i < stedstat->nadapters ; i++)
+        if(stedstat->adapter[i].ste_mtu < stedstat->hello.mtu)
+            stedstat->hello.mtu = stedstat->adapter[i].ste_mtu;
+    if(mtu >= ETHERMIN && mtu < stedstat->hello.mtu)
+        stedstat->hello.mtu = mtu;
+
+    /* リンク 1 以降はリンク 0 の設定を写し、リンクの番号だけ変える */
+    for(i = 1 ; i < nlinks ; i++){
+        link = &stedstat[i];
+        *link = *stedstat;
+        link->hello.link = i;
     }
 
+    /*
+     * 再接続した時に送り直すためのリングと、クレジットを待つキューはリンク毎に
+     * 持つ。用意できなければ HUB とセッションの再開やフロー制御を合意しないだけ。
+     */
+    for(i = 0 ; i < nlinks ; i++){
+        link = &stedstat[i];
+        link->has_token = 0;
+        if((link->replay = malloc(sizeof(ste_replay_t))) != NULL)
+            ste_replay_reset(link->replay);
+        if((link->credit = malloc(sizeof(ste_credit_t))) != NULL)
+            ste_credit_reset(link->credit);
+    }
+  
+    /*
+     * HUB との間の Connection をオープン。リンク 1 以降は HUB の返事を待って開く。
+     * 接続はブロックせずに進めるので、ここでは始めるだけ。
+     */
+    open_links(stedstat, nlinks, hub, proxy);
+
     bRunning = TRUE;
 
     while(bRunning){
         int ret;
         
-        Index = WSAWaitForMultipleEvents( 2 , EventArray , FALSE , 5000 , FALSE ) ;
+        /*
+         * UDP の場合は STE_MSG_HELLO を再送するため、早めにタイムアウトさせる。
+         * FEC で抜けの後ろのデータグラムを取っておいている間はもっと早める。
+         */
+        wait_msec = 5000;
+        for(i = 0 ; i < nlinks ; i++){
+            link = &stedstat[i];
+            if(!link->udp)
+                continue;
+            link_msec = (link->fec != NULL && STE_FEC_HOLDING(link->fec)) ?
+                STE_FEC_HOLD_USEC / 1000 : STE_UDP_HELLO_USEC / 1000;
+            if(link_msec < wait_msec)
+                wait_msec = link_msec;
+        }
+        /*
+         * TCP で送りきれなかったメッセージの残りがあるリンクは、すぐに送り直す。
+         */
+        for(i = 0 ; i < nlinks ; i++){
+            link = &stedstat[i];
+            if(link->sock_fd >= 0 && link->pendlen > 0)
+                wait_msec = STE_PEND_RETRY_MSEC;
+        }
+        /*
+         * 接続中のリンクは接続を進めるため、バックオフ中のリンクは再接続の時刻に起きる。
+         * 開いているリンクはハートビートを送る時刻に、プライマリの HUB を確認している
+         * 間は確認を進めるために起きる。Proxy 経由の場合は、トンネルの CONNECT の
+         * タイムアウトと、予備のトンネルを張り直す時刻にも起きる。
+         */
+        for(i = 0 ; i < nlinks ; i++){
+            link = &stedstat[i];
+            if(link->sock_fd >= 0 && link->hello_ok && (link->peer_caps & STE_CAP_PING))
+                dial_usec = ste_hb_wait_usec(&link->hb, ste_time_usec());
+            else if(link->sock_fd >= 0)
+                dial_usec = -1;
+            else
+                dial_usec = ste_dial_wait_usec(&link->dial, ste_time_usec());
+            probe_usec = ste_dial_wait_usec(&link->probe, ste_time_usec());
+            if(probe_usec >= 0 && (dial_usec < 0 || probe_usec < dial_usec))
+                dial_usec = probe_usec;
+            tunnel_usec = tunnel_wait_usec(link);
+            if(tunnel_usec >= 0 && (dial_usec < 0 || tunnel_usec < dial_usec))
+                dial_usec = tunnel_usec;
+            if(dial_usec < 0)
+                continue;
+            link_msec = (DWORD)((dial_usec + 999) / 1000);
+            if(link_msec < wait_msec)
+                wait_msec = link_msec;
+        }
+        Index = WSAWaitForMultipleEvents( 2 , EventArray , FALSE , wait_msec , FALSE ) ;
 
         switch(Index){
             case 0 + WSA_WAIT_EVENT_0:
-                /* Socket 用の Event だ */
-                ret = read_socket(stedstat);
-                if( ret < 0){
-                    /* socket にエラーが発生した模様。再接続に行く */
-                    CLOSE(sock_fd);
-                    stedstat->sock_fd = -1;
-                    if ((sock_fd = open_socket(stedstat, hub, proxy)) < 0){
-                        print_err(LOG_ERR,"failed to re-open connection with hub\n");
-                        bRunning = FALSE;
-                        goto err;
+                /* Socket 用の Event だ。全てのリンクの socket で共有している */
+                for(i = 0 ; i < nlinks ; i++){
+                    link = &stedstat[i];
+                    if(link->sock_fd < 0)
+                        continue;
+                    if(read_socket(link) < 0){
+                        /* socket にエラーが発生した模様。閉じて再接続に行く */
+                        close_socket(link);
                     }
                 }
                 break;
             case 1 + WSA_WAIT_EVENT_0:
                 /* Driver 用の Event だ */
                 do {
-                    /* 戻り値が 0 以上（データ有）である限り read_ste() を繰り返す */
-                    ret = read_ste(stedstat);
-                    if(ret < 0){
-                        /* socket への send() にてエラーが発生した模様。再接続に行く */
-                        CLOSE(sock_fd);
-                        stedstat->sock_fd = -1;                        
-                        if ((sock_fd = open_socket(stedstat, hub, proxy)) < 0){
-                            print_err(LOG_ERR,"failed to re-open connection with hub\n");
-                            bRunning = FALSE;
-                        }
-                    }
+                    /*
+                     * 戻り値が 0 以上（データ有）である限り read_ste() を繰り返す。
+                     * socket への send() にてエラーが発生したリンクは閉じられている。
+                     */
+                    ret = read_ste(stedstat, nlinks);
                 } while( ret > 0);
                 break;
             case WSA_WAIT_FAILED:
@@ -350,13 +732,55 @@ sted_svc_main(DWORD argc, LPTSTR *argv)
                 }
                 break;
         }
+
+        for(i = 0 ; i < nlinks ; i++){
+            link = &stedstat[i];
+            if(link->sock_fd >= 0 && link->pendlen > 0 && write_socket(link) < 0){
+                /* 残りを送れないまま socket にエラーが発生した */
+                close_socket(link);
+                continue;
+            }
+            if(link->udp && udp_timer(link) < 0){
+                /* UDP では HUB から返事が無かった。TCP で接続し直す */
+                close_socket(link);
+            }
+            if(hb_timer(link) < 0){
+                /* HUB が応答しない。閉じて（次の HUB に）接続し直す */
+                close_socket(link);
+            }
+        }
+
+        /* 閉じたリンクを開き直す。HUB に接続できない間も sted は止めない */
+        open_links(stedstat, nlinks, hub, proxy);
+
+        /*
+         * STE_STATS_INTERVAL 秒毎に TCP の状態をサンプリングし、統計ファイルを更新する。
+         * データが流れ続けていると WSA_WAIT_TIMEOUT にはならないので、毎回時刻を確認する。
+         */
+        if(ste_time_usec() - stats_usec >= STE_STATS_INTERVAL * 1000000){
+            write_stat_file(stedstat, nlinks);
+            stats_usec = ste_time_usec();
+        }
     }
 
   err:
-    if(stedstat->ste_handle != NULL){
-        ioctl_ste(stedstat->ste_handle, UNREGSVC);
-        stedstat->ste_handle = INVALID_HANDLE_VALUE;
+    for(i = 0 ; i < stedstat->nadapters ; i++){
+        if(stedstat->adapter[i].ste_handle != INVALID_HANDLE_VALUE){
+            ioctl_ste(stedstat->adapter[i].ste_handle, UNREGSVC);
+            stedstat->adapter[i].ste_handle = INVALID_HANDLE_VALUE;
+        }
+    }
+    for(i = 0 ; i < nlinks ; i++){
+        link = &stedstat[i];
+        free(link->lzc);
+        free(link->lzd);
+        free(link->aead);
+        free(link->fec);
+        free(link->replay);
+        free(link->credit);
+        memset(link->psk, 0x0, sizeof(link->psk));
     }
+    ste_trace_fini();
     print_err(LOG_ERR,"Stopped\n");
     return;
 }
@@ -427,6 +851,8 @@ BOOL sted_delete_svc()
  * print_err()
  *
  * エラーメッセージを表示するルーチン。
+ * 同期的に書き出すので、データパス上のデバッグメッセージには使わず、
+ * STE_TRACEn() を使うこと。
  *
  * 引数: 
  *       level : エラーレベル。つかってない。
@@ -441,14 +867,14 @@ print_err(int level, char *format, ...)
     int length;
     
     va_start(ap, format);
-    vsprintf(buf, format, ap);
+    length = STE_VSNPRINTF(buf, ERR_MSG_MAX - 1, format, ap);
     va_end(ap);
 
-    if(isTerminal == TRUE){
-        printf("%s", buf);
-    } else {
-        WriteFile(hStedLog, buf, strlen(buf), &length, NULL);
-    }
+    if(length < 0)
+        length = ERR_MSG_MAX - 1;
+    buf[length] = '\0';
+
+    ste_log_write(level, buf, length);
 }
 
 /*****************************************************************************
@@ -459,22 +885,68 @@ print_err(int level, char *format, ...)
 void
 print_usage(char *argv)
 {
-    printf ("Usage: %s [[ -i instance] [-h hub[:port]] [-p proxy[:port]] [-d level]] [-I|-U]\n",argv);
-    printf ("\t-i instance     : Instance number of the ste device\n");
-    printf ("\t-h hub[:port]   : Virtual HUB and its port number\n");
-    printf ("\t-p proxy[:port] : Proxy server and its port number\n");
+    printf ("Usage: %s [[ -i instance[,...]] [-h hub[:port][,...]] [-p [user:password@]proxy[:port]] [-d level] [-t cat=rate,...] [-c] [-s segment[,...]] [-n name] [-m mtu] [-z] [-k keyfile] [-u] [-f] [-l links] [-b msec] [-w standby]] [-I|-U]\n",argv);
+    printf ("\t-i instance     : Instance numbers of the ste devices (up to %d)\n", STE_MUX_MAX);
+    printf ("\t-h hub[:port]   : Virtual HUB and its port number, comma separated for failover (up to %d)\n", STE_HUB_MAX);
+    printf ("\t-p [user:password@]proxy[:port] : Proxy server and its port number\n");
     printf ("\t-d level        : Debug level[0-3]\n");
+    printf ("\t-t cat=rate,... : Trace sampling rate (cat: ste,sock,hub,dump,all)\n");
+    printf ("\t-c              : Add payload CRC32C (framing v2)\n");
+    printf ("\t-s segment      : Segment numbers, one for each ste device\n");
+    printf ("\t-n name         : Client name sent to the HUB\n");
+    printf ("\t-m mtu          : Maximum frame size including header\n");
+    printf ("\t-z              : Compress aggregated frames with LZ4\n");
+    printf ("\t-k keyfile      : Encrypt the link with the pre-shared key in keyfile\n");
+    printf ("\t-u              : Use UDP to the HUB (falls back to TCP)\n");
+    printf ("\t-f              : Send FEC parity over UDP, adapted to the loss rate\n");
+    printf ("\t-l links        : Number of parallel links to the HUB [1-%d]\n", MAXLINKS);
+    printf ("\t-b msec         : Heartbeat interval, 0 to disable (default %d)\n", STE_HB_INTERVAL_MSEC);
+    printf ("\t-w standby      : Number of standby tunnels through the proxy [0-%d]\n", STE_TUNNEL_STANDBY_MAX);
     printf ("\t-I              : Install Service\n");
     printf ("\t-U              : Uninstall Service\n");
 
     exit(0);
 }
 
+/*****************************************************************************
+ * parse_list()
+ * 
+ * -i, -s の引数（カンマで区切った数字の列）を解析する。
+ *
+ *  引数：
+ *           str  : 引数の文字列
+ *           list : 数字を返す
+ *           max  : list の大きさ
+ * 戻り値：
+ *         正常時   : 数字の個数
+ *         エラー時 : -1 (数字でないか、max 個より多い)
+ *****************************************************************************/
+static int
+parse_list(char *str, unsigned int *list, int max)
+{
+    char *end;
+    int   n = 0;
+
+    for(;;){
+        if(n >= max || *str < '0' || *str > '9')
+            return(-1);
+        list[n++] = strtoul(str, &end, 10);
+        if(*end == '\0')
+            return(n);
+        if(*end != ',')
+            return(-1);
+        str = end + 1;
+    }
+}
+
 /*****************************************************************************
  * open_ste()
  *
  * コントロールデバイスへのハンドルをオープンする。
  * IOCTL コマンドの REGSVC（ste オリジナル）を発行する。
+ * GETFRAMESIZE でドライバの最大フレームサイズを得る。古いドライバで
+ * 得られなければ ETHERMAX とする。
+ * 呼ぶ度に stedstat->adapter の次の要素にデバイスを追加する。
  *
  *  引数：
  *           stedstat :  sted 管理構造体
@@ -487,8 +959,11 @@ print_usage(char *argv)
 int
 open_ste(stedstat_t *stedstat, char *devname, int ppa)
 {
+    sted_adapter_t *adapter = &stedstat->adapter[stedstat->nadapters];
     HANDLE         ste_handle;
     char           devpath[STE_MAX_DEVICE_NAME];
+    ULONG          framesize = 0;
+    DWORD          bytes;
 
     //
     // 実際にオープンするデバイスのファイル名は devname + ppa
@@ -518,7 +993,17 @@ open_ste(stedstat_t *stedstat, char *devname, int ppa)
     /* ドライバに REGSVC コマンドの送信する */
     ioctl_ste(ste_handle, REGSVC);
     
-    stedstat->ste_handle = ste_handle;
+    adapter->ste_handle = ste_handle;
+    adapter->instance = ppa;
+
+    if(!DeviceIoControl(ste_handle, GETFRAMESIZE, NULL, 0, &framesize, sizeof(framesize), &bytes, NULL)
+       || bytes != sizeof(framesize) || framesize < ETHERMAX || framesize > STE_FRAME_MAX){
+        print_err(LOG_NOTICE, "failed to get frame size from STE device, using %d\n", ETHERMAX);
+        framesize = ETHERMAX;
+    }
+    adapter->ste_mtu = framesize;
+    print_err(LOG_INFO, "max frame size = %d\n", adapter->ste_mtu);
+    stedstat->nadapters++;
 
     return(0);
 }
@@ -570,9 +1055,15 @@ ioctl_ste(
 /**************************************************
  * Ste Virtual NIC driver 書き込み用ルーチン
  *
+ * STE_MSG_CAGG で受け取ったフレームはパディングが取り除かれているので、
+ * ETHERMIN より短ければ 0 を詰めて元に戻してから書き込む。
+ *
  * 引数
  *
  *    stedstat: sted_stat 構造体
+ *    adapter : 書き込む ste デバイス（stedstat->adapter の添字）
+ *    buf     : 書き込む Ethernet フレーム
+ *    len     : フレーム長
  *
  * 戻り値
  *
@@ -580,155 +1071,441 @@ ioctl_ste(
  *    障害時 :   -1
  ***************************************************/
 int
-write_ste(stedstat_t *stedstat)
+write_ste(stedstat_t *stedstat, int adapter, unsigned char *buf, int len)
 {
     HANDLE        ste_handle;
     DWORD         writesize;   // WriteFile() で実際に書き込んだサイズ
     BOOL          Ret;
+    unsigned char runt[ETHERMIN];
+    STE_ACCT_VAR(acct_t)
     
-    ste_handle = stedstat->ste_handle;
+    ste_handle = stedstat->adapter[adapter].ste_handle;
 
-    if(debuglevel > 1){
-        print_err(LOG_INFO, "write_ste called\n");
+    STE_TRACE0(2, TRC_WRITE_STE_CALLED);
+
+    if ( len < ETHERMIN ){
+        memcpy(runt, buf, len);
+        memset(runt + len, 0x0, ETHERMIN - len);
+        buf = runt;
+        len = ETHERMIN;
     }
 
+    STE_ACCT_BEGIN(acct_t);
     Ret = WriteFile(
         ste_handle,
-        stedstat->wdatabuf,
-        stedstat->orgdatalen,
+        buf,
+        len,
         &writesize,
         NULL
         );
+    STE_ACCT_END(STE_STAGE_STE_WRITE, acct_t);
+    STE_ACCT_FRAME();
 
     if ( Ret == FALSE ){
         print_err(LOG_ERR, "write_ste: WriteFile returns with FALSE\n");
-        if(debuglevel > 1){
-            print_err(LOG_INFO, "write_ste returned\n");            
-        }        
+        STE_TRACE0(2, TRC_WRITE_STE_RETURNED);
         return(-1);
     }
 
-    if(debuglevel > 1){
-        print_err(LOG_DEBUG, "wite_ste: WriteFile Succeeded. Wrote %d bytes\n", writesize);
-        print_err(LOG_INFO, "write_ste returned\n");
-    }
+    stedstat->stats.iframes++;
+    STE_TRACE1(2, TRC_WRITE_STE_WROTE, writesize);
+    STE_TRACE0(2, TRC_WRITE_STE_RETURNED);
     
     return(0);
 }
 
 /*********************************************************************
  * Ste Virtual NIC driver 読み込み用ルーチン
+ *
+ * 開いている全ての ste デバイスから 1 フレームずつ読み、encap_frame() で
+ * 送信バッファに詰める。デバイスを順番に読むので、1 つのデバイスのフレーム
+ * が続いても他のデバイスのフレームが待たされることは無い。
+ * 全てのドライバのキューが空になったら、溜めているフレームと FEC のグループ
+ * のパリティを送る。
  * 
  * 引数
  *
- *    stedstat: sted_stat 構造体
+ *    stedstat: sted_stat 構造体の配列
+ *    nlinks  : リンクの数
  *
  * 戻り値
  *
- *    正常時 :   読み込んだデータサイズ。（ 0 もありうる）
- *    障害時 :   -1 (socket への書き込みのエラー時）
+ *    正常時 :   読み込んだデータサイズの合計。（ 0 もありうる）
+ *    障害時 :   -1 (socket への書き込みのエラー時。エラーになったリンクは
+ *               閉じている）
  **********************************************************************/
 int
-read_ste(stedstat_t *stedstat)
+read_ste(stedstat_t *stedstat, int nlinks)
 {
+    stedstat_t     *link;       // フレームを送るリンク
+    int             i;
+    int             ret = 0;
+    int             total = 0;  // 全てのデバイスから読み込んだサイズの合計
     HANDLE          ste_handle;
     BOOL            Ret;    
     int             readsize;   // ReadFile で実際に読み込んだサイズ
-    int             pad = 0;    // パディング 
-    int             remain = 0; // 全データ長を 4 で割った余り 
-    stehead_t       steh;
     unsigned char  *rdatabuf = stedstat->rdatabuf; // ドライバからの読み込み用バッファ 
-    unsigned char  *sendbuf  = stedstat->sendbuf;  // Socket 送信バッファ        
-    unsigned char  *sendp;     // Socket 送信バッファの書き込み位置ポインタ 
+    STE_ACCT_VAR(acct_t)
 
-    sendp = sendbuf + stedstat->sendbuflen;        
-    ste_handle = stedstat->ste_handle;
+    STE_TRACE0(2, TRC_READ_STE_CALLED);
 
-    if(debuglevel > 1){
-        print_err(LOG_INFO, "read_ste called\n");
+    for ( i = 0 ; i < stedstat->nadapters ; i++){
+        ste_handle = stedstat->adapter[i].ste_handle;
+
+        STE_ACCT_BEGIN(acct_t);
+        Ret = ReadFile(
+            ste_handle,
+            rdatabuf,
+            SOCKBUFSIZE,
+            &readsize,
+            NULL
+            );
+        STE_ACCT_END(STE_STAGE_STE_READ, acct_t);
+
+        if ( Ret == FALSE || readsize == 0){
+            if ( Ret == FALSE )
+                STE_TRACE0(2, TRC_READ_STE_FALSE);
+            else
+                STE_TRACE1(2, TRC_READ_STE_READ, readsize);
+            continue;
+        }
+
+        STE_TRACE1(2, TRC_READ_STE_READ, readsize);
+        STE_TRACE1(2, TRC_READ_STE_FROM, readsize);
+        STE_TRACE_DUMP(3, rdatabuf, readsize);
+        STE_PROBE_FRAME_RX(readsize, rdatabuf, rdatabuf + 6);
+        STE_ACCT_FRAME();
+
+        total += readsize;
+        if ( encap_frame(stedstat, nlinks, i, rdatabuf, readsize) < 0)
+            return(-1);
     }
-    
-    Ret = ReadFile(
-        ste_handle,
-        rdatabuf,
-        SOCKBUFSIZE,
-        &readsize,
-        NULL
-        );
-    
-    if ( Ret == FALSE ){
-        if(debuglevel > 1)
-            print_err(LOG_ERR, "read_ste: ReadFile returns with FALSE\n");
-        if(debuglevel > 2)
-            print_err(LOG_INFO, "read_ste returned\n");
-        return(0);        
+
+    if ( total > 0){
+        STE_TRACE0(2, TRC_READ_STE_RETURNED);
+        return(total);
     }
 
-    if(debuglevel > 1){
-        print_err(LOG_DEBUG, "read_ste: read %d bytes\n", readsize);
+    /*
+     * ドライバのキューが空になった。溜めているフレームがあれば送信する。
+     */
+    for ( i = 0 ; i < nlinks ; i++){
+        link = &stedstat[i];
+        if ( link->sock_fd < 0)
+            continue;
+        if ( link->agg.count > 0 || link->sendbuflen > 0 || link->pendlen > 0){
+            STE_TRACE2(2, TRC_READ_STE_FLUSH, 0, link->sendbuflen);
+            if ( write_socket(link) < 0){
+                print_err(LOG_ERR, "read_ste returned\n");
+                close_socket(link);
+                ret = -1;
+                continue;
+            }
+        }
+        if ( flush_parity(link) < 0){
+            print_err(LOG_ERR, "read_ste returned\n");
+            close_socket(link);
+            ret = -1;
+        }
     }
-            
-    if(readsize == 0){
-        if(debuglevel > 1){
-            print_err(LOG_INFO, "read_ste returned\n");
-        }        
+    STE_TRACE0(3, TRC_READ_STE_RETURNED);
+    return(ret);        
+}
+
+/*********************************************************************
+ * encap_frame()
+ *
+ * ste デバイスから読んだフレームを、select_link() がフロー毎に選んだリンク
+ * の送信バッファに詰める。
+ * HUB が STE_MSG_AGG に対応していれば、STE_MSG_AGG が一杯になるか、最初の
+ * フレームを溜めてから STE_AGG_MAX_USEC 経つまでフレームを溜めて、1 つの
+ * メッセージとして送る。多重化している場合、STE_MSG_MUX にはデバイス
+ * （セグメント）毎に詰めるので、詰めているデバイスと違えば先に送る。
+ * 対応していなければ従来通りフレーム毎に stehead を付けて送信バッファに
+ * 詰める。2 つ目以降のデバイスのフレームは HUB が STE_CAP_MUX に合意した
+ * 場合だけ送る。
+ * 再接続するまでの間（開いているリンクが無いか、セッションの再開を申し込んで
+ * HUB の返事を待っている間）は送らずにリンクのリングに入れ、再開した時に送る。
+ * HUB と STE_CAP_CREDIT を合意していて、クレジットが無いかキューに溜めて
+ * いるフレームがあれば、送らずに優先度毎のキューに溜める。
+ * 送ったフレームをリングに取っておくのは put_frame()。
+ * 
+ * 引数
+ *
+ *    stedstat: sted_stat 構造体の配列
+ *    nlinks  : リンクの数
+ *    adapter : フレームを読んだ ste デバイス（stedstat->adapter の添字）
+ *    frame   : 読んだ Ethernet フレーム
+ *    len     : フレーム長
+ *
+ * 戻り値
+ *
+ *    正常時 :    0 (送れずに捨てた場合も含む)
+ *    障害時 :   -1 (socket への書き込みのエラー時。エラーになったリンクは
+ *               閉じている）
+ **********************************************************************/
+static int
+encap_frame(stedstat_t *stedstat, int nlinks, int adapter, unsigned char *frame, int len)
+{
+    stedstat_t     *link;       // フレームを送るリンク
+
+    /* フローでリンクを選ぶ。開いているリンクが無ければ、再開に備えてリンク 0 のリングに入れるか捨てる */
+    if ( (link = select_link(stedstat, nlinks, frame, len)) == NULL ){
+        if ( stedstat->has_token )
+            ste_replay_push(stedstat->replay, adapter, frame, len);
+        else
+            stedstat->stats.odrops++;
         return(0);
-    }    
-
-    if (debuglevel > 1){
-        print_err(LOG_DEBUG,"========= from ste %d bytes ==================\n", readsize);
-        if(debuglevel > 2){
-            int i;
-            for (i = 0; i < (int)readsize; i++){
-                if((i)%16 == 0){
-                    print_err(LOG_DEBUG,"\n%04d: ", i);                    
-                }
-                print_err(LOG_DEBUG, "%02x ", rdatabuf[i] & 0xff);                
+    }
+
+    if ( link->has_token && !link->hello_ok ){
+        /* 再開するかどうかは HUB の返事でわかる。それまではリングに入れておく */
+        ste_replay_push(link->replay, adapter, frame, len);
+        return(0);
+    }
+    if ( link->credit != NULL && (link->peer_caps & STE_CAP_CREDIT) &&
+         (link->credit->held > 0 || !ste_credit_avail(link->credit)) ){
+        /* HUB からのクレジットを待つ。キューが一杯か AQM が決めたら HUB の中でなくここで捨てる */
+        if ( ste_credit_hold(link->credit, adapter, frame, len, ste_time_usec(), &link->stats) < 0 )
+            link->stats.odrops++;
+        return(0);
+    }
+
+    return(put_frame(link, adapter, frame, len, 0));
+}
+
+/*********************************************************************
+ * put_frame()
+ *
+ * フレームをリンクの送信バッファに詰め、必要なら socket に送信する。
+ * encap_frame()、release_credit() と、セッションを再開した時にリングの
+ * フレームを送り直す resume_session() から呼ばれる。
+ * HUB と STE_CAP_RESUME を合意していれば、送信バッファか STE_MSG_AGG に
+ * 詰めたフレームだけをリングに入れる。HUB は受け取ったフレームを数えて
+ * いるので、捨てたフレームを入れるとリングの通し番号が HUB とずれる。
+ * 
+ * 引数
+ *
+ *    link    : フレームを送るリンク
+ *    adapter : フレームを読んだ ste デバイス（link->adapter の添字）
+ *    frame   : Ethernet フレーム
+ *    len     : フレーム長
+ *    resend  : リングから送り直すフレームなら 1（リングには入れない）
+ *
+ * 戻り値
+ *
+ *    正常時 :    0 (送れずに捨てた場合も含む)
+ *    障害時 :   -1 (socket への書き込みのエラー時か、STE_MSG_AGG に詰められ
+ *               なかった時。エラーになったリンクは閉じている）
+ **********************************************************************/
+int
+put_frame(stedstat_t *link, int adapter, unsigned char *frame, int len, int resend)
+{
+    unsigned int    segment = link->adapter[adapter].segment;
+    int             msglen;     // 送信バッファに詰めたメッセージのサイズ
+    int             flush = 0;  // socket に送信するか
+    STE_ACCT_VAR(acct_t)
+
+    if ( len > link->peer_mtu ){
+        /* HUB と合意した MTU より大きいフレームは送れない */
+        STE_TRACE2(1, TRC_READ_STE_TOOBIG, len, link->peer_mtu);
+        link->stats.odrops++;
+        return(0);
+    }
+
+    if ( link->use_key && link->aead == NULL ){
+        /* HUB と暗号化を合意するまでは平文で送らない */
+        link->stats.odrops++;
+        return(0);
+    }
+
+    if ( link->udp && (link->peer_caps & STE_CAP_AGG) == 0 ){
+        /* UDP では HUB の返事が来て STE_MSG_AGG で送れるようになるまで送らない */
+        link->stats.odrops++;
+        return(0);
+    }
+
+    if ( adapter > 0 && (link->peer_caps & STE_CAP_MUX) == 0 ){
+        /* HUB が多重化に合意するまでは、2 つ目以降のデバイスのフレームは送れない */
+        link->stats.odrops++;
+        return(0);
+    }
+
+    /* HUB は受け取ったフレームを全て数えるので、合意する前のフレームも数える */
+    if ( link->credit != NULL )
+        ste_credit_sent(link->credit, len);
+
+    if ( link->peer_caps & STE_CAP_AGG ){
+        /*
+         * STE_MSG_AGG に詰める。一杯か、詰めているセグメントが違えば
+         * 先に送信してから詰め直す。
+         */
+        if ( link->agg.mux && link->agg.count > 0 && link->agg.chan != segment){
+            if ( write_socket(link) < 0){
+                print_err(LOG_ERR, "read_ste returned\n");
+                close_socket(link);
+                return(-1);
+            }
+        }
+        link->agg.chan = segment;
+        if ( ste_agg_add(&link->agg, frame, len) < 0){
+            if ( write_socket(link) < 0){
+                print_err(LOG_ERR, "read_ste returned\n");
+                close_socket(link);
+                return(-1);
+            }
+            if ( ste_agg_add(&link->agg, frame, len) < 0){
+                /* 空にしても詰められない。送ったことにはせず、リンクを閉じてやり直す */
+                print_err(LOG_ERR, "frame of %d bytes does not fit in STE_MSG_AGG\n", len);
+                link->stats.odrops++;
+                close_socket(link);
+                return(-1);
             }
-            print_err(LOG_DEBUG, "\n\n");
         }
+        if ( link->agg.count == 1)
+            link->agg_usec = ste_time_usec();
+        link->stats.oframes++;
+        link->stats.olegacy += STE_LEGACY_SIZE(len);
+        STE_PROBE_FRAME_ENCAP(link->conn_id, len, link->agg.datalen);
+        if ( link->agg.count >= STE_AGG_MAX_FRAMES ||
+             ste_time_usec() - link->agg_usec >= STE_AGG_MAX_USEC)
+            flush = 1;
+    } else {
+        STE_ACCT_BEGIN(acct_t);
+        msglen = ste_msg_put_frame(link->sendbuf + link->sendbuflen, frame, len,
+                                   link->tx_flags);
+        link->sendbuflen += msglen;
+        link->stats.oframes++;
+        link->stats.owire += msglen;
+        link->stats.olegacy += STE_LEGACY_SIZE(len);
+        STE_ACCT_END(STE_STAGE_ENCAP, acct_t);
+        STE_PROBE_FRAME_ENCAP(link->conn_id, msglen, link->sendbuflen);
+        /*
+         * ste から受け取ったサイズが HUB と合意した MTU より小さいか、
+         * 送信バッファへの書き込み済みサイズが SENDBUF_THRESHOLD 以上
+         * になったら送信する
+         */
+        if( len < link->peer_mtu ||
+            link->sendbuflen > SENDBUF_THRESHOLD(link->peer_mtu))
+            flush = 1;
     }
-    
-    if( remain = ( sizeof(stehead_t) + readsize ) % 4 )
-        pad = 4 - remain;
-    steh.len = htonl(readsize + pad);
-    steh.orglen = htonl(readsize);
 
-    if(debuglevel > 1){
-        print_err(LOG_DEBUG, "stehead.len    = %d\n", ntohl(steh.len));
-        print_err(LOG_DEBUG, "stehead.pad    = %d\n", pad);                                    
-        print_err(LOG_DEBUG, "stehead.orglen = %d\n", ntohl(steh.orglen));
+    /* 詰めたフレームだけを数える。返事を待つ間に送ったものは数だけ数える */
+    if ( link->replay != NULL && !resend ){
+        if ( link->peer_caps & STE_CAP_RESUME )
+            ste_replay_push(link->replay, adapter, frame, len);
+        else if ( !link->hello_ok )
+            link->hello_frames++;
     }
-    memcpy(sendp, &steh, sizeof(stehead_t));
-    memcpy(sendp + sizeof(stehead_t), rdatabuf, readsize);
-    memset(sendp + sizeof(stehead_t) + readsize, 0x0, pad);
 
-    /*
-     * 実際に読み込んだデータのサイズ＋ヘッダサイズ＋パッドサイズ
-     * を stedstat にセット
-     */
-    stedstat->sendbuflen += sizeof(stehead_t) + readsize + pad;
-    /*
-     * ste から受け取ったサイズが ETHERMAX(1514byte)より小さいか、
-     * 送信バッファへの書き込み済みサイズが SENDBUF_THRESHOLD 以上
-     * になったら送信する
-     */
-    if( readsize < ETHERMAX || stedstat->sendbuflen > SENDBUF_THRESHOLD){
-        if(debuglevel > 1){        
-            print_err(LOG_DEBUG, "readsize = %d, sendbuflen = %d\n",
-                      readsize, stedstat->sendbuflen);
-        }
-        if ( write_socket(stedstat) < 0){
+    if( flush ){
+        STE_TRACE2(2, TRC_READ_STE_FLUSH, len, link->sendbuflen);
+        if ( write_socket(link) < 0){
             print_err(LOG_ERR, "read_ste returned\n");
+            close_socket(link);
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+/*********************************************************************
+ * release_credit()
+ *
+ * HUB からクレジットを受け取ったので、キューに溜めていたフレームを優先度
+ * の高い順に、クレジットの範囲で送信バッファに詰めて送る。HUB と
+ * STE_CAP_RESUME を合意していれば put_frame() がリングに入れるので、
+ * リングの中の順番は送った順番と同じになる。parse_msgs() から呼ばれる。
+ * 
+ * 引数
+ *
+ *    link    : クレジットを受け取ったリンク
+ *
+ * 戻り値
+ *
+ *    正常時 :    0
+ *    障害時 :   -1 (socket への書き込みのエラー時。リンクは閉じている）
+ **********************************************************************/
+int
+release_credit(stedstat_t *link)
+{
+    unsigned char  *frame;
+    unsigned int    adapter;
+    int             len;
+    int             sent = 0;
+    ste_uint64_t    now;
+
+    if ( link->credit == NULL )
+        return(0);
+
+    now = ste_time_usec();
+    while ( ste_credit_avail(link->credit) &&
+            (frame = ste_credit_head(link->credit, &adapter, &len)) != NULL ){
+        /* 取り除いても次に溜めるまでは frame の中身は残っている */
+        ste_credit_pop(link->credit, now, &link->stats);
+        if ( put_frame(link, (int)adapter, frame, len, 0) < 0 )
+            return(-1);
+        sent++;
+    }
+    link->stats.cheld = link->credit->held;
+
+    /* ドライバからの読み込みを待たずに送る */
+    if ( sent > 0 && (link->agg.count > 0 || link->sendbuflen > 0) ){
+        if ( write_socket(link) < 0){
+            print_err(LOG_ERR, "release_credit returned\n");
+            close_socket(link);
             return(-1);
         }
     }
+    return(0);
+}
 
-    if(debuglevel > 1){        
-        print_err(LOG_ERR, "read_ste returned\n");
+/*********************************************************************
+ * 統計ファイル書き出し用ルーチン
+ *
+ * HUB との接続の TCP の状態をサンプリングし、フレーム数などのカウンタ
+ * と一緒に STED_STAT_FILE に書き出す。ファイルは毎回作り直す。
+ * 複数のリンクを張っている場合は、開いているリンク毎に 1 行ずつ書く。
+ *
+ * 引数
+ *
+ *    stedstat: sted_stat 構造体の配列
+ *    nlinks  : リンクの数
+ *
+ * 戻り値
+ *
+ *    正常時 :    0
+ *    障害時 :   -1 (統計ファイルをオープンできなかった）
+ **********************************************************************/
+int
+write_stat_file(stedstat_t *stedstat, int nlinks)
+{
+    FILE       *fp;
+    stedstat_t *link;
+    char        peer[MAXHOSTNAME + 8];
+    int         i;
+
+    /* 閉じているリンクは飛ばす。リンク 0 が閉じていても他のリンクは書く */
+    if((fp = fopen(STED_STAT_FILE, "w")) == NULL)
+        return(-1);
+    for(i = 0 ; i < nlinks ; i++){
+        link = &stedstat[i];
+        if(link->sock_fd < 0)
+            continue;
+        ste_stats_sample(link->sock_fd, link->conn_id, &link->stats);
+        if(!link->udp)
+            ste_tune_update(link->sock_fd, &link->stats);
+        /* リンクが 1 本なら従来通り HUB の名前だけ */
+        if(nlinks > 1)
+            sprintf(peer, "%.*s/%d", MAXHOSTNAME, link->hub_name, i);
+        else
+            sprintf(peer, "%.*s", MAXHOSTNAME, link->hub_name);
+        ste_stats_print(fp, link->conn_id, peer, &link->stats);
     }
-    
-    return(readsize);
+    STE_ACCT_PRINT(fp);
+    fclose(fp);
+
+    return(0);
 }
 
 
@@ -752,6 +1529,7 @@ sted_svc_ctrl_handler(
     PDEV_BROADCAST_HDR  p      = (PDEV_BROADCAST_HDR) lpEventData;
     WPARAM              wParam = (WPARAM) dwEventType;
     stedstat_t         *stedstat = NULL;
+    int                 i;
 
     stedstat = (stedstat_t *)lpContext;
 
@@ -777,9 +1555,11 @@ sted_svc_ctrl_handler(
             SetServiceStatus (stedServiceStatusHandle,&stedServiceStatus);
             bRunning=FALSE;
 
-            if(stedstat->ste_handle != INVALID_HANDLE_VALUE){
-                ioctl_ste(stedstat->ste_handle, UNREGSVC);
-                stedstat->ste_handle = INVALID_HANDLE_VALUE;
+            for(i = 0 ; i < stedstat->nadapters ; i++){
+                if(stedstat->adapter[i].ste_handle != INVALID_HANDLE_VALUE){
+                    ioctl_ste(stedstat->adapter[i].ste_handle, UNREGSVC);
+                    stedstat->adapter[i].ste_handle = INVALID_HANDLE_VALUE;
+                }
             }
             break;
         case SERVICE_CONTROL_INTERROGATE:
@@ -0,0 +1,613 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_aead.c
+ *
+ * sted と stehub の間のリンクの暗号化（ChaCha20-Poly1305, RFC 8439）の
+ * ルーチン。stehub からも ..\sted\sted_aead.c としてコンパイルされる。
+ *
+ *  o 外部の暗号ライブラリは使わない。ChaCha20 は 32 bit の加算・XOR・
+ *    ローテートだけ、Poly1305 は 26 bit x 5 のリムで 64 bit の乗算だけを
+ *    使うので、どの CPU でも定数時間で動く。
+ *  o 1 メッセージ（最大 STE_AGG_MAX_FRAMES フレーム）をまとめて 1 回で
+ *    暗号化・認証するので、鍵のセットアップやタグの計算はフレーム毎
+ *    ではなくメッセージ毎にかかる。
+ *  o 送信するメッセージは組み立てたバッファの中で、受信したメッセージは
+ *    受信バッファの中でそのまま暗号化・復号する。キーストリームの XOR と
+ *    Poly1305 は 64 byte のブロック毎に続けてかけるので、データは 1 回しか
+ *    読み書きしない（暗号化してから別にタグを計算すると、大きなメッセージ
+ *    ではキャッシュから追い出されたデータをもう一度読むことになる）。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <windows.h>
+#include <wincrypt.h>
+#else
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include "sted.h"
+#include "sted_aead.h"
+
+#define  STE_ROTL32(v, n)         (((v) << (n)) | ((v) >> (32 - (n))))
+#define  STE_LE32(p)              ((unsigned int)(p)[0] | ((unsigned int)(p)[1] << 8) | \
+                                   ((unsigned int)(p)[2] << 16) | ((unsigned int)(p)[3] << 24))
+
+#define  STE_QR(a, b, c, d) \
+    a += b; d ^= a; d = STE_ROTL32(d, 16); \
+    c += d; b ^= c; b = STE_ROTL32(b, 12); \
+    a += b; d ^= a; d = STE_ROTL32(d, 8);  \
+    c += d; b ^= c; b = STE_ROTL32(b, 7)
+
+/*
+ * Poly1305 の状態
+ */
+typedef struct ste_poly
+{
+    unsigned int    r[5];
+    unsigned int    s[4];
+    unsigned int    h[5];
+} ste_poly_t;
+
+static void ste_put_le32(unsigned char *, unsigned int);
+static void ste_chacha_rounds(unsigned int *, unsigned int *);
+static void ste_chacha_block(unsigned int *, unsigned int, unsigned int *, unsigned char *);
+static void ste_poly_init(ste_poly_t *, unsigned char *);
+static void ste_poly_blocks(ste_poly_t *, unsigned char *, int);
+static void ste_poly_pad(ste_poly_t *, unsigned char *, int);
+static void ste_poly_finish(ste_poly_t *, unsigned char *);
+static void ste_aead_crypt(ste_aead_t *, unsigned int *, unsigned char *, unsigned char *, int, int, unsigned char *);
+
+static void
+ste_put_le32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+/*****************************************************************************
+ * ste_chacha_rounds()
+ *
+ * ChaCha の 20 ラウンド（10 回のダブルラウンド）を x に施す。
+ *
+ *  引数：
+ *           x  : 作業用の状態(16 ワード)
+ *           in : 初期状態(16 ワード)
+ *****************************************************************************/
+static void
+ste_chacha_rounds(unsigned int *x, unsigned int *in)
+{
+    int i;
+
+    memcpy(x, in, 16 * sizeof(unsigned int));
+    for(i = 0 ; i < 10 ; i++){
+        STE_QR(x[0], x[4], x[8],  x[12]);
+        STE_QR(x[1], x[5], x[9],  x[13]);
+        STE_QR(x[2], x[6], x[10], x[14]);
+        STE_QR(x[3], x[7], x[11], x[15]);
+        STE_QR(x[0], x[5], x[10], x[15]);
+        STE_QR(x[1], x[6], x[11], x[12]);
+        STE_QR(x[2], x[7], x[8],  x[13]);
+        STE_QR(x[3], x[4], x[9],  x[14]);
+    }
+}
+
+/*****************************************************************************
+ * ste_chacha_setup()
+ *
+ * ChaCha20 の初期状態を作る。
+ *
+ *  引数：
+ *           st    : 初期状態を返す(16 ワード)
+ *           key   : 鍵(8 ワード)
+ *           nonce : nonce(3 ワード)
+ *****************************************************************************/
+static void
+ste_chacha_setup(unsigned int *st, unsigned int *key, unsigned int *nonce)
+{
+    st[0] = 0x61707865;
+    st[1] = 0x3320646e;
+    st[2] = 0x79622d32;
+    st[3] = 0x6b206574;
+    memcpy(st + 4, key, 8 * sizeof(unsigned int));
+    st[12] = 0;
+    memcpy(st + 13, nonce, 3 * sizeof(unsigned int));
+}
+
+/*****************************************************************************
+ * ste_chacha_block()
+ *
+ * ChaCha20 のキーストリームを 1 ブロック(64 byte)作る。
+ *
+ *  引数：
+ *           st      : 初期状態(16 ワード。st[12] は無視する)
+ *           counter : ブロックカウンタ
+ *           x       : 作業領域(16 ワード)
+ *           out     : キーストリームを返す(64 byte)
+ *****************************************************************************/
+static void
+ste_chacha_block(unsigned int *st, unsigned int counter, unsigned int *x, unsigned char *out)
+{
+    int i;
+
+    st[12] = counter;
+    ste_chacha_rounds(x, st);
+    for(i = 0 ; i < 16 ; i++)
+        ste_put_le32(out + 4 * i, x[i] + st[i]);
+}
+
+/*****************************************************************************
+ * ste_poly_init()
+ *
+ * Poly1305 の状態を 32 byte の鍵（r と s）で初期化する。
+ *****************************************************************************/
+static void
+ste_poly_init(ste_poly_t *p, unsigned char *key)
+{
+    /* r は RFC 8439 の clamp をしてから 26 bit ずつに分ける */
+    p->r[0] = (STE_LE32(key + 0)) & 0x3ffffff;
+    p->r[1] = (STE_LE32(key + 3) >> 2) & 0x3ffff03;
+    p->r[2] = (STE_LE32(key + 6) >> 4) & 0x3ffc0ff;
+    p->r[3] = (STE_LE32(key + 9) >> 6) & 0x3f03fff;
+    p->r[4] = (STE_LE32(key + 12) >> 8) & 0x00fffff;
+    p->s[0] = STE_LE32(key + 16);
+    p->s[1] = STE_LE32(key + 20);
+    p->s[2] = STE_LE32(key + 24);
+    p->s[3] = STE_LE32(key + 28);
+    memset(p->h, 0x0, sizeof(p->h));
+}
+
+/*****************************************************************************
+ * ste_poly_blocks()
+ *
+ * 16 byte のブロックを Poly1305 に入れる。len は 16 の倍数であること。
+ *****************************************************************************/
+static void
+ste_poly_blocks(ste_poly_t *p, unsigned char *m, int len)
+{
+    unsigned int r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+    unsigned int s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    unsigned int h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+    ste_uint64_t d0, d1, d2, d3, d4;
+    unsigned int c;
+
+    for( ; len >= 16 ; m += 16, len -= 16){
+        h0 += (STE_LE32(m + 0)) & 0x3ffffff;
+        h1 += (STE_LE32(m + 3) >> 2) & 0x3ffffff;
+        h2 += (STE_LE32(m + 6) >> 4) & 0x3ffffff;
+        h3 += (STE_LE32(m + 9) >> 6) & 0x3ffffff;
+        h4 += (STE_LE32(m + 12) >> 8) | (1 << 24);
+
+        d0 = (ste_uint64_t)h0 * r0 + (ste_uint64_t)h1 * s4 + (ste_uint64_t)h2 * s3 +
+             (ste_uint64_t)h3 * s2 + (ste_uint64_t)h4 * s1;
+        d1 = (ste_uint64_t)h0 * r1 + (ste_uint64_t)h1 * r0 + (ste_uint64_t)h2 * s4 +
+             (ste_uint64_t)h3 * s3 + (ste_uint64_t)h4 * s2;
+        d2 = (ste_uint64_t)h0 * r2 + (ste_uint64_t)h1 * r1 + (ste_uint64_t)h2 * r0 +
+             (ste_uint64_t)h3 * s4 + (ste_uint64_t)h4 * s3;
+        d3 = (ste_uint64_t)h0 * r3 + (ste_uint64_t)h1 * r2 + (ste_uint64_t)h2 * r1 +
+             (ste_uint64_t)h3 * r0 + (ste_uint64_t)h4 * s4;
+        d4 = (ste_uint64_t)h0 * r4 + (ste_uint64_t)h1 * r3 + (ste_uint64_t)h2 * r2 +
+             (ste_uint64_t)h3 * r1 + (ste_uint64_t)h4 * r0;
+
+        c = (unsigned int)(d0 >> 26); h0 = (unsigned int)d0 & 0x3ffffff;
+        d1 += c; c = (unsigned int)(d1 >> 26); h1 = (unsigned int)d1 & 0x3ffffff;
+        d2 += c; c = (unsigned int)(d2 >> 26); h2 = (unsigned int)d2 & 0x3ffffff;
+        d3 += c; c = (unsigned int)(d3 >> 26); h3 = (unsigned int)d3 & 0x3ffffff;
+        d4 += c; c = (unsigned int)(d4 >> 26); h4 = (unsigned int)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+    }
+    p->h[0] = h0; p->h[1] = h1; p->h[2] = h2; p->h[3] = h3; p->h[4] = h4;
+}
+
+/*****************************************************************************
+ * ste_poly_pad()
+ *
+ * データを 16 byte の倍数まで 0 でパディングして Poly1305 に入れる。
+ *****************************************************************************/
+static void
+ste_poly_pad(ste_poly_t *p, unsigned char *m, int len)
+{
+    unsigned char last[16];
+    int           full = len & ~15;
+
+    ste_poly_blocks(p, m, full);
+    if(len > full){
+        memset(last, 0x0, sizeof(last));
+        memcpy(last, m + full, len - full);
+        ste_poly_blocks(p, last, 16);
+    }
+}
+
+/*****************************************************************************
+ * ste_poly_finish()
+ *
+ * h を 2^130 - 5 で完全に剰余を取り、s を足して 16 byte のタグを作る。
+ *****************************************************************************/
+static void
+ste_poly_finish(ste_poly_t *p, unsigned char *tag)
+{
+    unsigned int h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+    unsigned int g0, g1, g2, g3, g4, c, mask;
+    ste_uint64_t f;
+
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    /* h - (2^130 - 5) を計算し、負でなければそちらを使う（分岐しない） */
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1 << 26);
+    mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+
+    f = (ste_uint64_t)h0 + p->s[0];             ste_put_le32(tag + 0, (unsigned int)f);
+    f = (ste_uint64_t)h1 + p->s[1] + (f >> 32); ste_put_le32(tag + 4, (unsigned int)f);
+    f = (ste_uint64_t)h2 + p->s[2] + (f >> 32); ste_put_le32(tag + 8, (unsigned int)f);
+    f = (ste_uint64_t)h3 + p->s[3] + (f >> 32); ste_put_le32(tag + 12, (unsigned int)f);
+}
+
+/*****************************************************************************
+ * ste_aead_crypt()
+ *
+ * RFC 8439 の AEAD で buf をその場で暗号化（復号）し、認証タグを計算する。
+ * 64 byte 毎にキーストリームを XOR し、続けて同じ 64 byte の暗号文を
+ * Poly1305 に入れる。
+ *
+ *  引数：
+ *           st      : 暗号化の状態
+ *           nonce   : nonce(3 ワード)
+ *           aad     : 追加の認証データ(STE_AEAD_HDRSIZE byte)
+ *           buf     : 暗号化（復号）するデータ
+ *           len     : データのサイズ
+ *           encrypt : 暗号化なら 1、復号なら 0
+ *           tag     : タグを返す(STE_AEAD_TAGLEN byte)
+ *****************************************************************************/
+static void
+ste_aead_crypt(ste_aead_t *st, unsigned int *nonce, unsigned char *aad, unsigned char *buf, int len,
+               int encrypt, unsigned char *tag)
+{
+    unsigned int  cs[16], x[16];
+    unsigned char ks[64];
+    unsigned char lens[16];
+    unsigned int  counter = 1;
+    int           total = len;
+    int           i, n;
+    ste_poly_t    poly;
+
+    /* ブロックカウンタ 0 のキーストリームの先頭 32 byte が Poly1305 の鍵 */
+    ste_chacha_setup(cs, st->key, nonce);
+    ste_chacha_block(cs, 0, x, ks);
+    ste_poly_init(&poly, ks);
+    ste_poly_pad(&poly, aad, STE_AEAD_HDRSIZE);
+
+    /* 端数になるのは最後のブロックだけなので、パディングもそこだけ */
+    while(len > 0){
+        n = (len < 64) ? len : 64;
+        ste_chacha_block(cs, counter++, x, ks);
+        if(!encrypt)
+            ste_poly_pad(&poly, buf, n);
+        for(i = 0 ; i < n ; i++)
+            buf[i] ^= ks[i];
+        if(encrypt)
+            ste_poly_pad(&poly, buf, n);
+        buf += n;
+        len -= n;
+    }
+
+    memset(lens, 0x0, sizeof(lens));
+    ste_put_le32(lens, STE_AEAD_HDRSIZE);
+    ste_put_le32(lens + 8, (unsigned int)total);
+    ste_poly_blocks(&poly, lens, 16);
+    ste_poly_finish(&poly, tag);
+    memset(ks, 0x0, sizeof(ks));
+}
+
+/*****************************************************************************
+ * ste_aead_load_key()
+ *
+ * 事前共有鍵のファイルを読む。ファイルには 32 byte の鍵を 16 進数 64 文字で
+ * 書いておく（空白と改行は無視する）。
+ *
+ *  引数：
+ *           path : 鍵ファイルのパス
+ *           psk  : 鍵を返す(STE_AEAD_KEYLEN byte)
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (読めないか、16 進数 64 文字でない)
+ *****************************************************************************/
+int
+ste_aead_load_key(char *path, unsigned char *psk)
+{
+    FILE *fp;
+    int   c, v;
+    int   n = 0;
+
+    if((fp = fopen(path, "r")) == NULL)
+        return(-1);
+    while((c = fgetc(fp)) != EOF){
+        if(isspace(c))
+            continue;
+        if(c >= '0' && c <= '9')
+            v = c - '0';
+        else if(c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F')
+            v = c - 'A' + 10;
+        else
+            break;
+        if(n >= STE_AEAD_KEYLEN * 2){
+            n++;
+            break;
+        }
+        if(n & 1)
+            psk[n / 2] |= (unsigned char)v;
+        else
+            psk[n / 2] = (unsigned char)(v << 4);
+        n++;
+    }
+    fclose(fp);
+    return((n == STE_AEAD_KEYLEN * 2 && c == EOF) ? 0 : -1);
+}
+
+/*****************************************************************************
+ * ste_aead_random()
+ *
+ * OS の乱数生成器から乱数を取り出す。
+ *
+ *  引数：
+ *           buf : 乱数を返す
+ *           len : サイズ
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+ste_aead_random(unsigned char *buf, int len)
+{
+#ifdef STE_WINDOWS
+    HCRYPTPROV prov;
+    BOOL       ok;
+
+    if(!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+        return(-1);
+    ok = CryptGenRandom(prov, len, buf);
+    CryptReleaseContext(prov, 0);
+    return(ok ? 0 : -1);
+#else
+    FILE *fp;
+    int   n;
+
+    if((fp = fopen("/dev/urandom", "r")) == NULL)
+        return(-1);
+    n = (int)fread(buf, 1, len, fp);
+    fclose(fp);
+    return((n == len) ? 0 : -1);
+#endif
+}
+
+/*****************************************************************************
+ * ste_aead_init()
+ *
+ * 事前共有鍵と STE_MSG_HELLO で送り合った nonce からセッション鍵を作り、
+ * 暗号化の状態を初期化する。
+ *
+ *  引数：
+ *           st        : 暗号化の状態
+ *           psk       : 事前共有鍵(STE_AEAD_KEYLEN byte)
+ *           sted_nonce: sted の nonce(STE_HELLO_NONCE byte)
+ *           hub_nonce : stehub の nonce(STE_HELLO_NONCE byte)
+ *           role      : 自分の役割(STE_ROLE_XXX)
+ *****************************************************************************/
+void
+ste_aead_init(ste_aead_t *st, unsigned char *psk, unsigned char *sted_nonce, unsigned char *hub_nonce, int role)
+{
+    unsigned int  key[8], in[4], cs[16], x[16];
+    unsigned char n[16];
+    int           i;
+
+    /* HChaCha20: 鍵と 16 byte の入力から 32 byte の鍵を作る */
+    memcpy(n, sted_nonce, STE_HELLO_NONCE);
+    memcpy(n + STE_HELLO_NONCE, hub_nonce, STE_HELLO_NONCE);
+    for(i = 0 ; i < 8 ; i++)
+        key[i] = STE_LE32(psk + 4 * i);
+    for(i = 0 ; i < 4 ; i++)
+        in[i] = STE_LE32(n + 4 * i);
+    ste_chacha_setup(cs, key, in + 1);
+    cs[12] = in[0];
+    ste_chacha_rounds(x, cs);
+    for(i = 0 ; i < 4 ; i++){
+        st->key[i] = x[i];
+        st->key[4 + i] = x[12 + i];
+    }
+
+    st->tx_dir = (role == STE_ROLE_STED) ? STE_AEAD_DIR_STED : STE_AEAD_DIR_HUB;
+    st->rx_dir = (role == STE_ROLE_STED) ? STE_AEAD_DIR_HUB : STE_AEAD_DIR_STED;
+    st->tx_seq = 0;
+    st->rx_max = 0;
+    st->rx_bitmap = 0;
+    memset(key, 0x0, sizeof(key));
+    memset(x, 0x0, sizeof(x));
+    memset(cs, 0x0, sizeof(cs));
+}
+
+/*****************************************************************************
+ * ste_aead_seal()
+ *
+ * 完成したメッセージ（ste_agg_seal() 等が返したもの）をその場で暗号化して
+ * STE_MSG_SEAL にする。msg の前に STE_SEAL_HEADROOM byte、後ろに
+ * STE_SEAL_TAILROOM byte の空きがあること（ste_agg_seal() と ste_lz_seal()
+ * が返すメッセージは満たしている）。
+ *
+ *  引数：
+ *           st      : 暗号化の状態
+ *           msg     : 完成したメッセージ
+ *           msglen  : msg のサイズ。STE_MSG_SEAL のサイズを返す
+ *           txflags : STE_TX_XXX
+ *           cs      : 統計情報を数える接続毎の統計情報
+ * 戻り値：
+ *          STE_MSG_SEAL の先頭（msg の STE_SEAL_HEADROOM byte 前）
+ *****************************************************************************/
+unsigned char *
+ste_aead_seal(ste_aead_t *st, unsigned char *msg, int *msglen, int txflags, ste_connstat_t *cs)
+{
+    int            hsize = STE_HEADSIZE(txflags);
+    unsigned char *start = msg - STE_AEAD_HDRSIZE;
+    unsigned char *p = start + hsize;
+    unsigned int   nonce[3];
+    int            orglen;
+    int            len;
+    ste_uint64_t   seq = st->tx_seq++;
+
+    /* 元のヘッダは seq, orglen で上書きされるので先に読む */
+    len = ste_get_head(msg, txflags, &orglen);
+    p[0] = (unsigned char)(seq >> 56);
+    p[1] = (unsigned char)(seq >> 48);
+    p[2] = (unsigned char)(seq >> 40);
+    p[3] = (unsigned char)(seq >> 32);
+    p[4] = (unsigned char)(seq >> 24);
+    p[5] = (unsigned char)(seq >> 16);
+    p[6] = (unsigned char)(seq >> 8);
+    p[7] = (unsigned char)seq;
+    p[8] = (unsigned char)((unsigned int)orglen >> 24);
+    p[9] = (unsigned char)((unsigned int)orglen >> 16);
+    p[10] = (unsigned char)((unsigned int)orglen >> 8);
+    p[11] = (unsigned char)orglen;
+
+    nonce[0] = st->tx_dir;
+    nonce[1] = (unsigned int)seq;
+    nonce[2] = (unsigned int)(seq >> 32);
+    ste_aead_crypt(st, nonce, p, p + STE_AEAD_HDRSIZE, len, 1, p + STE_AEAD_HDRSIZE + len);
+
+    /* 元の本体は 4 の倍数なので、STE_MSG_SEAL にパディングは要らない */
+    len += STE_AEAD_HDRSIZE + STE_AEAD_TAGLEN;
+    ste_put_head(start, len, STE_MSG_SEAL, txflags);
+    *msglen = hsize + len;
+    cs->eseals++;
+    return(start);
+}
+
+/*****************************************************************************
+ * ste_aead_open()
+ *
+ * STE_MSG_SEAL を受信バッファの中で復号して認証し、中のメッセージを返す。
+ * 認証に失敗した場合、本体は壊れたまま（捨てること）。
+ * 中身はまとめたフレーム（STE_MSG_AGG, STE_MSG_CAGG, STE_MSG_HAGG,
+ * STE_MSG_ZAGG, STE_MSG_MUX）と STE_MSG_PING, STE_MSG_CREDIT に限る。
+ *
+ *  引数：
+ *           st    : 暗号化の状態
+ *           msg   : 受信した STE_MSG_SEAL
+ *           inner : 復号したメッセージを返す
+ *           cs    : 統計情報を数える接続毎の統計情報
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (認証に失敗したか、リプレイ)
+ *****************************************************************************/
+int
+ste_aead_open(ste_aead_t *st, ste_msg_t *msg, ste_msg_t *inner, ste_connstat_t *cs)
+{
+    unsigned char *p = msg->body;
+    unsigned char  tag[STE_AEAD_TAGLEN];
+    unsigned int   nonce[3];
+    unsigned char  diff = 0;
+    ste_uint64_t   seq = 0;
+    ste_uint64_t   off;
+    int            orglen;
+    int            len = msg->len - STE_AEAD_HDRSIZE - STE_AEAD_TAGLEN;
+    int            i;
+
+    if(len < 4 || (len & 3) != 0){
+        cs->eauth++;
+        return(-1);
+    }
+    for(i = 0 ; i < 8 ; i++)
+        seq = (seq << 8) | p[i];
+    orglen = (int)(((unsigned int)p[8] << 24) | (p[9] << 16) | (p[10] << 8) | p[11]);
+    if(orglen != STE_MSG_AGG && orglen != STE_MSG_CAGG && orglen != STE_MSG_HAGG && orglen != STE_MSG_ZAGG &&
+       orglen != STE_MSG_MUX && orglen != STE_MSG_PING && orglen != STE_MSG_CREDIT){
+        cs->eauth++;
+        return(-1);
+    }
+
+    /* 認証する前に、古すぎるものと受け取り済みのものを捨てる */
+    if(seq <= st->rx_max && (st->rx_bitmap & 1)){
+        off = st->rx_max - seq;
+        if(off >= STE_AEAD_WINDOW || (st->rx_bitmap & ((ste_uint64_t)1 << off))){
+            cs->ereplays++;
+            return(-1);
+        }
+    }
+
+    nonce[0] = st->rx_dir;
+    nonce[1] = (unsigned int)seq;
+    nonce[2] = (unsigned int)(seq >> 32);
+    ste_aead_crypt(st, nonce, p, p + STE_AEAD_HDRSIZE, len, 0, tag);
+    /* 比較は定数時間で */
+    for(i = 0 ; i < STE_AEAD_TAGLEN ; i++)
+        diff |= tag[i] ^ p[STE_AEAD_HDRSIZE + len + i];
+    if(diff != 0){
+        cs->eauth++;
+        return(-1);
+    }
+
+    /* 認証できたらリプレイウィンドウを進める */
+    if((st->rx_bitmap & 1) == 0 || seq > st->rx_max){
+        off = ((st->rx_bitmap & 1) == 0) ? STE_AEAD_WINDOW : seq - st->rx_max;
+        st->rx_bitmap = (off >= STE_AEAD_WINDOW) ? 1 : ((st->rx_bitmap << off) | 1);
+        st->rx_max = seq;
+    } else {
+        st->rx_bitmap |= (ste_uint64_t)1 << (st->rx_max - seq);
+    }
+
+    inner->type = orglen;
+    inner->body = p + STE_AEAD_HDRSIZE;
+    inner->len = len;
+    cs->eopens++;
+    return(0);
+}
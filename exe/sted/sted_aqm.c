@@ -0,0 +1,437 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_aqm.c
+ *
+ * sted と stehub が共通で使う送信キューの AQM（sted_aqm.h 参照）のルーチン。
+ * stehub からも ..\sted\sted_aqm.c としてコンパイルされる。
+ *
+ *  o CoDel の状態はフレームがキューから出る時（ste_aqm_depart()）に進め、
+ *    捨てるかどうかはフレームがキューに入る時（ste_aqm_admit()）に決める。
+ *  o 浮動小数点は使わない（制御則の sqrt は整数で求める）。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sted.h"
+#include "sted_aqm.h"
+
+static int           ste_aqm_fat(ste_aqm_t *, int);
+static int           ste_aqm_iphdr(unsigned char *, int, int *);
+static int           ste_aqm_ecn(unsigned char *, int);
+static ste_uint64_t  ste_aqm_control_law(ste_uint64_t, unsigned int);
+
+/*****************************************************************************
+ * ste_aqm_reset()
+ *
+ * キューを空にした。捨てる状態を抜け、フロー毎のバイト数を 0 に戻す。
+ *****************************************************************************/
+void
+ste_aqm_reset(ste_aqm_t *aqm)
+{
+    aqm->first_above_usec = 0;
+    aqm->drop_next_usec = 0;
+    aqm->dropping = 0;
+    aqm->count = 0;
+    aqm->lastcount = 0;
+    aqm->total = 0;
+    aqm->nflows = 0;
+    memset(aqm->backlog, 0x0, sizeof(aqm->backlog));
+}
+
+/*****************************************************************************
+ * ste_aqm_admit()
+ *
+ * フレームをキューに入れてよいかどうかを決める。フレームのフローがキューの
+ * 中に公平な取り分以上を持っていて、捨てる状態で次に捨てる時刻になって
+ * いれば捨てるか CE を付け、キューの空きが STE_AQM_HEADROOM より少なければ
+ * 捨てる。キューに入れたら ste_aqm_enqueue() を呼ぶこと。
+ *
+ *  引数：
+ *           aqm   : AQM の状態
+ *           flow  : フローの番号（STE_AQM_FLOW()）
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ *           room  : キューの空き(bytes)
+ *           now   : 現在時刻(usec)
+ *           cs    : 統計情報
+ * 戻り値：
+ *           STE_AQM_XXX
+ *****************************************************************************/
+int
+ste_aqm_admit(ste_aqm_t *aqm, int flow, unsigned char *frame, int len, int room,
+              ste_uint64_t now, ste_connstat_t *cs)
+{
+    /* 取り分より少ないフロー（対話的なフロー）は捨てない */
+    if(!ste_aqm_fat(aqm, flow))
+        return(STE_AQM_PASS);
+    if(room < STE_AQM_HEADROOM){
+        cs->aqdrops++;
+        return(STE_AQM_DROP);
+    }
+    if(!aqm->dropping || now < aqm->drop_next_usec)
+        return(STE_AQM_PASS);
+
+    aqm->count++;
+    aqm->drop_next_usec = ste_aqm_control_law(aqm->drop_next_usec > now ? aqm->drop_next_usec : now,
+                                              aqm->count);
+    if(ste_aqm_ecn(frame, len) > 0){
+        cs->aqmarks++;
+        return(STE_AQM_MARK);
+    }
+    cs->aqdrops++;
+    return(STE_AQM_DROP);
+}
+
+/*****************************************************************************
+ * ste_aqm_enqueue()
+ *
+ * フレームをキューに入れた。フロー毎のバイト数を足す。
+ *
+ *  引数：
+ *           aqm   : AQM の状態
+ *           flow  : フローの番号
+ *           len   : フレーム長
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_aqm_enqueue(ste_aqm_t *aqm, int flow, int len)
+{
+    if(aqm->backlog[flow] == 0)
+        aqm->nflows++;
+    aqm->backlog[flow] += len;
+    aqm->total += len;
+}
+
+/*****************************************************************************
+ * ste_aqm_depart()
+ *
+ * フレームがキューから出た。滞留時間を統計情報に入れ、CoDel の状態を進める。
+ * キューの中が 1 フレーム分以下になった場合も、滞留時間が目標以下だった
+ * ものとして扱う（CoDel の maxpacket と同じ）。
+ *
+ *  引数：
+ *           aqm   : AQM の状態
+ *           flow  : フローの番号
+ *           len   : フレーム長
+ *           usec  : キューに入れた時刻
+ *           now   : 現在時刻(usec)
+ *           cs    : 統計情報
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_aqm_depart(ste_aqm_t *aqm, int flow, int len, ste_uint64_t usec,
+               ste_uint64_t now, ste_connstat_t *cs)
+{
+    unsigned int sojourn;
+    unsigned int delta;
+    int          ok_to_drop = 0;
+
+    if(aqm->backlog[flow] <= (unsigned int)len){
+        if(aqm->backlog[flow] > 0)
+            aqm->nflows--;
+        aqm->backlog[flow] = 0;
+    } else {
+        aqm->backlog[flow] -= len;
+    }
+    aqm->total = (aqm->total > (unsigned int)len) ? aqm->total - len : 0;
+
+    sojourn = (now > usec) ? (unsigned int)(now - usec) : 0;
+    if(cs->aqsamples++ == 0)
+        cs->sojourn_us = sojourn;
+    else
+        cs->sojourn_us = (cs->sojourn_us * 7 + sojourn) / 8;
+    if(sojourn > cs->sojourn_max_us)
+        cs->sojourn_max_us = sojourn;
+
+    if(sojourn < STE_AQM_TARGET_USEC || aqm->total <= STE_FRAME_MAX){
+        aqm->first_above_usec = 0;
+    } else if(aqm->first_above_usec == 0){
+        aqm->first_above_usec = now + STE_AQM_INTERVAL_USEC;
+    } else if(now >= aqm->first_above_usec){
+        ok_to_drop = 1;
+    }
+
+    if(aqm->dropping){
+        if(!ok_to_drop)
+            aqm->dropping = 0;
+        return;
+    }
+    if(!ok_to_drop)
+        return;
+
+    /*
+     * 捨てる状態に入る。少し前まで捨てる状態だったなら、前回の間隔の
+     * 続きから始める。次に入ってきた取り分以上のフローのフレームを捨てる。
+     */
+    aqm->dropping = 1;
+    delta = aqm->count - aqm->lastcount;
+    if(delta > 1 && now - aqm->drop_next_usec < 16 * STE_AQM_INTERVAL_USEC)
+        aqm->count = delta;
+    else
+        aqm->count = 0;
+    aqm->lastcount = aqm->count;
+    aqm->drop_next_usec = now;
+}
+
+/*****************************************************************************
+ * ste_aqm_mark()
+ *
+ * ste_aqm_admit() が STE_AQM_MARK を返したフレームの IPv4/IPv6 のヘッダに
+ * CE を付ける。IPv4 はヘッダのチェックサムを差分で直す（RFC 1624）。
+ *
+ *  引数：
+ *           frame : Ethernet フレーム（書き換えてよいコピー）
+ *           len   : フレーム長
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_aqm_mark(unsigned char *frame, int len)
+{
+    int          off, ver;
+    unsigned int oldw, neww, sum;
+
+    if((off = ste_aqm_iphdr(frame, len, &ver)) < 0)
+        return;
+    if(ver == 6){
+        frame[off + 1] |= 0x30;
+        return;
+    }
+    oldw = (frame[off] << 8) | frame[off + 1];
+    frame[off + 1] |= 0x03;
+    neww = (frame[off] << 8) | frame[off + 1];
+    sum = (~((frame[off + 10] << 8) | frame[off + 11]) & 0xffff) + (~oldw & 0xffff) + neww;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = ~sum & 0xffff;
+    frame[off + 10] = (unsigned char)(sum >> 8);
+    frame[off + 11] = (unsigned char)sum;
+}
+
+/*****************************************************************************
+ * ste_aqm_queue_reset()
+ *
+ * バイト列の送信キューを空にした。覚えていたフレームを忘れる。
+ *****************************************************************************/
+void
+ste_aqm_queue_reset(ste_aqm_queue_t *q)
+{
+    ste_aqm_reset(&q->aqm);
+    q->sent = 0;
+    q->head = 0;
+    q->count = 0;
+}
+
+/*****************************************************************************
+ * ste_aqm_queue_push()
+ *
+ * フレームを送信キューに入れた。ahead バイト送ったらキューから出たとみなす。
+ * 覚えておけるフレーム数を超えたら数えない。
+ *
+ *  引数：
+ *           q     : 送信キューの AQM の状態
+ *           flow  : フローの番号
+ *           len   : フレーム長
+ *           ahead : フレームより前にあるデータのサイズ（フレームを含むメッセージ
+ *                   をまだ組み立てていなければ、その先頭の 1 byte を含める）
+ *           now   : 現在時刻(usec)
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_aqm_queue_push(ste_aqm_queue_t *q, int flow, int len, int ahead, ste_uint64_t now)
+{
+    ste_aqm_ent_t *ent;
+
+    if(q->count >= STE_AQM_QMAX)
+        return;
+    ent = &q->ent[(q->head + q->count) % STE_AQM_QMAX];
+    ent->usec = now;
+    ent->pos = q->sent + (unsigned int)ahead;
+    ent->flow = (unsigned short)flow;
+    ent->len = (unsigned short)len;
+    q->count++;
+    ste_aqm_enqueue(&q->aqm, flow, len);
+}
+
+/*****************************************************************************
+ * ste_aqm_queue_sent()
+ *
+ * 送信キューから bytes バイト送った。送り終えたフレームをキューから出す。
+ *
+ *  引数：
+ *           q     : 送信キューの AQM の状態
+ *           bytes : 送ったバイト数
+ *           now   : 現在時刻(usec)
+ *           cs    : 統計情報
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_aqm_queue_sent(ste_aqm_queue_t *q, int bytes, ste_uint64_t now, ste_connstat_t *cs)
+{
+    ste_aqm_ent_t *ent;
+
+    q->sent += (unsigned int)bytes;
+    while(q->count > 0){
+        ent = &q->ent[q->head];
+        if((int)(q->sent - ent->pos) < 0)
+            break;
+        ste_aqm_depart(&q->aqm, ent->flow, ent->len, ent->usec, now, cs);
+        q->head = (q->head + 1) % STE_AQM_QMAX;
+        q->count--;
+    }
+}
+
+/*****************************************************************************
+ * ste_aqm_fat()
+ *
+ * フローがキューの中に公平な取り分（合計 / フロー数）以上を持っているか
+ * どうかを返す。
+ *
+ *  引数：
+ *           aqm   : AQM の状態
+ *           flow  : フローの番号
+ * 戻り値：
+ *           取り分以上   : 1
+ *           取り分より少ない : 0
+ *****************************************************************************/
+static int
+ste_aqm_fat(ste_aqm_t *aqm, int flow)
+{
+    if(aqm->backlog[flow] == 0)
+        return(0);
+    return((ste_uint64_t)aqm->backlog[flow] * (unsigned int)aqm->nflows >= aqm->total);
+}
+
+/*****************************************************************************
+ * ste_aqm_iphdr()
+ *
+ * フレームの中の IPv4/IPv6 のヘッダの位置を返す。VLAN タグは 1 つまで
+ * 読み飛ばす（ste_credit_prio() と同じ）。
+ *
+ *  引数：
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ *           ver   : IP のバージョン（4 か 6）を返す
+ * 戻り値：
+ *           IP ヘッダの位置。IPv4/IPv6 でなければ -1
+ *****************************************************************************/
+static int
+ste_aqm_iphdr(unsigned char *frame, int len, int *ver)
+{
+    int off = 12;
+    int type;
+
+    if(len < 14)
+        return(-1);
+    type = (frame[off] << 8) | frame[off + 1];
+    if(type == 0x8100 && len >= 18){
+        off += 4;
+        type = (frame[off] << 8) | frame[off + 1];
+    }
+    off += 2;
+
+    if(type == 0x0800 && len >= off + 20 && (frame[off] >> 4) == 4){
+        *ver = 4;
+        return(off);
+    }
+    if(type == 0x86DD && len >= off + 40 && (frame[off] >> 4) == 6){
+        *ver = 6;
+        return(off);
+    }
+    return(-1);
+}
+
+/*****************************************************************************
+ * ste_aqm_ecn()
+ *
+ * フレームの IP ヘッダの ECN のフィールドを返す。
+ *
+ *  引数：
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ * 戻り値：
+ *           ECN のフィールド（0: Not-ECT, 1: ECT(1), 2: ECT(0), 3: CE）。
+ *           IPv4/IPv6 でなければ 0
+ *****************************************************************************/
+static int
+ste_aqm_ecn(unsigned char *frame, int len)
+{
+    int off, ver;
+
+    if((off = ste_aqm_iphdr(frame, len, &ver)) < 0)
+        return(0);
+    if(ver == 6)
+        return((frame[off + 1] >> 4) & 0x03);
+    return(frame[off + 1] & 0x03);
+}
+
+/*****************************************************************************
+ * ste_aqm_control_law()
+ *
+ * CoDel の制御則。次に捨てる時刻 t + INTERVAL / sqrt(count) を返す。
+ * sqrt(count) は count を 2^20 倍して整数の平方根を求める。
+ *
+ *  引数：
+ *           t     : 基準の時刻(usec)
+ *           count : 捨てる状態に入ってから捨てた数
+ * 戻り値：
+ *           次に捨てる時刻(usec)
+ *****************************************************************************/
+static ste_uint64_t
+ste_aqm_control_law(ste_uint64_t t, unsigned int count)
+{
+    ste_uint64_t x = (ste_uint64_t)count << 20;
+    ste_uint64_t r = 0;
+    ste_uint64_t bit = (ste_uint64_t)1 << 62;
+
+    while(bit > x)
+        bit >>= 2;
+    while(bit != 0){
+        if(x >= r + bit){
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    if(r == 0)
+        r = 1024;
+    return(t + (ste_uint64_t)STE_AQM_INTERVAL_USEC * 1024 / r);
+}
@@ -0,0 +1,342 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_credit.c
+ *
+ * stehub からのクレジットによるフロー制御（STE_CAP_CREDIT）の sted 側の
+ * ルーチン。
+ *
+ *  o 送ったフレームを数え、stehub から受け取った上限と比べる。
+ *  o クレジットが無い間のフレームを優先度毎のキューに溜める。キューには
+ *    AQM（sted_aqm.c）をかける。
+ *  o 上限の計算と STE_MSG_CREDIT の送信は stehub.c が行う。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sted.h"
+#include "sted_credit.h"
+
+/*****************************************************************************
+ * ste_credit_reset()
+ *
+ * HUB に接続した。送った数を 0 に戻し、キューを空にする。STE_MSG_CREDIT を
+ * 受け取るまでは制限しない。
+ *****************************************************************************/
+void
+ste_credit_reset(ste_credit_t *c)
+{
+    int i;
+
+    c->valid = 0;
+    c->tx_frames = 0;
+    c->tx_bytes = 0;
+    c->lim_frames = 0;
+    c->lim_bytes = 0;
+    c->stall_usec = 0;
+    c->held = 0;
+    for(i = 0 ; i < STE_CREDIT_BANDS ; i++){
+        c->band[i].head = 0;
+        c->band[i].count = 0;
+        c->band[i].wpos = 0;
+        ste_aqm_reset(&c->band[i].aqm);
+    }
+}
+
+/*****************************************************************************
+ * ste_credit_avail()
+ *
+ * フレームを 1 つ送れるだけのクレジットが残っているかどうかを返す。
+ *
+ *  引数：
+ *           c     : クレジットの状態
+ * 戻り値：
+ *           送れる   : 1
+ *           送れない : 0
+ *****************************************************************************/
+int
+ste_credit_avail(ste_credit_t *c)
+{
+    if(!c->valid)
+        return(1);
+    return((int)(c->lim_frames - c->tx_frames) > 0 && (int)(c->lim_bytes - c->tx_bytes) > 0);
+}
+
+/*****************************************************************************
+ * ste_credit_sent()
+ *
+ * フレームを送信バッファに詰めた。HUB と合意する前のフレームも、HUB が
+ * 数えるので同じように数える。
+ *
+ *  引数：
+ *           c     : クレジットの状態
+ *           len   : フレーム長
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_credit_sent(ste_credit_t *c, int len)
+{
+    c->tx_frames++;
+    c->tx_bytes += STE_CREDIT_SIZE(len);
+    c->stall_usec = 0;
+}
+
+/*****************************************************************************
+ * ste_credit_grant()
+ *
+ * HUB から STE_MSG_CREDIT を受け取った。上限は累計なので、今の上限より
+ * 古いものは無視する。STE_CREDIT_RESYNC_USEC の間何も送れずにいたのに、
+ * HUB が受け取った数が送った数と違えば、途中で数え損なっている（壊れた
+ * メッセージを HUB が捨てた）ので、HUB の数に合わせる。
+ *
+ *  引数：
+ *           c      : クレジットの状態
+ *           credit : ste_msg_get_credit() で取り出した値
+ *                    （フレーム数とバイト数の上限、HUB が受け取った数）
+ *           now    : 現在時刻(usec)
+ *           cs     : 統計情報
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_credit_grant(ste_credit_t *c, unsigned int *credit, ste_uint64_t now, ste_connstat_t *cs)
+{
+    cs->cgrants++;
+    if(c->stall_usec != 0 && now - c->stall_usec >= STE_CREDIT_RESYNC_USEC &&
+       (c->tx_frames != credit[2] || c->tx_bytes != credit[3])){
+        c->tx_frames = credit[2];
+        c->tx_bytes = credit[3];
+        c->stall_usec = now;
+        cs->cresyncs++;
+    }
+    if(!c->valid || (int)(credit[0] - c->lim_frames) > 0)
+        c->lim_frames = credit[0];
+    if(!c->valid || (int)(credit[1] - c->lim_bytes) > 0)
+        c->lim_bytes = credit[1];
+    c->valid = 1;
+}
+
+/*****************************************************************************
+ * ste_credit_prio()
+ *
+ * フレームの優先度を決める。802.1p の優先度か、IPv4/IPv6 の DSCP を見る。
+ * 相手が見つからなくなったり経路の情報が失われたりしないよう、ARP と
+ * ICMP/ICMPv6（近隣探索を含む）は優先する。
+ *
+ *  引数：
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ * 戻り値：
+ *           STE_CREDIT_PRIO_XXX
+ *****************************************************************************/
+int
+ste_credit_prio(unsigned char *frame, int len)
+{
+    int off = 12;
+    int type;
+    int pcp = -1;
+    int dscp;
+
+    if(len < 14)
+        return(STE_CREDIT_PRIO_NORMAL);
+
+    type = (frame[off] << 8) | frame[off + 1];
+    if(type == 0x8100 && len >= 18){
+        /* VLAN タグ */
+        pcp = frame[off + 2] >> 5;
+        off += 4;
+        type = (frame[off] << 8) | frame[off + 1];
+    }
+    off += 2;
+
+    if(pcp >= 6)
+        return(STE_CREDIT_PRIO_HIGH);
+    if(type == 0x0806)
+        return(STE_CREDIT_PRIO_HIGH);
+    if(type == 0x0800 && len >= off + 20 && (frame[off] >> 4) == 4){
+        dscp = frame[off + 1] >> 2;
+        if(frame[off + 9] == 1 || dscp == 46 || dscp >= 48)
+            return(STE_CREDIT_PRIO_HIGH);
+        if(dscp == 8)
+            return(STE_CREDIT_PRIO_LOW);
+    } else if(type == 0x86DD && len >= off + 40){
+        dscp = (((frame[off] & 0x0f) << 4) | (frame[off + 1] >> 4)) >> 2;
+        if(frame[off + 6] == 58 || dscp == 46 || dscp >= 48)
+            return(STE_CREDIT_PRIO_HIGH);
+        if(dscp == 8)
+            return(STE_CREDIT_PRIO_LOW);
+    }
+    if(pcp == 1)
+        return(STE_CREDIT_PRIO_LOW);
+    return(STE_CREDIT_PRIO_NORMAL);
+}
+
+/*****************************************************************************
+ * ste_credit_hold()
+ *
+ * クレジットが無いのでフレームをキューに溜める。溜めていたフレームを
+ * 追い越さないよう、キューが空でなければクレジットが残っていても溜める。
+ * 優先度のキューが一杯か、AQM が捨てると決めたら捨てる。
+ *
+ *  引数：
+ *           c     : クレジットの状態
+ *           chan  : フレームの ste デバイスの番号
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ *           now   : 現在時刻(usec)
+ *           cs    : 統計情報
+ * 戻り値：
+ *           溜めた : 0
+ *           捨てた : -1
+ *****************************************************************************/
+int
+ste_credit_hold(ste_credit_t *c, unsigned int chan, unsigned char *frame, int len,
+                ste_uint64_t now, ste_connstat_t *cs)
+{
+    ste_credit_band_t *b = &c->band[ste_credit_prio(frame, len)];
+    ste_credit_ent_t  *ent;
+    int                tail;
+    int                wpos = b->wpos;
+    int                flow;
+    int                action;
+
+    if(c->stall_usec == 0 && !ste_credit_avail(c)){
+        c->stall_usec = now;
+        cs->cstalls++;
+    }
+
+    /*
+     * 使っている領域は、折り返していなければ [tail, wpos)、折り返して
+     * いれば [tail, 末尾) と [0, wpos)。wpos が tail に追いつかないように
+     * するので、wpos == tail なら空。
+     */
+    if(b->count == 0){
+        b->head = 0;
+        wpos = 0;
+    } else {
+        tail = b->ent[b->head].off;
+        if(b->count >= STE_CREDIT_QFRAMES)
+            wpos = -1;
+        else if(wpos >= tail && wpos + len > STE_CREDIT_QBYTES)
+            wpos = (len < tail) ? 0 : -1;
+        else if(wpos < tail && wpos + len >= tail)
+            wpos = -1;
+    }
+    if(wpos < 0 || len > STE_CREDIT_QBYTES){
+        cs->cqdrops++;
+        return(-1);
+    }
+    flow = STE_AQM_FLOW(ste_flow_hash(frame, len));
+    action = ste_aqm_admit(&b->aqm, flow, frame, len, STE_CREDIT_QBYTES - (int)b->aqm.total, now, cs);
+    if(action == STE_AQM_DROP)
+        return(-1);
+
+    ent = &b->ent[(b->head + b->count) % STE_CREDIT_QFRAMES];
+    ent->off = wpos;
+    ent->len = len;
+    ent->chan = chan;
+    ent->flow = flow;
+    ent->usec = now;
+    memcpy(b->buf + wpos, frame, len);
+    if(action == STE_AQM_MARK)
+        ste_aqm_mark(b->buf + wpos, len);
+    ste_aqm_enqueue(&b->aqm, flow, len);
+    b->wpos = wpos + len;
+    b->count++;
+    c->held++;
+    cs->cheld = c->held;
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_credit_head()
+ *
+ * 次に送るフレーム（優先度の最も高いキューの最も古いフレーム）を返す。
+ * 送ったら ste_credit_pop() でキューから取り除く。
+ *
+ *  引数：
+ *           c     : クレジットの状態
+ *           chan  : フレームの ste デバイスの番号を返す
+ *           len   : フレーム長を返す
+ * 戻り値：
+ *           フレームの先頭。キューが空なら NULL
+ *****************************************************************************/
+unsigned char *
+ste_credit_head(ste_credit_t *c, unsigned int *chan, int *len)
+{
+    ste_credit_ent_t *ent;
+    int               i;
+
+    for(i = 0 ; i < STE_CREDIT_BANDS ; i++){
+        if(c->band[i].count == 0)
+            continue;
+        ent = &c->band[i].ent[c->band[i].head];
+        *chan = ent->chan;
+        *len = ent->len;
+        return(c->band[i].buf + ent->off);
+    }
+    return(NULL);
+}
+
+/*****************************************************************************
+ * ste_credit_pop()
+ *
+ * ste_credit_head() が返したフレームをキューから取り除き、AQM に
+ * 滞留時間を知らせる。
+ *
+ *  引数：
+ *           c     : クレジットの状態
+ *           now   : 現在時刻(usec)
+ *           cs    : 統計情報
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_credit_pop(ste_credit_t *c, ste_uint64_t now, ste_connstat_t *cs)
+{
+    ste_credit_ent_t *ent;
+    int               i;
+
+    for(i = 0 ; i < STE_CREDIT_BANDS ; i++){
+        if(c->band[i].count == 0)
+            continue;
+        ent = &c->band[i].ent[c->band[i].head];
+        ste_aqm_depart(&c->band[i].aqm, ent->flow, ent->len, ent->usec, now, cs);
+        c->band[i].head = (c->band[i].head + 1) % STE_CREDIT_QFRAMES;
+        c->band[i].count--;
+        c->held--;
+        return;
+    }
+}
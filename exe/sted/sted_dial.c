@@ -0,0 +1,637 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_dial.c
+ *
+ * sted が HUB（または Proxy）にブロックせずに接続するためのルーチン。
+ *
+ *  o 名前解決は別スレッドの getaddrinfo() で行い、結果はメインループから
+ *    ste_dial_poll() で受け取る。
+ *  o IPv6 と IPv4 のアドレスに STE_DIAL_STAGGER_USEC ずつずらして
+ *    non-blocking connect() を始め、最初に接続できたものを使う
+ *    （RFC 8305）。
+ *  o 失敗した場合は揺らぎ付きの指数バックオフで待ってからやり直す。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "sted.h"
+#include "sted_dial.h"
+
+#ifdef STE_WINDOWS
+#define STE_DIAL_CAS(p, o, n)      (InterlockedCompareExchange((p), (n), (o)) == (o))
+#define STE_DIAL_MEMBAR()          MemoryBarrier()
+#define STE_DIAL_INPROGRESS(err)   ((err) == WSAEWOULDBLOCK)
+#else
+#define STE_DIAL_CAS(p, o, n)      __sync_bool_compare_and_swap((p), (o), (n))
+#define STE_DIAL_MEMBAR()          __sync_synchronize()
+#define STE_DIAL_INPROGRESS(err)   ((err) == EINPROGRESS)
+#endif
+
+/*
+ * ste_dial_req の state
+ *
+ *  STE_DIAL_REQ_PENDING   スレッドが名前解決中
+ *  STE_DIAL_REQ_DONE      スレッドが名前解決を終えた。解放はメインループが行う
+ *  STE_DIAL_REQ_ABANDONED メインループが取り消した。解放はスレッドが行う
+ */
+#define STE_DIAL_REQ_PENDING    0
+#define STE_DIAL_REQ_DONE       1
+#define STE_DIAL_REQ_ABANDONED  2
+
+/*
+ * 名前解決の要求。メインループと名前解決スレッドで共有し、state を
+ * 先に書き換えられなかった方が解放する。
+ */
+struct ste_dial_req
+{
+    volatile long    state;                      /* STE_DIAL_REQ_XXX */
+    char             host[STE_DIAL_HOSTMAX];
+    char             port[8];
+    int              socktype;
+    int              error;                      /* getaddrinfo() の戻り値 */
+    struct addrinfo *res;                        /* getaddrinfo() の結果 */
+};
+
+static int  ste_dial_resolve(ste_dial_t *, char *, int, int, ste_uint64_t);
+static void ste_dial_sort(ste_dial_t *, struct addrinfo *);
+static int  ste_dial_start(ste_dial_t *, int, int);
+static int  ste_dial_connect(ste_dial_t *, int, ste_uint64_t);
+static int  ste_dial_fail(ste_dial_t *, ste_uint64_t);
+
+/*****************************************************************************
+ * ste_dial_init()
+ *
+ * 接続の状態を初期化する。
+ *****************************************************************************/
+void
+ste_dial_init(ste_dial_t *d)
+{
+    int i;
+
+    memset(d, 0, sizeof(ste_dial_t));
+    for(i = 0 ; i < STE_DIAL_MAXADDR ; i++)
+        d->fds[i] = -1;
+    d->state = STE_DIAL_IDLE;
+    /* バックオフの揺らぎ用。sted 毎に違っていればよい */
+    srand((unsigned int)ste_time_usec());
+}
+
+/*****************************************************************************
+ * ste_dial_parse()
+ *
+ * 「ホスト名:ポート番号」の文字列を分ける。IPv6 のアドレスは
+ * 「[2001:db8::1]:80」のように [] で囲む。[] で囲まずに「:」が 2 つ以上
+ * あれば、全体を IPv6 のアドレスとみなす。
+ *
+ *  引数：
+ *           str     : ホスト名（と「:」でくぎられたポート番号）
+ *           host    : ホスト名を返すバッファ
+ *           hostlen : host のサイズ
+ *           port    : ポート番号を返す。省略されていれば PORT_NO
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+ste_dial_parse(char *str, char *host, int hostlen, int *port)
+{
+    char *p;
+    int   len;
+
+    *port = PORT_NO;
+    if(str[0] == '['){
+        if((p = strchr(str, ']')) == NULL)
+            return(-1);
+        str++;
+        len = (int)(p - str);
+        p++;
+        if(*p != '\0' && *p != ':')
+            return(-1);
+    } else {
+        p = strchr(str, ':');
+        if(p != NULL && strchr(p + 1, ':') != NULL)
+            p = NULL;
+        len = (p != NULL) ? (int)(p - str) : (int)strlen(str);
+    }
+    if(p != NULL && *p == ':' && p[1] != '\0')
+        *port = atoi(p + 1);
+    if(len == 0 || len >= hostlen || *port <= 0 || *port > 65535)
+        return(-1);
+    memcpy(host, str, len);
+    host[len] = '\0';
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_dial_pick()
+ *
+ * カンマで区切った HUB の一覧（-h の引数）から n 番目のものを取り出す。
+ * 「:」で区切った IPv6 のアドレスにはカンマは含まれない。
+ *
+ *  引数：
+ *           list    : HUB の一覧
+ *           n       : 取り出す HUB の番号（0 から）
+ *           buf     : 取り出した「ホスト名:ポート番号」を返すバッファ
+ *           buflen  : buf のサイズ
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (n 番目が無いか、空か、buf に収まらない)
+ *****************************************************************************/
+int
+ste_dial_pick(char *list, int n, char *buf, int buflen)
+{
+    char *end;
+    int   len;
+
+    for(;;){
+        end = strchr(list, ',');
+        len = (end != NULL) ? (int)(end - list) : (int)strlen(list);
+        if(n-- == 0)
+            break;
+        if(end == NULL)
+            return(-1);
+        list = end + 1;
+    }
+    if(len == 0 || len >= buflen)
+        return(-1);
+    memcpy(buf, list, len);
+    buf[len] = '\0';
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_dial_resolver()
+ *
+ * 名前解決スレッドのメインルーチン。getaddrinfo() が終わった時に要求が
+ * 取り消されていれば、要求を解放して終わる。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+static DWORD WINAPI
+ste_dial_resolver(LPVOID arg)
+#else
+static void *
+ste_dial_resolver(void *arg)
+#endif
+{
+    struct ste_dial_req *req = arg;
+    struct addrinfo      hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = req->socktype;
+    req->error = getaddrinfo(req->host, req->port, &hints, &req->res);
+
+    if(!STE_DIAL_CAS(&req->state, STE_DIAL_REQ_PENDING, STE_DIAL_REQ_DONE)){
+        if(req->error == 0)
+            freeaddrinfo(req->res);
+        free(req);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_dial_resolve()
+ *
+ * 名前解決スレッドを起動する。
+ *
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+static int
+ste_dial_resolve(ste_dial_t *d, char *host, int port, int udp, ste_uint64_t now)
+{
+    struct ste_dial_req *req;
+#ifdef STE_WINDOWS
+    HANDLE               thread;
+#else
+    pthread_t            thread;
+#endif
+
+    if((req = malloc(sizeof(struct ste_dial_req))) == NULL){
+        print_err(LOG_ERR, "cannot allocate resolver request\n");
+        return(-1);
+    }
+    memset(req, 0, sizeof(struct ste_dial_req));
+    strncpy(req->host, host, STE_DIAL_HOSTMAX - 1);
+    sprintf(req->port, "%d", port);
+    req->socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+    req->state = STE_DIAL_REQ_PENDING;
+
+#ifdef STE_WINDOWS
+    if((thread = CreateThread(NULL, 0, ste_dial_resolver, req, 0, NULL)) == NULL){
+        print_err(LOG_ERR, "cannot create resolver thread\n");
+        free(req);
+        return(-1);
+    }
+    CloseHandle(thread);
+#else
+    if(pthread_create(&thread, NULL, ste_dial_resolver, req) != 0){
+        print_err(LOG_ERR, "cannot create resolver thread\n");
+        free(req);
+        return(-1);
+    }
+    pthread_detach(thread);
+#endif
+
+    d->req = req;
+    d->state = STE_DIAL_RESOLVING;
+    d->start_usec = now;
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_dial_sort()
+ *
+ * 名前解決の結果を接続を試す順番に並べる。getaddrinfo() は RFC 6724 の
+ * 順番で返すので、最初のアドレスのファミリーから始めて、もう一方の
+ * ファミリーと交互に並べる（RFC 8305 4 章）。
+ *****************************************************************************/
+static void
+ste_dial_sort(ste_dial_t *d, struct addrinfo *res)
+{
+    struct addrinfo *first[STE_DIAL_MAXADDR];
+    struct addrinfo *other[STE_DIAL_MAXADDR];
+    struct addrinfo *ai;
+    int              nfirst = 0;
+    int              nother = 0;
+    int              i;
+
+    for(ai = res ; ai != NULL ; ai = ai->ai_next){
+        if(ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+            continue;
+        if(ai->ai_addrlen > STE_DIAL_ADDRLEN)
+            continue;
+        if(ai->ai_family == res->ai_family){
+            if(nfirst < STE_DIAL_MAXADDR)
+                first[nfirst++] = ai;
+        } else {
+            if(nother < STE_DIAL_MAXADDR)
+                other[nother++] = ai;
+        }
+    }
+
+    d->naddrs = 0;
+    for(i = 0 ; i < STE_DIAL_MAXADDR && d->naddrs < STE_DIAL_MAXADDR ; i++){
+        if(i < nfirst){
+            memcpy(d->addr[d->naddrs], first[i]->ai_addr, first[i]->ai_addrlen);
+            d->addrlen[d->naddrs++] = (int)first[i]->ai_addrlen;
+        }
+        if(i < nother && d->naddrs < STE_DIAL_MAXADDR){
+            memcpy(d->addr[d->naddrs], other[i]->ai_addr, other[i]->ai_addrlen);
+            d->addrlen[d->naddrs++] = (int)other[i]->ai_addrlen;
+        }
+    }
+}
+
+/*****************************************************************************
+ * ste_dial_start()
+ *
+ * idx 番目のアドレスへの non-blocking connect() を始める。
+ *
+ * 戻り値：
+ *          1  : 接続できた（UDP の場合）
+ *          0  : 接続中
+ *          -1 : 失敗した
+ *****************************************************************************/
+static int
+ste_dial_start(ste_dial_t *d, int idx, int udp)
+{
+    struct sockaddr_storage ss;
+    int                     fd;
+#ifdef STE_WINDOWS
+    u_long                  on = 1;
+#endif
+
+    memset(&ss, 0, sizeof(ss));
+    memcpy(&ss, d->addr[idx], d->addrlen[idx]);
+
+    if((fd = socket(ss.ss_family, udp ? SOCK_DGRAM : SOCK_STREAM, 0)) < 0){
+        SET_ERRNO();
+        print_err(LOG_ERR, "socket: %s\n", strerror(errno));
+        return(-1);
+    }
+#ifdef STE_WINDOWS
+    if(ioctlsocket(fd, FIONBIO, &on) != 0){
+#else
+    if(fcntl(fd, F_SETFL, O_NONBLOCK) == -1){
+#endif
+        SET_ERRNO();
+        print_err(LOG_ERR, "Failed to set nonblock: %s\n", strerror(errno));
+        CLOSE(fd);
+        return(-1);
+    }
+
+    d->fds[idx] = fd;
+    d->nfds++;
+    if(connect(fd, (struct sockaddr *)&ss, d->addrlen[idx]) == 0)
+        return(1);
+    SET_ERRNO();
+    if(STE_DIAL_INPROGRESS(errno))
+        return(0);
+    if(!d->quiet)
+        print_err(LOG_ERR, "connect: %s\n", strerror(errno));
+    CLOSE(fd);
+    d->fds[idx] = -1;
+    d->nfds--;
+    return(-1);
+}
+
+/*****************************************************************************
+ * ste_dial_connect()
+ *
+ * 接続中の socket の結果を確認し、必要なら次のアドレスへの接続を始める。
+ * 1 つの接続が失敗した場合は、STE_DIAL_STAGGER_USEC を待たずに次の
+ * アドレスを試す。
+ *
+ * 戻り値：
+ *          接続できた socket、STE_DIAL_AGAIN（接続中）、-1（失敗）
+ *****************************************************************************/
+static int
+ste_dial_connect(ste_dial_t *d, int udp, ste_uint64_t now)
+{
+    fd_set         wfds, efds;
+    struct timeval tv;
+    int            fd, maxfd, err, i, ret;
+    socklen_t      errlen;
+
+    if(d->nfds > 0){
+        FD_ZERO(&wfds);
+        FD_ZERO(&efds);
+        maxfd = -1;
+        for(i = 0 ; i < d->naddrs ; i++){
+            if((fd = d->fds[i]) < 0)
+                continue;
+            FD_SET(fd, &wfds);
+            FD_SET(fd, &efds);
+            if(fd > maxfd)
+                maxfd = fd;
+        }
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+        if(select(maxfd + 1, NULL, &wfds, &efds, &tv) > 0){
+            for(i = 0 ; i < d->naddrs ; i++){
+                if((fd = d->fds[i]) < 0)
+                    continue;
+                if(!FD_ISSET(fd, &wfds) && !FD_ISSET(fd, &efds))
+                    continue;
+                /* Windows では失敗すると efds に入る */
+                err = 0;
+                errlen = sizeof(err);
+                if(getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *)&err, &errlen) < 0){
+                    SET_ERRNO();
+                    err = errno;
+                }
+                if(err == 0 && FD_ISSET(fd, &efds))
+                    err = ECONNREFUSED;
+                if(err == 0){
+                    d->fds[i] = -1;
+                    d->nfds--;
+                    ste_dial_cancel(d);
+                    return(fd);
+                }
+                if(!d->quiet)
+                    print_err(LOG_ERR, "connect: %s\n", strerror(err));
+                CLOSE(fd);
+                d->fds[i] = -1;
+                d->nfds--;
+                d->next_usec = now;
+            }
+        }
+    }
+
+    while(d->next < d->naddrs && (d->nfds == 0 || now >= d->next_usec)){
+        i = d->next++;
+        if((ret = ste_dial_start(d, i, udp)) == 1){
+            fd = d->fds[i];
+            d->fds[i] = -1;
+            d->nfds--;
+            ste_dial_cancel(d);
+            return(fd);
+        }
+        if(ret == 0)
+            d->next_usec = now + STE_DIAL_STAGGER_USEC;
+    }
+
+    if(d->nfds == 0)
+        return(ste_dial_fail(d, now));
+    if(now - d->start_usec >= STE_DIAL_TIMEOUT_USEC){
+        if(!d->quiet)
+            print_err(LOG_ERR, "connect: timed out\n");
+        return(ste_dial_fail(d, now));
+    }
+    return(STE_DIAL_AGAIN);
+}
+
+/*****************************************************************************
+ * ste_dial_fail()
+ *
+ * 今回の接続をあきらめ、バックオフする。
+ *
+ * 戻り値：
+ *          -1
+ *****************************************************************************/
+static int
+ste_dial_fail(ste_dial_t *d, ste_uint64_t now)
+{
+    ste_dial_backoff(d, now);
+    return(-1);
+}
+
+/*****************************************************************************
+ * ste_dial_poll()
+ *
+ * HUB（または Proxy）への接続を進める。ブロックしないので、STE_DIAL_AGAIN
+ * が返ったら ste_dial_wait_usec() の後にもう一度呼ぶ。失敗した場合は
+ * バックオフしており、待ち時間が過ぎてから呼ぶと最初からやり直す。
+ *
+ *  引数：
+ *           d       : 接続の状態
+ *           host    : 接続先のホスト名または IPv4/IPv6 アドレス
+ *           port    : 接続先のポート番号
+ *           udp     : UDP の socket を返す
+ *           now     : 現在時刻(usec)
+ * 戻り値：
+ *          接続できた socket（non-blocking）、STE_DIAL_AGAIN（接続中）、
+ *          -1（失敗）
+ *****************************************************************************/
+int
+ste_dial_poll(ste_dial_t *d, char *host, int port, int udp, ste_uint64_t now)
+{
+    struct ste_dial_req *req;
+
+    switch(d->state){
+        case STE_DIAL_BACKOFF:
+            if(now < d->retry_usec)
+                return(STE_DIAL_AGAIN);
+            /* FALLTHROUGH */
+        case STE_DIAL_IDLE:
+            if(ste_dial_resolve(d, host, port, udp, now) < 0)
+                return(ste_dial_fail(d, now));
+            return(STE_DIAL_AGAIN);
+        case STE_DIAL_RESOLVING:
+            req = d->req;
+            if(req->state != STE_DIAL_REQ_DONE){
+                if(now - d->start_usec >= STE_DIAL_TIMEOUT_USEC){
+                    if(!d->quiet)
+                        print_err(LOG_ERR, "hostname %s: resolver timed out\n", host);
+                    return(ste_dial_fail(d, now));
+                }
+                return(STE_DIAL_AGAIN);
+            }
+            STE_DIAL_MEMBAR();
+            if(req->error != 0){
+                if(!d->quiet)
+                    print_err(LOG_ERR, "hostname %s not found: %s\n", host, gai_strerror(req->error));
+                return(ste_dial_fail(d, now));
+            }
+            ste_dial_sort(d, req->res);
+            freeaddrinfo(req->res);
+            free(req);
+            d->req = NULL;
+            if(d->naddrs == 0){
+                if(!d->quiet)
+                    print_err(LOG_ERR, "hostname %s has no usable address\n", host);
+                return(ste_dial_fail(d, now));
+            }
+            d->state = STE_DIAL_CONNECTING;
+            d->next = 0;
+            d->next_usec = now;
+            /* FALLTHROUGH */
+        case STE_DIAL_CONNECTING:
+            return(ste_dial_connect(d, udp, now));
+    }
+    return(-1);
+}
+
+/*****************************************************************************
+ * ste_dial_cancel()
+ *
+ * 名前解決・接続中なら取り消し、接続中の socket を閉じる。
+ * 名前解決中のスレッドは止められないので、要求の解放はスレッドに任せる。
+ *****************************************************************************/
+void
+ste_dial_cancel(ste_dial_t *d)
+{
+    struct ste_dial_req *req;
+    int                  i;
+
+    for(i = 0 ; i < STE_DIAL_MAXADDR ; i++){
+        if(d->fds[i] < 0)
+            continue;
+        CLOSE(d->fds[i]);
+        d->fds[i] = -1;
+    }
+    d->nfds = 0;
+    d->naddrs = 0;
+    d->next = 0;
+
+    if((req = d->req) != NULL){
+        if(!STE_DIAL_CAS(&req->state, STE_DIAL_REQ_PENDING, STE_DIAL_REQ_ABANDONED)){
+            if(req->error == 0)
+                freeaddrinfo(req->res);
+            free(req);
+        }
+        d->req = NULL;
+    }
+    d->state = STE_DIAL_IDLE;
+}
+
+/*****************************************************************************
+ * ste_dial_backoff()
+ *
+ * 接続に失敗したか、接続が切れた。続けて失敗した回数に応じて待ち時間を
+ * 倍にし、[delay/2, delay) の乱数だけ待ってからやり直す。
+ *****************************************************************************/
+void
+ste_dial_backoff(ste_dial_t *d, ste_uint64_t now)
+{
+    ste_uint64_t delay = STE_DIAL_BACKOFF_MIN_USEC;
+    int          i;
+
+    ste_dial_cancel(d);
+    for(i = 0 ; i < d->failures && delay < STE_DIAL_BACKOFF_MAX_USEC ; i++)
+        delay *= 2;
+    if(delay > STE_DIAL_BACKOFF_MAX_USEC)
+        delay = STE_DIAL_BACKOFF_MAX_USEC;
+    else
+        d->failures++;
+
+    d->retry_usec = now + delay / 2 + (ste_uint64_t)rand() * (delay / 2) / ((ste_uint64_t)RAND_MAX + 1);
+    d->state = STE_DIAL_BACKOFF;
+    if(!d->quiet)
+        print_err(LOG_NOTICE, "reconnecting in %d msec\n", (int)((d->retry_usec - now) / 1000));
+}
+
+/*****************************************************************************
+ * ste_dial_established()
+ *
+ * HUB との接続が確立した（HUB から STE_MSG_HELLO の返事が来た）。
+ * 次に切れた場合は、最短の待ち時間で再接続する。
+ *****************************************************************************/
+void
+ste_dial_established(ste_dial_t *d)
+{
+    d->failures = 0;
+}
+
+/*****************************************************************************
+ * ste_dial_wait_usec()
+ *
+ * 次に ste_dial_poll() を呼ぶまでの時間を返す。
+ *
+ * 戻り値：
+ *          待ち時間(usec)。接続中でなければ -1
+ *****************************************************************************/
+long
+ste_dial_wait_usec(ste_dial_t *d, ste_uint64_t now)
+{
+    switch(d->state){
+        case STE_DIAL_RESOLVING:
+        case STE_DIAL_CONNECTING:
+            return(STE_DIAL_POLL_USEC);
+        case STE_DIAL_BACKOFF:
+            return((d->retry_usec > now) ? (long)(d->retry_usec - now) : 0);
+    }
+    return(-1);
+}
@@ -0,0 +1,605 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_fec.c
+ *
+ * UDP トランスポートの前方誤り訂正（XOR のパリティ）のルーチン。
+ * stehub からも ..\sted\sted_fec.c としてコンパイルされる。
+ *
+ *  o 送信側はデータグラムを送る度にパリティに XOR していくので、グループの
+ *    データグラムを取っておく必要は無い。受信側も届いたデータグラムと
+ *    パリティを acc に XOR していくので、1 つだけ抜けていれば acc が
+ *    そのまま抜けたデータグラムになる。
+ *  o 受信したデータグラムは ste_fec_input() で渡し、ste_fec_next() で
+ *    渡せるようになったものを順番通りに取り出す。取り出したデータグラムは
+ *    受信バッファか ste_fec_rx_t の held を指すので、次に ste_fec_input()
+ *    を呼ぶ前に全て処理すること。
+ *  o XOR は 1 byte ずつのループで書いてあるが、コンパイラが SIMD 命令に
+ *    展開するので、データグラムのコピーと同じ程度の速さで済む。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sted.h"
+#include "sted_fec.h"
+
+#define  STE_FEC_GET16(p)         (((unsigned int)(p)[0] << 8) | (unsigned int)(p)[1])
+/* seq（16 bit）の a が b より新しい */
+#define  STE_FEC_NEWER(a, b)      ((((a) - (b)) & 0xffff) != 0 && (((a) - (b)) & 0xffff) < 0x8000)
+
+static void  ste_fec_put16(unsigned char *, unsigned int);
+static void  ste_fec_xor(unsigned char *, int *, unsigned char *, int);
+static int   ste_fec_choose_k(unsigned int);
+static int   ste_fec_process(ste_fec_t *, unsigned char *, int, ste_connstat_t *);
+static void  ste_fec_recover(ste_fec_rx_t *, ste_connstat_t *);
+static void  ste_fec_drain(ste_fec_rx_t *);
+static void  ste_fec_finish(ste_fec_rx_t *, ste_connstat_t *);
+static void  ste_fec_out(ste_fec_rx_t *, unsigned char *, int);
+
+/*****************************************************************************
+ * ste_fec_put16()
+ *
+ * 16 bit の値をネットワークバイトオーダーで書き込む。
+ *****************************************************************************/
+static void
+ste_fec_put16(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+/*****************************************************************************
+ * ste_fec_xor()
+ *
+ * dst に src を XOR する。src の方が長ければ、dst の足りない部分は 0 と
+ * みなして dstlen を延ばす。
+ *
+ *  引数：
+ *           dst    : XOR する先
+ *           dstlen : dst の有効な長さ
+ *           src    : XOR するデータ
+ *           len    : src の長さ
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+static void
+ste_fec_xor(unsigned char *dst, int *dstlen, unsigned char *src, int len)
+{
+    int i;
+
+    if(len > *dstlen){
+        memset(dst + *dstlen, 0x0, len - *dstlen);
+        *dstlen = len;
+    }
+    for(i = 0 ; i < len ; i++)
+        dst[i] ^= src[i];
+}
+
+/*****************************************************************************
+ * ste_fec_choose_k()
+ *
+ * 相手が報告してきた損失率からグループの大きさを決める。損失率が p の時、
+ * グループの k + 1 個のデータグラムのうち 2 つ以上失われて復元できない
+ * 確率はおよそ k(k+1)p^2/2 なので、損失が多いほどグループを小さくする
+ * （パリティの割合を増やす）。
+ *
+ *  引数：
+ *           loss : 損失率（単位は 1/1024）
+ * 戻り値：
+ *           グループの大きさ（0 ならパリティを送らない）
+ *****************************************************************************/
+static int
+ste_fec_choose_k(unsigned int loss)
+{
+    if(loss == 0)
+        return(0);    /* 損失が無ければ帯域を使わない */
+    if(loss < 10)
+        return(16);   /* 1% 未満 */
+    if(loss < 25)
+        return(8);    /* 2.5% 未満 */
+    if(loss < 60)
+        return(4);    /* 6% 未満 */
+    return(2);
+}
+
+/*****************************************************************************
+ * ste_fec_reset()
+ *
+ * FEC の状態を初期化する。STE_CAP_FEC を合意する度に呼ぶ。parity, acc,
+ * held は使う時に初期化するので、ここでは触らない（ste_fec_next() で
+ * 取り出したデータグラムの処理中に呼ばれても、そのデータグラムは壊れない）。
+ *****************************************************************************/
+void
+ste_fec_reset(ste_fec_t *fec)
+{
+    ste_fec_tx_t *tx = &fec->tx;
+    ste_fec_rx_t *rx = &fec->rx;
+
+    tx->seq = 0;
+    tx->base = 0;
+    tx->k = 0;
+    tx->n = 0;
+    tx->maxlen = 0;
+    tx->lenxor = 0;
+    tx->peer_loss = 0;
+
+    rx->started = 0;
+    rx->max_seq = 0;
+    rx->expected = 0;
+    rx->received = 0;
+    rx->loss = 0;
+    rx->active = 0;
+    rx->nheld = 0;
+    rx->prev_valid = 0;
+    rx->pend = NULL;
+    rx->nout = 0;
+    rx->iout = 0;
+}
+
+/*****************************************************************************
+ * ste_fec_put_data()
+ *
+ * 送信するデータグラムの FEC のヘッダを書き、パリティに XOR する。
+ * グループが一杯になったら、呼び出し元は ste_fec_put_parity() で
+ * パリティを作って続けて送ること。
+ *
+ *  引数：
+ *           fec  : FEC の状態
+ *           hdr  : FEC のヘッダを書き込む場所(STE_FEC_HDRSIZE)
+ *           data : ヘッダの後ろに続けて送るデータ
+ *           len  : data の長さ
+ * 戻り値：
+ *           1 : グループが一杯になった
+ *           0 : それ以外
+ *****************************************************************************/
+int
+ste_fec_put_data(ste_fec_t *fec, unsigned char *hdr, unsigned char *data, int len)
+{
+    ste_fec_tx_t *tx = &fec->tx;
+
+    hdr[0] = STE_FEC_MAGIC;
+    hdr[3] = (unsigned char)(fec->rx.loss > 255 ? 255 : fec->rx.loss);
+    ste_fec_put16(hdr + 6, 0);
+
+    if(len > (int)STE_FEC_DATA_MAX){
+        /* パリティのバッファに入らないので、グループに入れずに送る */
+        hdr[1] = STE_FEC_NOSEQ;
+        hdr[2] = 0;
+        ste_fec_put16(hdr + 4, 0);
+        return(0);
+    }
+
+    /* グループの大きさはグループの最初に決める */
+    if(tx->n == 0){
+        tx->k = ste_fec_choose_k(tx->peer_loss);
+        tx->base = tx->seq;
+        tx->maxlen = 0;
+        tx->lenxor = 0;
+    }
+    hdr[1] = (unsigned char)tx->n;
+    hdr[2] = (unsigned char)tx->k;
+    ste_fec_put16(hdr + 4, tx->seq);
+    tx->seq = (tx->seq + 1) & 0xffff;
+    if(tx->k == 0)
+        return(0);
+
+    ste_fec_xor(tx->parity + STE_FEC_HDRSIZE, &tx->maxlen, data, len);
+    tx->lenxor ^= len;
+    tx->n++;
+    return(tx->n >= tx->k);
+}
+
+/*****************************************************************************
+ * ste_fec_put_parity()
+ *
+ * 組み立て中のグループのパリティのデータグラムを作り、グループを閉じる。
+ * グループが一杯になった時と、送信が途切れた時（送信キューが空になった
+ * 時）に呼ぶ。
+ *
+ *  引数：
+ *           fec  : FEC の状態
+ *           lenp : パリティのデータグラムの長さを返す
+ *           cs   : 統計情報
+ * 戻り値：
+ *           パリティのデータグラム（FEC のヘッダから）。次に
+ *           ste_fec_put_data() を呼ぶまで有効
+ *           NULL : グループにデータグラムが無い
+ *****************************************************************************/
+unsigned char *
+ste_fec_put_parity(ste_fec_t *fec, int *lenp, ste_connstat_t *cs)
+{
+    ste_fec_tx_t  *tx = &fec->tx;
+    unsigned char *p = tx->parity;
+
+    if(tx->n == 0)
+        return(NULL);
+
+    p[0] = STE_FEC_MAGIC;
+    p[1] = STE_FEC_PARITY;
+    p[2] = (unsigned char)tx->n;
+    p[3] = (unsigned char)(fec->rx.loss > 255 ? 255 : fec->rx.loss);
+    ste_fec_put16(p + 4, tx->base);
+    ste_fec_put16(p + 6, tx->lenxor);
+    *lenp = STE_FEC_HDRSIZE + tx->maxlen;
+    tx->n = 0;
+    cs->fparity++;
+    return(p);
+}
+
+/*****************************************************************************
+ * ste_fec_input()
+ *
+ * 受信した FEC のヘッダ付きのデータグラムを受け取る。ヘッダを確認して
+ * 損失率を数えるだけで、グループの処理は ste_fec_next() で行う。
+ *
+ *  引数：
+ *           fec  : FEC の状態
+ *           p    : FEC のヘッダの先頭
+ *           len  : FEC のヘッダからのデータグラムの長さ
+ *           now  : 受信した時刻(usec)
+ * 戻り値：
+ *           正常時 : 0
+ *           障害時 : -1 (ヘッダが壊れていた)
+ *****************************************************************************/
+int
+ste_fec_input(ste_fec_t *fec, unsigned char *p, int len, ste_uint64_t now)
+{
+    ste_fec_rx_t *rx = &fec->rx;
+    unsigned int  seq, d, lost;
+    int           idx, k;
+
+    if(len <= STE_FEC_HDRSIZE || len - STE_FEC_HDRSIZE > (int)STE_FEC_DATA_MAX || p[0] != STE_FEC_MAGIC)
+        return(-1);
+    idx = p[1];
+    k = p[2];
+    seq = STE_FEC_GET16(p + 4);
+
+    if(idx == STE_FEC_PARITY){
+        if(k == 0 || k > STE_FEC_KMAX)
+            return(-1);
+    } else if(idx == STE_FEC_NOSEQ){
+        if(k != 0)
+            return(-1);
+    } else {
+        if(k > STE_FEC_KMAX || (k == 0 ? idx != 0 : idx >= k))
+            return(-1);
+        /*
+         * seq の抜けから損失率を数える。遅れて届いたものも届いた数には
+         * 入れるので、入れ替わっただけなら損失にはならない。
+         */
+        if(!rx->started){
+            rx->started = 1;
+            rx->max_seq = seq;
+            rx->expected = 1;
+            rx->received = 1;
+        } else {
+            d = (seq - rx->max_seq) & 0xffff;
+            if(d != 0 && d < 0x8000){
+                rx->expected += d;
+                rx->max_seq = seq;
+            }
+            rx->received++;
+        }
+        if(rx->expected >= STE_FEC_LOSS_WINDOW){
+            lost = (rx->received < rx->expected) ? rx->expected - rx->received : 0;
+            rx->loss = (rx->loss * 3 + lost * 1024 / rx->expected) / 4;
+            rx->expected = 0;
+            rx->received = 0;
+        }
+    }
+
+    fec->tx.peer_loss = p[3];
+    rx->pend = p;
+    rx->pend_len = len;
+    rx->pend_usec = now;
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_fec_next()
+ *
+ * 渡せるようになったデータグラムを 1 つ取り出す。0 を返すまで繰り返し
+ * 呼ぶこと。
+ *
+ *  引数：
+ *           fec  : FEC の状態
+ *           pp   : データグラムの（FEC のヘッダより後ろの）先頭を返す
+ *           lenp : その長さを返す
+ *           cs   : 統計情報
+ * 戻り値：
+ *           1 : 取り出した
+ *           0 : 渡せるものはもう無い
+ *****************************************************************************/
+int
+ste_fec_next(ste_fec_t *fec, unsigned char **pp, int *lenp, ste_connstat_t *cs)
+{
+    ste_fec_rx_t *rx = &fec->rx;
+
+    for(;;){
+        if(rx->iout < rx->nout){
+            *pp = rx->out[rx->iout];
+            *lenp = rx->outlen[rx->iout];
+            rx->iout++;
+            return(1);
+        }
+        rx->nout = 0;
+        rx->iout = 0;
+        if(rx->pend == NULL)
+            return(0);
+        /* 前のグループを閉じた場合は、それを渡してからもう一度処理する */
+        if(ste_fec_process(fec, rx->pend, rx->pend_len, cs) == 0)
+            rx->pend = NULL;
+    }
+}
+
+/*****************************************************************************
+ * ste_fec_expire()
+ *
+ * 抜けの後ろのデータグラムを STE_FEC_HOLD_USEC 以上取っておいていたら、
+ * 復元をあきらめてグループを閉じる。STE_FEC_HOLDING() の間は定期的に
+ * 呼び、0 以外を返したら ste_fec_next() で取り出すこと。
+ *
+ *  引数：
+ *           fec  : FEC の状態
+ *           now  : 現在の時刻(usec)
+ *           cs   : 統計情報
+ * 戻り値：
+ *           渡せるようになったデータグラムの数
+ *****************************************************************************/
+int
+ste_fec_expire(ste_fec_t *fec, ste_uint64_t now, ste_connstat_t *cs)
+{
+    ste_fec_rx_t *rx = &fec->rx;
+
+    if(!rx->active || rx->nheld == 0 || now - rx->held_usec < STE_FEC_HOLD_USEC)
+        return(0);
+    if(rx->iout >= rx->nout){
+        rx->nout = 0;
+        rx->iout = 0;
+    }
+    ste_fec_finish(rx, cs);
+    return(rx->nout - rx->iout);
+}
+
+/*****************************************************************************
+ * ste_fec_process()
+ *
+ * 受信したデータグラムをグループに入れ、渡せるようになったものを out に
+ * 並べる。
+ *
+ *  引数：
+ *           fec  : FEC の状態
+ *           p    : FEC のヘッダの先頭
+ *           len  : FEC のヘッダからのデータグラムの長さ
+ *           cs   : 統計情報
+ * 戻り値：
+ *           0 : 処理した
+ *           1 : 新しいグループのデータグラムだったので、前のグループを
+ *               閉じた。out を渡してからもう一度呼ぶこと
+ *****************************************************************************/
+static int
+ste_fec_process(ste_fec_t *fec, unsigned char *p, int len, ste_connstat_t *cs)
+{
+    ste_fec_rx_t  *rx = &fec->rx;
+    unsigned char *data = p + STE_FEC_HDRSIZE;
+    unsigned int   base, bit;
+    int            idx = p[1];
+    int            k = p[2];
+
+    len -= STE_FEC_HDRSIZE;
+    if(idx == STE_FEC_NOSEQ){
+        ste_fec_out(rx, data, len);
+        return(0);
+    }
+    base = (idx == STE_FEC_PARITY) ? STE_FEC_GET16(p + 4) : (STE_FEC_GET16(p + 4) - idx) & 0xffff;
+    bit = (idx == STE_FEC_PARITY) ? 0 : 1u << idx;
+
+    if(rx->active && base != rx->base && STE_FEC_NEWER(base, rx->base)){
+        ste_fec_finish(rx, cs);
+        return(1);
+    }
+
+    if(!rx->active || base != rx->base){
+        /*
+         * 閉じたグループに遅れて届いたもの。渡していないデータグラムなら
+         * 順番は入れ替わるが渡す（ヘッダ圧縮の差分は捨てられるかもしれない）。
+         */
+        if(rx->prev_valid && base == rx->prev_base){
+            if(bit != 0 && (rx->prev_have & bit) == 0){
+                rx->prev_have |= bit;
+                ste_fec_out(rx, data, len);
+            }
+            return(0);
+        }
+        if(rx->active || (rx->prev_valid && !STE_FEC_NEWER(base, rx->prev_base))){
+            /* もっと古いグループ。パリティを送らないデータグラムだけ渡す */
+            if(bit != 0 && k == 0)
+                ste_fec_out(rx, data, len);
+            return(0);
+        }
+        if(bit != 0 && k == 0){
+            /* 相手はグループを作るのをやめた。前のグループはもう届かない */
+            rx->prev_valid = 0;
+            ste_fec_out(rx, data, len);
+            return(0);
+        }
+        /* 新しいグループ */
+        rx->active = 1;
+        rx->base = base;
+        rx->k = (bit != 0) ? k : 0;
+        rx->n = 0;
+        rx->have = 0;
+        rx->next = 0;
+        rx->nheld = 0;
+        rx->acclen = 0;
+        rx->lenxor = 0;
+    }
+
+    if(bit == 0){
+        if(rx->n != 0)
+            return(0);
+        rx->n = k;
+        rx->lenxor ^= STE_FEC_GET16(p + 6);
+    } else {
+        if(rx->have & bit)
+            return(0);
+        if(rx->k == 0)
+            rx->k = k;
+        rx->have |= bit;
+        rx->lenxor ^= len;
+    }
+    ste_fec_xor(rx->acc, &rx->acclen, data, len);
+
+    if(bit != 0){
+        if(idx == rx->next){
+            ste_fec_out(rx, data, len);
+            rx->next++;
+        } else {
+            /* 抜けの後ろ。復元できるかわかるまで取っておく */
+            memcpy(rx->held[idx], data, len);
+            rx->hlen[idx] = len;
+            if(rx->nheld++ == 0)
+                rx->held_usec = rx->pend_usec;
+        }
+    }
+    ste_fec_recover(rx, cs);
+    ste_fec_drain(rx);
+
+    /* 全て渡したら閉じる。パリティが届くまでは後からパリティだけ届くので待つ */
+    if(rx->n > 0 && rx->next >= rx->n)
+        ste_fec_finish(rx, cs);
+    else if(rx->n > 0 && rx->nheld > 0){
+        /* パリティが届いても 2 つ以上抜けている。待っても復元できない */
+        ste_fec_finish(rx, cs);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_fec_recover()
+ *
+ * パリティが届いていて、グループのデータグラムが 1 つだけ抜けていたら
+ * 復元して held に置く。
+ *****************************************************************************/
+static void
+ste_fec_recover(ste_fec_rx_t *rx, ste_connstat_t *cs)
+{
+    int i, m = -1, missing = 0;
+    int len;
+
+    if(rx->n == 0)
+        return;
+    for(i = 0 ; i < rx->n ; i++){
+        if((rx->have & (1u << i)) == 0){
+            m = i;
+            missing++;
+        }
+    }
+    if(missing != 1)
+        return;
+
+    /* 届いたものとパリティの len の XOR が、抜けたものの長さになる */
+    len = (int)rx->lenxor;
+    if(len == 0 || len > rx->acclen)
+        return;
+    memcpy(rx->held[m], rx->acc, len);
+    rx->hlen[m] = len;
+    rx->have |= 1u << m;
+    if(rx->nheld++ == 0)
+        rx->held_usec = rx->pend_usec;
+    cs->frecover++;
+}
+
+/*****************************************************************************
+ * ste_fec_drain()
+ *
+ * held に取っておいたデータグラムのうち、抜けの無くなったものを順番に
+ * out に並べる。
+ *****************************************************************************/
+static void
+ste_fec_drain(ste_fec_rx_t *rx)
+{
+    while(rx->next < STE_FEC_KMAX && (rx->have & (1u << rx->next))){
+        ste_fec_out(rx, rx->held[rx->next], rx->hlen[rx->next]);
+        rx->nheld--;
+        rx->next++;
+    }
+}
+
+/*****************************************************************************
+ * ste_fec_finish()
+ *
+ * 組み立て中のグループを閉じ、held に残っているデータグラムを抜けを
+ * 飛ばして順番に out に並べる。
+ *****************************************************************************/
+static void
+ste_fec_finish(ste_fec_rx_t *rx, ste_connstat_t *cs)
+{
+    int i, size;
+
+    /*
+     * パリティが届いていなければグループの大きさはわからない（送信が途切れて
+     * k より前に閉じたかもしれない）ので、届いた最後のデータグラムまでを数える。
+     */
+    size = rx->n;
+    if(size == 0)
+        for(i = 0 ; i < STE_FEC_KMAX ; i++)
+            if(rx->have & (1u << i))
+                size = i + 1;
+
+    for(i = rx->next ; i < STE_FEC_KMAX ; i++){
+        if(rx->have & (1u << i))
+            ste_fec_out(rx, rx->held[i], rx->hlen[i]);
+        else if(i < size)
+            cs->flost++;
+    }
+    rx->prev_valid = 1;
+    rx->prev_base = rx->base;
+    rx->prev_have = rx->have;
+    rx->active = 0;
+    rx->nheld = 0;
+}
+
+/*****************************************************************************
+ * ste_fec_out()
+ *
+ * 渡すデータグラムを out に並べる。
+ *****************************************************************************/
+static void
+ste_fec_out(ste_fec_rx_t *rx, unsigned char *p, int len)
+{
+    rx->out[rx->nout] = p;
+    rx->outlen[rx->nout] = len;
+    rx->nout++;
+}
@@ -0,0 +1,300 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_flight.c
+ *
+ * フライトレコーダー。stehub から ..\sted\sted_flight.c としてコンパイル
+ * される。
+ *
+ *  o フレームのイベントをスレッド毎のリングバッファに常に記録する。
+ *    リングバッファは固定長で、古いイベントは上書きする。ロックは使わない。
+ *  o ste_flight_egress() で受信から送信までの滞留時間を求め、閾値を
+ *    超えていたら、その位置を覚えておく。閾値を超えた後のイベントが
+ *    STE_FLIGHT_AFTER 個記録されたら（もしくは ste_flight_flush() が
+ *    呼ばれたら）、前後のイベントをスナップショットとしてファイルに
+ *    追記する。
+ *  o スナップショットの書き出しはデータパスで同期的に行うので、
+ *    STE_FLIGHT_HOLDOFF_USEC より短い間隔では書き出さない。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sted.h"
+#include "sted_trace.h"
+#include "sted_flight.h"
+
+static char                       ste_flight_path[STE_LOG_PATH_MAX];
+static unsigned int               ste_flight_threshold = STE_FLIGHT_THRESHOLD;
+static STE_THREAD_LOCAL ste_flight_ring_t *ste_flight_myring = NULL;
+static STE_THREAD_LOCAL int       ste_flight_noring = 0;
+
+static char *ste_flight_evname[] = {
+    "none", "ingress", "decide", "enqueue", "egress", "drop"
+};
+
+static ste_flight_ring_t *ste_flight_getring(void);
+static void               ste_flight_snapshot(ste_flight_ring_t *);
+
+/*****************************************************************************
+ * ste_flight_init()
+ *
+ * フライトレコーダーを初期化する。
+ *
+ *  引数：
+ *           path      : スナップショットを書き出すファイルのパス
+ *           threshold : 滞留時間の閾値(usec)。0 ならスナップショットは書き出さない
+ *****************************************************************************/
+void
+ste_flight_init(char *path, unsigned int threshold)
+{
+    strncpy(ste_flight_path, path, STE_LOG_PATH_MAX - 1);
+    ste_flight_threshold = threshold;
+}
+
+/*****************************************************************************
+ * ste_flight_getring()
+ *
+ * 呼び出したスレッド用のリングバッファを返す。初回呼び出し時に確保する。
+ *
+ * 戻り値：
+ *          正常時 : リングバッファ
+ *          障害時 : NULL (メモリが確保できなかった)
+ *****************************************************************************/
+static ste_flight_ring_t *
+ste_flight_getring(void)
+{
+    ste_flight_ring_t *ring;
+
+    if(ste_flight_myring != NULL)
+        return(ste_flight_myring);
+    if(ste_flight_noring)
+        return(NULL);
+
+    if((ring = malloc(sizeof(ste_flight_ring_t))) == NULL){
+        ste_flight_noring = 1;
+        return(NULL);
+    }
+    memset(ring, 0x0, sizeof(ste_flight_ring_t));
+#ifdef STE_WINDOWS
+    ring->tid = GetCurrentThreadId();
+#else
+    ring->tid = (unsigned int)pthread_self();
+#endif
+    ste_flight_myring = ring;
+    return(ring);
+}
+
+/*****************************************************************************
+ * ste_flight_put()
+ *
+ * イベントをリングバッファに書き込む。書き出し待ちのスナップショットが
+ * あり、閾値を超えた後のイベントが揃ったら書き出す。
+ *****************************************************************************/
+static void
+ste_flight_put(ste_flight_ring_t *ring, int type, unsigned int seq, int conn, int len, int arg,
+               ste_uint64_t usec)
+{
+    ste_flight_ev_t *ev;
+
+    ev = &ring->ev[ring->head & (STE_FLIGHT_RINGSIZE - 1)];
+    ev->usec = usec;
+    ev->seq  = seq;
+    ev->type = (unsigned short)type;
+    ev->conn = (unsigned short)conn;
+    ev->len  = len;
+    ev->arg  = arg;
+    ring->head++;
+
+    if(ring->pending && ring->head - ring->trigger >= STE_FLIGHT_AFTER)
+        ste_flight_snapshot(ring);
+}
+
+/*****************************************************************************
+ * ste_flight_ingress()
+ *
+ * フレームの受信を記録し、フレームの通し番号を振る。
+ *
+ *  引数：
+ *           conn : 受信した接続の ID
+ *           len  : フレーム長
+ *           usec : 受信した時刻を返す（ste_flight_egress() に渡す）
+ * 戻り値：
+ *          フレームの通し番号
+ *****************************************************************************/
+unsigned int
+ste_flight_ingress(int conn, int len, ste_uint64_t *usec)
+{
+    ste_flight_ring_t *ring;
+
+    *usec = ste_time_usec();
+    if((ring = ste_flight_getring()) == NULL)
+        return(0);
+    ring->seq++;
+    ste_flight_put(ring, STE_FLT_INGRESS, ring->seq, conn, len, 0, *usec);
+    return(ring->seq);
+}
+
+/*****************************************************************************
+ * ste_flight_record()
+ *
+ * 受信と送信以外のイベント（転送先の決定、キューイング、破棄）を記録する。
+ *
+ *  引数：
+ *           type : イベントの種類(STE_FLT_XXX)
+ *           seq  : フレームの通し番号
+ *           conn : 接続 ID
+ *           len  : フレーム長
+ *           arg  : イベント毎の引数
+ *****************************************************************************/
+void
+ste_flight_record(int type, unsigned int seq, int conn, int len, int arg)
+{
+    ste_flight_ring_t *ring;
+
+    if((ring = ste_flight_getring()) == NULL)
+        return;
+    ste_flight_put(ring, type, seq, conn, len, arg, ste_time_usec());
+}
+
+/*****************************************************************************
+ * ste_flight_egress()
+ *
+ * フレームの送信を記録し、滞留時間が閾値を超えていたらスナップショット
+ * の書き出しを予約する。
+ *
+ *  引数：
+ *           seq     : フレームの通し番号
+ *           conn    : 送信した接続の ID
+ *           len     : フレーム長
+ *           result  : send() の戻り値
+ *           ingress : 受信した時刻(ste_flight_ingress() が返したもの)
+ *****************************************************************************/
+void
+ste_flight_egress(unsigned int seq, int conn, int len, int result, ste_uint64_t ingress)
+{
+    ste_flight_ring_t *ring;
+    ste_uint64_t       now;
+    ste_uint64_t       residence;
+
+    if((ring = ste_flight_getring()) == NULL)
+        return;
+
+    now = ste_time_usec();
+    ste_flight_put(ring, STE_FLT_EGRESS, seq, conn, len, result, now);
+
+    residence = now - ingress;
+    if(ste_flight_threshold == 0 || residence < ste_flight_threshold || ring->pending)
+        return;
+    if(now - ring->last_snap < STE_FLIGHT_HOLDOFF_USEC)
+        return;
+
+    ring->pending = 1;
+    ring->trigger = ring->head;
+    ring->trigger_seq = seq;
+    ring->trigger_usec = (unsigned int)residence;
+}
+
+/*****************************************************************************
+ * ste_flight_flush()
+ *
+ * 書き出し待ちのスナップショットがあれば、閾値を超えた後のイベントが
+ * 揃っていなくても書き出す。トラフィックが止まった時のために main
+ * ループから定期的に呼ぶ。
+ *****************************************************************************/
+void
+ste_flight_flush(void)
+{
+    if(ste_flight_myring != NULL && ste_flight_myring->pending)
+        ste_flight_snapshot(ste_flight_myring);
+}
+
+/*****************************************************************************
+ * ste_flight_snapshot()
+ *
+ * 閾値を超えたイベントの前後をファイルに追記する。時刻は閾値を超えた
+ * フレームを受信した時刻からの相対時間(usec)で出す。ファイルが
+ * STE_LOG_ROTATE_SIZE を超えたら path.old に移して新しく作る。
+ *****************************************************************************/
+static void
+ste_flight_snapshot(ste_flight_ring_t *ring)
+{
+    FILE             *fp;
+    ste_flight_ev_t  *ev;
+    ste_uint64_t      base = 0;
+    unsigned int      start, end, i;
+    char              oldpath[STE_LOG_PATH_MAX + 4];
+
+    ring->pending = 0;
+    ring->last_snap = ste_time_usec();
+
+    /* 上書きされていない範囲だけを出す */
+    end = ring->head;
+    start = (ring->trigger >= STE_FLIGHT_BEFORE) ? ring->trigger - STE_FLIGHT_BEFORE : 0;
+    if(end - start > STE_FLIGHT_RINGSIZE)
+        start = end - STE_FLIGHT_RINGSIZE;
+
+    /* 閾値を超えたフレームの受信時刻を探す */
+    for(i = start ; i != end ; i++){
+        ev = &ring->ev[i & (STE_FLIGHT_RINGSIZE - 1)];
+        if(ev->seq == ring->trigger_seq && ev->type == STE_FLT_INGRESS){
+            base = ev->usec;
+            break;
+        }
+    }
+    if(base == 0)
+        base = ring->ev[start & (STE_FLIGHT_RINGSIZE - 1)].usec;
+
+    if((fp = fopen(ste_flight_path, "a")) == NULL)
+        return;
+    fseek(fp, 0, SEEK_END);
+    if(ftell(fp) > STE_LOG_ROTATE_SIZE){
+        fclose(fp);
+        STE_SNPRINTF(oldpath, sizeof(oldpath), "%s.old", ste_flight_path);
+        oldpath[sizeof(oldpath) - 1] = '\0';
+        remove(oldpath);
+        rename(ste_flight_path, oldpath);
+        if((fp = fopen(ste_flight_path, "w")) == NULL)
+            return;
+    }
+
+    fprintf(fp, "=== snapshot: thread=%u seq=%u residence=%u usec threshold=%u usec ===\n",
+            ring->tid, ring->trigger_seq, ring->trigger_usec, ste_flight_threshold);
+    for(i = start ; i != end ; i++){
+        ev = &ring->ev[i & (STE_FLIGHT_RINGSIZE - 1)];
+        fprintf(fp, "%c%9d seq=%-8u %-8s conn=%-4u len=%-5d arg=%d\n",
+                (ev->seq == ring->trigger_seq) ? '*' : ' ',
+                (int)(ev->usec - base), ev->seq,
+                ste_flight_evname[ev->type <= STE_FLT_DROP ? ev->type : 0],
+                ev->conn, ev->len, ev->arg);
+    }
+    fclose(fp);
+}
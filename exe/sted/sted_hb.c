@@ -0,0 +1,190 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_hb.c
+ *
+ * HUB の死活監視（ハートビート）のルーチン。
+ *
+ *  o STE_MSG_PING を送る時刻と、HUB から最後に受信した時刻を管理する。
+ *  o 返事の stamp から RTT を測り、応答しないとみなすまでの時間を決める。
+ *  o メッセージの送受信とフェイルオーバーは sted_socket.c が行う。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sted.h"
+#include "sted_hb.h"
+
+/*****************************************************************************
+ * ste_hb_init()
+ *
+ * ハートビートの状態を初期化する。
+ *
+ *  引数：
+ *           hb            : ハートビートの状態
+ *           interval_msec : STE_MSG_PING を送る間隔(msec)。0 なら送らない
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_hb_init(ste_hb_t *hb, int interval_msec)
+{
+    memset(hb, 0x0, sizeof(ste_hb_t));
+    hb->interval_usec = (interval_msec > 0) ? (ste_uint64_t)interval_msec * 1000 : 0;
+}
+
+/*****************************************************************************
+ * ste_hb_reset()
+ *
+ * HUB に接続した。最初の STE_MSG_PING は間隔が経ってから送る。
+ *****************************************************************************/
+void
+ste_hb_reset(ste_hb_t *hb, ste_uint64_t now)
+{
+    hb->next_usec = now + hb->interval_usec;
+    hb->rx_usec = now;
+}
+
+/*****************************************************************************
+ * ste_hb_rx()
+ *
+ * HUB から受信した。返事に限らず、何か受信できれば HUB は生きている。
+ *****************************************************************************/
+void
+ste_hb_rx(ste_hb_t *hb, ste_uint64_t now)
+{
+    hb->rx_usec = now;
+}
+
+/*****************************************************************************
+ * ste_hb_due()
+ *
+ * STE_MSG_PING を送る時刻になったかどうかを返し、次の時刻を決める。
+ *
+ *  引数：
+ *           hb  : ハートビートの状態
+ *           now : 現在時刻(usec)
+ * 戻り値：
+ *          送る   : 1
+ *          送らない : 0
+ *****************************************************************************/
+int
+ste_hb_due(ste_hb_t *hb, ste_uint64_t now)
+{
+    if(hb->interval_usec == 0 || now < hb->next_usec)
+        return(0);
+    hb->next_usec = now + hb->interval_usec;
+    return(1);
+}
+
+/*****************************************************************************
+ * ste_hb_reply()
+ *
+ * STE_MSG_PING の返事を受け取った。stamp（送った時刻）から RTT を測り、
+ * RFC 6298 と同じく平滑化する。
+ *
+ *  引数：
+ *           hb    : ハートビートの状態
+ *           stamp : 返事に入っていた stamp
+ *           now   : 現在時刻(usec)
+ *           cs    : RTT を入れる接続毎の統計情報
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_hb_reply(ste_hb_t *hb, ste_uint64_t stamp, ste_uint64_t now, ste_connstat_t *cs)
+{
+    unsigned int rtt, diff;
+
+    hb->rx_usec = now;
+    cs->hbpongs++;
+    /* 前の接続の返事や壊れた stamp は使わない */
+    if(stamp > now || now - stamp > STE_HB_DEAD_MAX_USEC)
+        return;
+    rtt = (unsigned int)(now - stamp);
+    if(cs->hbrtt_us == 0){
+        cs->hbrtt_us = rtt;
+        cs->hbrttvar_us = rtt / 2;
+        return;
+    }
+    diff = (rtt > cs->hbrtt_us) ? rtt - cs->hbrtt_us : cs->hbrtt_us - rtt;
+    cs->hbrttvar_us = (cs->hbrttvar_us * 3 + diff) / 4;
+    cs->hbrtt_us = (cs->hbrtt_us * 7 + rtt) / 8;
+}
+
+/*****************************************************************************
+ * ste_hb_dead()
+ *
+ * HUB が応答しなくなったかどうかを返す。間隔の STE_HB_MISSES 倍か、
+ * RTO（srtt + 4 * rttvar）の 2 倍の長い方（STE_HB_DEAD_MAX_USEC まで）の
+ * 間、何も受信していなければ応答しないとみなす。
+ *
+ *  引数：
+ *           hb  : ハートビートの状態
+ *           now : 現在時刻(usec)
+ *           cs  : RTT の入った接続毎の統計情報
+ * 戻り値：
+ *          応答しない : 1
+ *          生きている : 0
+ *****************************************************************************/
+int
+ste_hb_dead(ste_hb_t *hb, ste_uint64_t now, ste_connstat_t *cs)
+{
+    ste_uint64_t limit = hb->interval_usec * STE_HB_MISSES;
+    ste_uint64_t rto = (ste_uint64_t)cs->hbrtt_us + 4 * (ste_uint64_t)cs->hbrttvar_us;
+
+    if(hb->interval_usec == 0)
+        return(0);
+    if(limit < rto * 2)
+        limit = rto * 2;
+    if(limit > STE_HB_DEAD_MAX_USEC)
+        limit = STE_HB_DEAD_MAX_USEC;
+    return(now > hb->rx_usec && now - hb->rx_usec >= limit);
+}
+
+/*****************************************************************************
+ * ste_hb_wait_usec()
+ *
+ * 次に STE_MSG_PING を送るまでの時間を返す。
+ *
+ * 戻り値：
+ *          待ち時間(usec)。ハートビートを送らなければ -1
+ *****************************************************************************/
+long
+ste_hb_wait_usec(ste_hb_t *hb, ste_uint64_t now)
+{
+    if(hb->interval_usec == 0)
+        return(-1);
+    return((hb->next_usec > now) ? (long)(hb->next_usec - now) : 0);
+}
@@ -0,0 +1,587 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_hc.c
+ *
+ * sted と stehub の間のリンクで、TCP/IPv4 のフレームのヘッダを圧縮して
+ * STE_MSG_HAGG を組み立て、受け取った STE_MSG_HAGG からフレームを復元する
+ * ルーチン。stehub からも ..\sted\sted_hc.c としてコンパイルされる。
+ *
+ *  o 圧縮するのは IP オプションの無い、フラグメントされていない TCP/IPv4
+ *    のフレームで、フレーム長が IP の total length と一致するものだけ。
+ *    それ以外は STE_HC_RAW でそのまま送る。
+ *  o 送信側はエントリを書き込めた時だけコンテキストを更新する。
+ *    STE_MSG_AGG に入りきらずに ste_agg_add() が失敗した場合は何も
+ *    変えない。
+ *  o 受信側は送られてきたデータを一切信用せず、範囲を外れたら
+ *    STE_MSG_HAGG 全体を壊れたものとして捨てる。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sted.h"
+#include "sted_hc.h"
+
+/*
+ * フレーム内のオフセット
+ */
+#define  STE_HC_IP                14               /* IPv4 ヘッダ */
+#define  STE_HC_TCP               (STE_HC_IP + 20) /* TCP ヘッダ */
+#define  STE_HC_OPT               (STE_HC_TCP + 20) /* TCP オプション */
+
+#define  STE_HC_GET16(p)          (((p)[0] << 8) | (p)[1])
+#define  STE_HC_GET32(p)          (((unsigned int)(p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3])
+
+static void ste_hc_put16(unsigned char *, unsigned int);
+static void ste_hc_put32(unsigned char *, unsigned int);
+static int  ste_hc_put_varint(unsigned char *, unsigned int);
+static int  ste_hc_get_varint(unsigned char **, unsigned char *, unsigned int *);
+static unsigned int ste_hc_ipsum(unsigned char *);
+static int  ste_hc_check(unsigned char *, int);
+static int  ste_hc_same_flow(ste_hc_ctx_t *, unsigned char *, int);
+static int  ste_hc_is_ts(unsigned char *, int);
+static void ste_hc_learn(ste_hc_ctx_t *, unsigned char *, int, int, int);
+
+/*****************************************************************************
+ * ste_hcc_reset()
+ *
+ * 送信側のコンテキストを全て捨てる。新しい接続や、送信できずにメッセージを
+ * 捨てた後に呼ぶ。以降の各フローの最初のフレームはフルヘッダになる。
+ *
+ *  引数：
+ *           hc : 送信側の状態
+ *           cs : 圧縮の統計情報を数える接続毎の統計情報
+ *****************************************************************************/
+void
+ste_hcc_reset(ste_hcc_t *hc, ste_connstat_t *cs)
+{
+    memset(hc->ctx, 0x0, sizeof(hc->ctx));
+    hc->cs = cs;
+}
+
+/*****************************************************************************
+ * ste_hcd_reset()
+ *
+ * 受信側のコンテキストを全て捨てる。新しい接続では必ず呼ぶこと。
+ *
+ *  引数：
+ *           hd : 受信側の状態
+ *****************************************************************************/
+void
+ste_hcd_reset(ste_hcd_t *hd)
+{
+    memset(hd->ctx, 0x0, sizeof(hd->ctx));
+}
+
+/*****************************************************************************
+ * ste_hc_put16(), ste_hc_put32()
+ *
+ * 16 bit, 32 bit の値をネットワークバイトオーダーで書き込む。
+ *****************************************************************************/
+static void
+ste_hc_put16(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)v;
+}
+
+static void
+ste_hc_put32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+/*****************************************************************************
+ * ste_hc_put_varint()
+ *
+ * 7 bit ずつの可変長で書き込む（下位から。続きがあれば 0x80 を立てる）。
+ * 16384 未満の値は STE_MSG_CAGG の長さと同じ形式になる。
+ *
+ * 戻り値：
+ *          書き込んだサイズ(1〜5)
+ *****************************************************************************/
+static int
+ste_hc_put_varint(unsigned char *p, unsigned int v)
+{
+    int n = 0;
+
+    while(v >= 0x80){
+        p[n++] = (unsigned char)(0x80 | (v & 0x7f));
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return(n);
+}
+
+/*****************************************************************************
+ * ste_hc_get_varint()
+ *
+ * 7 bit ずつの可変長を読む。
+ *
+ *  引数：
+ *           pp  : 読む位置。読んだ分だけ進める
+ *           end : 本体の末尾
+ *           v   : 読んだ値を返す
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (本体の末尾を越えているか 5 byte より長い)
+ *****************************************************************************/
+static int
+ste_hc_get_varint(unsigned char **pp, unsigned char *end, unsigned int *v)
+{
+    unsigned char *p = *pp;
+    int            shift;
+
+    *v = 0;
+    for(shift = 0 ; shift < 35 ; shift += 7){
+        if(p >= end)
+            return(-1);
+        *v |= (unsigned int)(*p & 0x7f) << shift;
+        if((*p++ & 0x80) == 0){
+            *pp = p;
+            return(0);
+        }
+    }
+    return(-1);
+}
+
+/*****************************************************************************
+ * ste_hc_ipsum()
+ *
+ * IPv4 ヘッダ(20 byte)のチェックサムを計算する。チェックサムのフィールドは
+ * 0 として扱う。
+ *****************************************************************************/
+static unsigned int
+ste_hc_ipsum(unsigned char *ip)
+{
+    unsigned int sum = 0;
+    int          i;
+
+    for(i = 0 ; i < 20 ; i += 2)
+        if(i != 10)
+            sum += STE_HC_GET16(ip + i);
+    while(sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return(~sum & 0xffff);
+}
+
+/*****************************************************************************
+ * ste_hc_check()
+ *
+ * フレームが圧縮できる TCP/IPv4 のフレームか確認する。
+ *
+ *  引数：
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長（パディングを取り除いたもの）
+ * 戻り値：
+ *          圧縮できる : ヘッダ長（Ethernet + IPv4 + TCP）
+ *          できない   : 0
+ *****************************************************************************/
+static int
+ste_hc_check(unsigned char *frame, int len)
+{
+    unsigned char *ip = frame + STE_HC_IP;
+    int            hlen;
+
+    if(len < STE_HC_OPT || STE_HC_GET16(frame + 12) != 0x0800)
+        return(0);
+    /* IP オプション無し、TCP、フラグメントされていない */
+    if(ip[0] != 0x45 || ip[9] != 6 || (STE_HC_GET16(ip + 6) & 0x3fff) != 0)
+        return(0);
+    if(STE_HC_GET16(ip + 2) != len - STE_HC_IP)
+        return(0);
+    /* 受信側で計算し直すので、正しいチェックサムが入っているものだけ */
+    if((unsigned int)STE_HC_GET16(ip + 10) != ste_hc_ipsum(ip))
+        return(0);
+    hlen = STE_HC_TCP + (frame[STE_HC_TCP + 12] >> 4) * 4;
+    if(hlen < STE_HC_OPT || hlen > len)
+        return(0);
+    return(hlen);
+}
+
+/*****************************************************************************
+ * ste_hc_same_flow()
+ *
+ * フレームがコンテキストと同じフローで、差分だけで送れるか確認する。
+ * シーケンス番号等、STE_HC_DELTA で送れるフィールド以外が全て同じなら
+ * 同じフローとみなす。
+ *****************************************************************************/
+static int
+ste_hc_same_flow(ste_hc_ctx_t *ctx, unsigned char *frame, int hlen)
+{
+    unsigned char *c = ctx->hdr;
+
+    if(ctx->valid == 0 || ctx->hlen != hlen)
+        return(0);
+    /* Ethernet ヘッダ, IP の version/IHL/TOS */
+    if(memcmp(c, frame, STE_HC_IP + 2) != 0)
+        return(0);
+    /* IP の flags/fragment, TTL, protocol, アドレス */
+    if(memcmp(c + STE_HC_IP + 6, frame + STE_HC_IP + 6, 4) != 0 ||
+       memcmp(c + STE_HC_IP + 12, frame + STE_HC_IP + 12, 8) != 0)
+        return(0);
+    /* TCP のポート, data offset, urgent pointer */
+    if(memcmp(c + STE_HC_TCP, frame + STE_HC_TCP, 4) != 0 ||
+       c[STE_HC_TCP + 12] != frame[STE_HC_TCP + 12] ||
+       memcmp(c + STE_HC_TCP + 18, frame + STE_HC_TCP + 18, 2) != 0)
+        return(0);
+    return(1);
+}
+
+/*****************************************************************************
+ * ste_hc_is_ts()
+ *
+ * TCP のオプションが NOP, NOP, タイムスタンプ だけか確認する（Linux や
+ * Windows がタイムスタンプを使う場合の典型的な並び）。
+ *****************************************************************************/
+static int
+ste_hc_is_ts(unsigned char *hdr, int hlen)
+{
+    unsigned char *opt = hdr + STE_HC_OPT;
+
+    return(hlen == STE_HC_OPT + 12 && opt[0] == 1 && opt[1] == 1 && opt[2] == 8 && opt[3] == 10);
+}
+
+/*****************************************************************************
+ * ste_hc_learn()
+ *
+ * フレームのヘッダをコンテキストに覚える。
+ *****************************************************************************/
+static void
+ste_hc_learn(ste_hc_ctx_t *ctx, unsigned char *frame, int hlen, int paylen, int msn)
+{
+    memcpy(ctx->hdr, frame, hlen);
+    ctx->hlen = hlen;
+    ctx->paylen = paylen;
+    ctx->msn = msn;
+    ctx->valid = 1;
+}
+
+/*****************************************************************************
+ * ste_hc_put()
+ *
+ * フレームのヘッダを圧縮して STE_MSG_HAGG のエントリを書き込む。
+ * ste ドライバが付けた末尾のパディングは取り除く。
+ *
+ *  引数：
+ *           hc    : 送信側の状態
+ *           out   : 書き込み先
+ *           room  : 書き込み先の空き
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ * 戻り値：
+ *          正常時 : 書き込んだサイズ
+ *          障害時 : -1 (room に収まらない。コンテキストは変えない)
+ *****************************************************************************/
+int
+ste_hc_put(ste_hcc_t *hc, unsigned char *out, int room, unsigned char *frame, int len)
+{
+    unsigned char  hb[64];
+    unsigned char *c, *f, *cip, *fip;
+    ste_hc_ctx_t  *ctx;
+    unsigned int   h;
+    int            hlen, hbl, paylen, olen;
+    int            id, mask = 0;
+    unsigned int   seq, cseq;
+
+    len = ste_frame_trim(frame, len);
+    if((hlen = ste_hc_check(frame, len)) == 0){
+        hb[0] = STE_HC_RAW;
+        hbl = 1 + ste_hc_put_varint(hb + 1, len);
+        if(hbl + len > room)
+            return(-1);
+        memcpy(out, hb, hbl);
+        memcpy(out + hbl, frame, len);
+        return(hbl + len);
+    }
+
+    /* アドレスとポートでコンテキストを決める */
+    fip = frame + STE_HC_IP;
+    h = STE_HC_GET32(fip + 12) ^ STE_HC_GET32(fip + 16) ^ STE_HC_GET32(frame + STE_HC_TCP);
+    h ^= h >> 16;
+    h ^= h >> 8;
+    id = h & (STE_HC_CTX_MAX - 1);
+    ctx = &hc->ctx[id];
+    paylen = len - hlen;
+
+    if(ste_hc_same_flow(ctx, frame, hlen) == 0 || ctx->count >= STE_HC_REFRESH){
+        hb[0] = STE_HC_FULL;
+        hb[1] = (unsigned char)id;
+        hb[2] = (unsigned char)(ctx->msn + 1);
+        hbl = 3 + ste_hc_put_varint(hb + 3, len);
+        if(hbl + len > room)
+            return(-1);
+        memcpy(out, hb, hbl);
+        memcpy(out + hbl, frame, len);
+        ste_hc_learn(ctx, frame, hlen, paylen, (ctx->msn + 1) & 0xff);
+        ctx->count = 0;
+        hc->cs->hfull++;
+        return(hbl + len);
+    }
+
+    c = ctx->hdr;
+    f = frame;
+    cip = c + STE_HC_IP;
+    hb[0] = STE_HC_DELTA;
+    hb[1] = (unsigned char)id;
+    hb[2] = (unsigned char)(ctx->msn + 1);
+    hbl = 4;
+    if(STE_HC_GET16(fip + 4) != ((STE_HC_GET16(cip + 4) + 1) & 0xffff)){
+        mask |= STE_HC_F_IPID;
+        memcpy(hb + hbl, fip + 4, 2);
+        hbl += 2;
+    }
+    seq = STE_HC_GET32(f + STE_HC_TCP + 4);
+    cseq = STE_HC_GET32(c + STE_HC_TCP + 4);
+    if(seq != cseq + ctx->paylen){
+        mask |= STE_HC_F_SEQ;
+        hbl += ste_hc_put_varint(hb + hbl, seq - cseq);
+    }
+    if(memcmp(f + STE_HC_TCP + 8, c + STE_HC_TCP + 8, 4) != 0){
+        mask |= STE_HC_F_ACK;
+        hbl += ste_hc_put_varint(hb + hbl, STE_HC_GET32(f + STE_HC_TCP + 8) - STE_HC_GET32(c + STE_HC_TCP + 8));
+    }
+    if(memcmp(f + STE_HC_TCP + 14, c + STE_HC_TCP + 14, 2) != 0){
+        mask |= STE_HC_F_WIN;
+        memcpy(hb + hbl, f + STE_HC_TCP + 14, 2);
+        hbl += 2;
+    }
+    if(f[STE_HC_TCP + 13] != c[STE_HC_TCP + 13]){
+        mask |= STE_HC_F_FLAGS;
+        hb[hbl++] = f[STE_HC_TCP + 13];
+    }
+    olen = hlen - STE_HC_OPT;
+    if(olen > 0 && memcmp(f + STE_HC_OPT, c + STE_HC_OPT, olen) != 0){
+        if(ste_hc_is_ts(f, hlen) && ste_hc_is_ts(c, hlen)){
+            mask |= STE_HC_F_TS;
+            hbl += ste_hc_put_varint(hb + hbl, STE_HC_GET32(f + STE_HC_OPT + 4) - STE_HC_GET32(c + STE_HC_OPT + 4));
+            hbl += ste_hc_put_varint(hb + hbl, STE_HC_GET32(f + STE_HC_OPT + 8) - STE_HC_GET32(c + STE_HC_OPT + 8));
+        } else {
+            mask |= STE_HC_F_OPTS;
+        }
+    }
+    hb[3] = (unsigned char)mask;
+    /* オプション全体はヘッダの作業領域に収まらないことがあるので後で書く */
+    if(mask & STE_HC_F_OPTS)
+        hbl += olen;
+    if(hbl + 2 + 5 + paylen > room)
+        return(-1);
+
+    if(mask & STE_HC_F_OPTS){
+        memcpy(out, hb, hbl - olen);
+        memcpy(out + hbl - olen, f + STE_HC_OPT, olen);
+    } else {
+        memcpy(out, hb, hbl);
+    }
+    memcpy(out + hbl, f + STE_HC_TCP + 16, 2);
+    hbl += 2;
+    hbl += ste_hc_put_varint(out + hbl, paylen);
+    memcpy(out + hbl, f + hlen, paylen);
+
+    ste_hc_learn(ctx, frame, hlen, paylen, (ctx->msn + 1) & 0xff);
+    ctx->count++;
+    hc->cs->hdelta++;
+    hc->cs->hsaved += len - (hbl + paylen);
+    return(hbl + paylen);
+}
+
+/*****************************************************************************
+ * ste_hc_parse()
+ *
+ * STE_MSG_HAGG を解析し、フレームを復元する。STE_HC_DELTA から復元した
+ * フレームは hd->out に置くので、次に ste_hc_parse() を呼ぶまでに使い
+ * 終わること。取りこぼしで復元できないフレームは数えて捨てる。
+ *
+ *  引数：
+ *           hd     : 受信側の状態
+ *           msg    : 受信した STE_MSG_HAGG
+ *           frames : フレームの先頭へのポインタを返す(STE_AGG_MAX_FRAMES 個分)
+ *           lens   : フレーム長を返す(STE_AGG_MAX_FRAMES 個分)
+ *           mtu    : 受け付けるフレーム長の上限
+ *           cs     : 統計情報を数える接続毎の統計情報
+ * 戻り値：
+ *          正常時 : フレーム数
+ *          障害時 : -1 (エントリが本体のサイズと合わないか、不正な値がある)
+ *****************************************************************************/
+int
+ste_hc_parse(ste_hcd_t *hd, ste_msg_t *msg, unsigned char **frames, int *lens, int mtu, ste_connstat_t *cs)
+{
+    unsigned char *p = msg->body;
+    unsigned char *end = msg->body + msg->len;
+    unsigned char *o = hd->out;
+    unsigned char *oend = hd->out + STE_HC_OUTSIZE;
+    unsigned char *ip, *opts, *fields;
+    ste_hc_ctx_t  *ctx;
+    unsigned int   len, v;
+    int            count = 0;
+    int            code, id, msn, mask, hlen, olen;
+
+    while(p < end){
+        code = *p++;
+        if(code == STE_HC_PAD)
+            break;
+        if(count >= STE_AGG_MAX_FRAMES)
+            return(-1);
+
+        if(code == STE_HC_RAW){
+            if(ste_hc_get_varint(&p, end, &len) < 0 || len == 0 || len > (unsigned int)mtu ||
+               len > (unsigned int)(end - p))
+                return(-1);
+            frames[count] = p;
+            lens[count++] = len;
+            p += len;
+            continue;
+        }
+
+        if(code != STE_HC_FULL && code != STE_HC_DELTA)
+            return(-1);
+        if(end - p < 2 || p[0] >= STE_HC_CTX_MAX)
+            return(-1);
+        id = *p++;
+        msn = *p++;
+        ctx = &hd->ctx[id];
+
+        if(code == STE_HC_FULL){
+            if(ste_hc_get_varint(&p, end, &len) < 0 || len == 0 || len > (unsigned int)mtu ||
+               len > (unsigned int)(end - p))
+                return(-1);
+            if((hlen = ste_hc_check(p, len)) > 0){
+                ste_hc_learn(ctx, p, hlen, len - hlen, msn);
+            } else {
+                ctx->valid = 0;
+                cs->herrors++;
+            }
+            frames[count] = p;
+            lens[count++] = len;
+            p += len;
+            continue;
+        }
+
+        /* STE_HC_DELTA。まず読み飛ばせるようにエントリ全体を確認する */
+        if(p >= end)
+            return(-1);
+        mask = *p++;
+        if(mask & ~(STE_HC_F_IPID | STE_HC_F_SEQ | STE_HC_F_ACK | STE_HC_F_WIN |
+                    STE_HC_F_FLAGS | STE_HC_F_TS | STE_HC_F_OPTS))
+            return(-1);
+        if(ctx->valid == 0 || msn != ((ctx->msn + 1) & 0xff) ||
+           ((mask & STE_HC_F_TS) && ste_hc_is_ts(ctx->hdr, ctx->hlen) == 0)){
+            /* 前のフレームを取りこぼした。次のフルヘッダまで捨てる */
+            ctx->valid = 0;
+            ctx = NULL;
+        }
+        hlen = (ctx != NULL) ? ctx->hlen : 0;
+        olen = hlen - STE_HC_OPT;
+        fields = p;
+        if(mask & STE_HC_F_IPID)
+            p += 2;
+        if((mask & STE_HC_F_SEQ) && ste_hc_get_varint(&p, end, &v) < 0)
+            return(-1);
+        if((mask & STE_HC_F_ACK) && ste_hc_get_varint(&p, end, &v) < 0)
+            return(-1);
+        if(mask & STE_HC_F_WIN)
+            p += 2;
+        if(mask & STE_HC_F_FLAGS)
+            p += 1;
+        if((mask & STE_HC_F_TS) && (ste_hc_get_varint(&p, end, &v) < 0 || ste_hc_get_varint(&p, end, &v) < 0))
+            return(-1);
+        if(mask & STE_HC_F_OPTS){
+            /* 長さはコンテキストでしか分からないので、無ければ読み飛ばせない */
+            if(ctx == NULL || olen <= 0)
+                return(-1);
+            p += olen;
+        }
+        p += 2; /* TCP のチェックサム */
+        if(p > end || ste_hc_get_varint(&p, end, &len) < 0 || len > (unsigned int)(end - p))
+            return(-1);
+        if(ctx == NULL){
+            cs->herrors++;
+            p += len;
+            continue;
+        }
+        if(hlen + len > (unsigned int)mtu || o + hlen + len > oend)
+            return(-1);
+
+        /* 直前のヘッダに差分を当てて復元する */
+        memcpy(o, ctx->hdr, hlen);
+        ip = o + STE_HC_IP;
+        opts = o + STE_HC_OPT;
+        ste_hc_put16(ip + 2, hlen - STE_HC_IP + len);
+        if(mask & STE_HC_F_IPID){
+            memcpy(ip + 4, fields, 2);
+            fields += 2;
+        } else {
+            ste_hc_put16(ip + 4, STE_HC_GET16(ip + 4) + 1);
+        }
+        ste_hc_put16(ip + 10, ste_hc_ipsum(ip));
+        if(mask & STE_HC_F_SEQ){
+            ste_hc_get_varint(&fields, end, &v);
+            ste_hc_put32(o + STE_HC_TCP + 4, STE_HC_GET32(o + STE_HC_TCP + 4) + v);
+        } else {
+            ste_hc_put32(o + STE_HC_TCP + 4, STE_HC_GET32(o + STE_HC_TCP + 4) + ctx->paylen);
+        }
+        if(mask & STE_HC_F_ACK){
+            ste_hc_get_varint(&fields, end, &v);
+            ste_hc_put32(o + STE_HC_TCP + 8, STE_HC_GET32(o + STE_HC_TCP + 8) + v);
+        }
+        if(mask & STE_HC_F_WIN){
+            memcpy(o + STE_HC_TCP + 14, fields, 2);
+            fields += 2;
+        }
+        if(mask & STE_HC_F_FLAGS)
+            o[STE_HC_TCP + 13] = *fields++;
+        if(mask & STE_HC_F_TS){
+            ste_hc_get_varint(&fields, end, &v);
+            ste_hc_put32(opts + 4, STE_HC_GET32(opts + 4) + v);
+            ste_hc_get_varint(&fields, end, &v);
+            ste_hc_put32(opts + 8, STE_HC_GET32(opts + 8) + v);
+        }
+        if(mask & STE_HC_F_OPTS){
+            memcpy(opts, fields, olen);
+            fields += olen;
+        }
+        memcpy(o + STE_HC_TCP + 16, fields, 2);
+        memcpy(o + hlen, p, len);
+        p += len;
+
+        ste_hc_learn(ctx, o, hlen, len, msn);
+        frames[count] = o;
+        lens[count++] = hlen + len;
+        o += hlen + len;
+    }
+    return(count);
+}
@@ -0,0 +1,424 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_http.c
+ *
+ * sted が Proxy サーバ経由で HUB に接続するためのルーチン。
+ *
+ *  o CONNECT リクエストを作り、レスポンスをブロックせずに読み進める。
+ *  o レスポンスの後ろに続いていたデータは捨てずに取っておく。
+ *  o トンネルができた後も、予備のトンネルが Proxy に切られていないかを
+ *    ste_tunnel_poll() で確かめる。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include "sted.h"
+#include "sted_http.h"
+
+static const char ste_http_b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int  ste_http_status_line(ste_http_t *);
+static int  ste_tunnel_fail(ste_tunnel_t *);
+
+/*****************************************************************************
+ * ste_http_reset()
+ *
+ * レスポンスを読み始める前に状態を初期化する。
+ *****************************************************************************/
+void
+ste_http_reset(ste_http_t *h)
+{
+    memset(h, 0x0, sizeof(ste_http_t));
+    h->state = STE_HTTP_STATUS;
+}
+
+/*****************************************************************************
+ * ste_http_feed()
+ *
+ * 受信したデータから CONNECT のレスポンスを読み進める。ヘッダの終わり
+ * （空行）まで読んだら state を STE_HTTP_DONE にして、そこで止まる。
+ * 残りはトンネルのデータ（HUB からのデータ）なので読まない。
+ * 行の終わりは CRLF だが、LF だけでも受け付ける。
+ *
+ *  引数：
+ *           h    : レスポンスを読み進めている状態
+ *           data : 受信したデータ
+ *           cnt  : data の長さ
+ * 戻り値：
+ *          正常時 : 読んだ長さ（STE_HTTP_DONE なら、その後ろがトンネルのデータ）
+ *          障害時 : -1（レスポンスが壊れているか、ヘッダが長すぎる）
+ *****************************************************************************/
+int
+ste_http_feed(ste_http_t *h, unsigned char *data, int cnt)
+{
+    int i;
+
+    for(i = 0 ; i < cnt && h->state != STE_HTTP_DONE ; i++){
+        if(h->state == STE_HTTP_ERROR || ++h->total > STE_HTTP_HEAD_MAX){
+            h->state = STE_HTTP_ERROR;
+            return(-1);
+        }
+        if(data[i] != '\n'){
+            /* 行の途中。ステータスラインだけ保存する */
+            if(data[i] != '\r' && h->state == STE_HTTP_STATUS && h->linelen < STE_HTTP_LINE_MAX - 1)
+                h->line[h->linelen] = data[i];
+            if(data[i] != '\r')
+                h->linelen++;
+            continue;
+        }
+        if(h->state == STE_HTTP_STATUS){
+            if(ste_http_status_line(h) < 0){
+                h->state = STE_HTTP_ERROR;
+                return(-1);
+            }
+            h->state = STE_HTTP_HEADER;
+        } else if(h->linelen == 0){
+            /* 空行。1xx なら次のレスポンスを待つ */
+            if(h->status >= 100 && h->status < 200)
+                h->state = STE_HTTP_STATUS;
+            else
+                h->state = STE_HTTP_DONE;
+        }
+        h->linelen = 0;
+    }
+    return(i);
+}
+
+/*****************************************************************************
+ * ste_http_status_line()
+ *
+ * 「HTTP/1.1 200 Connection established」のようなステータスラインから
+ * ステータスコードを取り出す。
+ *****************************************************************************/
+static int
+ste_http_status_line(ste_http_t *h)
+{
+    char *p;
+    int   i;
+
+    h->line[(h->linelen < STE_HTTP_LINE_MAX) ? h->linelen : STE_HTTP_LINE_MAX - 1] = '\0';
+    if(strncmp(h->line, "HTTP/", 5) != 0 || (p = strchr(h->line, ' ')) == NULL)
+        return(-1);
+    while(*p == ' ')
+        p++;
+    h->status = 0;
+    for(i = 0 ; i < 3 ; i++){
+        if(p[i] < '0' || p[i] > '9')
+            return(-1);
+        h->status = h->status * 10 + (p[i] - '0');
+    }
+    if(p[3] != '\0' && p[3] != ' ')
+        return(-1);
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_http_basic()
+ *
+ * 「user:password」から Proxy-Authorization の値（Basic 認証）を作る。
+ *
+ *  引数：
+ *           buf     : 値を返すバッファ
+ *           buflen  : buf のサイズ
+ *           userinfo: 「user:password」
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1（長すぎる）
+ *****************************************************************************/
+int
+ste_http_basic(char *buf, int buflen, char *userinfo)
+{
+    unsigned char *s = (unsigned char *)userinfo;
+    int            len = (int)strlen(userinfo);
+    int            i, n;
+    unsigned int   v;
+
+    if(6 + (len + 2) / 3 * 4 + 1 > buflen)
+        return(-1);
+    strcpy(buf, "Basic ");
+    n = 6;
+    for(i = 0 ; i < len ; i += 3){
+        v = s[i] << 16;
+        if(i + 1 < len)
+            v |= s[i + 1] << 8;
+        if(i + 2 < len)
+            v |= s[i + 2];
+        buf[n++] = ste_http_b64[(v >> 18) & 0x3f];
+        buf[n++] = ste_http_b64[(v >> 12) & 0x3f];
+        buf[n++] = (i + 1 < len) ? ste_http_b64[(v >> 6) & 0x3f] : '=';
+        buf[n++] = (i + 2 < len) ? ste_http_b64[v & 0x3f] : '=';
+    }
+    buf[n] = '\0';
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_http_connect_req()
+ *
+ * HUB へのトンネルを作る CONNECT リクエストを作る。IPv6 のアドレスは
+ * [] で囲む。
+ *
+ *  引数：
+ *           buf     : リクエストを返すバッファ
+ *           buflen  : buf のサイズ
+ *           host    : HUB のホスト名
+ *           port    : HUB のポート番号
+ *           auth    : Proxy-Authorization の値。空文字列なら付けない
+ * 戻り値：
+ *          正常時 : リクエストの長さ
+ *          障害時 : -1（長すぎる）
+ *****************************************************************************/
+int
+ste_http_connect_req(char *buf, int buflen, char *host, int port, char *auth)
+{
+    char  authority[STE_DIAL_HOSTMAX + 16];
+
+    if((int)strlen(host) + 16 > (int)sizeof(authority) ||
+       2 * (int)strlen(host) + (int)strlen(auth) + 96 > buflen)
+        return(-1);
+    if(strchr(host, ':') != NULL)
+        sprintf(authority, "[%s]:%d", host, port);
+    else
+        sprintf(authority, "%s:%d", host, port);
+    if(auth[0] != '\0')
+        sprintf(buf, "CONNECT %s HTTP/1.1\r\nHost: %s\r\nProxy-Authorization: %s\r\n\r\n",
+                authority, authority, auth);
+    else
+        sprintf(buf, "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n", authority, authority);
+    return((int)strlen(buf));
+}
+
+/*****************************************************************************
+ * ste_tunnel_init()
+ *
+ * トンネルの状態を初期化する。
+ *****************************************************************************/
+void
+ste_tunnel_init(ste_tunnel_t *t)
+{
+    memset(t, 0x0, sizeof(ste_tunnel_t));
+    t->state = STE_TUNNEL_IDLE;
+    t->fd = -1;
+    ste_http_reset(&t->http);
+}
+
+/*****************************************************************************
+ * ste_tunnel_start()
+ *
+ * Proxy に接続できた socket で CONNECT を送り始める。レスポンスは
+ * ste_tunnel_poll() で待つ。quiet は引き継ぐ。
+ *
+ *  引数：
+ *           t         : トンネル
+ *           fd        : Proxy に接続した socket（non-blocking mode）
+ *           host      : HUB のホスト名
+ *           port      : HUB のポート番号
+ *           auth      : Proxy-Authorization の値。空文字列なら付けない
+ *           hub_index : HUB の番号
+ *           now       : 現在時刻(usec)
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1（socket は閉じる）
+ *****************************************************************************/
+int
+ste_tunnel_start(ste_tunnel_t *t, int fd, char *host, int port, char *auth,
+                 int hub_index, ste_uint64_t now)
+{
+    int quiet = t->quiet;
+
+    ste_tunnel_init(t);
+    t->quiet = quiet;
+    t->fd = fd;
+    t->hub_index = hub_index;
+    t->start_usec = now;
+    if((t->reqlen = ste_http_connect_req(t->req, sizeof(t->req), host, port, auth)) < 0){
+        print_err(LOG_ERR, "CONNECT request to %s is too long\n", host);
+        return(ste_tunnel_fail(t));
+    }
+    t->state = STE_TUNNEL_WAITING;
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_tunnel_poll()
+ *
+ * トンネルの確立を進める。CONNECT の残りを送り、届いているレスポンスを
+ * 読み進める。レスポンスの後ろに続いていたデータは rest に取っておく。
+ * できた後のトンネル（予備）は、Proxy に切られていないかを確かめる。
+ *
+ *  引数：
+ *           t   : トンネル
+ *           now : 現在時刻(usec)
+ * 戻り値：
+ *          できた : 0
+ *          待つ   : STE_DIAL_AGAIN
+ *          失敗   : -1（socket は閉じる。http.status が 0 以外なら Proxy が
+ *                   返したステータスコード）
+ *****************************************************************************/
+int
+ste_tunnel_poll(ste_tunnel_t *t, ste_uint64_t now)
+{
+    unsigned char  buf[STE_HTTP_HEAD_MAX];
+    int            n, used;
+
+    if(t->state == STE_TUNNEL_IDLE)
+        return(-1);
+
+    while(t->state == STE_TUNNEL_WAITING && t->reqsent < t->reqlen){
+        if((n = send(t->fd, t->req + t->reqsent, t->reqlen - t->reqsent, 0)) < 0){
+            SET_ERRNO();
+            if(errno == EINTR)
+                continue;
+            if(errno == EWOULDBLOCK)
+                break;
+            if(!t->quiet)
+                print_err(LOG_ERR, "ste_tunnel_poll: send %s (%d)\n", strerror(errno), errno);
+            return(ste_tunnel_fail(t));
+        }
+        t->reqsent += n;
+    }
+
+    while(t->restlen < (int)sizeof(t->rest)){
+        n = recv(t->fd, buf, sizeof(buf) - t->restlen, 0);
+        if(n < 0){
+            SET_ERRNO();
+            if(errno == EINTR)
+                continue;
+            if(errno == EWOULDBLOCK || errno == 0)
+                break;
+            if(!t->quiet)
+                print_err(LOG_ERR, "ste_tunnel_poll: recv %s (%d)\n", strerror(errno), errno);
+            return(ste_tunnel_fail(t));
+        }
+        if(n == 0){
+            if(!t->quiet)
+                print_err(LOG_ERR, "connection with proxy server is being closed\n");
+            return(ste_tunnel_fail(t));
+        }
+        used = 0;
+        if(t->state == STE_TUNNEL_WAITING){
+            if((used = ste_http_feed(&t->http, buf, n)) < 0){
+                if(!t->quiet)
+                    print_err(LOG_ERR, "ste_tunnel_poll: Illegal response from Proxy server\n");
+                return(ste_tunnel_fail(t));
+            }
+            if(t->http.state == STE_HTTP_DONE){
+                if(t->http.status != HTTP_STAT_OK)
+                    return(ste_tunnel_fail(t));
+                t->state = STE_TUNNEL_READY;
+                t->start_usec = now;
+            }
+        }
+        /* トンネルのデータ。予備のトンネルには HUB から何も届かないはず */
+        if(n > used){
+            if(t->restlen + n - used > (int)sizeof(t->rest))
+                return(ste_tunnel_fail(t));
+            memcpy(t->rest + t->restlen, buf + used, n - used);
+            t->restlen += n - used;
+        }
+    }
+
+    if(t->state == STE_TUNNEL_READY)
+        return(0);
+    if(now - t->start_usec >= STE_TUNNEL_TIMEOUT_USEC){
+        if(!t->quiet)
+            print_err(LOG_ERR, "ste_tunnel_poll: no response from Proxy server\n");
+        return(ste_tunnel_fail(t));
+    }
+    return(STE_DIAL_AGAIN);
+}
+
+/*****************************************************************************
+ * ste_tunnel_fail()
+ *
+ * トンネルを閉じて -1 を返す。Proxy が返したステータスコードは残す。
+ *****************************************************************************/
+static int
+ste_tunnel_fail(ste_tunnel_t *t)
+{
+    ste_tunnel_close(t);
+    return(-1);
+}
+
+/*****************************************************************************
+ * ste_tunnel_close()
+ *
+ * トンネルの socket を閉じる。
+ *****************************************************************************/
+void
+ste_tunnel_close(ste_tunnel_t *t)
+{
+    if(t->fd >= 0)
+        CLOSE(t->fd);
+    t->fd = -1;
+    t->state = STE_TUNNEL_IDLE;
+    t->restlen = 0;
+}
+
+/*****************************************************************************
+ * ste_tunnel_wait_usec()
+ *
+ * 次に ste_tunnel_poll() を呼ぶまでの時間を返す。レスポンスを待っている
+ * 間はタイムアウトの時刻、できた後は張り直す時刻まで。
+ *
+ * 戻り値：
+ *          待ち時間(usec)。使っていなければ -1
+ *****************************************************************************/
+long
+ste_tunnel_wait_usec(ste_tunnel_t *t, ste_uint64_t now)
+{
+    ste_uint64_t until;
+
+    switch(t->state){
+        case STE_TUNNEL_WAITING:
+            /* CONNECT を送り切れていなければ、すぐに続きを送る */
+            if(t->reqsent < t->reqlen)
+                return(STE_DIAL_POLL_USEC);
+            until = t->start_usec + STE_TUNNEL_TIMEOUT_USEC;
+            break;
+        case STE_TUNNEL_READY:
+            until = t->start_usec + STE_TUNNEL_REFRESH_USEC;
+            break;
+        default:
+            return(-1);
+    }
+    return((until > now) ? (long)(until - now) : 0);
+}
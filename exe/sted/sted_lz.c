@@ -0,0 +1,525 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_lz.c
+ *
+ * sted と stehub の間のリンクで、STE_MSG_AGG を LZ4 のブロック形式で圧縮
+ * して STE_MSG_ZAGG として送り、受け取った STE_MSG_ZAGG を展開する
+ * ルーチン。stehub からも ..\sted\sted_lz.c としてコンパイルされる。
+ *
+ *  o 圧縮は貪欲法のみ（LZ4 の高速モード相当）。一致は 4 byte のハッシュ
+ *    で探し、直前 STE_LZ_WINDOW byte 以内（オフセットは 16 bit）の辞書
+ *    も参照する。
+ *  o 展開は送られてきたデータを一切信用せず、オフセットや長さが辞書や
+ *    出力の範囲を外れていたらエラーにする。
+ *  o buf が一杯になったら最後の STE_LZ_WINDOW byte を先頭に移す。送信側と
+ *    受信側で移すタイミングがずれても、受信側は常に送信側以上の辞書を
+ *    持っているので問題無い。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sted.h"
+#include "sted_trace.h"
+#include "sted_lz.h"
+
+/*
+ * LZ4 のブロック形式の定数
+ *
+ *  STE_LZ_MINMATCH     一致の最小長
+ *  STE_LZ_LASTLITERALS ブロックの末尾のこのサイズは必ずリテラル
+ *  STE_LZ_MFLIMIT      一致はブロックの末尾からこのサイズより前で始まる
+ *  STE_LZ_MAXOFFSET    一致のオフセットの最大値
+ */
+#define  STE_LZ_MINMATCH       4
+#define  STE_LZ_LASTLITERALS   5
+#define  STE_LZ_MFLIMIT        12
+#define  STE_LZ_MAXOFFSET      65535
+
+static void ste_lz_clear(ste_lzc_t *);
+static unsigned int ste_lz_hash(unsigned char *);
+static int  ste_lz_slide(unsigned char *, int, int);
+static int  ste_lz_put_len(unsigned char *, unsigned char *, int);
+static int  ste_lz_compress(ste_lzc_t *, unsigned char *, int, unsigned char *, int);
+static int  ste_lz_decompress(ste_lzd_t *, unsigned char *, int, int);
+
+/*****************************************************************************
+ * ste_lzc_reset()
+ *
+ * 送信側の状態を初期化する。次に送る STE_MSG_ZAGG には STE_LZ_F_RESET を
+ * 付ける。新しい接続では必ず呼ぶこと。
+ *
+ *  引数：
+ *           z : 送信側の状態
+ *****************************************************************************/
+void
+ste_lzc_reset(ste_lzc_t *z)
+{
+    ste_lz_clear(z);
+    z->skip = 0;
+    z->backoff = 1;
+    z->cpu_start = 0;
+    z->cpu_usec = 0;
+}
+
+/*****************************************************************************
+ * ste_lz_clear()
+ *
+ * 送信側の辞書だけを捨てる。圧縮を試さない数や CPU の予算はそのまま。
+ *****************************************************************************/
+static void
+ste_lz_clear(ste_lzc_t *z)
+{
+    z->pos = 0;
+    z->offset = 0;
+    z->reset = 1;
+    memset(z->hash, 0x0, sizeof(z->hash));
+}
+
+/*****************************************************************************
+ * ste_lzd_reset()
+ *
+ * 受信側の辞書を捨てる。新しい接続では必ず呼ぶこと。
+ *
+ *  引数：
+ *           z : 受信側の状態
+ *****************************************************************************/
+void
+ste_lzd_reset(ste_lzd_t *z)
+{
+    z->pos = 0;
+    z->offset = 0;
+    z->broken = 0;
+}
+
+/*****************************************************************************
+ * ste_lz_hash()
+ *
+ * 4 byte のハッシュ値を求める。
+ *****************************************************************************/
+static unsigned int
+ste_lz_hash(unsigned char *p)
+{
+    unsigned int v;
+
+    v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+    return((v * 2654435761U) >> (32 - STE_LZ_HASHLOG));
+}
+
+/*****************************************************************************
+ * ste_lz_slide()
+ *
+ * buf の後ろに need byte 入らなければ、最後の STE_LZ_WINDOW byte を先頭
+ * に移す。
+ *
+ *  引数：
+ *           buf  : 辞書
+ *           pos  : buf に入っているデータのサイズ
+ *           need : これから入れるサイズ
+ * 戻り値：
+ *          前に移したサイズ（移さなければ 0）
+ *****************************************************************************/
+static int
+ste_lz_slide(unsigned char *buf, int pos, int need)
+{
+    int shift;
+
+    if(pos + need <= (int)STE_LZ_BUFSIZE)
+        return(0);
+    shift = pos - STE_LZ_WINDOW;
+    memmove(buf, buf + shift, STE_LZ_WINDOW);
+    return(shift);
+}
+
+/*****************************************************************************
+ * ste_lz_put_len()
+ *
+ * 15 以上の長さの残りを 255 の並び + 端数として書き込む。
+ *
+ *  引数：
+ *           op   : 書き込み先
+ *           oend : 書き込み先の末尾
+ *           len  : 長さ - 15
+ * 戻り値：
+ *          正常時 : 書き込んだサイズ
+ *          障害時 : -1 (書き込み先が足りない)
+ *****************************************************************************/
+static int
+ste_lz_put_len(unsigned char *op, unsigned char *oend, int len)
+{
+    int n = len / 255 + 1;
+
+    if(op + n > oend)
+        return(-1);
+    for( ; len >= 255 ; len -= 255)
+        *op++ = 255;
+    *op = (unsigned char)len;
+    return(n);
+}
+
+/*****************************************************************************
+ * ste_lz_compress()
+ *
+ * src を辞書の後ろにコピーして LZ4 のブロック形式で圧縮する。dstmax に
+ * 収まらなければ途中でやめ、辞書も元に戻す。
+ *
+ *  引数：
+ *           z      : 送信側の状態
+ *           src    : 圧縮するデータ
+ *           len    : 圧縮するデータのサイズ
+ *           dst    : 書き込み先
+ *           dstmax : 書き込み先のサイズ
+ * 戻り値：
+ *          正常時 : 圧縮後のサイズ
+ *          障害時 : -1 (dstmax に収まらない)
+ *****************************************************************************/
+static int
+ste_lz_compress(ste_lzc_t *z, unsigned char *src, int len, unsigned char *dst, int dstmax)
+{
+    unsigned char *ip, *anchor, *iend, *mflimit, *matchlimit, *ref, *token;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + dstmax;
+    unsigned int   h;
+    int            shift, i, n;
+    int            litlen, mlen;
+
+    if((shift = ste_lz_slide(z->buf, z->pos, len)) > 0){
+        z->pos -= shift;
+        for(i = 0 ; i < (1 << STE_LZ_HASHLOG) ; i++)
+            z->hash[i] = (z->hash[i] >= (unsigned int)shift) ? z->hash[i] - shift : 0;
+    }
+    memcpy(z->buf + z->pos, src, len);
+
+    ip = anchor = z->buf + z->pos;
+    iend = ip + len;
+    mflimit = iend - STE_LZ_MFLIMIT;
+    matchlimit = iend - STE_LZ_LASTLITERALS;
+
+    while(ip < mflimit){
+        h = ste_lz_hash(ip);
+        ref = z->buf + z->hash[h];
+        z->hash[h] = (unsigned int)(ip - z->buf);
+        /* ハッシュの衝突や古い位置もあるので、中身を比べて確かめる */
+        if(ref >= ip || ip - ref > STE_LZ_MAXOFFSET || memcmp(ref, ip, STE_LZ_MINMATCH) != 0){
+            ip++;
+            continue;
+        }
+        /* 一致を前後に延ばす */
+        while(ip > anchor && ref > z->buf && ip[-1] == ref[-1]){
+            ip--;
+            ref--;
+        }
+        for(mlen = STE_LZ_MINMATCH ; ip + mlen < matchlimit && ip[mlen] == ref[mlen] ; mlen++)
+            ;
+
+        /* token, リテラル長, リテラル, オフセット, 一致長 */
+        litlen = (int)(ip - anchor);
+        if(op + 1 + litlen + 2 + 1 > oend)
+            return(-1);
+        token = op++;
+        if(litlen >= 15){
+            *token = 15 << 4;
+            if((n = ste_lz_put_len(op, oend, litlen - 15)) < 0)
+                return(-1);
+            op += n;
+        } else {
+            *token = (unsigned char)(litlen << 4);
+        }
+        if(op + litlen + 2 > oend)
+            return(-1);
+        memcpy(op, anchor, litlen);
+        op += litlen;
+        *op++ = (unsigned char)(ip - ref);
+        *op++ = (unsigned char)((ip - ref) >> 8);
+        if(mlen - STE_LZ_MINMATCH >= 15){
+            *token |= 15;
+            if((n = ste_lz_put_len(op, oend, mlen - STE_LZ_MINMATCH - 15)) < 0)
+                return(-1);
+            op += n;
+        } else {
+            *token |= (unsigned char)(mlen - STE_LZ_MINMATCH);
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+
+    /* 残りは全てリテラル */
+    litlen = (int)(iend - anchor);
+    if(op + 1 > oend)
+        return(-1);
+    token = op++;
+    if(litlen >= 15){
+        *token = 15 << 4;
+        if((n = ste_lz_put_len(op, oend, litlen - 15)) < 0)
+            return(-1);
+        op += n;
+    } else {
+        *token = (unsigned char)(litlen << 4);
+    }
+    if(op + litlen > oend)
+        return(-1);
+    memcpy(op, anchor, litlen);
+    op += litlen;
+
+    z->pos += len;
+    return((int)(op - dst));
+}
+
+/*****************************************************************************
+ * ste_lz_decompress()
+ *
+ * LZ4 のブロックを辞書の後ろに展開する。
+ *
+ *  引数：
+ *           z      : 受信側の状態
+ *           src    : LZ4 のブロック（後ろにパディングがあってもよい）
+ *           srclen : src のサイズ
+ *           rawlen : 展開後のサイズ
+ * 戻り値：
+ *          正常時 : 0 (z->buf + z->pos - rawlen から rawlen byte)
+ *          障害時 : -1 (ブロックが壊れている)
+ *****************************************************************************/
+static int
+ste_lz_decompress(ste_lzd_t *z, unsigned char *src, int srclen, int rawlen)
+{
+    unsigned char *ip = src;
+    unsigned char *iend = src + srclen;
+    unsigned char *op, *oend, *ref;
+    int            token, len, b;
+    int            offset;
+
+    z->pos -= ste_lz_slide(z->buf, z->pos, rawlen);
+    op = z->buf + z->pos;
+    oend = op + rawlen;
+
+    for(;;){
+        if(ip >= iend)
+            return(-1);
+        token = *ip++;
+
+        /* リテラル */
+        len = token >> 4;
+        if(len == 15){
+            do {
+                if(ip >= iend)
+                    return(-1);
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+        if(len > iend - ip || len > oend - op)
+            return(-1);
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if(op == oend)
+            break;  /* 最後のシーケンスはリテラルだけ */
+
+        /* 一致 */
+        if(iend - ip < 2)
+            return(-1);
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op - z->buf)
+            return(-1);
+        len = token & 15;
+        if(len == 15){
+            do {
+                if(ip >= iend)
+                    return(-1);
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+        len += STE_LZ_MINMATCH;
+        if(len > oend - op)
+            return(-1);
+        /* 重なっていることがあるので 1 byte ずつコピーする */
+        for(ref = op - offset ; len > 0 ; len--)
+            *op++ = *ref++;
+    }
+
+    z->pos += rawlen;
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_lz_seal()
+ *
+ * ste_agg_seal() で STE_MSG_AGG（STE_MSG_CAGG, STE_MSG_HAGG, STE_MSG_MUX）を完成させ、圧縮して縮めば
+ * STE_MSG_ZAGG にする。縮まない場合や、圧縮にかけた時間が予算を超えて
+ * いる場合は STE_MSG_AGG のまま返す。送信し終わったら ste_agg_reset() する
+ * こと。
+ *
+ *  引数：
+ *           z       : 送信側の状態
+ *           agg     : 組み立て中の STE_MSG_AGG
+ *           msglen  : 完成したメッセージのサイズを返す
+ *           txflags : STE_TX_XXX
+ *           cs      : 圧縮の統計情報を数える接続毎の統計情報
+ * 戻り値：
+ *          完成したメッセージの先頭
+ *****************************************************************************/
+unsigned char *
+ste_lz_seal(ste_lzc_t *z, ste_agg_t *agg, int *msglen, int txflags, ste_connstat_t *cs)
+{
+    unsigned char *msg, *raw, *p, *start;
+    int            hsize = STE_HEADSIZE(txflags);
+    int            type = agg->mux ? STE_MSG_MUX :
+        ((agg->hc != NULL) ? STE_MSG_HAGG : (agg->compact ? STE_MSG_CAGG : STE_MSG_AGG));
+    int            rawlen, clen, bodylen;
+    int            pad = 0;
+    unsigned int   usec;
+    ste_uint64_t   now;
+
+    msg = ste_agg_seal(agg, msglen, txflags);
+    raw = msg + hsize;
+    rawlen = *msglen - hsize;
+
+    if(rawlen < STE_LZ_MIN_BYTES)
+        return(msg);
+    if(z->skip > 0){
+        z->skip--;
+        cs->zskips++;
+        return(msg);
+    }
+    now = ste_time_usec();
+    if(now - z->cpu_start >= STE_LZ_CPU_WINDOW_USEC){
+        z->cpu_start = now;
+        z->cpu_usec = 0;
+    }
+    if(z->cpu_usec >= STE_LZ_CPU_BUDGET_USEC){
+        cs->zskips++;
+        return(msg);
+    }
+
+    if(z->offset >= STE_LZ_RESET_BYTES)
+        ste_lz_clear(z);
+    p = z->out + STE_SEAL_HEADROOM + sizeof(stehead2_t) + STE_LZ_HDRSIZE;
+    clen = ste_lz_compress(z, raw, rawlen, p, rawlen - rawlen / STE_LZ_MIN_SAVING);
+    usec = (unsigned int)(ste_time_usec() - now);
+    z->cpu_usec += usec;
+    cs->zusec += usec;
+
+    if(clen < 0){
+        /* 縮まなかった。しばらく試さない */
+        z->skip = z->backoff;
+        if(z->backoff < STE_LZ_BACKOFF_MAX)
+            z->backoff *= 2;
+        cs->zskips++;
+        return(msg);
+    }
+    z->backoff = 1;
+
+    p -= STE_LZ_HDRSIZE;
+    p[0] = (unsigned char)(-type);
+    p[1] = z->reset ? STE_LZ_F_RESET : 0;
+    p[2] = (unsigned char)(rawlen >> 8);
+    p[3] = (unsigned char)rawlen;
+    p[4] = (unsigned char)(z->offset >> 24);
+    p[5] = (unsigned char)(z->offset >> 16);
+    p[6] = (unsigned char)(z->offset >> 8);
+    p[7] = (unsigned char)z->offset;
+    z->reset = 0;
+    z->offset += rawlen;
+
+    bodylen = STE_LZ_HDRSIZE + clen;
+    if((bodylen & 3) != 0)
+        pad = 4 - (bodylen & 3);
+    memset(p + bodylen, 0x0, pad);
+    start = p - hsize;
+    ste_put_head(start, bodylen + pad, STE_MSG_ZAGG, txflags);
+    *msglen = hsize + bodylen + pad;
+
+    cs->zmsgs++;
+    cs->zin += rawlen;
+    cs->zout += bodylen + pad;
+    return(start);
+}
+
+/*****************************************************************************
+ * ste_lz_open()
+ *
+ * STE_MSG_ZAGG を展開し、中の STE_MSG_AGG（STE_MSG_CAGG, STE_MSG_HAGG, STE_MSG_MUX）を返す。
+ * inner の body は z の buf を指しているので、次に ste_lz_open() を
+ * 呼ぶまでに使い終わること。
+ *
+ *  引数：
+ *           z     : 受信側の状態
+ *           msg   : 受信した STE_MSG_ZAGG
+ *           inner : 展開した STE_MSG_AGG（STE_MSG_CAGG, STE_MSG_HAGG, STE_MSG_MUX）を返す
+ *           cs    : 展開の統計情報を数える接続毎の統計情報
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (壊れているか、辞書がずれていて展開できない)
+ *****************************************************************************/
+int
+ste_lz_open(ste_lzd_t *z, ste_msg_t *msg, ste_msg_t *inner, ste_connstat_t *cs)
+{
+    unsigned char *p = msg->body;
+    int            type = -(int)p[0];
+    int            rawlen = (p[2] << 8) | p[3];
+    unsigned int   offset;
+    ste_uint64_t   now;
+
+    offset = ((unsigned int)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+    if((type != STE_MSG_AGG && type != STE_MSG_CAGG && type != STE_MSG_HAGG && type != STE_MSG_MUX) ||
+       rawlen < 4 || rawlen > (int)STE_MSG_MAX){
+        cs->zerrors++;
+        return(-1);
+    }
+
+    if(p[1] & STE_LZ_F_RESET){
+        ste_lzd_reset(z);
+    } else if(z->broken || offset != z->offset){
+        z->broken = 1;
+        cs->zerrors++;
+        return(-1);
+    }
+
+    now = ste_time_usec();
+    if(ste_lz_decompress(z, p + STE_LZ_HDRSIZE, msg->len - STE_LZ_HDRSIZE, rawlen) < 0){
+        z->broken = 1;
+        cs->zerrors++;
+        return(-1);
+    }
+    cs->dusec += ste_time_usec() - now;
+    cs->dmsgs++;
+    z->offset += rawlen;
+
+    inner->type = type;
+    inner->body = z->buf + z->pos - rawlen;
+    inner->len = rawlen;
+    return(0);
+}
@@ -0,0 +1,1238 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_proto.c
+ *
+ * sted と stehub の間のプロトコルのメッセージを組み立て、解析する
+ * ルーチン。stehub からも ..\sted\sted_proto.c としてコンパイルされる。
+ *
+ *  o ste_rx_next() は recv() したデータからメッセージを 1 つずつ取り出す。
+ *    メッセージが recv() したデータの中に収まっていればコピーせずに
+ *    そのまま指し示し、境界をまたいだ場合だけ ste_rx_t の buf にコピー
+ *    して再構成する。
+ *  o ste_msg_put_XXX() は送信バッファにメッセージを書き込む。
+ *  o ste_agg_XXX() は STE_MSG_AGG（STE_MSG_CAGG, STE_MSG_HAGG）を組み立てる。
+ *    STE_MSG_HAGG のエントリの中身は sted_hc.c が書く。
+ *  o ste_frame_trim() は ste ドライバが ETHERMIN までパディングしたフレーム
+ *    の末尾のパディングを取り除く。
+ *  o ste_flow_hash() は STE_CAP_STRIPE でフレームを送るリンクを選ぶための
+ *    フローのハッシュを求める。
+ *  o ste_crc32c() はフレーミング v2 のヘッダと本体の CRC32C を計算する。
+ *    SSE4.2 の crc32 命令が使える CPU ではそれを使い、使えなければ
+ *    テーブルを引いて計算する。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include "sted.h"
+#include "sted_proto.h"
+
+/*
+ * CRC32C の計算に SSE4.2 の crc32 命令を使えるかどうか。
+ * 使えるコンパイラでも、実際に使うのは CPU が対応している場合だけ。
+ */
+#if defined(STE_WINDOWS) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#include <nmmintrin.h>
+#define  STE_CRC_HW
+#define  STE_CRC_TARGET
+#define  STE_CRC_HW_CHECK()  ste_crc_cpuid()
+static int
+ste_crc_cpuid(void)
+{
+    int info[4];
+
+    __cpuid(info, 1);
+    return((info[2] >> 20) & 1);  /* ECX bit 20 : SSE4.2 */
+}
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <nmmintrin.h>
+#define  STE_CRC_HW
+#define  STE_CRC_TARGET      __attribute__((target("sse4.2")))
+#define  STE_CRC_HW_CHECK()  (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"))
+#endif
+
+#define  STE_CRC32C_POLY     0x82F63B78  /* Castagnoli（ビット反転） */
+
+static unsigned int ste_crc_table[256];
+static int          ste_crc_inited = 0;
+static int          ste_crc_use_hw = 0;
+
+static int  ste_rx_valid(int, int, int);
+static int  ste_rx_headsize(ste_rx_t *);
+static int  ste_rx_decode(ste_rx_t *);
+static int  ste_rx_scan(ste_rx_t *, unsigned char **, int *);
+static int  ste_put_runt(unsigned char *, unsigned char *, int);
+static void ste_crc_init(void);
+
+/*****************************************************************************
+ * ste_rx_reset()
+ *
+ * 受信途中のメッセージを捨てて、次のデータをメッセージの先頭として扱う。
+ * 新しい接続なので、v1 のヘッダも受け付ける状態に戻す。MTU も
+ * STE_MSG_HELLO で合意するまでは ETHERMAX とする。
+ *
+ *  引数：
+ *           rx : 受信の状態
+ *****************************************************************************/
+void
+ste_rx_reset(ste_rx_t *rx)
+{
+    ste_rx_restart(rx);
+    rx->sync = 0;
+    rx->mtu = ETHERMAX;
+}
+
+/*****************************************************************************
+ * ste_rx_restart()
+ *
+ * 受信途中のメッセージを捨てて、次のデータをメッセージの先頭として扱う。
+ * ste_rx_reset() と違い、同じ接続のままなので v2 のヘッダを受信したか
+ * どうかと MTU は変えない。UDP ではメッセージがデータグラムをまたがない
+ * ので、データグラム毎に呼ぶ。
+ *
+ *  引数：
+ *           rx : 受信の状態
+ *****************************************************************************/
+void
+ste_rx_restart(ste_rx_t *rx)
+{
+    rx->state = STE_RX_HEAD;
+    rx->headlen = rx->datalen = rx->dataleft = rx->orglen = 0;
+    rx->flags = rx->discard = 0;
+}
+
+/*****************************************************************************
+ * ste_rx_valid()
+ *
+ * stehead の len と orglen が妥当かどうかを確認する。
+ *
+ *  引数：
+ *           datalen : パディングを含む本体のサイズ
+ *           orglen  : フレーム長もしくは STE_MSG_XXX
+ *           mtu     : 受け付けるフレーム長の上限
+ * 戻り値：
+ *          妥当    : 1
+ *          不正    : 0
+ *****************************************************************************/
+static int
+ste_rx_valid(int datalen, int orglen, int mtu)
+{
+    if(orglen > 0)
+        return(orglen <= mtu && datalen >= orglen && datalen - orglen < 4);
+
+    switch(orglen){
+        case STE_MSG_HELLO:
+            return(datalen >= STE_HELLO_SIZE && datalen <= STE_HELLO_MAX && (datalen & 3) == 0);
+        case STE_MSG_AGG:
+        case STE_MSG_CAGG:
+        case STE_MSG_HAGG:
+            return(datalen >= 4 && datalen <= (int)(STE_MSG_MAX - sizeof(stehead_t)));
+        case STE_MSG_ZAGG:
+            return(datalen > STE_LZ_HDRSIZE && datalen <= (int)(STE_MSG_MAX - sizeof(stehead_t)));
+        case STE_MSG_SEAL:
+            return(datalen >= STE_SEAL_OVERHEAD + 4 && datalen <= (int)(STE_MSG_MAX - sizeof(stehead_t)));
+        case STE_MSG_MUX:
+            return(datalen >= STE_MUX_HDRSIZE + 4 && datalen <= (int)(STE_MSG_MAX - sizeof(stehead_t)));
+        case STE_MSG_PING:
+            return(datalen >= STE_PING_LEN && datalen <= 4 * STE_PING_LEN && (datalen & 3) == 0);
+        case STE_MSG_CREDIT:
+            return(datalen >= STE_CREDIT_LEN && datalen <= 4 * STE_CREDIT_LEN && (datalen & 3) == 0);
+        default:
+            return(0);
+    }
+}
+
+/*****************************************************************************
+ * ste_rx_headsize()
+ *
+ * 受信中のヘッダのサイズを返す。先頭 byte が同期ワードなら stehead2_t、
+ * そうでなければ stehead_t。
+ *
+ *  引数：
+ *           rx : 受信の状態
+ * 戻り値：
+ *          ヘッダのサイズ
+ *****************************************************************************/
+static int
+ste_rx_headsize(ste_rx_t *rx)
+{
+    if(rx->headlen > 0 && rx->hbuf[0] == STE_SYNC_M0)
+        return(sizeof(stehead2_t));
+    return(sizeof(stehead_t));
+}
+
+/*****************************************************************************
+ * ste_rx_decode()
+ *
+ * 受信したヘッダを確認し、rx に本体のサイズなどをセットする。
+ *
+ *  引数：
+ *           rx : 受信の状態
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (同期ワード, CRC, len, orglen のいずれかが不正)
+ *****************************************************************************/
+static int
+ste_rx_decode(ste_rx_t *rx)
+{
+    stehead_t  steh;
+    stehead2_t steh2;
+
+    if(rx->hbuf[0] != STE_SYNC_M0){
+        /* v2 のヘッダを受信した後の v1 のヘッダは壊れているとみなす */
+        if(rx->sync)
+            return(-1);
+        memcpy(&steh, rx->hbuf, sizeof(stehead_t));
+        rx->datalen = ntohl(steh.len);
+        rx->orglen = ntohl(steh.orglen);
+        rx->flags = 0;
+    } else {
+        memcpy(&steh2, rx->hbuf, sizeof(stehead2_t));
+        if(steh2.magic[1] != STE_SYNC_M1 || steh2.magic[2] != STE_SYNC_M2)
+            return(-1);
+        if(ste_crc32c(0, rx->hbuf, offsetof(stehead2_t, hcrc)) != ntohl(steh2.hcrc))
+            return(-1);
+        rx->datalen = ntohl(steh2.len);
+        rx->orglen = ntohl(steh2.orglen);
+        rx->flags = steh2.flags;
+        rx->pcrc = ntohl(steh2.pcrc);
+        rx->sync = 1;
+    }
+    if(ste_rx_valid(rx->datalen, rx->orglen, rx->mtu) == 0)
+        return(-1);
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_rx_scan()
+ *
+ * 受信データから次の同期ワードを探す。memchr() で先頭 byte を探し、続く
+ * 2 byte を確認する。受信データの末尾で途切れた候補も見つかったものとする
+ * （ヘッダの CRC で確認する）。
+ *
+ *  引数：
+ *           rx    : 受信の状態
+ *           datap : 未処理の受信データへのポインタ。候補の位置まで進める
+ *           cntp  : 未処理の受信データのサイズ
+ * 戻り値：
+ *          1 : 候補が見つかった。rx はヘッダを受信する状態になる
+ *          0 : 見つからなかった（全て捨てた）
+ *****************************************************************************/
+static int
+ste_rx_scan(ste_rx_t *rx, unsigned char **datap, int *cntp)
+{
+    unsigned char *p = *datap;
+    unsigned char *q;
+    int            cnt = *cntp;
+
+    while(cnt > 0){
+        if((q = (unsigned char *)memchr(p, STE_SYNC_M0, cnt)) == NULL){
+            rx->discard += cnt;
+            p += cnt;
+            cnt = 0;
+            break;
+        }
+        rx->discard += q - p;
+        cnt -= q - p;
+        p = q;
+        if((cnt < 2 || p[1] == STE_SYNC_M1) && (cnt < 3 || p[2] == STE_SYNC_M2)){
+            rx->state = STE_RX_HEAD;
+            rx->headlen = 0;
+            *datap = p;
+            *cntp = cnt;
+            return(1);
+        }
+        p++;
+        cnt--;
+        rx->discard++;
+    }
+    *datap = p;
+    *cntp = cnt;
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_rx_next()
+ *
+ * 受信データからメッセージを 1 つ取り出す。
+ *
+ * ヘッダが壊れていた場合、v2 なら壊れたヘッダの 2 byte 目から同期ワードを
+ * 探し直す（次の呼び出しで）。v1 では次のヘッダの位置がわからないので、
+ * 今回の受信データの残りを全て捨てる。本体の CRC が合わなかった場合は
+ * そのメッセージだけを捨てる（ヘッダの CRC は合っているので同期は保たれる）。
+ *
+ *  引数：
+ *           rx    : 受信の状態
+ *           datap : 未処理の受信データへのポインタ。消費した分だけ進める
+ *           cntp  : 未処理の受信データのサイズ。消費した分だけ減らす
+ *           msg   : 取り出したメッセージ
+ * 戻り値：
+ *          1  : メッセージを取り出した
+ *          0  : メッセージを完成させるにはデータが足りない（全て消費した）
+ *          -1 : ヘッダか本体が壊れていたので捨てた。捨てたサイズは rx->discard、
+ *               壊れたヘッダの orglen は rx->orglen に残る。呼び出し元は
+ *               そのまま次のメッセージの取り出しを続けてよい
+ *****************************************************************************/
+int
+ste_rx_next(ste_rx_t *rx, unsigned char **datap, int *cntp, ste_msg_t *msg)
+{
+    unsigned char *p = *datap;
+    int            cnt = *cntp;
+    unsigned char *head;   /* ヘッダが丸ごと今回の受信データにある場合はその先頭 */
+    int            need;
+    int            n;
+
+    rx->discard = 0;
+
+    if(rx->state == STE_RX_RESYNC && ste_rx_scan(rx, &p, &cnt) == 0)
+        goto more;
+
+    if(rx->state == STE_RX_HEAD){
+        head = (rx->headlen == 0) ? p : NULL;
+        /* ヘッダの先頭 byte を受信するまでサイズが決まらないので 2 回まわる */
+        for(;;){
+            need = ste_rx_headsize(rx);
+            n = need - rx->headlen;
+            if(n > cnt)
+                n = cnt;
+            memcpy(rx->hbuf + rx->headlen, p, n);
+            rx->headlen += n;
+            p += n;
+            cnt -= n;
+            if(rx->headlen < need)
+                goto more;
+            if(need == ste_rx_headsize(rx))
+                break;
+        }
+
+        if(ste_rx_decode(rx) < 0){
+            rx->headlen = 0;
+            if(rx->sync){
+                rx->state = STE_RX_RESYNC;
+                if(head != NULL){
+                    /* 壊れたヘッダの中に次の同期ワードがあるかもしれない */
+                    cnt += (p - head) - 1;
+                    p = head + 1;
+                    rx->discard = 1;
+                } else {
+                    rx->discard = need;
+                }
+            } else {
+                rx->discard = need + cnt;
+                p += cnt;
+                cnt = 0;
+            }
+            *datap = p;
+            *cntp = cnt;
+            return(-1);
+        }
+
+        rx->dataleft = rx->datalen;
+        rx->state = STE_RX_BODY;
+        if(cnt >= rx->datalen){
+            /* 本体が丸ごと受信データの中にある。コピーしない */
+            msg->body = p;
+            p += rx->datalen;
+            cnt -= rx->datalen;
+            goto done;
+        }
+    }
+
+    n = (cnt < rx->dataleft) ? cnt : rx->dataleft;
+    memcpy(rx->buf + (rx->datalen - rx->dataleft), p, n);
+    rx->dataleft -= n;
+    p += n;
+    cnt -= n;
+    if(rx->dataleft > 0)
+        goto more;
+    msg->body = rx->buf;
+
+  done:
+    rx->state = STE_RX_HEAD;
+    rx->headlen = 0;
+    *datap = p;
+    *cntp = cnt;
+    if((rx->flags & STE_HF_PCRC) && ste_crc32c(0, msg->body, rx->datalen) != rx->pcrc){
+        rx->discard = rx->datalen;
+        return(-1);
+    }
+    msg->type = rx->orglen;
+    msg->len = (rx->orglen > 0) ? rx->orglen : rx->datalen;
+    return(1);
+
+  more:
+    *datap = p;
+    *cntp = cnt;
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_put_head()
+ *
+ * out にヘッダを書き込む。本体はヘッダの直後に書き込み済みであること
+ * （本体の CRC を計算するため）。sted_lz.c からも使う。
+ *
+ *  引数：
+ *           out     : 書き込み先
+ *           len     : パディングを含む本体のサイズ
+ *           orglen  : フレーム長もしくは STE_MSG_XXX
+ *           txflags : STE_TX_XXX
+ * 戻り値：
+ *          ヘッダのサイズ
+ *****************************************************************************/
+int
+ste_put_head(unsigned char *out, int len, int orglen, int txflags)
+{
+    stehead_t  steh;
+    stehead2_t steh2;
+
+    if((txflags & STE_TX_SYNC) == 0){
+        steh.len = htonl(len);
+        steh.orglen = htonl(orglen);
+        memcpy(out, &steh, sizeof(stehead_t));
+        return(sizeof(stehead_t));
+    }
+
+    steh2.magic[0] = STE_SYNC_M0;
+    steh2.magic[1] = STE_SYNC_M1;
+    steh2.magic[2] = STE_SYNC_M2;
+    steh2.flags = 0;
+    steh2.pcrc = 0;
+    if(txflags & STE_TX_PCRC){
+        steh2.flags |= STE_HF_PCRC;
+        steh2.pcrc = htonl(ste_crc32c(0, out + sizeof(stehead2_t), len));
+    }
+    steh2.len = htonl(len);
+    steh2.orglen = htonl(orglen);
+    steh2.hcrc = htonl(ste_crc32c(0, (unsigned char *)&steh2, offsetof(stehead2_t, hcrc)));
+    memcpy(out, &steh2, sizeof(stehead2_t));
+    return(sizeof(stehead2_t));
+}
+
+/*****************************************************************************
+ * ste_get_head()
+ *
+ * ste_put_head() で書き込んだヘッダを読む。組み立て済みのメッセージを
+ * 包み直す（sted_aead.c）ためのもの。
+ *
+ *  引数：
+ *           msg     : 組み立て済みのメッセージ
+ *           txflags : STE_TX_XXX
+ *           orglen  : フレーム長もしくは STE_MSG_XXX を返す
+ * 戻り値：
+ *          パディングを含む本体のサイズ
+ *****************************************************************************/
+int
+ste_get_head(unsigned char *msg, int txflags, int *orglen)
+{
+    stehead_t  steh;
+    stehead2_t steh2;
+
+    if((txflags & STE_TX_SYNC) == 0){
+        memcpy(&steh, msg, sizeof(stehead_t));
+        *orglen = ntohl(steh.orglen);
+        return(ntohl(steh.len));
+    }
+    memcpy(&steh2, msg, sizeof(stehead2_t));
+    *orglen = ntohl(steh2.orglen);
+    return(ntohl(steh2.len));
+}
+
+/*****************************************************************************
+ * ste_msg_put_frame()
+ *
+ * Ethernet フレームにヘッダとパディングを付けて書き込む。
+ *
+ *  引数：
+ *           out     : 書き込み先
+ *           frame   : Ethernet フレーム
+ *           len     : フレーム長
+ *           txflags : STE_TX_XXX
+ * 戻り値：
+ *          書き込んだサイズ
+ *****************************************************************************/
+int
+ste_msg_put_frame(unsigned char *out, unsigned char *frame, int len, int txflags)
+{
+    int hsize = STE_HEADSIZE(txflags);
+    int pad = 0;
+    int remain;
+
+    /* STE_MSG_CAGG で受け取った短いフレームは ETHERMIN に戻して送る */
+    len = ste_put_runt(out + hsize, frame, len);
+    if((remain = (hsize + len) % 4) != 0)
+        pad = 4 - remain;
+    memset(out + hsize + len, 0x0, pad);
+    ste_put_head(out, len + pad, len, txflags);
+    return(hsize + len + pad);
+}
+
+/*****************************************************************************
+ * ste_msg_put_hello()
+ *
+ * STE_MSG_HELLO を書き込む。ハンドシェイクの前なので常に stehead_t を使う。
+ * nonce と bundle も含めて送る。多重化するセグメントと、STE_CAP_RESUME の
+ * token があればその分長くなる（最大で sizeof(stehead_t) + STE_HELLO_MAX）。
+ *
+ *  引数：
+ *           out   : 書き込み先
+ *           hello : 送る内容
+ * 戻り値：
+ *          書き込んだサイズ
+ *****************************************************************************/
+int
+ste_msg_put_hello(unsigned char *out, ste_hello_t *hello)
+{
+    stehead_t      steh;
+    unsigned char *p = out + sizeof(stehead_t);
+    unsigned short nmtu = htons((unsigned short)hello->mtu);
+    unsigned int   nfeatures = htonl(hello->features);
+    unsigned int   nsegment = htonl(hello->segment);
+    unsigned int   nbundle = htonl(hello->bundle);
+    unsigned int   nseg;
+    unsigned int   nrx_seq = htonl(hello->rx_seq);
+    int            nsegs = (hello->nsegs < 1) ? 1 : hello->nsegs;
+    int            len;
+    int            i;
+    size_t         n;
+
+    len = STE_HELLO_LEN + 4 * (nsegs - 1);
+    if(hello->features & STE_CAP_RESUME)
+        len += STE_HELLO_RESUME;
+    steh.len = htonl(len);
+    steh.orglen = htonl((unsigned int)STE_MSG_HELLO);
+    memcpy(out, &steh, sizeof(stehead_t));
+
+    p[0] = (unsigned char)hello->version;
+    p[1] = (unsigned char)hello->role;
+    memcpy(p + 2, &nmtu, 2);
+    memcpy(p + 4, &nfeatures, 4);
+    memcpy(p + 8, &nsegment, 4);
+    n = strnlen(hello->client_id, STE_CLIENTID_MAX);
+    memcpy(p + 12, hello->client_id, n);
+    memset(p + 12 + n, 0x0, STE_CLIENTID_MAX - n);
+    memcpy(p + STE_HELLO_SIZE, hello->nonce, STE_HELLO_NONCE);
+    p += STE_HELLO_SIZE + STE_HELLO_NONCE;
+    memcpy(p, &nbundle, 4);
+    p[4] = (unsigned char)hello->link;
+    p[5] = (unsigned char)hello->nlinks;
+    p[6] = (unsigned char)nsegs;
+    p[7] = 0;
+    p += STE_HELLO_BUNDLE;
+    for(i = 1 ; i < nsegs ; i++){
+        nseg = htonl(hello->segs[i]);
+        memcpy(p, &nseg, 4);
+        p += 4;
+    }
+    if(hello->features & STE_CAP_RESUME){
+        memcpy(p, hello->token, STE_RESUME_TOKEN);
+        memcpy(p + STE_RESUME_TOKEN, &nrx_seq, 4);
+    }
+    return(sizeof(stehead_t) + len);
+}
+
+/*****************************************************************************
+ * ste_msg_get_hello()
+ *
+ * STE_MSG_HELLO の中身を取り出す。MTU は STE_FRAME_MAX に切り詰める。
+ * セグメントの一覧が不正（本体に収まっていない）なら segment だけにする。
+ * STE_CAP_RESUME の token が本体に収まっていなければ、features から
+ * STE_CAP_RESUME を落とす。
+ *
+ *  引数：
+ *           msg   : 受信した STE_MSG_HELLO
+ *           hello : 取り出した内容
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (バージョンか MTU が不正)
+ *****************************************************************************/
+int
+ste_msg_get_hello(ste_msg_t *msg, ste_hello_t *hello)
+{
+    unsigned char *p = msg->body;
+    unsigned short nmtu;
+    unsigned int   nfeatures;
+    unsigned int   nsegment;
+    unsigned int   nbundle;
+    unsigned int   nseg;
+    unsigned int   nrx_seq;
+    int            nsegs;
+    int            resume = 0;
+    int            i;
+
+    memcpy(&nmtu, p + 2, 2);
+    memcpy(&nfeatures, p + 4, 4);
+    memcpy(&nsegment, p + 8, 4);
+    hello->version = p[0];
+    hello->role = p[1];
+    hello->mtu = ntohs(nmtu);
+    hello->features = ntohl(nfeatures);
+    hello->segment = ntohl(nsegment);
+    memcpy(hello->client_id, p + 12, STE_CLIENTID_MAX);
+    hello->client_id[STE_CLIENTID_MAX] = '\0';
+    if(msg->len >= STE_HELLO_SIZE + STE_HELLO_NONCE)
+        memcpy(hello->nonce, p + STE_HELLO_SIZE, STE_HELLO_NONCE);
+    else
+        memset(hello->nonce, 0x0, STE_HELLO_NONCE);
+    hello->bundle = 0;
+    hello->link = 0;
+    hello->nlinks = 1;
+    hello->nsegs = 1;
+    hello->segs[0] = hello->segment;
+    memset(hello->token, 0x0, STE_RESUME_TOKEN);
+    hello->rx_seq = 0;
+    if(msg->len >= STE_HELLO_LEN){
+        p += STE_HELLO_SIZE + STE_HELLO_NONCE;
+        memcpy(&nbundle, p, 4);
+        hello->bundle = ntohl(nbundle);
+        hello->link = p[4];
+        hello->nlinks = p[5];
+        if(hello->nlinks == 0 || hello->link >= hello->nlinks)
+            hello->bundle = 0;
+        nsegs = p[6];
+        p += STE_HELLO_BUNDLE;
+        if(nsegs > 1 && nsegs <= STE_MUX_MAX && msg->len >= STE_HELLO_LEN + 4 * (nsegs - 1)){
+            for(i = 1 ; i < nsegs ; i++){
+                memcpy(&nseg, p, 4);
+                hello->segs[i] = ntohl(nseg);
+                p += 4;
+            }
+            hello->nsegs = nsegs;
+        }
+        /* セグメントの一覧が不正なら、その後ろの token の位置もわからない */
+        if((hello->features & STE_CAP_RESUME) && (nsegs <= 1 || hello->nsegs > 1) &&
+           msg->len >= STE_HELLO_LEN + 4 * (hello->nsegs - 1) + STE_HELLO_RESUME){
+            memcpy(hello->token, p, STE_RESUME_TOKEN);
+            memcpy(&nrx_seq, p + STE_RESUME_TOKEN, 4);
+            hello->rx_seq = ntohl(nrx_seq);
+            resume = 1;
+        }
+    }
+    if(!resume)
+        hello->features &= ~STE_CAP_RESUME;
+
+    if(hello->version == 0 || hello->mtu < ETHERMIN)
+        return(-1);
+    if(hello->mtu > STE_FRAME_MAX)
+        hello->mtu = STE_FRAME_MAX;
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_msg_put_ping()
+ *
+ * STE_MSG_PING を組み立てる。暗号化する場合は out の前後に
+ * STE_SEAL_HEADROOM, STE_SEAL_TAILROOM の空きを用意しておくこと。
+ *
+ *  引数：
+ *           out     : 書き込み先
+ *           kind    : STE_PING_XXX
+ *           stamp   : 送った時刻（返事ではリクエストの stamp）
+ *           txflags : STE_TX_XXX
+ * 戻り値：
+ *          書き込んだサイズ
+ *****************************************************************************/
+int
+ste_msg_put_ping(unsigned char *out, int kind, ste_uint64_t stamp, int txflags)
+{
+    unsigned char *p = out + STE_HEADSIZE(txflags);
+    int            i;
+
+    p[0] = (unsigned char)kind;
+    p[1] = p[2] = p[3] = 0;
+    for(i = 0 ; i < 8 ; i++)
+        p[4 + i] = (unsigned char)(stamp >> (56 - 8 * i));
+    return(ste_put_head(out, STE_PING_LEN, STE_MSG_PING, txflags) + STE_PING_LEN);
+}
+
+/*****************************************************************************
+ * ste_msg_get_ping()
+ *
+ * STE_MSG_PING の中身を取り出す。
+ *
+ *  引数：
+ *           msg   : 受信した STE_MSG_PING
+ *           kind  : STE_PING_XXX を返す
+ *           stamp : stamp を返す
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (知らない kind)
+ *****************************************************************************/
+int
+ste_msg_get_ping(ste_msg_t *msg, int *kind, ste_uint64_t *stamp)
+{
+    unsigned char *p = msg->body;
+    int            i;
+
+    *kind = p[0];
+    *stamp = 0;
+    for(i = 0 ; i < 8 ; i++)
+        *stamp = (*stamp << 8) | p[4 + i];
+    if(*kind != STE_PING_REQUEST && *kind != STE_PING_REPLY)
+        return(-1);
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_msg_put_credit()
+ *
+ * STE_MSG_CREDIT を組み立てる。暗号化する場合は out の前後に
+ * STE_SEAL_HEADROOM, STE_SEAL_TAILROOM の空きを用意しておくこと。
+ *
+ *  引数：
+ *           out     : 書き込み先
+ *           credit  : フレーム数とバイト数の上限、受け取ったフレーム数と
+ *                     バイト数の 4 つの値（sted_credit.h 参照）
+ *           txflags : STE_TX_XXX
+ * 戻り値：
+ *          書き込んだサイズ
+ *****************************************************************************/
+int
+ste_msg_put_credit(unsigned char *out, unsigned int *credit, int txflags)
+{
+    unsigned char *p = out + STE_HEADSIZE(txflags);
+    unsigned int   ncredit;
+    int            i;
+
+    for(i = 0 ; i < 4 ; i++){
+        ncredit = htonl(credit[i]);
+        memcpy(p + 4 * i, &ncredit, 4);
+    }
+    return(ste_put_head(out, STE_CREDIT_LEN, STE_MSG_CREDIT, txflags) + STE_CREDIT_LEN);
+}
+
+/*****************************************************************************
+ * ste_msg_get_credit()
+ *
+ * STE_MSG_CREDIT の中身を取り出す。
+ *
+ *  引数：
+ *           msg    : 受信した STE_MSG_CREDIT
+ *           credit : 4 つの値を返す
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (本体が短い)
+ *****************************************************************************/
+int
+ste_msg_get_credit(ste_msg_t *msg, unsigned int *credit)
+{
+    unsigned int ncredit;
+    int          i;
+
+    if(msg->len < STE_CREDIT_LEN)
+        return(-1);
+    for(i = 0 ; i < 4 ; i++){
+        memcpy(&ncredit, msg->body + 4 * i, 4);
+        credit[i] = ntohl(ncredit);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_put_runt()
+ *
+ * フレームを out にコピーする。ETHERMIN より短ければ 0 でパディングする。
+ *
+ *  引数：
+ *           out   : 書き込み先
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ * 戻り値：
+ *          書き込んだサイズ
+ *****************************************************************************/
+static int
+ste_put_runt(unsigned char *out, unsigned char *frame, int len)
+{
+    memcpy(out, frame, len);
+    if(len >= ETHERMIN)
+        return(len);
+    memset(out + len, 0x0, ETHERMIN - len);
+    return(ETHERMIN);
+}
+
+/*****************************************************************************
+ * ste_frame_trim()
+ *
+ * ste ドライバが ETHERMIN までパディングしたフレームから、末尾のパディングを
+ * 取り除いた長さを返す。本来の長さは IPv4/IPv6/ARP のヘッダから求め、
+ * パディングが全て 0 の場合だけ取り除く（受信側で 0 を詰めて元に戻すため）。
+ *
+ *  引数：
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ * 戻り値：
+ *          パディングを取り除いた長さ（取り除けなければ len）
+ *****************************************************************************/
+int
+ste_frame_trim(unsigned char *frame, int len)
+{
+    int off = 12;
+    int type;
+    int real;
+    int i;
+
+    if(len > ETHERMIN || len < 14)
+        return(len);
+
+    type = (frame[off] << 8) | frame[off + 1];
+    if(type == 0x8100 && len >= 18){
+        /* VLAN タグ */
+        off += 4;
+        type = (frame[off] << 8) | frame[off + 1];
+    }
+    off += 2;
+
+    switch(type){
+        case 0x0800: /* IPv4: total length */
+            if(len < off + 4)
+                return(len);
+            real = off + ((frame[off + 2] << 8) | frame[off + 3]);
+            break;
+        case 0x86DD: /* IPv6: 固定ヘッダ + payload length */
+            if(len < off + 6)
+                return(len);
+            real = off + 40 + ((frame[off + 4] << 8) | frame[off + 5]);
+            break;
+        case 0x0806: /* ARP (Ethernet/IPv4) */
+            real = off + 28;
+            break;
+        default:
+            return(len);
+    }
+    if(real <= off || real >= len)
+        return(len);
+
+    for(i = real ; i < len ; i++)
+        if(frame[i] != 0)
+            return(len);
+    return(real);
+}
+
+/*****************************************************************************
+ * ste_flow_hash()
+ *
+ * フレームが属するフローのハッシュを返す。同じフローのフレームは同じリンク
+ * で送って順番を保つため、TCP/UDP なら IP アドレスとポート番号、それ以外の
+ * IP なら IP アドレスとプロトコル、IP 以外なら MAC アドレスと EtherType
+ * から求める。フラグメントはポート番号が無いので IP アドレスまでにする。
+ *
+ *  引数：
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ * 戻り値：
+ *          ハッシュ値
+ *****************************************************************************/
+unsigned int
+ste_flow_hash(unsigned char *frame, int len)
+{
+    unsigned int   h = 2166136261U;  /* FNV-1a */
+    unsigned char *key;
+    int            keylen;
+    int            off = 12;
+    int            type;
+    int            proto = -1;
+    int            l4 = 0;
+    int            i;
+
+    if(len < 14)
+        return(0);
+
+    type = (frame[off] << 8) | frame[off + 1];
+    if(type == 0x8100 && len >= 18){
+        /* VLAN タグ */
+        off += 4;
+        type = (frame[off] << 8) | frame[off + 1];
+    }
+    off += 2;
+
+    if(type == 0x0800 && len >= off + 20 && (frame[off] >> 4) == 4){
+        /* IPv4: 送信元と宛先のアドレス。MF が立っているかオフセットがあればフラグメント */
+        key = frame + off + 12;
+        keylen = 8;
+        proto = frame[off + 9];
+        if((((frame[off + 6] << 8) | frame[off + 7]) & 0x3fff) == 0)
+            l4 = off + (frame[off] & 0x0f) * 4;
+    } else if(type == 0x86DD && len >= off + 40){
+        /* IPv6: 拡張ヘッダは辿らない */
+        key = frame + off + 8;
+        keylen = 32;
+        proto = frame[off + 6];
+        l4 = off + 40;
+    } else {
+        key = frame;
+        keylen = off;
+    }
+
+    for(i = 0 ; i < keylen ; i++)
+        h = (h ^ key[i]) * 16777619U;
+    if(proto >= 0){
+        h = (h ^ (unsigned int)proto) * 16777619U;
+        /* TCP, UDP, SCTP のポート番号 */
+        if((proto == 6 || proto == 17 || proto == 132) && l4 > 0 && len >= l4 + 4)
+            for(i = 0 ; i < 4 ; i++)
+                h = (h ^ frame[l4 + i]) * 16777619U;
+    }
+    /* 下位のビットで剰余をとるので、上位のビットも混ぜておく */
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    return(h);
+}
+
+/*****************************************************************************
+ * ste_agg_parse()
+ *
+ * STE_MSG_AGG もしくは STE_MSG_CAGG を解析し、含まれるフレームの位置と長さ
+ * を返す。STE_MSG_CAGG のフレームは ETHERMIN より短いことがあるので、
+ * ste ドライバに渡す前に ETHERMIN までパディングすること。
+ * STE_MSG_HAGG は ste_hc_parse() で解析する。
+ *
+ *  引数：
+ *           msg    : 受信した STE_MSG_AGG もしくは STE_MSG_CAGG
+ *           frames : フレームの先頭へのポインタを返す(STE_AGG_MAX_FRAMES 個分)
+ *           lens   : フレーム長を返す(STE_AGG_MAX_FRAMES 個分)
+ *           mtu    : 受け付けるフレーム長の上限
+ * 戻り値：
+ *          正常時 : フレーム数
+ *          障害時 : -1 (count や len の表が本体のサイズと合わない)
+ *****************************************************************************/
+int
+ste_agg_parse(ste_msg_t *msg, unsigned char **frames, int *lens, int mtu)
+{
+    unsigned char *p = msg->body;
+    int            count;
+    int            off;
+    int            len;
+    int            i;
+
+    if(msg->type == STE_MSG_CAGG){
+        /* 可変長の長さ + フレームの繰り返し。長さ 0 は末尾のパディング */
+        off = 0;
+        for(count = 0 ; off < msg->len ; count++){
+            len = p[off] & 0x7f;
+            if(p[off++] & 0x80){
+                if(off >= msg->len)
+                    return(-1);
+                len |= (p[off++] & 0x7f) << 7;
+            }
+            if(len == 0)
+                break;
+            if(count >= STE_AGG_MAX_FRAMES || len > mtu || off + len > msg->len)
+                return(-1);
+            frames[count] = p + off;
+            lens[count] = len;
+            off += len;
+        }
+        return(count);
+    }
+
+    count = (p[0] << 8) | p[1];
+    off = 2 + 2 * count;
+    if(count > STE_AGG_MAX_FRAMES || off > msg->len)
+        return(-1);
+
+    for(i = 0 ; i < count ; i++){
+        lens[i] = (p[2 + 2 * i] << 8) | p[3 + 2 * i];
+        if(lens[i] == 0 || lens[i] > mtu || off + lens[i] > msg->len)
+            return(-1);
+        frames[i] = p + off;
+        off += lens[i];
+    }
+    return(count);
+}
+
+/*****************************************************************************
+ * ste_agg_reset()
+ *
+ * STE_MSG_AGG の組み立てを最初からやり直す。compact, hc, mux, chan はそのまま。
+ *
+ *  引数：
+ *           agg : 組み立て中の STE_MSG_AGG
+ *****************************************************************************/
+void
+ste_agg_reset(ste_agg_t *agg)
+{
+    agg->count = 0;
+    agg->datalen = 0;
+}
+
+/*****************************************************************************
+ * ste_agg_add()
+ *
+ * STE_MSG_AGG にフレームを詰める。agg->compact が立っていれば STE_MSG_CAGG
+ * の形式（可変長の長さ + パディングを取り除いたフレーム）で、agg->hc が
+ * 設定されていれば STE_MSG_HAGG の形式（ヘッダを圧縮したエントリ）で詰める。
+ * 詰めたデータの合計が agg->maxbytes を超える場合は詰めない。ただし最初の
+ * フレームは（STE_AGG_MAX_BYTES までなら）必ず詰める。
+ *
+ *  引数：
+ *           agg   : 組み立て中の STE_MSG_AGG
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (上限に達していて詰められない。ste_agg_seal() して送ること)
+ *****************************************************************************/
+int
+ste_agg_add(ste_agg_t *agg, unsigned char *frame, int len)
+{
+    unsigned char *p = agg->buf + STE_AGG_DATA + agg->datalen;
+    int            need;
+    int            room;
+
+    if(agg->hc != NULL){
+        if(agg->count >= STE_AGG_MAX_FRAMES)
+            return(-1);
+        room = (agg->count == 0) ? STE_AGG_MAX_BYTES : agg->maxbytes;
+        if((need = ste_hc_put(agg->hc, p, room - agg->datalen, frame, len)) < 0)
+            return(-1);
+        agg->lens[agg->count++] = (unsigned short)need;
+        agg->datalen += need;
+        return(0);
+    }
+
+    if(agg->compact){
+        len = ste_frame_trim(frame, len);
+        need = (len < 0x80) ? 1 + len : 2 + len;
+    } else {
+        need = (len < ETHERMIN) ? ETHERMIN : len;
+    }
+    if(agg->count >= STE_AGG_MAX_FRAMES || agg->datalen + need > STE_AGG_MAX_BYTES)
+        return(-1);
+    if(agg->count > 0 && agg->datalen + need > agg->maxbytes)
+        return(-1);
+
+    if(agg->compact){
+        if(len < 0x80){
+            *p++ = (unsigned char)len;
+        } else {
+            *p++ = (unsigned char)(0x80 | (len & 0x7f));
+            *p++ = (unsigned char)(len >> 7);
+        }
+        memcpy(p, frame, len);
+    } else {
+        ste_put_runt(p, frame, len);
+    }
+    agg->lens[agg->count++] = (unsigned short)need;
+    agg->datalen += need;
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_agg_seal()
+ *
+ * 詰めたフレームの直前にヘッダを書き、末尾をパディングして STE_MSG_AGG を
+ * 完成させる。agg->mux が立っていれば、さらにその前に STE_MSG_MUX の
+ * ヘッダを書く。送信し終わったら ste_agg_reset() すること。
+ *
+ *  引数：
+ *           agg     : 組み立て中の STE_MSG_AGG
+ *           msglen  : 完成したメッセージのサイズを返す
+ *           txflags : STE_TX_XXX
+ * 戻り値：
+ *          完成したメッセージの先頭
+ *****************************************************************************/
+unsigned char *
+ste_agg_seal(ste_agg_t *agg, int *msglen, int txflags)
+{
+    unsigned char *start;
+    unsigned char *p;
+    int            hsize = STE_HEADSIZE(txflags);
+    int            msize = agg->mux ? STE_MUX_HDRSIZE : 0;
+    int            hdrlen;
+    int            bodylen;
+    int            type;
+    int            pad = 0;
+    int            i;
+
+    if(agg->compact || agg->hc != NULL){
+        /* 長さはフレームの直前に入っているので表は無い */
+        type = (agg->hc != NULL) ? STE_MSG_HAGG : STE_MSG_CAGG;
+        hdrlen = hsize + msize;
+        start = agg->buf + STE_AGG_DATA - hdrlen;
+        bodylen = msize + agg->datalen;
+        if((bodylen & 3) != 0)
+            pad = 4 - (bodylen & 3);
+        memset(agg->buf + STE_AGG_DATA + agg->datalen, 0x0, pad);
+        p = start + hsize;
+    } else {
+        type = STE_MSG_AGG;
+        hdrlen = hsize + msize + 2 + 2 * agg->count;
+        start = agg->buf + STE_AGG_DATA - hdrlen;
+        bodylen = hdrlen - hsize + agg->datalen;
+        if((bodylen & 3) != 0)
+            pad = 4 - (bodylen & 3);
+        memset(agg->buf + STE_AGG_DATA + agg->datalen, 0x0, pad);
+        p = start + hsize + msize;
+        *p++ = (unsigned char)(agg->count >> 8);
+        *p++ = (unsigned char)agg->count;
+        for(i = 0 ; i < agg->count ; i++){
+            *p++ = (unsigned char)(agg->lens[i] >> 8);
+            *p++ = (unsigned char)agg->lens[i];
+        }
+        p = start + hsize;
+    }
+
+    if(agg->mux){
+        p[0] = (unsigned char)(-type);
+        p[1] = 0;
+        p[2] = 0;
+        p[3] = 0;
+        p[4] = (unsigned char)(agg->chan >> 24);
+        p[5] = (unsigned char)(agg->chan >> 16);
+        p[6] = (unsigned char)(agg->chan >> 8);
+        p[7] = (unsigned char)agg->chan;
+        type = STE_MSG_MUX;
+    }
+    ste_put_head(start, bodylen + pad, type, txflags);
+
+    *msglen = hsize + bodylen + pad;
+    return(start);
+}
+
+/*****************************************************************************
+ * ste_mux_open()
+ *
+ * STE_MSG_MUX からセグメント番号と中のメッセージを取り出す。中のメッセージ
+ * の本体は msg の本体を指す（コピーしない）。
+ *
+ *  引数：
+ *           msg     : 受信した STE_MSG_MUX
+ *           inner   : 中のメッセージ（STE_MSG_AGG, STE_MSG_CAGG, STE_MSG_HAGG）を返す
+ *           segment : セグメント番号を返す
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (中のメッセージの種類が不正)
+ *****************************************************************************/
+int
+ste_mux_open(ste_msg_t *msg, ste_msg_t *inner, unsigned int *segment)
+{
+    unsigned char *p = msg->body;
+    int            type = -(int)p[0];
+
+    if(type != STE_MSG_AGG && type != STE_MSG_CAGG && type != STE_MSG_HAGG)
+        return(-1);
+    *segment = ((unsigned int)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+    inner->type = type;
+    inner->body = p + STE_MUX_HDRSIZE;
+    inner->len = msg->len - STE_MUX_HDRSIZE;
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_crc_init()
+ *
+ * CRC32C のテーブルを作り、crc32 命令が使えるかどうかを確認する。
+ *****************************************************************************/
+static void
+ste_crc_init(void)
+{
+    unsigned int c;
+    int          i, j;
+
+    for(i = 0 ; i < 256 ; i++){
+        c = i;
+        for(j = 0 ; j < 8 ; j++)
+            c = (c & 1) ? (c >> 1) ^ STE_CRC32C_POLY : (c >> 1);
+        ste_crc_table[i] = c;
+    }
+#ifdef STE_CRC_HW
+    ste_crc_use_hw = STE_CRC_HW_CHECK();
+#endif
+    ste_crc_inited = 1;
+}
+
+#ifdef STE_CRC_HW
+/*****************************************************************************
+ * ste_crc32c_hw()
+ *
+ * SSE4.2 の crc32 命令で CRC32C を計算する。
+ *****************************************************************************/
+static STE_CRC_TARGET unsigned int
+ste_crc32c_hw(unsigned int crc, unsigned char *p, int len)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    ste_uint64_t     v64;
+#endif
+    unsigned int     v;
+
+#if defined(_M_X64) || defined(__x86_64__)
+    while(len >= 8){
+        memcpy(&v64, p, 8);
+        crc = (unsigned int)_mm_crc32_u64(crc, v64);
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while(len >= 4){
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while(len-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+    return(crc);
+}
+#endif
+
+/*****************************************************************************
+ * ste_crc32c()
+ *
+ * CRC32C（Castagnoli）を計算する。
+ *
+ *  引数：
+ *           crc  : 前回までの CRC（最初は 0）
+ *           p    : データ
+ *           len  : データのサイズ
+ * 戻り値：
+ *          CRC32C
+ *****************************************************************************/
+unsigned int
+ste_crc32c(unsigned int crc, unsigned char *p, int len)
+{
+    if(ste_crc_inited == 0)
+        ste_crc_init();
+
+    crc = ~crc;
+#ifdef STE_CRC_HW
+    if(ste_crc_use_hw)
+        return(~ste_crc32c_hw(crc, p, len));
+#endif
+    while(len-- > 0)
+        crc = ste_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return(~crc);
+}
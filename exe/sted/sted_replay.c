@@ -0,0 +1,172 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_replay.c
+ *
+ * セッションの再開（STE_CAP_RESUME）で送り直すフレームのリング。
+ * stehub から ..\sted\sted_replay.c としてコンパイルされる。
+ *
+ *  o フレームデータは buf に先頭から詰め、末尾に収まらなければ先頭に
+ *    戻る。空きが足りなければ古いフレームから捨てる。
+ *  o 受信側の rx_seq と比べて、送り直すフレームの数を決める。
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include "sted_replay.h"
+
+/*****************************************************************************
+ * ste_replay_reset()
+ *
+ * リングを空にし、通し番号を 0 に戻す。新しいセッションを始める時に呼ぶ。
+ *****************************************************************************/
+void
+ste_replay_reset(ste_replay_t *r)
+{
+    r->tx_seq = 0;
+    r->rx_seq = 0;
+    r->head = 0;
+    r->count = 0;
+    r->wpos = 0;
+}
+
+/*****************************************************************************
+ * ste_replay_push()
+ *
+ * 送ったフレームをリングに入れ、tx_seq を進める。
+ *
+ *  引数：
+ *           r     : リング
+ *           chan  : フレームの ste デバイスの番号（stehub ではセグメント番号）
+ *           frame : Ethernet フレーム
+ *           len   : フレーム長
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_replay_push(ste_replay_t *r, unsigned int chan, unsigned char *frame, int len)
+{
+    ste_replay_ent_t *ent;
+    int               tail;
+
+    r->tx_seq++;
+    if(len <= 0 || len >= STE_REPLAY_BYTES){
+        /* 入らないフレームより前のものは、送り直すと順番が変わるので捨てる */
+        r->count = 0;
+        return;
+    }
+
+    /*
+     * 使っている領域は、折り返していなければ [tail, wpos)、折り返して
+     * いれば [tail, 末尾) と [0, wpos)。wpos が tail に追いつかないように
+     * するので、wpos == tail なら空。
+     */
+    for(;;){
+        if(r->count == 0){
+            r->head = 0;
+            r->wpos = 0;
+            break;
+        }
+        if(r->count < STE_REPLAY_FRAMES){
+            tail = r->ent[r->head].off;
+            if(r->wpos >= tail){
+                if(r->wpos + len <= STE_REPLAY_BYTES)
+                    break;
+                if(len < tail){
+                    r->wpos = 0;
+                    break;
+                }
+            } else if(r->wpos + len < tail){
+                break;
+            }
+        }
+        r->head = (r->head + 1) % STE_REPLAY_FRAMES;
+        r->count--;
+    }
+
+    ent = &r->ent[(r->head + r->count) % STE_REPLAY_FRAMES];
+    ent->off = r->wpos;
+    ent->len = len;
+    ent->chan = chan;
+    memcpy(r->buf + r->wpos, frame, len);
+    r->wpos += len;
+    r->count++;
+}
+
+/*****************************************************************************
+ * ste_replay_start()
+ *
+ * 再開したセッションで送り直すフレームの数を求める。相手がまだ受け取って
+ * いないフレームのうち、リングに残っているもの。リングから溢れたものが
+ * あれば、送り直した後に相手の rx_seq と tx_seq が一致するように tx_seq を
+ * 戻す。
+ *
+ *  引数：
+ *           r       : リング
+ *           peer_rx : 相手が受け取ったフレームの数（相手の rx_seq）
+ * 戻り値：
+ *           送り直すフレームの数。ste_replay_get() で取り出す
+ *****************************************************************************/
+int
+ste_replay_start(ste_replay_t *r, unsigned int peer_rx)
+{
+    unsigned int n = r->tx_seq - peer_rx;
+
+    if(n > 0x7fffffff){
+        /* 送った数より多く受け取っている。相手の数え方に合わせる */
+        r->tx_seq = peer_rx;
+        return(0);
+    }
+    if(n > (unsigned int)r->count){
+        r->tx_seq = peer_rx + r->count;
+        n = r->count;
+    }
+    return((int)n);
+}
+
+/*****************************************************************************
+ * ste_replay_get()
+ *
+ * 送り直すフレームを古い順に取り出す。
+ *
+ *  引数：
+ *           r     : リング
+ *           n     : ste_replay_start() が返した数
+ *           k     : 何番目のフレームか（0 から n - 1）
+ *           chan  : フレームの ste デバイスの番号（セグメント番号）を返す
+ *           len   : フレーム長を返す
+ * 戻り値：
+ *           フレームの先頭
+ *****************************************************************************/
+unsigned char *
+ste_replay_get(ste_replay_t *r, int n, int k, unsigned int *chan, int *len)
+{
+    ste_replay_ent_t *ent;
+
+    ent = &r->ent[(r->head + r->count - n + k) % STE_REPLAY_FRAMES];
+    *chan = ent->chan;
+    *len = ent->len;
+    return(r->buf + ent->off);
+}
@@ -40,6 +40,55 @@
  *   2005/05/14
  *     o EAGAIN を EWOULDBLOCK に変更した。
  *     o Windows の為に sted_win.h に EWOULDBLOCK を define するようにした。
+ *   2026/10/19
+ *     o データパスのデバッグメッセージを print_err() からトレースに変更した。
+ *     o 接続毎の統計情報（送受信のカウンタ）を数えるようにした。
+ *     o STE_STAGE_ACCT 付きでビルドした場合、recv/解析/send の消費サイクルを計測する。
+ *     o 受信データの解析を ste_rx_next() に置き換え、制御メッセージと STE_MSG_AGG
+ *       を扱えるようにした。
+ *     o フレーミング v2（同期ワードと CRC32C 付きのヘッダ）に対応した。ヘッダが
+ *       壊れていても受信データの残りを全て捨てずに済むようになった。
+ *     o 接続直後に STE_MSG_HELLO でバージョンと機能をネゴシエートするようにした。
+ *     o 小さいフレーム向けの STE_MSG_CAGG に対応した。
+ *     o HUB と合意した MTU までのフレーム（ジャンボフレーム）を受け付けるようにした。
+ *     o -z を指定した場合、HUB との間のメッセージを LZ4 で圧縮するようにした。
+ *     o HUB が対応していれば、TCP/IPv4 のフレームのヘッダを圧縮して送受信する
+ *       ようにした（STE_MSG_HAGG）。
+ *     o -k を指定した場合、HUB との間のメッセージを ChaCha20-Poly1305 で暗号化・
+ *       認証するようにした（STE_MSG_SEAL）。
+ *     o -u を指定した場合、HUB との間を UDP で送受信するようにした。HUB から
+ *       返事が無ければ TCP に切り替える。
+ *     o 再接続時にポート番号が失われる問題を修正した（strtok() で引数の文字列
+ *       を書き換えていた）。
+ *     o -f を指定した場合、UDP のデータグラムに FEC のパリティを付けて送り、
+ *       失われたデータグラムを復元するようにした。
+ *     o -l を指定した場合、HUB との間に複数のリンクを張り、フレームをフロー毎に
+ *       振り分けて送るようにした（STE_CAP_STRIPE）。
+ *     o -i で複数の ste デバイスを指定した場合、HUB との接続に多重化して
+ *       送受信するようにした（STE_CAP_MUX）。
+ *     o HUB への名前解決と接続をブロックせずに行うようにした（sted_dial.c）。
+ *       IPv6 の HUB にも接続でき、IPv6 と IPv4 のアドレスには Happy Eyeballs
+ *       で並行して接続する。
+ *     o 接続できなかった場合と接続が切れた場合は、揺らぎ付きの指数
+ *       バックオフで待ってから再接続するようにした。sted は終了しない。
+ *     o TCP の HUB とはセッションの再開に合意し、接続が切れても送受信中の
+ *       フレームを失わずに再接続するようにした（STE_CAP_RESUME,
+ *       sted_replay.c）。
+ *     o ハートビートで HUB の死活を監視し、-h に複数指定した HUB の間で
+ *       フェイルオーバー・フェイルバックするようにした（sted_hb.c）。
+ *     o Proxy の CONNECT のレスポンスをブロックせずに読み進めるようにした。
+ *       分かれて届いたレスポンスを読み違える問題と、レスポンスの後ろに
+ *       続いていた HUB からのデータを捨てていた問題を修正した。select() の
+ *       タイムアウトを確認していなかった（if( ret = 0)）問題も無くなった。
+ *     o Proxy-Authorization（Basic 認証）と、-w で指定した数の予備のトンネルを
+ *       張っておく機能を追加した（sted_http.c）。
+ *     o HUB との TCP 接続の Nagle を止め、送受信の socket バッファを
+ *       帯域遅延積に合わせて調整するようにした（sted_tune.c）。
+ *     o HUB からのクレジットの範囲でだけフレームを送り、クレジットが無い間は
+ *       優先度毎のキューに溜めるようにした（STE_CAP_CREDIT, sted_credit.c）。
+ *     o クレジットを待つキューに FQ-CoDel と同様の AQM をかけ、滞留時間が
+ *       長くなったら大きなフローのフレームを捨てるか ECN の CE を付ける
+ *       ようにした（sted_aqm.c）。
  *    
  *****************************************************************************/
 
@@ -51,6 +100,7 @@
 #include <dbt.h>        /* for windows */
 #else
 #include <sys/socket.h>   
+#include <sys/uio.h>      
 #include <netdb.h>        
 #include <syslog.h>       
 #include <sys/ethernet.h> 
@@ -66,19 +116,42 @@
 #include <sys/stat.h>
 #include "ste.h"
 #include "sted.h"
+#include "sted_trace.h"
+#include "sted_probe.h"
+#include "sted_udp.h"
+#include "sted_dial.h"
+#include "sted_http.h"
+#include "sted_tune.h"
 
 #ifdef STE_WINDOWS
 extern WSAEVENT   EventArray[2]; // socket と ste ドライバ用の 2 つの Event の配列
 #endif
 
-extern int debuglevel;
-extern int write_ste(stedstat_t *);
+static int send_socket(stedstat_t *, unsigned char *, int);
+static int send_gather(stedstat_t *, unsigned char *, int, unsigned char *, int);
+static int flush_pending(stedstat_t *);
+static int queue_pending(stedstat_t *, unsigned char *, int);
+static int send_hello(stedstat_t *);
+static int recv_dgram(stedstat_t *, u_char *, int);
+static int parse_msgs(stedstat_t *, u_char *, int);
+static int find_adapter(stedstat_t *, unsigned int);
+static int resume_session(stedstat_t *, ste_hello_t *);
+static int next_hub(stedstat_t *);
+static void drop_socket(stedstat_t *);
+static void probe_primary(stedstat_t *, char *);
+static int open_tunnel(stedstat_t *, char *, int, char *, int, int *);
+static void keep_standby(stedstat_t *, char *);
+static void cancel_open(stedstat_t *);
 
 /*****************************************************************************
  * open_socket()
  * 
  * HUB(stehub) と TCP connection を確立し、Socket を返す。
  * Proxy サーバが指定されていれば、そちらと TCP connection を確立する。
+ * -u が指定されていて Proxy を経由しない場合は UDP の socket を返す。
+ * 名前解決と接続（Proxy 経由なら CONNECT のレスポンス）を待たずに戻るので、
+ * STE_DIAL_AGAIN が返ったら後でもう一度呼ぶ。ホスト名には IPv6 のアドレス
+ * （[] で囲む）も使える。
  *
  *  引数：
  *           stedstat: sted 管理用構造体
@@ -86,150 +159,728 @@ extern int write_ste(stedstat_t *);
  *           proxy   : Proxy のホスト名（と「:」でくぎられたポート番号）
  * 戻り値：
  *         成功時 :  ソケット番号
+ *         接続中 :  STE_DIAL_AGAIN
  *         失敗時 :  -1
  *****************************************************************************/
 int
 open_socket(stedstat_t *stedstat, char *hub, char *proxy)
 {
-    static	struct  sockaddr_in sin;
-    static	struct  hostent	   *hp;
-    char *hub_name, *proxy_name;
-    char *hub_port_string, *proxy_port_string;
-    int hub_port, proxy_port;
+    char  hub_entry[STE_DIAL_HOSTMAX];
+    char  hub_host[STE_DIAL_HOSTMAX];
+    char  proxy_host[STE_DIAL_HOSTMAX];
+    int   hub_port, proxy_port = 0;
     int   sock;
-    char *temp;
-    int nRtn;    
-
+    int   restlen = 0;
+    unsigned char connid[STE_UDP_HDRSIZE];
 #ifdef STE_WINDOWS    
+    static int wsa_started = 0;
     WSADATA wsaData;
-    nRtn = WSAStartup(MAKEWORD(1, 1), &wsaData);        
+
+    if(!wsa_started && WSAStartup(MAKEWORD(2, 2), &wsaData) == 0)
+        wsa_started = 1;
 #endif
 
-    memset((char *) &sin,0,sizeof(sin));
-    if((hub_name = strtok(hub, ":")) == NULL){
+    /*
+     * 再接続でも使うので、引数の文字列は書き換えない。
+     * 正しい形式かどうかは起動時に確認してある。
+     * 複数の HUB が指定されていれば、hub_index 番目の HUB に接続する。
+     */
+    if(ste_dial_pick(hub, stedstat->hub_index, hub_entry, sizeof(hub_entry)) < 0 ||
+       ste_dial_parse(hub_entry, hub_host, sizeof(hub_host), &hub_port) < 0){
         print_err(LOG_ERR, "hub name was not given\n");
         return(-1);
     }
-    if((hub_port_string = strtok(NULL, ":")) == NULL){
-        hub_port = PORT_NO;
-    } else {
-        hub_port = atoi(hub_port_string);
-    }
     
     /*
      * stedstat 構造体に hub のホスト名、ポート番号を記録
      */
-    strncpy(stedstat->hub_name, hub_name, MAXHOSTNAME);
+    strncpy(stedstat->hub_name, hub_host, MAXHOSTNAME - 1);
     stedstat->hub_port = hub_port;
 
     if( proxy == NULL){
-        /*
-         * proxy が指定されていないので、直接 仮想ハブホストに接続詞に行くため
-         * に仮想ハブホストの hostent 得る。
-         */
-        if(( hp = gethostbyname(hub_name)) == NULL) {
-            print_err(LOG_ERR,"hostname %s not found.\n",hub_name);
-            return(-1);
-        }
-        /*
-         * sockaddr_in の sin_port に 仮想ハブホストのポート番号をセット
-         */        
-        sin.sin_port	= htons((short)hub_port);
         /*
          * stedstat 構造体の proxy には NULL をセット
          */
-
         memset(stedstat->proxy_name, 0x0, MAXHOSTNAME);
-        
         stedstat->proxy_port = 0;
     } else {
         /*
          * proxy が指定されているので、proxy に接続しにいく必要がある。
-         * proxy サーバの hostent 得る。
+         * stedstat 構造体に proxy サーバのホスト名、ポート番号を記録
          */
-        if((proxy_name = strtok(proxy, ":")) == NULL){
+        if(ste_dial_parse(proxy, proxy_host, sizeof(proxy_host), &proxy_port) < 0){
             print_err(LOG_ERR,"proxy name was not given\n");
             return(-1);
         }
-        if((proxy_port_string = strtok(NULL, ":")) == NULL){
-            proxy_port = PORT_NO;
-        } else {
-            proxy_port = atoi(proxy_port_string);
-        }
-        if(( hp = gethostbyname(proxy_name)) == NULL) {
-            print_err(LOG_ERR,"hostname %s not found.\n",proxy_name);
-            return(-1);
-        }
-        /*
-         * sockaddr_in の sin_port に proxy サーバのポート番号をセット
-         */
-        sin.sin_port	= htons((short)proxy_port);
-        /*
-         * stedstat 構造体に proxy サーバのホスト名、ポート番号を記録
-         */
-        strncpy(stedstat->proxy_name, proxy_name, MAXHOSTNAME);
+        strncpy(stedstat->proxy_name, proxy_host, MAXHOSTNAME - 1);
         stedstat->proxy_port = proxy_port;
     }
-    
-    memcpy((char *)&sin.sin_addr,hp->h_addr,hp->h_length);
-    sin.sin_family = AF_INET;
 
-    if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        SET_ERRNO();
-        print_err(LOG_ERR, "socket:%s\n", strerror(errno));
-        return(-1);
-    }
-
-    if(connect(sock,(struct sockaddr *)&sin, sizeof sin) < 0) {
-        SET_ERRNO();
-        print_err(LOG_ERR, "connect: %s\n", strerror(errno));        
-        return(-1);
-    }
+    /*
+     * 名前解決と connect() はブロックせずに進める（sted_dial.c）。終わるまでは
+     * STE_DIAL_AGAIN を返すので、メインループから何度も呼ばれる。
+     * UDP でも connect() しておけば、send()/recv() は HUB との間だけになる。
+     * Proxy 経由の場合は、CONNECT のレスポンスを受け取るまで続ける。
+     */
+    stedstat->udp = (stedstat->use_udp && proxy == NULL);
+    if(proxy == NULL)
+        sock = ste_dial_poll(&stedstat->dial, hub_host, hub_port, stedstat->udp, ste_time_usec());
+    else
+        sock = open_tunnel(stedstat, hub_host, hub_port, proxy_host, proxy_port, &restlen);
+    if(sock == -1)
+        next_hub(stedstat);
+    if(sock < 0)
+        return(sock);
 
     /*
-     * recv() でブロックされるのを防ぐため、non-blocking mode に設定
+     * socket は ste_dial_poll() が non-blocking mode にしてある。
+     * Windows では受信したら EventArray[0] で知らせてもらう。
      */      
 #ifdef STE_WINDOWS
     if( WSAEventSelect(sock , EventArray[0] , FD_READ ) == SOCKET_ERROR ){
         SET_ERRNO();
         print_err(LOG_ERR,"WSAEventSelect failed: %s\n", strerror(errno));
+        CLOSE(sock);
+        ste_dial_backoff(&stedstat->dial, ste_time_usec());
         return(-1);
     }        
-#else    
-    if( fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
-        SET_ERRNO();
-        print_err(LOG_ERR, "Failed to set nonblock: %s\n",sock, strerror(errno));
-        return(-1);
-    }
 #endif
 
     /*
-     * stedstat 構造体に FD を記録
+     * stedstat 構造体に FD と接続 ID を記録
      */
     stedstat->sock_fd = sock;
+    stedstat->conn_id++;
+    ste_stats_init(&stedstat->stats);
+    if(!stedstat->udp)
+        ste_tune_open(sock, 0, &stedstat->stats);
+    ste_rx_reset(&stedstat->rx);
+    ste_agg_reset(&stedstat->agg);
+    stedstat->agg.compact = 0;
+    stedstat->agg.hc = NULL;
+    stedstat->agg.mux = 0;
+    ste_hcd_reset(&stedstat->hcd);
+    stedstat->sendbuflen = 0;
+    stedstat->pendlen = 0;
+    stedstat->peer_caps = 0;
+    stedstat->peer_mtu = ETHERMAX;
+    stedstat->tx_flags = 0;
+    stedstat->agg.maxbytes = stedstat->udp ? STE_UDP_PAYLOAD : STE_AGG_MAX_BYTES;
+    stedstat->hello_ok = 0;
+    stedstat->hello_frames = 0;
+    stedstat->hello_tries = 0;
+    ste_hb_reset(&stedstat->hb, ste_time_usec());
+    if(stedstat->lzc != NULL)
+        ste_lzc_reset(stedstat->lzc);
+    if(stedstat->lzd != NULL)
+        ste_lzd_reset(stedstat->lzd);
+    free(stedstat->aead);
+    stedstat->aead = NULL;
+    free(stedstat->fec);
+    stedstat->fec = NULL;
+
+    if(stedstat->udp){
+        /* conn id は HUB が送信元のアドレスの代わりにセッションを探すのに使う */
+        if(ste_aead_random(connid, STE_UDP_HDRSIZE) < 0)
+            ste_udp_put_connid(connid, (unsigned int)ste_time_usec() ^ (unsigned int)stedstat->conn_id);
+        stedstat->udp_connid = STE_UDP_GET32(connid);
+        print_err(LOG_NOTICE, "Sending to HUB over UDP (conn id %08x)\n", stedstat->udp_connid);
+    } else if(stedstat->nhubs > 1){
+        print_err(LOG_NOTICE, "Successfully connected with HUB %s (#%d of %d)\n",
+                  stedstat->hub_name, stedstat->hub_index + 1, stedstat->nhubs);
+    } else {
+        print_err(LOG_NOTICE, "Successfully connected with HUB\n");
+    }
 
     /*
-     * HUB 経由の場合CONNECT リクエストを作成。
+     * HUB にハンドシェイクの STE_MSG_HELLO を送る。返事は待たずに、HUB から
+     * STE_MSG_HELLO が返ってくるまでは従来の形式（フレーム毎に stehead）で
+     * 送る。識別名が指定されていなければホスト名を使う。
+     * UDP の場合は返事が来るまで udp_timer() が再送する。
      */
-    if(proxy != NULL){
-        int stat;
-        if((stat = send_connect_req(stedstat)) != 0){
-            if ( stat > 0)
-                print_err(LOG_ERR, "proxy server %s returned \"%d - %s\"\n",
-                          proxy_name, stat, stat2string(stat));
-            print_err(LOG_ERR, "CONNECT request to %s failed.\n",proxy_name);
-            return(-1);
+    if(stedstat->hello.client_id[0] == '\0'){
+        char hostname[256];
+
+        if(gethostname(hostname, sizeof(hostname)) == 0){
+            strncpy(stedstat->hello.client_id, hostname, STE_CLIENTID_MAX);
+            stedstat->hello.client_id[STE_CLIENTID_MAX] = '\0';
+        }
+    }
+    /* 暗号化する場合、セッション鍵を作るための nonce は接続毎に変える */
+    if(stedstat->use_key && ste_aead_random(stedstat->hello.nonce, STE_HELLO_NONCE) < 0){
+        print_err(LOG_ERR, "cannot generate nonce\n");
+        return(-1);
+    }
+    /*
+     * セッションの再開は TCP でだけ申し込む。前の接続でトークンを受け取って
+     * いれば、それと受け取ったフレームの数を送る（sted_replay.h 参照）。
+     */
+    stedstat->hello.features &= ~STE_CAP_RESUME;
+    memset(stedstat->hello.token, 0x0, STE_RESUME_TOKEN);
+    stedstat->hello.rx_seq = 0;
+    if(stedstat->udp || stedstat->replay == NULL){
+        stedstat->has_token = 0;
+    } else {
+        stedstat->hello.features |= STE_CAP_RESUME;
+        if(stedstat->has_token){
+            memcpy(stedstat->hello.token, stedstat->token, STE_RESUME_TOKEN);
+            stedstat->hello.rx_seq = stedstat->replay->rx_seq;
+        } else {
+            ste_replay_reset(stedstat->replay);
         }
     }
-    print_err(LOG_NOTICE, "Successfully connected with HUB\n");
+    /* フロー制御も TCP でだけ申し込む。送った数は接続する度に数え直す */
+    stedstat->hello.features &= ~STE_CAP_CREDIT;
+    if(!stedstat->udp && stedstat->credit != NULL){
+        stedstat->hello.features |= STE_CAP_CREDIT;
+        ste_credit_reset(stedstat->credit);
+    }
+    if(send_hello(stedstat) < 0)
+        return(-1);
+
+    /* Proxy のレスポンスの後ろに続いていた HUB からのデータ（recvbuf にある） */
+    if(restlen > 0){
+        stedstat->stats.ibytes += restlen;
+        if(parse_msgs(stedstat, stedstat->recvbuf, restlen) < 0)
+            return(-1);
+    }
     
     return(sock);
 }
 
+/*****************************************************************************
+ * open_tunnel()
+ * 
+ * Proxy 経由で HUB へのトンネルを作る。今の HUB への予備のトンネルが
+ * できていれば、待たずにそれを使う。無ければ Proxy に接続して CONNECT を
+ * 送り、レスポンスを待つ。レスポンスの後ろに続いていた HUB からのデータは
+ * recvbuf にコピーし、その長さを restlen に返す。
+ *
+ *  引数：
+ *           stedstat  : sted 管理用構造体
+ *           hub_host  : HUB のホスト名
+ *           hub_port  : HUB のポート番号
+ *           proxy_host: Proxy のホスト名
+ *           proxy_port: Proxy のポート番号
+ *           restlen   : recvbuf にコピーしたデータの長さを返す
+ * 戻り値：
+ *         成功時 :  ソケット番号
+ *         接続中 :  STE_DIAL_AGAIN
+ *         失敗時 :  -1
+ *****************************************************************************/
+static int
+open_tunnel(stedstat_t *stedstat, char *hub_host, int hub_port, char *proxy_host, int proxy_port,
+            int *restlen)
+{
+    ste_tunnel_t *t = &stedstat->tunnel;
+    ste_tunnel_t *s;
+    ste_uint64_t  now = ste_time_usec();
+    int           sock, ret, i;
+
+    for(i = 0 ; i < stedstat->nstandby && t->state == STE_TUNNEL_IDLE ; i++){
+        s = &stedstat->standby[i];
+        if(s->state != STE_TUNNEL_READY || s->hub_index != stedstat->hub_index ||
+           ste_tunnel_poll(s, now) < 0)
+            continue;
+        *t = *s;
+        ste_tunnel_init(s);
+        s->quiet = 1;
+        ste_dial_cancel(&stedstat->dial);
+        print_err(LOG_NOTICE, "switching to a standby tunnel through proxy %s\n", proxy_host);
+    }
+
+    if(t->state == STE_TUNNEL_IDLE){
+        if((sock = ste_dial_poll(&stedstat->dial, proxy_host, proxy_port, 0, now)) < 0)
+            return(sock);
+        if(ste_tunnel_start(t, sock, hub_host, hub_port, stedstat->proxy_auth,
+                            stedstat->hub_index, now) < 0){
+            ste_dial_backoff(&stedstat->dial, now);
+            return(-1);
+        }
+#ifdef STE_WINDOWS
+        /* レスポンスが届いたらメインループを起こしてもらう */
+        WSAEventSelect(sock, EventArray[0], FD_READ | FD_CLOSE);
+#endif
+    }
+
+    if((ret = ste_tunnel_poll(t, now)) == STE_DIAL_AGAIN)
+        return(ret);
+    if(ret < 0){
+        if(t->http.state == STE_HTTP_DONE && t->http.status != HTTP_STAT_OK)
+            print_err(LOG_ERR, "proxy server %s returned \"%d - %s\"\n",
+                      proxy_host, t->http.status, stat2string(t->http.status));
+        print_err(LOG_ERR, "CONNECT request to %s failed.\n", proxy_host);
+        ste_dial_backoff(&stedstat->dial, now);
+        return(-1);
+    }
+
+    sock = t->fd;
+    *restlen = t->restlen;
+    memcpy(stedstat->recvbuf, t->rest, t->restlen);
+    ste_tunnel_init(t);
+    return(sock);
+}
+
+/*****************************************************************************
+ * keep_standby()
+ * 
+ * -w が指定されていれば、予備のトンネルを Proxy 経由で今の HUB まで張って
+ * おく。別の HUB へのトンネルと、STE_TUNNEL_REFRESH_USEC 経ったトンネルは
+ * 閉じて張り直す。失敗したらバックオフしてからやり直す。
+ *
+ *  引数：
+ *           stedstat: sted 管理用構造体（HUB に接続しているリンク）
+ *           proxy   : Proxy のホスト名（と「:」でくぎられたポート番号）
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+static void
+keep_standby(stedstat_t *stedstat, char *proxy)
+{
+    char          proxy_host[STE_DIAL_HOSTMAX];
+    int           proxy_port;
+    ste_tunnel_t *t;
+    ste_dial_t   *d;
+    ste_uint64_t  now = ste_time_usec();
+    int           i, sock, ret;
+
+    if(stedstat->nstandby == 0 ||
+       ste_dial_parse(proxy, proxy_host, sizeof(proxy_host), &proxy_port) < 0)
+        return;
+
+    for(i = 0 ; i < stedstat->nstandby ; i++){
+        t = &stedstat->standby[i];
+        d = &stedstat->standby_dial[i];
+        if(t->state != STE_TUNNEL_IDLE &&
+           (t->hub_index != stedstat->hub_index ||
+            (t->state == STE_TUNNEL_READY && now - t->start_usec >= STE_TUNNEL_REFRESH_USEC)))
+            ste_tunnel_close(t);
+        if(t->state == STE_TUNNEL_IDLE){
+            if((sock = ste_dial_poll(d, proxy_host, proxy_port, 0, now)) < 0)
+                continue;
+            if(ste_tunnel_start(t, sock, stedstat->hub_name, stedstat->hub_port,
+                                stedstat->proxy_auth, stedstat->hub_index, now) < 0){
+                ste_dial_backoff(d, now);
+                continue;
+            }
+#ifdef STE_WINDOWS
+            WSAEventSelect(sock, EventArray[0], FD_READ | FD_CLOSE);
+#endif
+        }
+        if((ret = ste_tunnel_poll(t, now)) == 0)
+            ste_dial_established(d);
+        else if(ret == -1)
+            ste_dial_backoff(d, now);
+    }
+}
+
+/*****************************************************************************
+ * tunnel_wait_usec()
+ * 
+ * Proxy 経由の場合に、確立中のトンネルと予備のトンネルのために次に
+ * メインループを起こす時刻までの時間を返す。
+ *
+ *  引数：
+ *           stedstat: sted 管理用構造体
+ * 戻り値：
+ *           待ち時間(usec)。待つものが無ければ -1
+ *****************************************************************************/
+long
+tunnel_wait_usec(stedstat_t *stedstat)
+{
+    ste_uint64_t now = ste_time_usec();
+    long         wait, usec;
+    int          i;
+
+    wait = ste_tunnel_wait_usec(&stedstat->tunnel, now);
+    for(i = 0 ; i < stedstat->nstandby ; i++){
+        usec = ste_tunnel_wait_usec(&stedstat->standby[i], now);
+        if(usec < 0)
+            usec = ste_dial_wait_usec(&stedstat->standby_dial[i], now);
+        if(usec >= 0 && (wait < 0 || usec < wait))
+            wait = usec;
+    }
+    return(wait);
+}
+
+/*****************************************************************************
+ * cancel_open()
+ * 
+ * リンクの接続中の connect() と、確立中のトンネルを取り消す。
+ *
+ *  引数：
+ *           stedstat: sted 管理用構造体
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+static void
+cancel_open(stedstat_t *stedstat)
+{
+    ste_dial_cancel(&stedstat->dial);
+    ste_tunnel_close(&stedstat->tunnel);
+}
+
+/*****************************************************************************
+ * close_socket()
+ * 
+ * HUB(stehub) との接続を閉じる。閉じたリンクは、バックオフの待ち時間が
+ * 過ぎてから open_links() が開き直す。複数の HUB が指定されていれば、
+ * 待たずに次の HUB に接続し直す（next_hub()）。
+ *
+ *  引数：
+ *           stedstat: sted 管理用構造体
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+close_socket(stedstat_t *stedstat)
+{
+    if(stedstat->sock_fd < 0)
+        return;
+    drop_socket(stedstat);
+    if(next_hub(stedstat) == 0)
+        ste_dial_backoff(&stedstat->dial, ste_time_usec());
+}
+
+/*****************************************************************************
+ * drop_socket()
+ * 
+ * HUB(stehub) との接続の socket を閉じ、クレジットを待っていたフレームを
+ * 片付ける。次の HUB への切り替えやバックオフは呼び出し側が決める。
+ *
+ *  引数：
+ *           stedstat: sted 管理用構造体
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+static void
+drop_socket(stedstat_t *stedstat)
+{
+    unsigned char *frame;
+    unsigned int   adapter;
+    int            len;
+
+    CLOSE(stedstat->sock_fd);
+    stedstat->sock_fd = -1;
+    /* クレジットを待っていたフレームは、セッションを再開したら送れるようリングに入れる */
+    if(stedstat->credit != NULL){
+        while((frame = ste_credit_head(stedstat->credit, &adapter, &len)) != NULL){
+            if(stedstat->has_token)
+                ste_replay_push(stedstat->replay, adapter, frame, len);
+            else
+                stedstat->stats.odrops++;
+            ste_credit_pop(stedstat->credit, ste_time_usec(), &stedstat->stats);
+        }
+        stedstat->stats.cheld = 0;
+    }
+}
+
+/*****************************************************************************
+ * next_hub()
+ * 
+ * 接続が切れたか接続に失敗したので、-h に指定された次の HUB に切り替える。
+ * 一巡するまではバックオフせずにすぐ接続する。リンク 1 以降はリンク 0 と
+ * 同じ HUB に接続するので、ここでは切り替えない（open_links() 参照）。
+ *
+ *  引数：
+ *           stedstat: sted 管理用構造体
+ * 戻り値：
+ *           次の HUB にすぐ接続する : 1
+ *           バックオフする          : 0
+ *****************************************************************************/
+static int
+next_hub(stedstat_t *stedstat)
+{
+    if(stedstat->nhubs <= 1 || stedstat->hello.link > 0)
+        return(0);
+    stedstat->hub_index = (stedstat->hub_index + 1) % stedstat->nhubs;
+    ste_dial_cancel(&stedstat->probe);
+    stedstat->probe_usec = 0;
+    stedstat->probe_ok = 0;
+    if(stedstat->hub_index == 0)
+        return(0);
+    print_err(LOG_NOTICE, "failing over to hub #%d of %d\n", stedstat->hub_index + 1, stedstat->nhubs);
+    cancel_open(stedstat);
+    return(1);
+}
+
+/*****************************************************************************
+ * probe_primary()
+ * 
+ * プライマリ以外の HUB に接続している間、STE_FAILBACK_USEC 毎にプライマリの
+ * HUB に TCP で接続してみる。STE_FAILBACK_PROBES 回続けて接続できたら、
+ * 今の接続を閉じてプライマリに接続し直す。確認の接続はすぐに閉じる。
+ *
+ *  引数：
+ *           stedstat: sted 管理用構造体（リンク 0）
+ *           hub     : HUB の一覧（-h の引数）
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+static void
+probe_primary(stedstat_t *stedstat, char *hub)
+{
+    char          entry[STE_DIAL_HOSTMAX];
+    char          host[STE_DIAL_HOSTMAX];
+    int           port;
+    int           sock;
+    ste_uint64_t  now = ste_time_usec();
+
+    if(now < stedstat->probe_usec)
+        return;
+    if(ste_dial_pick(hub, 0, entry, sizeof(entry)) < 0 ||
+       ste_dial_parse(entry, host, sizeof(host), &port) < 0)
+        return;
+    stedstat->probe.quiet = 1;
+    if((sock = ste_dial_poll(&stedstat->probe, host, port, 0, now)) == STE_DIAL_AGAIN)
+        return;
+    /* 失敗してもバックオフせず、次の確認の時刻まで待つ */
+    ste_dial_cancel(&stedstat->probe);
+    stedstat->probe_usec = now + STE_FAILBACK_USEC;
+    if(sock < 0){
+        stedstat->probe_ok = 0;
+        return;
+    }
+    CLOSE(sock);
+    if(++stedstat->probe_ok < STE_FAILBACK_PROBES)
+        return;
+
+    print_err(LOG_NOTICE, "primary hub %s is reachable again, failing back\n", host);
+    stedstat->probe_ok = 0;
+    stedstat->probe_usec = 0;
+    stedstat->hub_index = 0;
+    drop_socket(stedstat);
+    ste_dial_cancel(&stedstat->dial);
+}
+
+/*****************************************************************************
+ * open_links()
+ * 
+ * 閉じているリンクを HUB(stehub) に接続し直す。
+ * リンク 1 以降は、リンク 0 で HUB が STE_CAP_STRIPE に合意してから開く。
+ * 対応していない HUB は同じ sted のリンクの間でもフレームを転送して
+ * しまうため。
+ * 接続はブロックせずに進めるので、毎回のメインループから呼ぶ。開けなかった
+ * リンクは（リンク 0 も）バックオフの待ち時間が過ぎてからやり直す。
+ * その間、ste デバイスから読んだフレームは select_link() が NULL を返すので
+ * 捨てる（統計の odrops に数える）。
+ * リンク 1 以降はリンク 0 と同じ HUB に接続する。リンク 0 が別の HUB に
+ * 切り替わったら、前の HUB に残っているリンクは閉じて開き直す。
+ * リンク 0 がプライマリ以外の HUB に接続していれば、プライマリに戻れるか
+ * 確かめる（Proxy 経由の場合を除く）。
+ *
+ *  引数：
+ *           stedstat: sted 管理用構造体の配列
+ *           nlinks  : リンクの数
+ *           hub     : HUB のホスト名（と「:」でくぎられたポート番号）
+ *           proxy   : Proxy のホスト名（と「:」でくぎられたポート番号）
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+open_links(stedstat_t *stedstat, int nlinks, char *hub, char *proxy)
+{
+    stedstat_t *link;
+    int         i, ret;
+
+    if(proxy == NULL && stedstat->hub_index != 0 && stedstat->sock_fd >= 0 && stedstat->hello_ok)
+        probe_primary(stedstat, hub);
+
+    for(i = 0 ; i < nlinks ; i++){
+        link = &stedstat[i];
+        if(i > 0 && link->sock_fd >= 0 && link->hub_index != stedstat->hub_index){
+            print_err(LOG_NOTICE, "closing link %d to the previous hub\n", i);
+            close_socket(link);
+            cancel_open(link);
+        }
+        if(link->sock_fd >= 0){
+            /* Proxy 経由なら、次に切れた時のための予備のトンネルを張っておく */
+            if(proxy != NULL && link->hello_ok)
+                keep_standby(link, proxy);
+            continue;
+        }
+        if(i > 0 && (stedstat->sock_fd < 0 || (stedstat->peer_caps & STE_CAP_STRIPE) == 0)){
+            /* リンク 0 が開き直すのを待つ。接続中なら取り消す */
+            cancel_open(link);
+            continue;
+        }
+        if(i > 0 && link->hub_index != stedstat->hub_index){
+            cancel_open(link);
+            link->hub_index = stedstat->hub_index;
+        }
+        if((ret = open_socket(link, hub, proxy)) == STE_DIAL_AGAIN)
+            continue;
+        if(ret < 0){
+            close_socket(link);
+            if(i == 0)
+                print_err(LOG_ERR, "failed to open connection with hub\n");
+            else
+                print_err(LOG_ERR, "failed to open link %d with hub\n", i);
+        }
+    }
+}
+
+/*****************************************************************************
+ * select_link()
+ * 
+ * フレームを送るリンクを選ぶ。同じフローのフレームは同じリンクで送るので、
+ * フロー毎の順番は変わらない。リンク 1 以降は HUB が STE_CAP_STRIPE に
+ * 合意したものだけ使う。閉じているリンクに振り分けられていたフローは、
+ * 残りのリンクに振り分け直す。
+ *
+ *  引数：
+ *           stedstat: sted 管理用構造体の配列
+ *           nlinks  : リンクの数
+ *           frame   : 送る Ethernet フレーム
+ *           len     : フレーム長
+ * 戻り値：
+ *           送るリンク。開いているリンクが無ければ NULL
+ *****************************************************************************/
+stedstat_t *
+select_link(stedstat_t *stedstat, int nlinks, unsigned char *frame, int len)
+{
+    stedstat_t *up[MAXLINKS];
+    stedstat_t *link;
+    int         nup = 0;
+    int         i;
+
+    for(i = 0 ; i < nlinks ; i++){
+        link = &stedstat[i];
+        if(link->sock_fd < 0)
+            continue;
+        if(i > 0 && (!link->hello_ok || (link->peer_caps & STE_CAP_STRIPE) == 0))
+            continue;
+        up[nup++] = link;
+    }
+    if(nup == 0)
+        return(NULL);
+    if(nup == 1)
+        return(up[0]);
+    return(up[ste_flow_hash(frame, len) % nup]);
+}
+
+/*****************************************************************************
+ * send_hello()
+ * 
+ * HUB(stehub) に STE_MSG_HELLO を送る。
+ *
+ *  引数：
+ *           stedstat   : sted 管理用構造体
+ *           
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+static int
+send_hello(stedstat_t *stedstat)
+{
+    stedstat->sendbuflen += ste_msg_put_hello(stedstat->sendbuf + stedstat->sendbuflen, &stedstat->hello);
+    stedstat->hello_tries++;
+    stedstat->hello_usec = ste_time_usec();
+    return(write_socket(stedstat));
+}
+
+/*****************************************************************************
+ * udp_timer()
+ * 
+ * UDP で HUB(stehub) と送受信している場合のタイマー処理。
+ * HUB から STE_MSG_HELLO の返事が来るまで STE_UDP_HELLO_USEC 毎に再送し、
+ * 何も送らないまま STE_UDP_KEEPALIVE_SEC 経ったらキープアライブ（メッセージ
+ * の無いデータグラム）を送って途中の NAT のマッピングを保つ。
+ * FEC で抜けの後ろのデータグラムを取っておいていれば、時間切れのものを
+ * ste ドライバに渡す。
+ *
+ *  引数：
+ *           stedstat   : sted 管理用構造体
+ *           
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (返事が無いまま STE_UDP_HELLO_TRIES 回送った。use_udp を
+ *                   0 にしたので、呼び出し元で接続し直すと TCP になる。
+ *                   または受信したメッセージの処理に失敗した)
+ *****************************************************************************/
+int
+udp_timer(stedstat_t *stedstat)
+{
+    ste_uint64_t   now = ste_time_usec();
+    u_char        *p;
+    int            len;
+
+    if(!stedstat->udp || stedstat->sock_fd < 0)
+        return(0);
+
+    if(stedstat->fec != NULL && ste_fec_expire(stedstat->fec, now, &stedstat->stats) > 0){
+        while(ste_fec_next(stedstat->fec, &p, &len, &stedstat->stats))
+            if(recv_dgram(stedstat, p, len) < 0)
+                return(-1);
+    }
+
+    if(!stedstat->hello_ok){
+        if(now - stedstat->hello_usec < STE_UDP_HELLO_USEC)
+            return(0);
+        if(stedstat->hello_tries >= STE_UDP_HELLO_TRIES){
+            print_err(LOG_ERR, "no reply from hub over UDP, falling back to TCP\n");
+            stedstat->use_udp = 0;
+            return(-1);
+        }
+        return(send_hello(stedstat));
+    }
+
+    if(now - stedstat->tx_usec >= (ste_uint64_t)STE_UDP_KEEPALIVE_SEC * 1000000)
+        return(send_socket(stedstat, NULL, 0));
+    return(0);
+}
+
+/*****************************************************************************
+ * hb_timer()
+ * 
+ * HUB と STE_CAP_PING を合意していれば、ハートビートの間隔毎に STE_MSG_PING
+ * を送る。HUB から何も受信しないまま ste_hb_dead() の時間が経ったら、
+ * HUB が応答しない（half-open の接続）とみなす。
+ *
+ *  引数：
+ *           stedstat   : sted 管理用構造体
+ *           
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (HUB が応答しないか、送信でエラーになった。呼び出し元で
+ *                   接続を閉じると、次の HUB に切り替わる)
+ *****************************************************************************/
+int
+hb_timer(stedstat_t *stedstat)
+{
+    unsigned char  buf[STE_SEAL_HEADROOM + sizeof(stehead2_t) + STE_PING_LEN + STE_SEAL_TAILROOM];
+    unsigned char *msgp = buf + STE_SEAL_HEADROOM;
+    int            msglen;
+    ste_uint64_t   now = ste_time_usec();
+
+    if(stedstat->sock_fd < 0 || !stedstat->hello_ok || (stedstat->peer_caps & STE_CAP_PING) == 0)
+        return(0);
+
+    if(ste_hb_dead(&stedstat->hb, now, &stedstat->stats)){
+        print_err(LOG_ERR, "hub %s did not respond for %d msec\n", stedstat->hub_name,
+                  (int)((now - stedstat->hb.rx_usec) / 1000));
+        return(-1);
+    }
+    if(!ste_hb_due(&stedstat->hb, now))
+        return(0);
+
+    msglen = ste_msg_put_ping(msgp, STE_PING_REQUEST, now, stedstat->tx_flags);
+    if(stedstat->aead != NULL)
+        msgp = ste_aead_seal(stedstat->aead, msgp, &msglen, stedstat->tx_flags, &stedstat->stats);
+    stedstat->stats.hbpings++;
+    return(send_socket(stedstat, msgp, msglen));
+}
+
 /*****************************************************************************
  * read_socket()
  * 
  * HUB(stehub) からのデータを読み込み、 ste ドライバに転送する。
+ * 受信データからメッセージを取り出すのは ste_rx_next() が行う。
+ * UDP の場合は届いているデータグラムを STE_UDP_BATCH 個まで続けて読む。
+ * データグラム毎に完結しているので、途中までのメッセージは持ち越さない。
+ * FEC のヘッダが付いていれば、ste_fec_next() が順番を揃えて（失われた
+ * ものは復元して）返すデータグラムを処理する。
  *
  *  引数：
  *           stedstat   : sted 管理用構造体
@@ -241,209 +892,458 @@ open_socket(stedstat_t *stedstat, char *hub, char *proxy)
 int
 read_socket(stedstat_t *stedstat)
 {
-    stehead_t   *steh;
-    int          flags = 0;
     int          recvsize;  // recv() で実際に読み込んだサイズ        
-    int          cnt;       // recvsize の中で、未処理のデータサイズ
+    int          total = 0;
+    int          n;
     int          sock_fd = stedstat->sock_fd;
     u_char      *recvbuf = stedstat->recvbuf;
-    u_char      *readp;
-    u_char      *wdatabuf = stedstat->wdatabuf;
+    u_char      *p;
+    int          len;
+    STE_ACCT_VAR(acct_t)
+
+    STE_TRACE0(2, TRC_READ_SOCK_CALLED);
 
-    if(debuglevel > 1){    
-        print_err(LOG_DEBUG, "read_socket called\n");
+    if(stedstat->udp){
+        for(n = 0 ; n < STE_UDP_BATCH ; n++){
+            STE_ACCT_BEGIN(acct_t);
+            recvsize = recv(sock_fd, recvbuf, SOCKBUFSIZE, 0);
+            STE_ACCT_END(STE_STAGE_SOCK_RECV, acct_t);
+            if(recvsize < 0){
+                /*
+                 * UDP では HUB が落ちていても（ICMP port unreachable が返って
+                 * きても）接続を閉じる必要は無い。返事が無ければ udp_timer() が
+                 * TCP に切り替える。
+                 */
+                SET_ERRNO();
+                STE_TRACE1(2, TRC_READ_SOCK_AGAIN, errno);
+                break;
+            }
+            /* 他の接続（古い conn id）宛てのデータグラムは捨てる */
+            if(recvsize < STE_UDP_HDRSIZE || STE_UDP_GET32(recvbuf) != stedstat->udp_connid)
+                continue;
+            stedstat->stats.irecvs++;
+            stedstat->stats.ibytes += recvsize;
+            ste_hb_rx(&stedstat->hb, ste_time_usec());
+            STE_TRACE2(2, TRC_READ_SOCK_FROM, recvsize, 0);
+            STE_TRACE_DUMP(3, recvbuf, recvsize);
+            total += recvsize;
+            if(recvsize > STE_UDP_HDRSIZE && recvbuf[STE_UDP_HDRSIZE] == STE_FEC_MAGIC){
+                /* FEC を合意する前に届いたものや、壊れたものは捨てる */
+                if(stedstat->fec == NULL ||
+                   ste_fec_input(stedstat->fec, recvbuf + STE_UDP_HDRSIZE, recvsize - STE_UDP_HDRSIZE,
+                                 ste_time_usec()) < 0)
+                    continue;
+                while(ste_fec_next(stedstat->fec, &p, &len, &stedstat->stats))
+                    if(recv_dgram(stedstat, p, len) < 0)
+                        return(-1);
+                continue;
+            }
+            if(recv_dgram(stedstat, recvbuf + STE_UDP_HDRSIZE, recvsize - STE_UDP_HDRSIZE) < 0)
+                return(-1);
+        }
+        STE_TRACE0(2, TRC_READ_SOCK_RETURNED);
+        return(total);
     }
     
-    if( (recvsize = recv(sock_fd, recvbuf, SOCKBUFSIZE,0)) < 0)  {
+    STE_ACCT_BEGIN(acct_t);
+    recvsize = recv(sock_fd, recvbuf, SOCKBUFSIZE,0);
+    STE_ACCT_END(STE_STAGE_SOCK_RECV, acct_t);
+    if( recvsize < 0)  {
         SET_ERRNO();
         if(errno == EINTR || errno == EWOULDBLOCK || errno == 0){
-            if(debuglevel > 1){
-                print_err(LOG_NOTICE, "read_socket: recv %s\n", strerror(errno));
-                print_err(LOG_DEBUG, "read_socket returned\n");
-            }
+            STE_TRACE1(2, TRC_READ_SOCK_AGAIN, errno);
+            STE_TRACE0(2, TRC_READ_SOCK_RETURNED);
             return(0);
         }        
         print_err(LOG_ERR,"read_socket: recv %s (%d)\n", strerror(errno),errno);
-            if(debuglevel > 1){        
-                print_err(LOG_DEBUG, "read_socket returned\n");
-            }            
+        STE_TRACE0(2, TRC_READ_SOCK_RETURNED);
         return(-1);
     }
     if( recvsize == 0){
         print_err(LOG_ERR, "connection with hub is being closed\n");
-        if(debuglevel > 1){                        
-            print_err(LOG_DEBUG, "read_socket returned\n");
-        }        
+        STE_TRACE0(2, TRC_READ_SOCK_RETURNED);
         return(-1);
     }
-    
-    if(debuglevel > 1){
-        print_err(LOG_DEBUG, "========= from hub %d bytes ===================\n", recvsize);
-        print_err(LOG_DEBUG, "datalen(Frame size)                   = %d\n", stedstat->datalen);        
-        print_err(LOG_DEBUG, "dataleft(needed to complete Frame)    = %d\n",stedstat->dataleft);
-        if (debuglevel > 2){
-            int i;
-            for (i = 0; i < recvsize; i++){
-                if((i)%16 == 0){
-                    print_err(LOG_DEBUG, "\n%04d: ", i);                    
-                }
-                print_err(LOG_DEBUG, "%02x ", recvbuf[i] & 0xff);                
-            }
-            print_err(LOG_DEBUG, "\n\n");
+    stedstat->stats.irecvs++;
+    stedstat->stats.ibytes += recvsize;
+    ste_hb_rx(&stedstat->hb, ste_time_usec());
+
+    STE_TRACE2(2, TRC_READ_SOCK_FROM, recvsize, stedstat->rx.dataleft);
+    STE_TRACE_DUMP(3, recvbuf, recvsize);
+
+    if(parse_msgs(stedstat, recvbuf, recvsize) < 0)
+        return(-1);
+
+    STE_TRACE0(2, TRC_READ_SOCK_RETURNED);
+    return(recvsize);
+}
+
+/*****************************************************************************
+ * recv_dgram()
+ * 
+ * UDP のデータグラム 1 つ分のメッセージを処理する。メッセージはデータグラム
+ * をまたがないので、前のデータグラムの途中までのメッセージは捨てる。
+ *
+ *  引数：
+ *           stedstat   : sted 管理用構造体
+ *           readp      : conn id（FEC のヘッダ）より後ろの先頭
+ *           cnt        : その長さ
+ *           
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (parse_msgs() 参照)
+ *****************************************************************************/
+static int
+recv_dgram(stedstat_t *stedstat, u_char *readp, int cnt)
+{
+    ste_rx_restart(&stedstat->rx);
+    return(parse_msgs(stedstat, readp, cnt));
+}
+
+/*****************************************************************************
+ * find_adapter()
+ * 
+ * STE_MSG_MUX のセグメント番号から、フレームを書き込む ste デバイスを探す。
+ *
+ *  引数：
+ *           stedstat   : sted 管理用構造体
+ *           segment    : セグメント番号
+ *           
+ * 戻り値：
+ *          正常時 : stedstat->adapter の添字
+ *          障害時 : -1 (そのセグメントの ste デバイスは開いていない)
+ *****************************************************************************/
+static int
+find_adapter(stedstat_t *stedstat, unsigned int segment)
+{
+    int i;
+
+    for(i = 0 ; i < stedstat->nadapters ; i++)
+        if(stedstat->adapter[i].segment == segment)
+            return(i);
+    return(-1);
+}
+
+/*****************************************************************************
+ * resume_session()
+ * 
+ * HUB から STE_MSG_HELLO の返事を受け取った時に、セッションの再開を処理する。
+ * 前のセッションのトークンが返ってくれば再開できたので、HUB が受け取って
+ * いなかったフレームをリングから送り直す。違うトークンが返ってくれば
+ * 新しいセッションなので、リングに取っておいたフレームは捨てる。
+ * 新しいセッションでは、HUB は STE_MSG_HELLO の後に受け取ったフレームから
+ * 数えるので、返事を待つ間に送ったフレームの数から数え直す。
+ *
+ *  引数：
+ *           stedstat   : sted 管理用構造体
+ *           hello      : HUB からの返事
+ *           
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (送り直している間に socket への書き込みでエラーになった)
+ *****************************************************************************/
+static int
+resume_session(stedstat_t *stedstat, ste_hello_t *hello)
+{
+    unsigned char *frame;
+    unsigned int   adapter;
+    int            n, k, len;
+
+    if((stedstat->peer_caps & STE_CAP_RESUME) == 0){
+        stedstat->has_token = 0;
+        if(stedstat->replay != NULL)
+            ste_replay_reset(stedstat->replay);
+        return(0);
+    }
+
+    if(stedstat->has_token && memcmp(stedstat->token, hello->token, STE_RESUME_TOKEN) == 0){
+        n = ste_replay_start(stedstat->replay, hello->rx_seq);
+        print_err(LOG_NOTICE, "resumed session with hub, resending %d frames\n", n);
+        for(k = 0 ; k < n ; k++){
+            frame = ste_replay_get(stedstat->replay, n, k, &adapter, &len);
+            /* HUB が多重化に合意しなくなっていれば、2 つ目以降のデバイスのフレームは送れない */
+            if(adapter > 0 && (stedstat->peer_caps & STE_CAP_MUX) == 0)
+                continue;
+            if(put_frame(stedstat, (int)adapter, frame, len, 1) < 0)
+                return(-1);
         }
+        return(0);
     }
 
-    /* 未処理データサイズをセット */
-    cnt = recvsize;
-    /* 処理用のポインタをセット */
-    readp = recvbuf;
+    if(stedstat->has_token)
+        print_err(LOG_NOTICE, "hub did not resume the session, starting a new one\n");
+    ste_replay_reset(stedstat->replay);
+    stedstat->replay->tx_seq = stedstat->hello_frames;
+    memcpy(stedstat->token, hello->token, STE_RESUME_TOKEN);
+    stedstat->has_token = 1;
+    return(0);
+}
+
+/*****************************************************************************
+ * parse_msgs()
+ * 
+ * 受信データからメッセージを取り出し、フレームを ste ドライバに書き込む。
+ * STE_MSG_MUX のフレームはセグメント番号で選んだ ste デバイスに書き込む。
+ *
+ *  引数：
+ *           stedstat   : sted 管理用構造体
+ *           readp      : 受信データ
+ *           cnt        : 受信データのサイズ
+ *           
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (メモリが足りず、HUB と合意した形式で受信できないか、
+ *                   溜めていたフレームを送る時に socket への書き込みで
+ *                   エラーになった)
+ *****************************************************************************/
+static int
+parse_msgs(stedstat_t *stedstat, u_char *readp, int cnt)
+{
+    int          ret;
+    int          nframes;
+    int          i;
+    ste_msg_t    msg;
+    ste_msg_t    inner;
+    u_char      *frames[STE_AGG_MAX_FRAMES];
+    int          lens[STE_AGG_MAX_FRAMES];
+    ste_hello_t  hello;
+    int          kind;
+    ste_uint64_t stamp;
+    unsigned int segment;
+    int          adapter;
+    unsigned int credit[4];
+    STE_ACCT_VAR(acct_t)
+
+    STE_ACCT_BEGIN(acct_t);
             
-    while(1){ 
-        if (stedstat->dataleft == 0){
+    while(cnt > 0){ 
+        ret = ste_rx_next(&stedstat->rx, &readp, &cnt, &msg);
+        if(ret == 0){
+            /* メッセージはまだ不完全。次のデータの到着を待つ */
+            STE_TRACE1(2, TRC_READ_SOCK_NEEDMORE, stedstat->rx.dataleft);
+            break;
+        }
+        if(ret < 0){
             /*
-             * 受信データの先頭部分。先頭部分は stehead なので、
-             * 読み込んで、フレームのサイズを得る。
+             * ヘッダか本体が壊れていた。フレーミング v2 なら ste_rx_next() が
+             * 次の同期ワードを探すので、捨てるのは壊れた部分だけで済む。
+             * v1 の場合は次のヘッダの位置がわからないので、今回の受信データの
+             * 残りは全て捨てられている。
              */
-            u_char *newp;
-            if((newp = read_socket_header(stedstat, &cnt, readp)) == NULL){
-                /* stehead はまだ不完全。次のデータの到着を待つ */
-                break;
-            }
-            readp = newp;
+            STE_TRACE2(1, TRC_READ_SOCK_BROKEN, stedstat->rx.orglen, stedstat->rx.discard);
+            STE_PROBE_RESYNC(stedstat->conn_id, stedstat->rx.orglen, stedstat->rx.discard);
+            continue;
         }
+        STE_TRACE3(2, TRC_READ_SOCK_MSG, msg.type, msg.len, cnt);
+
         /*
-         * 読み取った stehead から、オリジナルの Ethernet フレームのサイズを
-         * 確認し、 0 より大きく、ETHERMAX(1514bytes)以下であることを確かめる。
+         * 暗号化を合意していれば、STE_MSG_SEAL を復号して中のメッセージを
+         * 処理する。鍵を指定されている場合、STE_MSG_HELLO 以外の平文は
+         * 受け付けない。
          */
-        if( stedstat->orgdatalen <= 0 || stedstat->orgdatalen > ETHERMAX ){
+        if(msg.type == STE_MSG_SEAL){
+            if(stedstat->aead == NULL || ste_aead_open(stedstat->aead, &msg, &inner, &stedstat->stats) < 0){
+                STE_TRACE2(1, TRC_READ_SOCK_AUTHERR, msg.type, msg.len);
+                continue;
+            }
+            msg = inner;
+        } else if(stedstat->use_key && msg.type != STE_MSG_HELLO){
+            stedstat->stats.eauth++;
+            STE_TRACE2(1, TRC_READ_SOCK_AUTHERR, msg.type, msg.len);
+            continue;
+        }
+
+        if(msg.type == STE_MSG_ZAGG){
             /*
-             * stehead は壊れていると思われる。以降の受信データは無視し、ループを抜ける。
-             * （仮想ハブが受信パケットをこちらに転送せずに破棄した可能性が高い）
-             * この方法だと、未読のデータをすべて破棄するしかなく、また次の受信データの
-             * 先頭が stehead であるという保証も無いため、一度ここに入り込むと、しばらく
-             * ここに来続ける可能性がある・・ヘッダーはデータの境界情報を持つ重要なもの
-             * なので、もっと確実・安全に取り出せる仕組みを検討する必要がある。
+             * 圧縮された STE_MSG_AGG（STE_MSG_MUX）。辞書がずれていたら、HUB が
+             * 辞書をリセットするまで捨て続ける。
              */
-            stedstat->dataleft = stedstat->datalen = stedstat->dummyheadlen = 0;
-            if (debuglevel > 0) {            
-                print_err(LOG_NOTICE, "read_socket: header is broken\n");
+            if(stedstat->lzd == NULL || ste_lz_open(stedstat->lzd, &msg, &inner, &stedstat->stats) < 0){
+                STE_TRACE2(1, TRC_READ_SOCK_LZERR, msg.len,
+                           stedstat->lzd != NULL ? stedstat->lzd->broken : -1);
+                continue;
             }
-            break;
+            msg = inner;
         }
-        if (debuglevel > 1) {
-            print_err(LOG_DEBUG, "---------------------\n");                            
-            print_err(LOG_DEBUG, "cnt(data size not yet processed)      = %d\n", cnt);
-            print_err(LOG_DEBUG, "datalen(Frame size)                   = %d\n", stedstat->datalen);
-            print_err(LOG_DEBUG, "dataleft(needed to complete Frame)    = %d\n", stedstat->dataleft);
-        }
-        if(cnt < stedstat->dataleft){
-            /* この受信データだけでは元のフレームを再構成できない */
-            /* とりあえずコピーしておいて、次のデータの到着を待つ */
-            /* 書き込み位置は、書き込み済みの位置の次 */
-            memcpy(wdatabuf + (stedstat->datalen - stedstat->dataleft) , readp, cnt);
-            stedstat->dataleft = stedstat->dataleft - cnt;
-            if (debuglevel > 1) {
-                print_err(LOG_DEBUG, "Need more %d bytes to complete a framed.\n", stedstat->dataleft);
-            }            
-            break;
-        }
-        if (cnt == stedstat->dataleft){
-            /* この受信データで元のフレームを再構成できる */
-            /* 丁度１フレーム分しか含んでいない */
-            if (debuglevel > 1){
-                print_err(LOG_DEBUG, "Frame completed. And no unread data left.\n");
-            }
-            memcpy(wdatabuf + (stedstat->datalen - stedstat->dataleft), readp, cnt);
-
-            write_ste(stedstat);
 
-            if (debuglevel > 1){
-                print_err(LOG_DEBUG, "wrote %d bytes to driver completed.\n",stedstat->orgdatalen);
-            }            
-            stedstat->dataleft = stedstat->datalen = stedstat->dummyheadlen = 0;
-            break;
-        }
-        if (cnt > stedstat->dataleft){
-            /* この受信データだけで元のフレームを再構成できる */
-            /* さらに別のフレームのデータも含まれている */
-            memcpy(wdatabuf  + (stedstat->datalen - stedstat->dataleft), readp, stedstat->dataleft);
-            write_ste(stedstat);            
-            
-            readp = readp + stedstat->dataleft;
-            cnt = cnt - stedstat->dataleft;
-            stedstat->dataleft = stedstat->datalen = stedstat->dummyheadlen = 0;
-            if (debuglevel > 1){
-                print_err(LOG_DEBUG, "Frame completed. Still %d bytes of unread data.\n", cnt);
-                print_err(LOG_DEBUG, "wrote %d bytes to driver completed.\n",stedstat->orgdatalen);
+        /* 多重化されていなければ最初の ste デバイスに書き込む */
+        adapter = 0;
+        if(msg.type == STE_MSG_MUX){
+            if(ste_mux_open(&msg, &inner, &segment) < 0 || (adapter = find_adapter(stedstat, segment)) < 0){
+                STE_TRACE2(1, TRC_READ_SOCK_BROKEN, msg.type, msg.len);
+                STE_PROBE_RESYNC(stedstat->conn_id, msg.type, msg.len);
+                continue;
             }
-            /* while ループを続ける */
-            continue;
+            msg = inner;
+        }
+
+        switch(msg.type){
+            case STE_MSG_HELLO:
+                /*
+                 * HUB からのハンドシェイクの返事。合意したバージョンと機能が
+                 * 入っている。古い HUB は他の sted の STE_MSG_HELLO をそのまま
+                 * 転送してくるので、STE_ROLE_HUB 以外のものは無視する。
+                 */
+                if(ste_msg_get_hello(&msg, &hello) < 0 || hello.role != STE_ROLE_HUB)
+                    break;
+                stedstat->hello_ok = 1;
+                ste_dial_established(&stedstat->dial);
+                stedstat->peer_caps = hello.features & stedstat->hello.features;
+                if(stedstat->hello.nlinks > 1 && (stedstat->peer_caps & STE_CAP_STRIPE) == 0){
+                    /* リンク 0 だけで送受信する。リンク 1 以降は閉じる */
+                    print_err(LOG_NOTICE, "hub does not support striping, using a single link\n");
+                    if(stedstat->hello.link > 0)
+                        return(-1);
+                }
+                stedstat->peer_mtu = (hello.mtu < stedstat->hello.mtu) ? hello.mtu : stedstat->hello.mtu;
+                stedstat->rx.mtu = stedstat->peer_mtu;
+                stedstat->agg.compact = (stedstat->peer_caps & STE_CAP_COMPACT) ? 1 : 0;
+                stedstat->agg.mux = (stedstat->peer_caps & STE_CAP_MUX) ? 1 : 0;
+                if(stedstat->hello.nsegs > 1 && stedstat->hello.link == 0 && (stedstat->peer_caps & STE_CAP_MUX) == 0)
+                    print_err(LOG_NOTICE, "hub does not support multiplexing, using instance %d only\n",
+                              stedstat->adapter[0].instance);
+                if(stedstat->peer_caps & STE_CAP_SYNC){
+                    stedstat->tx_flags = STE_TX_SYNC;
+                    if(stedstat->peer_caps & STE_CAP_PCRC)
+                        stedstat->tx_flags |= STE_TX_PCRC;
+                }
+                if((stedstat->peer_caps & STE_CAP_AGG) && (stedstat->peer_caps & STE_CAP_HC)){
+                    ste_hcc_reset(&stedstat->hcc, &stedstat->stats);
+                    stedstat->agg.hc = &stedstat->hcc;
+                }
+                if(stedstat->peer_caps & STE_CAP_LZ4){
+                    if(stedstat->lzc == NULL)
+                        stedstat->lzc = malloc(sizeof(ste_lzc_t));
+                    if(stedstat->lzd == NULL)
+                        stedstat->lzd = malloc(sizeof(ste_lzd_t));
+                    if(stedstat->lzc == NULL || stedstat->lzd == NULL){
+                        /* HUB は STE_MSG_ZAGG を送ってくるので続けられない */
+                        print_err(LOG_ERR, "cannot allocate lz4 buffers\n");
+                        return(-1);
+                    }
+                    ste_lzc_reset(stedstat->lzc);
+                    ste_lzd_reset(stedstat->lzd);
+                }
+                if(stedstat->use_key){
+                    if((stedstat->peer_caps & STE_CAP_AEAD) == 0 || (stedstat->peer_caps & STE_CAP_AGG) == 0){
+                        /* 平文では送受信しないので、フレームは捨て続けることになる */
+                        print_err(LOG_ERR, "hub refused encryption, frames are not forwarded\n");
+                    } else {
+                        if(stedstat->aead == NULL)
+                            stedstat->aead = malloc(sizeof(ste_aead_t));
+                        if(stedstat->aead == NULL){
+                            print_err(LOG_ERR, "cannot allocate encryption buffers\n");
+                            return(-1);
+                        }
+                        ste_aead_init(stedstat->aead, stedstat->psk, stedstat->hello.nonce, hello.nonce,
+                                      STE_ROLE_STED);
+                    }
+                }
+                /* 鍵を指定していれば、HUB の返事やクレジットは暗号化されていないと受け取れない */
+                if(stedstat->use_key && stedstat->aead == NULL)
+                    stedstat->peer_caps &= ~(STE_CAP_PING | STE_CAP_CREDIT);
+                if(stedstat->udp && (stedstat->peer_caps & STE_CAP_FEC)){
+                    if(stedstat->fec == NULL)
+                        stedstat->fec = malloc(sizeof(ste_fec_t));
+                    if(stedstat->fec == NULL){
+                        /* HUB は FEC のヘッダを付けて送ってくるので続けられない */
+                        print_err(LOG_ERR, "cannot allocate fec buffers\n");
+                        return(-1);
+                    }
+                    ste_fec_reset(stedstat->fec);
+                }
+                print_err(LOG_NOTICE, "hub protocol version %d, features 0x%x, mtu %d\n",
+                          hello.version, stedstat->peer_caps, stedstat->peer_mtu);
+                if(resume_session(stedstat, &hello) < 0)
+                    return(-1);
+                break;
+            case STE_MSG_AGG:
+            case STE_MSG_CAGG:
+            case STE_MSG_HAGG:
+                if(msg.type == STE_MSG_HAGG)
+                    nframes = ste_hc_parse(&stedstat->hcd, &msg, frames, lens, stedstat->rx.mtu,
+                                           &stedstat->stats);
+                else
+                    nframes = ste_agg_parse(&msg, frames, lens, stedstat->rx.mtu);
+                if(nframes < 0){
+                    STE_TRACE2(1, TRC_READ_SOCK_BROKEN, msg.type, msg.len);
+                    STE_PROBE_RESYNC(stedstat->conn_id, msg.type, msg.len);
+                    break;
+                }
+                STE_TRACE1(2, TRC_READ_SOCK_AGG, nframes);
+                for(i = 0 ; i < nframes ; i++)
+                    write_ste(stedstat, adapter, frames[i], lens[i]);
+                if(stedstat->replay != NULL)
+                    stedstat->replay->rx_seq += nframes;
+                break;
+            case STE_MSG_PING:
+                if(ste_msg_get_ping(&msg, &kind, &stamp) == 0 && kind == STE_PING_REPLY)
+                    ste_hb_reply(&stedstat->hb, stamp, ste_time_usec(), &stedstat->stats);
+                break;
+            case STE_MSG_CREDIT:
+                /* 上限が増えたら、クレジットを待っていたフレームを送る */
+                if((stedstat->peer_caps & STE_CAP_CREDIT) == 0 || stedstat->credit == NULL ||
+                   ste_msg_get_credit(&msg, credit) < 0)
+                    break;
+                ste_credit_grant(stedstat->credit, credit, ste_time_usec(), &stedstat->stats);
+                if(release_credit(stedstat) < 0)
+                    return(-1);
+                break;
+            default:
+                /* Ethernet フレーム */
+                write_ste(stedstat, adapter, msg.body, msg.len);
+                if(stedstat->replay != NULL)
+                    stedstat->replay->rx_seq++;
+                break;
         }
     } /* while loop end */
+    STE_ACCT_END(STE_STAGE_PARSE, acct_t);
 
-    if(debuglevel > 1){                    
-        print_err(LOG_DEBUG, "read_socket returned\n");
-    }
-    return(recvsize);
+    return(0);
 }
 
 /*****************************************************************************
- * read_socket_header()
+ * send_socket()
  * 
- * ヘッダー（stehead 構造体）を読み取り、dummyhead にコピーする。
- * 受け取ったポインタにヘッダーの一部しかない場合は、受信部分だけを dummyhead
- * にコピーしておき、次のパケットの到着を待つ。
+ * 1 つのバッファを HUB(stehub) へ send() する。
+ * UDP の場合は先頭に conn id を付けた 1 つのデータグラムとして送る。
+ * buf が NULL ならキープアライブ（conn id だけのデータグラム）になる。
+ * FEC を合意していれば FEC のヘッダも付け、グループが一杯になったら
+ * 続けてパリティを送る。
  *
  *  引数：
- *           stedstat : sted 管理用構造体
- *           cnt      : readp に含まれるデータのサイズ
- *           readp    : 受信データ（stehead 構造体を含むと思われる）
+ *           stedstat   : sted 管理用構造体
+ *           buf        : 送信するデータ
+ *           len        : 送信するデータのサイズ
+ *           
  * 戻り値：
- *          stehead 完成時  : stehead をとばしたデータの読み込み開始位置
- *          stehead 未完成時: NULL
+ *          正常時 : 0 (EWOULDBLOCK 等で送信をあきらめた場合も含む)
+ *          障害時 : -1
  *****************************************************************************/
-u_char *
-read_socket_header(stedstat_t *stedstat, int *cnt, u_char *readp)
+static int
+send_socket(stedstat_t *stedstat, unsigned char *buf, int len)
 {
-    int unreadlen; /* まだ recv されていない header の長さ */
-    
-    unreadlen = sizeof(stehead_t) - stedstat->dummyheadlen;
-    
-    if( *cnt >= unreadlen){
-        /* stehead の足りないところは無い */
-        memcpy((char *)&stedstat->dummyhead + stedstat->dummyheadlen, readp, unreadlen);
-        readp = readp + unreadlen;
-        *cnt = *cnt - unreadlen;
-        stedstat->dummyheadlen = sizeof(stehead_t);
-        stedstat->datalen = stedstat->dataleft = ntohl(stedstat->dummyhead.len);
-        stedstat->orgdatalen = ntohl(stedstat->dummyhead.orglen);
-        if (debuglevel > 1) {
-            print_err(LOG_DEBUG, "---------------------\n");            
-            print_err(LOG_DEBUG, "read_socket_header: ste header is completed\n");
-            print_err(LOG_DEBUG, "Data size = %d , Without PAD = %d\n",
-                      stedstat->datalen, stedstat->orgdatalen);
-        }
-        return(readp);
-    } else {
-        /*
-         * ヘッダー部を取得後でないとその後の
-         * 処理がはじめられないので、stehead の
-         * サイズ分が到着するまで recv を繰り返す
-         */
-        memcpy((char *)&stedstat->dummyhead + stedstat->dummyheadlen, readp, *cnt);
-        stedstat->dummyheadlen = stedstat->dummyheadlen + *cnt;
-        if (debuglevel > 1) {
-            print_err(LOG_DEBUG, "---------------------\n");            
-            print_err(LOG_DEBUG, "read_socket_header: Insuficient header.\n");
-        }
-        return((u_char *)NULL);
-    }
+    unsigned char  fechdr[STE_FEC_HDRSIZE];
+    int            full;
+    int            ret;
+
+    if(!stedstat->udp || stedstat->fec == NULL || buf == NULL)
+        return(send_gather(stedstat, NULL, 0, buf, len));
+
+    full = ste_fec_put_data(stedstat->fec, fechdr, buf, len);
+    ret = send_gather(stedstat, fechdr, STE_FEC_HDRSIZE, buf, len);
+    if(ret == 0 && full)
+        ret = flush_parity(stedstat);
+    return(ret);
 }
 
 /*****************************************************************************
- * write_socket()
+ * flush_parity()
  * 
- * stedstat 構造体の sendbuf に溜まっているデータを HUB(stehub) へ転送する。
+ * FEC のグループにパリティをまだ送っていないデータグラムがあれば、
+ * パリティを送ってグループを閉じる。送信が途切れた時（ste ドライバの
+ * キューが空になった時）に呼ぶので、受信側はグループが一杯になるのを
+ * 待たずに復元できる。
  *
  *  引数：
  *           stedstat   : sted 管理用構造体
@@ -453,137 +1353,264 @@ read_socket_header(stedstat_t *stedstat, int *cnt, u_char *readp)
  *          障害時 : -1
  *****************************************************************************/
 int
-write_socket(stedstat_t *stedstat)
+flush_parity(stedstat_t *stedstat)
 {
-    if (debuglevel > 1) {        
-        print_err(LOG_DEBUG,"write_socket called\n");
-    }
-    
-    if( stedstat->sendbuflen == 0){
-        if (debuglevel > 1) {
-            print_err(LOG_ERR,"sendbuflen == 0\n");
-            print_err(LOG_ERR,"write_socket returned\n");
-        }
+    unsigned char *parity;
+    int            len;
+
+    if(!stedstat->udp || stedstat->fec == NULL)
+        return(0);
+    if((parity = ste_fec_put_parity(stedstat->fec, &len, &stedstat->stats)) == NULL)
         return(0);
+    return(send_gather(stedstat, parity, len, NULL, 0));
+}
+
+/*****************************************************************************
+ * send_gather()
+ * 
+ * hdr と buf を続けて HUB(stehub) へ send() する。UDP の場合は先頭に
+ * conn id を付けて、1 回のシステムコールで 1 つのデータグラムとして送る。
+ *
+ *  引数：
+ *           stedstat   : sted 管理用構造体
+ *           hdr        : 先に送るデータ（UDP の場合だけ。無ければ NULL）
+ *           hlen       : hdr のサイズ
+ *           buf        : 送信するデータ（UDP の場合は NULL でもよい）
+ *           len        : 送信するデータのサイズ
+ *           
+ * TCP で一部しか送れなかった場合や EWOULDBLOCK の場合は、送れなかった分を
+ * pendbuf に取っておき、次の送信の前に送る。送りきれないうちは、新しい
+ * メッセージもその後ろに並べる。HUB はフレームを数えているので（クレジット、
+ * セッションの再開）、TCP では送れなかったメッセージを黙って捨てない。
+ *
+ * 戻り値：
+ *          正常時 : 0 (EWOULDBLOCK 等で送信をあきらめた場合も含む)
+ *          障害時 : -1
+ *****************************************************************************/
+static int
+send_gather(stedstat_t *stedstat, unsigned char *hdr, int hlen, unsigned char *buf, int len)
+{
+    int ret;
+    int niov = 0;
+    unsigned char  connid[STE_UDP_HDRSIZE];
+#ifdef STE_WINDOWS
+    WSABUF         wsabuf[3];
+    DWORD          sent;
+#else
+    struct iovec   iov[3];
+    struct msghdr  mh;
+#endif
+    STE_ACCT_VAR(acct_t)
+
+    STE_ACCT_BEGIN(acct_t);
+    if(stedstat->udp){
+        /* conn id とメッセージを 1 回のシステムコールでまとめて送る */
+        ste_udp_put_connid(connid, stedstat->udp_connid);
+#ifdef STE_WINDOWS
+        wsabuf[niov].buf = (char *)connid;
+        wsabuf[niov++].len = STE_UDP_HDRSIZE;
+        if(hdr != NULL){
+            wsabuf[niov].buf = (char *)hdr;
+            wsabuf[niov++].len = hlen;
+        }
+        if(buf != NULL){
+            wsabuf[niov].buf = (char *)buf;
+            wsabuf[niov++].len = len;
+        }
+        ret = (WSASend(stedstat->sock_fd, wsabuf, niov, &sent, 0, NULL, NULL) == 0) ? (int)sent : -1;
+#else
+        iov[niov].iov_base = (char *)connid;
+        iov[niov++].iov_len = STE_UDP_HDRSIZE;
+        if(hdr != NULL){
+            iov[niov].iov_base = (char *)hdr;
+            iov[niov++].iov_len = hlen;
+        }
+        if(buf != NULL){
+            iov[niov].iov_base = (char *)buf;
+            iov[niov++].iov_len = len;
+        }
+        memset(&mh, 0x0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = niov;
+        ret = sendmsg(stedstat->sock_fd, &mh, 0);
+#endif
+        len = STE_UDP_HDRSIZE + (hdr != NULL ? hlen : 0) + (buf != NULL ? len : 0);
+    } else {
+        /* メッセージの途中で止まっている残りを先に送る */
+        if(stedstat->pendlen > 0 && flush_pending(stedstat) < 0){
+            STE_ACCT_END(STE_STAGE_SOCK_SEND, acct_t);
+            return(-1);
+        }
+        if(stedstat->pendlen > 0){
+            /* まだ残っていれば、順番が変わらないよう残りの後ろに並べる */
+            STE_ACCT_END(STE_STAGE_SOCK_SEND, acct_t);
+            return(queue_pending(stedstat, buf, len));
+        }
+        ret = send(stedstat->sock_fd, buf, len, 0);
+        if(ret >= 0 && ret < len){
+            /* 送りきれなかった残りは捨てずに取っておく */
+            memcpy(stedstat->pendbuf, buf + ret, len - ret);
+            stedstat->pendlen = len - ret;
+        }
     }
-    
-    if ( send(stedstat->sock_fd, stedstat->sendbuf, stedstat->sendbuflen, 0) < 0){
+    STE_ACCT_END(STE_STAGE_SOCK_SEND, acct_t);
+    stedstat->stats.osends++;
+    stedstat->tx_usec = ste_time_usec();
+    if(ret < 0){
         SET_ERRNO();
-        if(errno == EINTR || errno == EWOULDBLOCK || errno == 0){
-            if (debuglevel > 1) {            
-                print_err(LOG_NOTICE, "write_socket: send: %s\n", strerror(errno));
-            }                        
+        STE_PROBE_SOCK_FLUSH(stedstat->conn_id, len, -errno);
+        /* UDP ではエラーでも（HUB が落ちていても）データグラムを捨てるだけ */
+        if(errno == EINTR || errno == EWOULDBLOCK || errno == 0 || stedstat->udp){
+            STE_TRACE1(2, TRC_WRITE_SOCK_AGAIN, errno);
+            /* TCP では送信待ちに入れて後で送る */
+            if(!stedstat->udp)
+                return(queue_pending(stedstat, buf, len));
+            stedstat->stats.odrops++;
         } else {
             print_err(LOG_ERR,"write_socket: send %s (%d)\n", strerror(errno), errno);
-            if (debuglevel > 1) {
-                print_err(LOG_DEBUG,"write_socket returned\n");
-            }            
             return(-1);
         }
+    } else {
+        STE_PROBE_SOCK_FLUSH(stedstat->conn_id, len, ret);
+        stedstat->stats.obytes += ret;
     }
-    stedstat->sendbuflen = 0;  /* 書き込み済みサイズを 0 に戻す */
-    if (debuglevel > 1) {                        
-        print_err(LOG_DEBUG,"write_socket returned\n");
-    }    
     return(0);
 }
 
 /*****************************************************************************
- * send_connect_req()
+ * flush_pending()
  * 
- * Proxy サーバに CONNECT リクエストを投げ、レスポンスを待つ。
- * もし、レスポンスのなかに「200」(=OK)が含まれていなかったら
- * Proxy サーバは CONNECT メソッドをサポートしてない（もしくは
- * アクセスコントロールとか・）と思われる。あきらめて -1 を返す。
+ * TCP で前回送りきれなかったメッセージの残り（pendbuf）を HUB(stehub) へ送る。
+ * まだ送りきれない場合は、送れた分だけ詰めて残りを取っておく。
  *
  *  引数：
- *           stedstat : sted 管理用構造体
+ *           stedstat   : sted 管理用構造体
+ *           
  * 戻り値：
- *          正常時 : Proxy サーバから返ってきたステータスコード
+ *          正常時 : 0 (EWOULDBLOCK 等で残りが送れなかった場合も含む)
  *          障害時 : -1
  *****************************************************************************/
-int
-send_connect_req(stedstat_t *stedstat)
+static int
+flush_pending(stedstat_t *stedstat)
 {
-    static fd_set fds;
-    struct timeval timeout;
-    int ret, cnt;
-    u_char buf[SOCKBUFSIZE];
-    char *http_ver;       /* レスポンスに含まれる HTTP バージョン */
-    char *http_stat_char; /* レスポンスに含まれる ステータスコード */
-    int  http_stat;       /* レスポンスに含まれる ステータスコード */
-    char connect_req[CONNECT_REQ_SIZE];
-    char *hub_name = stedstat->hub_name;
-    int hub_port = stedstat->hub_port;
-    int  sock = stedstat->sock_fd;
-        
-    timeout.tv_sec = CONNECT_REQ_TIMEOUT;
-    timeout.tv_usec = 0;
-
-    FD_ZERO(&fds);
-    FD_SET(sock, &fds);
-        
-    sprintf(connect_req, 
-             "CONNECT %s:%d HTTP/1.1\r\nHost: %s:%d\r\n\r\n",
-             hub_name, hub_port, hub_name, hub_port);
-    if ( send(sock, connect_req , strlen(connect_req), 0) < 0){
-        /* この時点では全ての error を error として終了処理する */
+    int ret;
+
+    ret = send(stedstat->sock_fd, stedstat->pendbuf, stedstat->pendlen, 0);
+    if(ret < 0){
         SET_ERRNO();
-        print_err(LOG_ERR, "send_connect_req: send %s (%d)\n", strerror(errno), errno);
-        return(-1);
-    }
-    ret = select(sock+1, &fds, NULL, NULL, &timeout);
-    if( ret = 0){
-        SET_ERRNO();    
-        print_err(LOG_ERR,"send_connect_req: select %s\n", strerror(errno));
-        return(-1);
-    } else if(ret < 0){
-        SET_ERRNO();            
-        print_err(LOG_ERR,"send_connect_req: select %s\n", strerror(errno));            
+        if(errno == EINTR || errno == EWOULDBLOCK || errno == 0){
+            STE_TRACE1(2, TRC_WRITE_SOCK_AGAIN, errno);
+            return(0);
+        }
+        print_err(LOG_ERR,"flush_pending: send %s (%d)\n", strerror(errno), errno);
         return(-1);
     }
+    stedstat->stats.obytes += ret;
+    if(ret < stedstat->pendlen)
+        memmove(stedstat->pendbuf, stedstat->pendbuf + ret, stedstat->pendlen - ret);
+    stedstat->pendlen -= ret;
+    return(0);
+}
 
-    if(FD_ISSET(sock, &fds)) {
-        if( (cnt = recv(sock, buf, SOCKBUFSIZE,0)) < 0)  {
-            SET_ERRNO();
-            if(errno == EINTR || errno == EWOULDBLOCK || errno == 0){
-                if(debuglevel > 1){                    
-                    print_err(LOG_NOTICE, "send_connect_req: recv %s\n", strerror(errno));
-                }
-                return(0);
-            }
-            print_err(LOG_ERR,"send_connect_req: recv %s (%d)\n", strerror(errno), errno);
-            return(-1);
-        }
-        if( cnt == 0){
-            print_err(LOG_ERR, "connection with proxy server is being closed\n");
-            return(-1);
-        }
-        /*
-         * 受信データに HTTP ステータスラインが途中までしかて含まれていないかもし
-         * れないし、CRLF の後に、他の仮想ハブからのデータがもう含まれているかも
-         * しれないが、ここではそれらは無視する。
-         * （ここではデータを救いようがないので・・）
-         */
-        if((http_ver = strtok((char *)buf, " ")) == NULL){
-            print_err(LOG_ERR, "send_connect_req: Illegal responce from Proxy server\n");
-            return(-1);
-        }
-        if((http_stat_char = strtok(NULL, " "))  == NULL){
-            print_err(LOG_ERR, "send_connect_req: Illegal responce from Proxy server\n");
+/*****************************************************************************
+ * queue_pending()
+ * 
+ * TCP で送れなかったメッセージを送信待ち（pendbuf）の後ろに並べる。
+ * 入りきらない場合、HUB とクレジットかセッションの再開を合意していれば、
+ * 捨てると HUB と数がずれるので、接続を閉じてやり直す（再開できれば
+ * リングから送り直す）。合意していなければ捨てて odrops に数える。
+ *
+ *  引数：
+ *           stedstat   : sted 管理用構造体
+ *           buf        : 送れなかったメッセージ
+ *           len        : メッセージのサイズ
+ *           
+ * 戻り値：
+ *          正常時 : 0 (送信待ちに入らずに捨てた場合も含む)
+ *          障害時 : -1 (送信待ちが溢れた。呼び出し元で接続を閉じる)
+ *****************************************************************************/
+static int
+queue_pending(stedstat_t *stedstat, unsigned char *buf, int len)
+{
+    if(stedstat->pendlen + len > STE_PEND_MAX){
+        if(stedstat->peer_caps & (STE_CAP_CREDIT | STE_CAP_RESUME)){
+            print_err(LOG_ERR, "send queue to hub overflowed, reconnecting\n");
             return(-1);
         }
-        http_stat = atoi(http_stat_char);
+        STE_TRACE1(2, TRC_WRITE_SOCK_AGAIN, EWOULDBLOCK);
+        stedstat->stats.odrops++;
+        return(0);
+    }
+    memcpy(stedstat->pendbuf + stedstat->pendlen, buf, len);
+    stedstat->pendlen += len;
+    return(0);
+}
+
+/*****************************************************************************
+ * write_socket()
+ * 
+ * stedstat 構造体の sendbuf に溜まっているデータと、組み立て中の
+ * STE_MSG_AGG を HUB(stehub) へ転送する。前回送りきれなかった
+ * メッセージの残りがあれば、それを先に送る。
+ *
+ *  引数：
+ *           stedstat   : sted 管理用構造体
+ *           
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+write_socket(stedstat_t *stedstat)
+{
+    unsigned char *msgp;
+    int            msglen;
+    int            ret = 0;
+    ste_uint64_t   odrops;
+
+    STE_TRACE0(2, TRC_WRITE_SOCK_CALLED);
+    
+    if( stedstat->sendbuflen == 0 && stedstat->agg.count == 0){
+        if( stedstat->pendlen > 0)
+            ret = flush_pending(stedstat);
+        STE_TRACE0(2, TRC_WRITE_SOCK_EMPTY);
+        STE_TRACE0(2, TRC_WRITE_SOCK_RETURNED);
+        return(ret);
+    }
+
+    if( stedstat->sendbuflen > 0){
+        ret = send_socket(stedstat, stedstat->sendbuf, stedstat->sendbuflen);
+        stedstat->sendbuflen = 0;  /* 書き込み済みサイズを 0 に戻す */
+    }
+
+    if( ret == 0 && stedstat->agg.count > 0){
+        if( stedstat->peer_caps & STE_CAP_LZ4)
+            msgp = ste_lz_seal(stedstat->lzc, &stedstat->agg, &msglen, stedstat->tx_flags,
+                               &stedstat->stats);
+        else
+            msgp = ste_agg_seal(&stedstat->agg, &msglen, stedstat->tx_flags);
+        if( stedstat->aead != NULL)
+            msgp = ste_aead_seal(stedstat->aead, msgp, &msglen, stedstat->tx_flags, &stedstat->stats);
+        STE_TRACE2(2, TRC_READ_STE_AGG, stedstat->agg.count, msglen);
+        stedstat->stats.owire += msglen;
+        odrops = stedstat->stats.odrops;
+        ret = send_socket(stedstat, msgp, msglen);
         /*
-         * Proxy から返されたステータスコードを return する
+         * 送れなかった STE_MSG_ZAGG が辞書に入ったままだと HUB と辞書が
+         * ずれるので、辞書をリセットして次からやり直す。ヘッダ圧縮の
+         * コンテキストも同様。
          */
-        if( http_stat != HTTP_STAT_OK){
-            return(http_stat);
+        if( stedstat->stats.odrops != odrops){
+            if( stedstat->peer_caps & STE_CAP_LZ4)
+                ste_lzc_reset(stedstat->lzc);
+            if( stedstat->agg.hc != NULL)
+                ste_hcc_reset(stedstat->agg.hc, &stedstat->stats);
         }
-        return(0);
+        ste_agg_reset(&stedstat->agg);
     }
-    /* 起こりえないと思うが */
-    return(-1);
+
+    STE_TRACE0(2, TRC_WRITE_SOCK_RETURNED);
+    return(ret);
 }
 
 /*****************************************************************************
@@ -0,0 +1,405 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_stats.c
+ *
+ * sted と stehub が共通で使う接続毎の統計情報のルーチン。stehub からも
+ * ..\sted\sted_stats.c としてコンパイルされる。
+ *
+ *  o フレーム数・バイト数のカウンタはデータパスで直接加算する。
+ *  o STE_STATS_INTERVAL 秒毎に ste_stats_sample() で socket の TCP の状態
+ *    を取得し、閾値を超えていたら劣化した接続としてログに出す。
+ *  o ste_stats_print() で統計ファイルに 1 接続 1 行で書き出す。
+ *  o STE_STAGE_ACCT を define した場合は、ステージ毎のサイクル計測の結果を
+ *    ste_acct_print() でスレッド毎に書き出す。
+ *
+ *  TCP の状態は OS 毎に取得方法が違う。
+ *    Windows : WSAIoctl(SIO_TCP_INFO)。Windows 10 1703 以降の SDK が必要。
+ *              SDK に SIO_TCP_INFO が無い場合はカウンタだけになる。
+ *              rttvar は返ってこないので、RTT の変化から推定する。
+ *    Linux   : getsockopt(TCP_INFO)
+ *    その他  : 取得しない
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <mstcpip.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <syslog.h>
+#ifdef STE_STAGE_ACCT
+#include <pthread.h>
+#endif
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "sted.h"
+#include "sted_trace.h"
+#include "sted_stats.h"
+
+#ifdef STE_WINDOWS
+#define STE_U64_FMT   "%I64u"
+#else
+#define STE_U64_FMT   "%llu"
+#endif
+
+static int ste_stats_tcpinfo(int, ste_tcpinfo_t *);
+
+#ifdef STE_STAGE_ACCT
+static char *ste_acct_stagename[STE_STAGE_MAX] = {
+    "recv", "parse", "decide", "fanout", "send", "ste_read", "encap", "ste_write"
+};
+
+/*
+ * スレッド毎の計測結果のテーブル。最後の 1 つは STE_ACCT_MAX_THREADS を
+ * 超えたスレッドが共用する。
+ */
+static ste_acct_t                ste_acct_table[STE_ACCT_MAX_THREADS + 1];
+static volatile long             ste_acct_nthreads = 0;
+static STE_THREAD_LOCAL ste_acct_t *ste_acct_my = NULL;
+#endif
+
+/*****************************************************************************
+ * ste_stats_init()
+ *
+ * 統計情報を初期化する。接続（再接続）する度に呼ぶ。
+ *
+ *  引数：
+ *           cs : 接続毎の統計情報
+ *****************************************************************************/
+void
+ste_stats_init(ste_connstat_t *cs)
+{
+    memset(cs, 0x0, sizeof(ste_connstat_t));
+    cs->start_usec = cs->sample_usec = ste_time_usec();
+}
+
+/*****************************************************************************
+ * ste_stats_tcpinfo()
+ *
+ * socket の TCP の状態を取得し、ste_tcpinfo_t の単位に揃えて返す。
+ * delivery_rate はここでは求めない。
+ *
+ *  引数：
+ *           fd   : 対象の socket
+ *           tcpi : 取得した値を格納する ste_tcpinfo_t
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (この OS では取得できない場合も含む)
+ *****************************************************************************/
+static int
+ste_stats_tcpinfo(int fd, ste_tcpinfo_t *tcpi)
+{
+#if defined(STE_WINDOWS) && defined(SIO_TCP_INFO)
+    DWORD        version = 0;
+    DWORD        bytes = 0;
+    TCP_INFO_v0  info;
+    unsigned int diff;
+
+    if(WSAIoctl((SOCKET)fd, SIO_TCP_INFO, &version, sizeof(version),
+                &info, sizeof(info), &bytes, NULL, NULL) != 0)
+        return(-1);
+
+    /* RTT の変化量の移動平均（RFC 6298 の RTTVAR と同じ重み）*/
+    if(tcpi->rtt_us != 0){
+        diff = (info.RttUs > tcpi->rtt_us) ? info.RttUs - tcpi->rtt_us : tcpi->rtt_us - info.RttUs;
+        tcpi->rttvar_us = (tcpi->rttvar_us * 3 + diff) / 4;
+    } else {
+        tcpi->rttvar_us = info.RttUs / 2;
+    }
+    tcpi->rtt_us  = info.RttUs;
+    tcpi->cwnd    = info.Cwnd;
+    tcpi->mss     = info.Mss;
+    tcpi->unacked = info.BytesInFlight;
+    /* Windows は再送をバイト数で返すので、MSS で割ってセグメント数にする */
+    tcpi->retrans = (info.Mss != 0) ? (unsigned int)(info.BytesRetrans / info.Mss) : 0;
+    return(0);
+#elif defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t       len = sizeof(info);
+
+    memset(&info, 0x0, sizeof(info));
+    if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return(-1);
+
+    tcpi->rtt_us    = info.tcpi_rtt;
+    tcpi->rttvar_us = info.tcpi_rttvar;
+    tcpi->mss       = info.tcpi_snd_mss;
+    /* Linux は cwnd と unacked をセグメント数で返すので、MSS を掛ける */
+    tcpi->cwnd      = info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+    tcpi->unacked   = info.tcpi_unacked * info.tcpi_snd_mss;
+    tcpi->retrans   = info.tcpi_total_retrans;
+    return(0);
+#else
+    return(-1);
+#endif
+}
+
+/*****************************************************************************
+ * ste_stats_sample()
+ *
+ * TCP の状態をサンプリングし、前回からの差分で delivery rate と再送数を
+ * 求め、劣化しているかを判定する。劣化の状態が変わったらログに出す。
+ * main ループから STE_STATS_INTERVAL 秒毎に呼ばれる。
+ *
+ *  引数：
+ *           fd   : 対象の socket
+ *           id   : 接続 ID（ログ用）
+ *           cs   : 接続毎の統計情報
+ * 戻り値：
+ *          正常時 : 劣化と判定した理由(STE_DEGRADED_XXX)。劣化していなければ 0
+ *          障害時 : -1 (TCP の状態を取得できなかった)
+ *****************************************************************************/
+int
+ste_stats_sample(int fd, int id, ste_connstat_t *cs)
+{
+    ste_tcpinfo_t *tcpi = &cs->tcpi;
+    ste_uint64_t   now;
+    ste_uint64_t   elapsed;
+    ste_uint64_t   acked;
+    unsigned int   retrans;
+    int            degraded = 0;
+
+    now = ste_time_usec();
+    retrans = tcpi->retrans;
+
+    if(ste_stats_tcpinfo(fd, tcpi) < 0){
+        cs->tcpi_valid = 0;
+        cs->sample_usec = now;
+        cs->sample_obytes = cs->obytes;
+        return(-1);
+    }
+
+    /*
+     * 前回のサンプリングから相手に届いたバイト数は、その間に send() した
+     * バイト数から、ACK 待ちのバイト数の増加分を引いたもの。
+     */
+    elapsed = now - cs->sample_usec;
+    acked = cs->obytes - cs->sample_obytes + cs->sample_unacked;
+    acked = (acked > tcpi->unacked) ? acked - tcpi->unacked : 0;
+    if(elapsed > 0)
+        tcpi->delivery_rate = acked * 1000000 / elapsed;
+
+    cs->retrans_delta = (cs->tcpi_valid && tcpi->retrans > retrans) ? tcpi->retrans - retrans : 0;
+    cs->sample_usec = now;
+    cs->sample_obytes = cs->obytes;
+    cs->sample_unacked = tcpi->unacked;
+    cs->tcpi_valid = 1;
+
+    /*
+     * 閾値と比較する
+     */
+    if(tcpi->rtt_us > STE_DEGRADE_RTT_USEC)
+        degraded |= STE_DEGRADED_RTT;
+    if(cs->retrans_delta > STE_DEGRADE_RETRANS)
+        degraded |= STE_DEGRADED_RETRANS;
+    if(tcpi->unacked > 0 && tcpi->mss > 0 && tcpi->cwnd <= STE_DEGRADE_CWND_SEGS * tcpi->mss)
+        degraded |= STE_DEGRADED_CWND;
+
+    if(degraded != 0 && cs->degraded == 0){
+        print_err(LOG_NOTICE, "conn%d: link degraded (rtt=%u us, retrans=+%u, cwnd=%u bytes)\n",
+                  id, tcpi->rtt_us, cs->retrans_delta, tcpi->cwnd);
+    } else if (degraded == 0 && cs->degraded != 0){
+        print_err(LOG_NOTICE, "conn%d: link recovered (rtt=%u us, cwnd=%u bytes)\n",
+                  id, tcpi->rtt_us, tcpi->cwnd);
+    }
+    cs->degraded = degraded;
+
+    return(degraded);
+}
+
+/*****************************************************************************
+ * ste_stats_print()
+ *
+ * 接続毎の統計情報を 1 行で書き出す。スクリプトから読みやすいように
+ * key=value の形式にする。TCP の状態が取得できていない場合は tcp=none。
+ *
+ *  引数：
+ *           fp   : 書き出し先
+ *           id   : 接続 ID
+ *           peer : 接続先の名前
+ *           cs   : 接続毎の統計情報
+ *****************************************************************************/
+void
+ste_stats_print(FILE *fp, int id, char *peer, ste_connstat_t *cs)
+{
+    ste_tcpinfo_t *tcpi = &cs->tcpi;
+    double         saved = 0.0;
+
+    if(cs->olegacy > 0)
+        saved = ((double)cs->olegacy - (double)cs->owire) * 100.0 / (double)cs->olegacy;
+
+    fprintf(fp, "conn=%d peer=%s uptime=%u", id, peer,
+            (unsigned int)((ste_time_usec() - cs->start_usec) / 1000000));
+    fprintf(fp, " iframes=" STE_U64_FMT " oframes=" STE_U64_FMT, cs->iframes, cs->oframes);
+    fprintf(fp, " ibytes=" STE_U64_FMT " obytes=" STE_U64_FMT, cs->ibytes, cs->obytes);
+    fprintf(fp, " irecvs=" STE_U64_FMT " osends=" STE_U64_FMT, cs->irecvs, cs->osends);
+    fprintf(fp, " odrops=" STE_U64_FMT, cs->odrops);
+    /* 従来の形式（フレーム毎に stehead）と比べた送信データの削減率 */
+    fprintf(fp, " owire=" STE_U64_FMT " olegacy=" STE_U64_FMT " saved=%.1f%%",
+            cs->owire, cs->olegacy, saved);
+    /* LZ4 の圧縮を合意している場合だけ */
+    if(cs->zmsgs + cs->zskips + cs->dmsgs + cs->zerrors > 0){
+        fprintf(fp, " zmsgs=" STE_U64_FMT " zskips=" STE_U64_FMT " ratio=%.2f",
+                cs->zmsgs, cs->zskips, cs->zout > 0 ? (double)cs->zin / (double)cs->zout : 0.0);
+        fprintf(fp, " zusec=" STE_U64_FMT " dmsgs=" STE_U64_FMT " dusec=" STE_U64_FMT " zerrors=" STE_U64_FMT,
+                cs->zusec, cs->dmsgs, cs->dusec, cs->zerrors);
+    }
+    /* ヘッダ圧縮を合意している場合だけ */
+    if(cs->hfull + cs->hdelta + cs->herrors > 0){
+        fprintf(fp, " hfull=" STE_U64_FMT " hdelta=" STE_U64_FMT " hsaved=" STE_U64_FMT " herrors=" STE_U64_FMT,
+                cs->hfull, cs->hdelta, cs->hsaved, cs->herrors);
+    }
+    /* 暗号化を合意している場合だけ */
+    if(cs->eseals + cs->eopens + cs->eauth + cs->ereplays > 0){
+        fprintf(fp, " eseals=" STE_U64_FMT " eopens=" STE_U64_FMT " eauth=" STE_U64_FMT " ereplays=" STE_U64_FMT,
+                cs->eseals, cs->eopens, cs->eauth, cs->ereplays);
+    }
+    /* UDP で FEC を合意している場合だけ */
+    if(cs->fparity + cs->frecover + cs->flost > 0){
+        fprintf(fp, " fparity=" STE_U64_FMT " frecover=" STE_U64_FMT " flost=" STE_U64_FMT,
+                cs->fparity, cs->frecover, cs->flost);
+    }
+    /* ハートビートを合意している場合だけ。TCP の rtt と違い HUB の送信キューの待ち時間も含む */
+    if(cs->hbpings + cs->hbpongs > 0){
+        fprintf(fp, " hbpings=" STE_U64_FMT " hbpongs=" STE_U64_FMT " hbrtt=%u hbrttvar=%u",
+                cs->hbpings, cs->hbpongs, cs->hbrtt_us, cs->hbrttvar_us);
+    }
+    /* socket バッファを調整している TCP の接続だけ（sted_tune.h 参照） */
+    if(cs->sndbuf + cs->rcvbuf > 0){
+        fprintf(fp, " sndbuf=%u rcvbuf=%u lowat=%u bdp=%u",
+                cs->sndbuf, cs->rcvbuf, cs->lowat, cs->bdp);
+    }
+    /* クレジットによるフロー制御を合意している場合だけ（sted_credit.h 参照） */
+    if(cs->cgrants > 0){
+        fprintf(fp, " cgrants=" STE_U64_FMT " cstalls=" STE_U64_FMT " cheld=%u cqdrops=" STE_U64_FMT
+                " cresyncs=" STE_U64_FMT, cs->cgrants, cs->cstalls, cs->cheld, cs->cqdrops, cs->cresyncs);
+    }
+    /* AQM のキューにフレームを入れた場合だけ（sted_aqm.h 参照）。最大値は書き出す度に戻す */
+    if(cs->aqsamples + cs->aqdrops + cs->aqmarks > 0){
+        fprintf(fp, " sojourn=%u sojmax=%u aqdrops=" STE_U64_FMT " aqmarks=" STE_U64_FMT,
+                cs->sojourn_us, cs->sojourn_max_us, cs->aqdrops, cs->aqmarks);
+        cs->sojourn_max_us = 0;
+    }
+
+    if(cs->tcpi_valid == 0){
+        fprintf(fp, " tcp=none\n");
+        return;
+    }
+
+    fprintf(fp, " rtt=%u rttvar=%u cwnd=%u mss=%u unacked=%u retrans=%u(+%u)",
+            tcpi->rtt_us, tcpi->rttvar_us, tcpi->cwnd, tcpi->mss, tcpi->unacked,
+            tcpi->retrans, cs->retrans_delta);
+    fprintf(fp, " rate=" STE_U64_FMT, tcpi->delivery_rate);
+    fprintf(fp, " status=%s%s%s%s\n",
+            cs->degraded ? "degraded" : "ok",
+            (cs->degraded & STE_DEGRADED_RTT)     ? ",rtt"     : "",
+            (cs->degraded & STE_DEGRADED_RETRANS) ? ",retrans" : "",
+            (cs->degraded & STE_DEGRADED_CWND)    ? ",cwnd"    : "");
+}
+
+#ifdef STE_STAGE_ACCT
+/*****************************************************************************
+ * ste_acct_self()
+ *
+ * 呼び出したスレッド用の計測結果を返す。初回呼び出し時に登録する。
+ *
+ * 戻り値：
+ *          スレッド用の計測結果
+ *****************************************************************************/
+ste_acct_t *
+ste_acct_self(void)
+{
+    long  idx;
+
+    if(ste_acct_my != NULL)
+        return(ste_acct_my);
+
+#ifdef STE_WINDOWS
+    idx = InterlockedIncrement(&ste_acct_nthreads) - 1;
+#else
+    idx = __sync_add_and_fetch(&ste_acct_nthreads, 1) - 1;
+#endif
+    if(idx >= STE_ACCT_MAX_THREADS)
+        idx = STE_ACCT_MAX_THREADS;
+#ifdef STE_WINDOWS
+    ste_acct_table[idx].tid = GetCurrentThreadId();
+#else
+    ste_acct_table[idx].tid = (unsigned int)pthread_self();
+#endif
+    ste_acct_my = &ste_acct_table[idx];
+    return(ste_acct_my);
+}
+
+/*****************************************************************************
+ * ste_acct_print()
+ *
+ * スレッド毎のステージ毎の計測結果を書き出す。フレームあたりのサイクル数と
+ * システムコール数を出す。
+ *
+ *  引数：
+ *           fp   : 書き出し先
+ *****************************************************************************/
+void
+ste_acct_print(FILE *fp)
+{
+    ste_acct_t   *acct;
+    ste_uint64_t  syscalls;
+    double        frames;
+    long          nthreads;
+    long          i;
+    int           stage;
+
+    nthreads = ste_acct_nthreads;
+    if(nthreads > STE_ACCT_MAX_THREADS + 1)
+        nthreads = STE_ACCT_MAX_THREADS + 1;
+
+    for(i = 0 ; i < nthreads ; i++){
+        acct = &ste_acct_table[i];
+        if(acct->frames == 0)
+            continue;
+        frames = (double)acct->frames;
+        syscalls = acct->calls[STE_STAGE_SOCK_RECV] + acct->calls[STE_STAGE_SOCK_SEND] +
+            acct->calls[STE_STAGE_STE_READ] + acct->calls[STE_STAGE_STE_WRITE];
+
+        fprintf(fp, "acct thread=%u unit=%s frames=" STE_U64_FMT " syscalls/frame=%.2f\n",
+                acct->tid, STE_ACCT_UNIT, acct->frames, (double)syscalls / frames);
+        for(stage = 0 ; stage < STE_STAGE_MAX ; stage++){
+            if(acct->calls[stage] == 0)
+                continue;
+            fprintf(fp, "acct thread=%u stage=%s calls=" STE_U64_FMT " cycles=" STE_U64_FMT
+                    " cycles/frame=%.0f cycles/call=%.0f\n",
+                    acct->tid, ste_acct_stagename[stage], acct->calls[stage], acct->cycles[stage],
+                    (double)acct->cycles[stage] / frames,
+                    (double)acct->cycles[stage] / (double)acct->calls[stage]);
+        }
+    }
+}
+#endif /* #ifdef STE_STAGE_ACCT */
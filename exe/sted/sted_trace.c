@@ -0,0 +1,673 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_trace.c
+ *
+ * sted と stehub が共通で使うトレース（非同期バイナリログ）とログファイル
+ * 出力用のルーチン。stehub からも ..\sted\sted_trace.c としてコンパイルされる。
+ *
+ *  o データパスからはフォーマット ID と引数だけをスレッド毎のリングバッファ
+ *    に書き込む（ste_trace_write(), ste_trace_dump()）。ロックも、vsprintf()
+ *    も、WriteFile() も呼ばない。
+ *  o drain スレッドが定期的にリングバッファを読み出し、フォーマットして
+ *    まとめてログに書き出す。
+ *  o ログファイルは STE_LOG_ROTATE_SIZE を超えるとローテートする。
+ *  o カテゴリ毎にサンプリングレートを設定でき、N 回に 1 回だけ記録する
+ *    ことができる。本番環境でもトレースを有効にしたままにするため。
+ *
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/time.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "sted.h"
+#include "sted_trace.h"
+#include "sted_probe.h"
+
+#if defined(STE_ETW) && defined(STE_WINDOWS)
+/*
+ * プローブ用の TraceLogging の provider "Ste"
+ * {5b6c9a3e-7d1f-4f0b-9c2e-8a4d1e6f3b27}
+ */
+TRACELOGGING_DEFINE_PROVIDER(ste_etw_provider, "Ste",
+    (0x5b6c9a3e, 0x7d1f, 0x4f0b, 0x9c, 0x2e, 0x8a, 0x4d, 0x1e, 0x6f, 0x3b, 0x27));
+#endif
+
+/*
+ * フォーマット ID 毎のカテゴリとフォーマットのテーブル
+ */
+#define TRCFMT(id, cat, fmt) { STE_TRC_CAT_##cat, fmt },
+static struct ste_trace_fmt {
+    int   cat;
+    char *fmt;
+} ste_trace_fmts[] = {
+    { 0, "" },          /* TRC_NONE */
+    STE_TRACE_FORMATS
+};
+#undef TRCFMT
+
+static char *ste_trace_catname[STE_TRC_CAT_MAX] = { "ste", "sock", "hub", "dump" };
+
+/*
+ * カテゴリ毎のサンプリングレート
+ *  0 : 記録しない
+ *  1 : 全て記録する（デフォルト）
+ *  N : N 回に 1 回記録する
+ */
+static unsigned int ste_trace_sample[STE_TRC_CAT_MAX] = { 1, 1, 1, 1 };
+
+static ste_trace_ring_t         *ste_trace_rings[STE_TRACE_MAX_RINGS];
+static volatile long             ste_trace_nrings = 0;
+static volatile int              ste_trace_running = 0;
+static STE_THREAD_LOCAL ste_trace_ring_t *ste_trace_myring = NULL;
+static STE_THREAD_LOCAL int      ste_trace_noring = 0;
+static char                      ste_trace_outbuf[STE_TRACE_OUTBUFSIZE];
+
+static char                      ste_log_path[STE_LOG_PATH_MAX];
+static int                       ste_log_dest = STE_LOG_DEST_STDERR;
+static unsigned long             ste_log_size = 0;
+#ifdef STE_WINDOWS
+static HANDLE                    ste_log_handle = INVALID_HANDLE_VALUE;
+static HANDLE                    ste_trace_thread = NULL;
+static CRITICAL_SECTION          ste_log_lock;
+#define STE_MEMBAR()             MemoryBarrier()
+#else
+static FILE                     *ste_log_fp = NULL;
+static pthread_t                 ste_trace_thread;
+static pthread_mutex_t           ste_log_lock = PTHREAD_MUTEX_INITIALIZER;
+#define STE_MEMBAR()             __sync_synchronize()
+#endif
+
+static ste_trace_ring_t *ste_trace_getring(void);
+static void              ste_trace_put(ste_trace_ring_t *, ste_trace_rec_t *, unsigned char *);
+static int               ste_trace_drain(void);
+static int               ste_trace_format(ste_trace_rec_t *, char *, int);
+static void              ste_log_rotate(void);
+
+/*****************************************************************************
+ * ste_time_usec()
+ *
+ * 単調増加する時刻を usec 単位で返す。トレースや統計情報のタイムスタンプ用。
+ *****************************************************************************/
+ste_uint64_t
+ste_time_usec(void)
+{
+#ifdef STE_WINDOWS
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER        count;
+
+    if(freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return((ste_uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 +
+           (ste_uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return((ste_uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+#endif
+}
+
+/*****************************************************************************
+ * ste_trace_getring()
+ *
+ * 呼び出したスレッド用のリングバッファを返す。初回呼び出し時に確保する。
+ *
+ * 戻り値：
+ *          正常時 : リングバッファ
+ *          障害時 : NULL (リングバッファ数が上限に達した)
+ *****************************************************************************/
+static ste_trace_ring_t *
+ste_trace_getring(void)
+{
+    ste_trace_ring_t *ring;
+    long              idx;
+
+    if(ste_trace_myring != NULL)
+        return(ste_trace_myring);
+    if(ste_trace_noring)
+        return(NULL);
+
+#ifdef STE_WINDOWS
+    idx = InterlockedIncrement(&ste_trace_nrings) - 1;
+#else
+    idx = __sync_add_and_fetch(&ste_trace_nrings, 1) - 1;
+#endif
+    if(idx >= STE_TRACE_MAX_RINGS || (ring = malloc(sizeof(ste_trace_ring_t))) == NULL){
+        ste_trace_noring = 1;
+        return(NULL);
+    }
+    memset(ring, 0x0, sizeof(ste_trace_ring_t) - STE_TRACE_RINGSIZE);
+#ifdef STE_WINDOWS
+    ring->tid = GetCurrentThreadId();
+#else
+    ring->tid = (unsigned int)pthread_self();
+#endif
+    STE_MEMBAR();
+    ste_trace_rings[idx] = ring;
+    ste_trace_myring = ring;
+    return(ring);
+}
+
+/*****************************************************************************
+ * ste_trace_put()
+ *
+ * レコードをリングバッファに書き込む。リングバッファの末尾にレコードが
+ * 収まらない場合は TRC_NONE の詰め物を書いて先頭に戻る。空きが無い場合は
+ * レコードを捨てて dropped を数える（データパスを待たせないため）。
+ *
+ *  引数：
+ *           ring : リングバッファ
+ *           rec  : レコードのヘッダ（reclen, bloblen は設定済み）
+ *           blob : ダンプデータ（無ければ NULL）
+ *****************************************************************************/
+static void
+ste_trace_put(ste_trace_ring_t *ring, ste_trace_rec_t *rec, unsigned char *blob)
+{
+    unsigned int     head = ring->head;
+    unsigned int     off  = head & (STE_TRACE_RINGSIZE - 1);
+    unsigned int     need = rec->reclen;
+    ste_trace_rec_t *pad;
+
+    if(off + rec->reclen > STE_TRACE_RINGSIZE)
+        need += STE_TRACE_RINGSIZE - off;
+
+    if(head - ring->tail + need > STE_TRACE_RINGSIZE){
+        ring->dropped++;
+        return;
+    }
+
+    if(off + rec->reclen > STE_TRACE_RINGSIZE){
+        pad = (ste_trace_rec_t *)(ring->buf + off);
+        pad->id = TRC_NONE;
+        pad->reclen = (unsigned short)(STE_TRACE_RINGSIZE - off);
+        head += STE_TRACE_RINGSIZE - off;
+        off = 0;
+    }
+
+    memcpy(ring->buf + off, rec, sizeof(ste_trace_rec_t));
+    if(rec->bloblen)
+        memcpy(ring->buf + off + sizeof(ste_trace_rec_t), blob, rec->bloblen);
+
+    /* レコードを書き終えてから head を進める */
+    STE_MEMBAR();
+    ring->head = head + rec->reclen;
+}
+
+/*****************************************************************************
+ * ste_trace_write()
+ *
+ * トレースを記録する。STE_TRACEn() マクロから呼ばれる。
+ *
+ *  引数：
+ *           id    : フォーマット ID (TRC_XXX)
+ *           a0-a3 : フォーマットに渡す引数
+ *****************************************************************************/
+void
+ste_trace_write(int id, unsigned int a0, unsigned int a1, unsigned int a2, unsigned int a3)
+{
+    ste_trace_ring_t *ring;
+    ste_trace_rec_t   rec;
+    int               cat = ste_trace_fmts[id].cat;
+    unsigned int      rate = ste_trace_sample[cat];
+
+    if(rate == 0 || ste_trace_running == 0)
+        return;
+    if((ring = ste_trace_getring()) == NULL)
+        return;
+    if(rate > 1 && (++ring->sample_cnt[cat] % rate) != 0)
+        return;
+
+    rec.id = (unsigned short)id;
+    rec.reclen = STE_TRACE_RECALIGN;
+    rec.bloblen = 0;
+    rec.reserved = 0;
+    rec.usec = ste_time_usec();
+    rec.args[0] = a0;
+    rec.args[1] = a1;
+    rec.args[2] = a2;
+    rec.args[3] = a3;
+
+    ste_trace_put(ring, &rec, NULL);
+}
+
+/*****************************************************************************
+ * ste_trace_dump()
+ *
+ * データを 16 進ダンプ用のレコードとして記録する。STE_TRACE_MAX_BLOB を
+ * 超えた分は記録しない。
+ *
+ *  引数：
+ *           data : ダンプするデータ
+ *           len  : データ長
+ *****************************************************************************/
+void
+ste_trace_dump(unsigned char *data, int len)
+{
+    ste_trace_ring_t *ring;
+    ste_trace_rec_t   rec;
+    unsigned int      rate = ste_trace_sample[STE_TRC_CAT_DUMP];
+
+    if(rate == 0 || ste_trace_running == 0 || len <= 0)
+        return;
+    if((ring = ste_trace_getring()) == NULL)
+        return;
+    if(rate > 1 && (++ring->sample_cnt[STE_TRC_CAT_DUMP] % rate) != 0)
+        return;
+
+    memset(&rec, 0x0, sizeof(rec));
+    rec.id = TRC_DUMP;
+    rec.args[0] = len;
+    if(len > STE_TRACE_MAX_BLOB)
+        len = STE_TRACE_MAX_BLOB;
+    rec.bloblen = (unsigned short)len;
+    rec.reclen = (unsigned short)((sizeof(ste_trace_rec_t) + len + STE_TRACE_RECALIGN - 1)
+                                  & ~(STE_TRACE_RECALIGN - 1));
+    rec.usec = ste_time_usec();
+
+    ste_trace_put(ring, &rec, data);
+}
+
+/*****************************************************************************
+ * ste_trace_format()
+ *
+ * レコードを文字列にフォーマットする。drain スレッドから呼ばれる。
+ *
+ *  引数：
+ *           rec    : レコード
+ *           out    : 出力先
+ *           outlen : 出力先のサイズ
+ * 戻り値：
+ *          書き込んだ文字数
+ *****************************************************************************/
+static int
+ste_trace_format(ste_trace_rec_t *rec, char *out, int outlen)
+{
+    unsigned char *data;
+    int            i, len = 0;
+
+    if(rec->id >= TRC_MAX)
+        return(0);
+
+    if(rec->id != TRC_DUMP){
+        len = STE_SNPRINTF(out, outlen, ste_trace_fmts[rec->id].fmt,
+                           rec->args[0], rec->args[1], rec->args[2], rec->args[3]);
+        return((len < 0 || len >= outlen) ? 0 : len);
+    }
+
+    /* print_err() で出力していた頃と同じ形式でダンプする */
+    data = (unsigned char *)rec + sizeof(ste_trace_rec_t);
+    for (i = 0; i < rec->bloblen && outlen - len > 32; i++){
+        if(i % 16 == 0)
+            len += STE_SNPRINTF(out + len, outlen - len, "\n%04d: ", i);
+        len += STE_SNPRINTF(out + len, outlen - len, "%02x ", data[i] & 0xff);
+    }
+    len += STE_SNPRINTF(out + len, outlen - len, "\n\n");
+    return(len);
+}
+
+/*****************************************************************************
+ * ste_trace_drain()
+ *
+ * 全てのリングバッファからレコードを読み出し、フォーマットしてログに
+ * 書き出す。
+ *
+ * 戻り値：
+ *          読み出したレコード数
+ *****************************************************************************/
+static int
+ste_trace_drain(void)
+{
+    ste_trace_ring_t *ring;
+    ste_trace_rec_t  *rec;
+    unsigned int      head, tail, off, dropped;
+    int               i, nrings, outlen = 0, nrec = 0;
+    /* 1 レコード分のフォーマットに必要な最大サイズ */
+    int               margin = STE_TRACE_MAX_BLOB * 3 + (STE_TRACE_MAX_BLOB / 16) * 8 + 512;
+
+    nrings = (int)ste_trace_nrings;
+    if(nrings > STE_TRACE_MAX_RINGS)
+        nrings = STE_TRACE_MAX_RINGS;
+
+    for(i = 0 ; i < nrings ; i++){
+        if((ring = ste_trace_rings[i]) == NULL)
+            continue;
+
+        head = ring->head;
+        tail = ring->tail;
+        /* head を読んでからレコードを読む */
+        STE_MEMBAR();
+
+        while(tail != head){
+            off = tail & (STE_TRACE_RINGSIZE - 1);
+            rec = (ste_trace_rec_t *)(ring->buf + off);
+            if(rec->id == TRC_NONE){
+                tail += STE_TRACE_RINGSIZE - off;
+                continue;
+            }
+            if(STE_TRACE_OUTBUFSIZE - outlen < margin){
+                ste_log_write(LOG_DEBUG, ste_trace_outbuf, outlen);
+                outlen = 0;
+            }
+            outlen += ste_trace_format(rec, ste_trace_outbuf + outlen, STE_TRACE_OUTBUFSIZE - outlen);
+            tail += rec->reclen;
+            nrec++;
+        }
+        STE_MEMBAR();
+        ring->tail = tail;
+
+        dropped = ring->dropped;
+        if(dropped != ring->reported){
+            outlen += STE_SNPRINTF(ste_trace_outbuf + outlen, STE_TRACE_OUTBUFSIZE - outlen,
+                                   "trace: %u records dropped (thread %u)\n",
+                                   dropped - ring->reported, ring->tid);
+            ring->reported = dropped;
+        }
+    }
+    if(outlen > 0)
+        ste_log_write(LOG_DEBUG, ste_trace_outbuf, outlen);
+
+    return(nrec);
+}
+
+/*****************************************************************************
+ * ste_trace_thread_main()
+ *
+ * drain スレッドのメインルーチン。ste_trace_fini() が呼ばれるまで
+ * STE_TRACE_DRAIN_MSEC 毎にリングバッファを読み出す。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+static DWORD WINAPI
+ste_trace_thread_main(LPVOID arg)
+#else
+static void *
+ste_trace_thread_main(void *arg)
+#endif
+{
+    (void)arg;
+    while(ste_trace_running){
+        if(ste_trace_drain() == 0){
+#ifdef STE_WINDOWS
+            Sleep(STE_TRACE_DRAIN_MSEC);
+#else
+            usleep(STE_TRACE_DRAIN_MSEC * 1000);
+#endif
+        }
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_trace_init()
+ *
+ * drain スレッドを起動する。ste_log_open() の後に呼ぶこと。
+ * STE_ETW 付きでコンパイルされた場合はプローブ用の ETW provider も登録する。
+ *
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+ste_trace_init(void)
+{
+#if defined(STE_ETW) && defined(STE_WINDOWS)
+    TraceLoggingRegister(ste_etw_provider);
+#endif
+    ste_trace_running = 1;
+#ifdef STE_WINDOWS
+    if((ste_trace_thread = CreateThread(NULL, 0, ste_trace_thread_main, NULL, 0, NULL)) == NULL){
+        ste_trace_running = 0;
+        return(-1);
+    }
+    SetThreadPriority(ste_trace_thread, THREAD_PRIORITY_BELOW_NORMAL);
+#else
+    if(pthread_create(&ste_trace_thread, NULL, ste_trace_thread_main, NULL) != 0){
+        ste_trace_running = 0;
+        return(-1);
+    }
+#endif
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_trace_fini()
+ *
+ * drain スレッドを停止し、リングバッファに残っているレコードを書き出す。
+ * drain スレッドが終わるのを待ってから書き出す（2 つが同時に書き出さない
+ * ように）。
+ *****************************************************************************/
+void
+ste_trace_fini(void)
+{
+#if defined(STE_ETW) && defined(STE_WINDOWS)
+    TraceLoggingUnregister(ste_etw_provider);
+#endif
+    if(ste_trace_running == 0)
+        return;
+    ste_trace_running = 0;
+#ifdef STE_WINDOWS
+    WaitForSingleObject(ste_trace_thread, INFINITE);
+    CloseHandle(ste_trace_thread);
+    ste_trace_thread = NULL;
+#else
+    pthread_join(ste_trace_thread, NULL);
+#endif
+    ste_trace_drain();
+}
+
+/*****************************************************************************
+ * ste_trace_set_sample()
+ *
+ * カテゴリ毎のサンプリングレートを設定する。
+ *
+ *  引数：
+ *           spec : "カテゴリ名=レート" をカンマで区切ったもの。
+ *                  例) "sock=100,dump=0"
+ *                  カテゴリ名に all を指定すると全カテゴリに設定する。
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+ste_trace_set_sample(char *spec)
+{
+    char *name, *rate;
+    int   i, found;
+
+    for(name = strtok(spec, ",") ; name != NULL ; name = strtok(NULL, ",")){
+        if((rate = strchr(name, '=')) == NULL)
+            return(-1);
+        *rate++ = '\0';
+        found = 0;
+        for(i = 0 ; i < STE_TRC_CAT_MAX ; i++){
+            if(strcmp(name, "all") == 0 || strcmp(name, ste_trace_catname[i]) == 0){
+                ste_trace_sample[i] = (unsigned int)atoi(rate);
+                found = 1;
+            }
+        }
+        if(found == 0)
+            return(-1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_log_open()
+ *
+ * ログファイルをオープンし、ログの出力先を設定する。
+ *
+ *  引数：
+ *           path : ログファイルのパス
+ *           dest : ログの出力先 (STE_LOG_DEST_XXX)
+ * 戻り値：
+ *          正常時 : 0
+ *          障害時 : -1
+ *****************************************************************************/
+int
+ste_log_open(char *path, int dest)
+{
+    strncpy(ste_log_path, path, STE_LOG_PATH_MAX - 1);
+    ste_log_dest = dest;
+    ste_log_size = 0;
+#ifdef STE_WINDOWS
+    InitializeCriticalSection(&ste_log_lock);
+    ste_log_handle = CreateFile(ste_log_path,
+                                GENERIC_READ|GENERIC_WRITE,
+                                FILE_SHARE_READ| FILE_SHARE_WRITE,
+                                NULL,
+                                CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL,
+                                NULL);
+    if(ste_log_handle == INVALID_HANDLE_VALUE)
+        return(-1);
+    SetFilePointer(ste_log_handle, 0, NULL, FILE_END);
+#else
+    if(dest == STE_LOG_DEST_FILE && (ste_log_fp = fopen(ste_log_path, "w")) == NULL)
+        return(-1);
+#endif
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_log_setdest()
+ *
+ * ログの出力先を変更する。
+ *
+ *  引数：
+ *           dest : ログの出力先 (STE_LOG_DEST_XXX)
+ *****************************************************************************/
+void
+ste_log_setdest(int dest)
+{
+    ste_log_dest = dest;
+}
+
+/*****************************************************************************
+ * ste_log_rotate()
+ *
+ * ログファイルを path.1 -> path.2 ... の様にずらし、新しいログファイルを
+ * オープンする。ste_log_lock を取得した状態で呼ぶこと。
+ *****************************************************************************/
+static void
+ste_log_rotate(void)
+{
+    char from[STE_LOG_PATH_MAX + 4];
+    char to[STE_LOG_PATH_MAX + 4];
+    int  gen;
+
+    for(gen = STE_LOG_GENERATIONS - 1 ; gen > 0 ; gen--){
+        sprintf(from, "%s.%d", ste_log_path, gen);
+        sprintf(to, "%s.%d", ste_log_path, gen + 1);
+#ifdef STE_WINDOWS
+        MoveFileEx(from, to, MOVEFILE_REPLACE_EXISTING);
+#else
+        rename(from, to);
+#endif
+    }
+    sprintf(to, "%s.1", ste_log_path);
+#ifdef STE_WINDOWS
+    CloseHandle(ste_log_handle);
+    MoveFileEx(ste_log_path, to, MOVEFILE_REPLACE_EXISTING);
+    ste_log_handle = CreateFile(ste_log_path,
+                                GENERIC_READ|GENERIC_WRITE,
+                                FILE_SHARE_READ| FILE_SHARE_WRITE,
+                                NULL,
+                                CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL,
+                                NULL);
+#else
+    fclose(ste_log_fp);
+    rename(ste_log_path, to);
+    ste_log_fp = fopen(ste_log_path, "w");
+#endif
+    ste_log_size = 0;
+}
+
+/*****************************************************************************
+ * ste_log_write()
+ *
+ * フォーマット済みのメッセージをログの出力先に書き出す。print_err() と
+ * drain スレッドの両方から呼ばれるので、ロックを取って書き込む。
+ *
+ *  引数：
+ *           level : syslog のレベル (syslog に出力する場合のみ使用)
+ *           buf   : メッセージ
+ *           len   : メッセージ長
+ *****************************************************************************/
+void
+ste_log_write(int level, char *buf, int len)
+{
+#ifdef STE_WINDOWS
+    DWORD written;
+#endif
+
+    switch(ste_log_dest){
+        case STE_LOG_DEST_STDOUT:
+            fwrite(buf, 1, len, stdout);
+            return;
+        case STE_LOG_DEST_STDERR:
+            fwrite(buf, 1, len, stderr);
+            return;
+#ifndef STE_WINDOWS
+        case STE_LOG_DEST_SYSLOG:
+            syslog(level, "%.*s", len, buf);
+            return;
+#endif
+        default:
+            break;
+    }
+
+#ifdef STE_WINDOWS
+    EnterCriticalSection(&ste_log_lock);
+    if(ste_log_handle != INVALID_HANDLE_VALUE){
+        WriteFile(ste_log_handle, buf, len, &written, NULL);
+        ste_log_size += len;
+        if(ste_log_size > STE_LOG_ROTATE_SIZE)
+            ste_log_rotate();
+    }
+    LeaveCriticalSection(&ste_log_lock);
+#else
+    pthread_mutex_lock(&ste_log_lock);
+    if(ste_log_fp != NULL){
+        fwrite(buf, 1, len, ste_log_fp);
+        fflush(ste_log_fp);
+        ste_log_size += len;
+        if(ste_log_size > STE_LOG_ROTATE_SIZE)
+            ste_log_rotate();
+    }
+    pthread_mutex_unlock(&ste_log_lock);
+#endif
+}
@@ -0,0 +1,221 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_tune.c
+ *
+ * sted と stehub が共通で使うトランスポートのチューニングのルーチン。
+ * stehub からも ..\sted\sted_tune.c としてコンパイルされる。
+ *
+ *  o 設定に失敗しても接続は続ける（OS のデフォルトのまま送受信する）。
+ *  o OS が実際に確保したサイズは OS によって違う（Linux は設定した値の
+ *    2 倍を返す）ので、統計情報には設定した値を入れる。
+ *****************************************************************************/
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mstcpip.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include "sted.h"
+#include "sted_tune.h"
+
+static int           ste_tune_set(int, int, int, unsigned int);
+static unsigned int  ste_tune_clamp(ste_uint64_t, unsigned int, unsigned int);
+static int           ste_tune_differ(unsigned int, unsigned int);
+
+/*****************************************************************************
+ * ste_tune_open()
+ *
+ * HUB（sted）との TCP の接続ができたら呼ぶ。TCP_NODELAY を設定し、今の
+ * socket バッファのサイズを統計情報に入れる。ste_stats_init() の後に呼ぶこと。
+ *
+ *  引数：
+ *           fd    : 接続した socket
+ *           lowat : TCP_NOTSENT_LOWAT も設定する（送りきれなかった分を自分で
+ *                   取っておける場合だけ 1 にする）
+ *           cs    : 接続毎の統計情報
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_tune_open(int fd, int lowat, ste_connstat_t *cs)
+{
+    int        val;
+    socklen_t  len;
+
+    ste_tune_set(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+
+    len = sizeof(val);
+    if(getsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char *)&val, &len) == 0 && val > 0)
+        cs->sndbuf = (unsigned int)val;
+    len = sizeof(val);
+    if(getsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char *)&val, &len) == 0 && val > 0)
+        cs->rcvbuf = (unsigned int)val;
+#ifdef TCP_NOTSENT_LOWAT
+    if(lowat && ste_tune_set(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, STE_TUNE_LOWAT_MIN) == 0)
+        cs->lowat = STE_TUNE_LOWAT_MIN;
+#endif
+    cs->tune_usec = ste_time_usec();
+    cs->tune_ibytes = cs->ibytes;
+    cs->tune_odrops = cs->odrops;
+}
+
+/*****************************************************************************
+ * ste_tune_update()
+ *
+ * ste_stats_sample() で求めた delivery rate と RTT から BDP を求め、socket
+ * バッファのサイズを調整する。RTT は TCP_INFO から取れなければ、ハート
+ * ビートで測ったもの（hbrtt_us）を使う。どちらも無ければ何もしない。
+ * delivery rate は TCP_INFO から取れた場合だけ有効なので、取れなければ
+ * 受信側だけを調整する。
+ *
+ *  引数：
+ *           fd : 対象の socket（TCP）
+ *           cs : 接続毎の統計情報
+ * 戻り値：
+ *           無し
+ *****************************************************************************/
+void
+ste_tune_update(int fd, ste_connstat_t *cs)
+{
+    ste_uint64_t   now = ste_time_usec();
+    ste_uint64_t   elapsed = now - cs->tune_usec;
+    ste_uint64_t   irate = 0;
+    ste_uint64_t   bdp, ibdp;
+    unsigned int   rtt_us = cs->tcpi_valid ? cs->tcpi.rtt_us : cs->hbrtt_us;
+    unsigned int   target;
+    int            limited;
+#if defined(STE_WINDOWS) && defined(SIO_IDEAL_SEND_BACKLOG_QUERY)
+    ULONG          isb = 0;
+    DWORD          bytes = 0;
+#endif
+
+    if(elapsed > 0)
+        irate = (cs->ibytes - cs->tune_ibytes) * 1000000 / elapsed;
+    limited = (cs->odrops != cs->tune_odrops) ||
+        (cs->tcpi_valid && cs->sndbuf > 0 && cs->tcpi.unacked >= cs->sndbuf / 4 * 3);
+    cs->tune_usec = now;
+    cs->tune_ibytes = cs->ibytes;
+    cs->tune_odrops = cs->odrops;
+    if(rtt_us == 0)
+        return;
+
+    /* 受信側は大きくするだけ */
+    ibdp = irate * rtt_us / 1000000;
+    target = ste_tune_clamp(ibdp * STE_TUNE_GAIN, STE_TUNE_BUF_MIN, STE_TUNE_BUF_MAX);
+    if(target > cs->rcvbuf && ste_tune_differ(target, cs->rcvbuf) &&
+       ste_tune_set(fd, SOL_SOCKET, SO_RCVBUF, target) == 0)
+        cs->rcvbuf = target;
+
+    if(cs->tcpi_valid == 0)
+        return;
+    bdp = cs->tcpi.delivery_rate * rtt_us / 1000000;
+    cs->bdp = ste_tune_clamp(bdp, 0, STE_TUNE_BUF_MAX);
+
+    /*
+     * 送信側。頭打ちになっていれば倍にし、そうでなければ BDP に合わせて
+     * 小さくする（1 回に半分まで）。
+     */
+    target = ste_tune_clamp(bdp * STE_TUNE_GAIN, STE_TUNE_BUF_MIN, STE_TUNE_BUF_MAX);
+    if(limited && target < cs->sndbuf * 2)
+        target = ste_tune_clamp((ste_uint64_t)cs->sndbuf * 2, STE_TUNE_BUF_MIN, STE_TUNE_BUF_MAX);
+    if(target < cs->sndbuf / 2)
+        target = cs->sndbuf / 2;
+#if defined(STE_WINDOWS) && defined(SIO_IDEAL_SEND_BACKLOG_QUERY)
+    if(WSAIoctl((SOCKET)fd, SIO_IDEAL_SEND_BACKLOG_QUERY, NULL, 0, &isb, sizeof(isb),
+                &bytes, NULL, NULL) == 0 && isb > target)
+        target = ste_tune_clamp(isb, STE_TUNE_BUF_MIN, STE_TUNE_BUF_MAX);
+#endif
+    if(ste_tune_differ(target, cs->sndbuf) &&
+       ste_tune_set(fd, SOL_SOCKET, SO_SNDBUF, target) == 0)
+        cs->sndbuf = target;
+
+#ifdef TCP_NOTSENT_LOWAT
+    /* 未送信のデータは BDP の半分まで。足りなければ stehub の送信キューに残る */
+    if(cs->lowat != 0){
+        target = ste_tune_clamp(bdp / 2, STE_TUNE_LOWAT_MIN, STE_TUNE_LOWAT_MAX);
+        if(ste_tune_differ(target, cs->lowat) &&
+           ste_tune_set(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, target) == 0)
+            cs->lowat = target;
+    }
+#endif
+}
+
+/*****************************************************************************
+ * ste_tune_set()
+ *
+ * socket オプションに整数の値を設定する。
+ *****************************************************************************/
+static int
+ste_tune_set(int fd, int level, int name, unsigned int value)
+{
+    int val = (int)value;
+
+    if(setsockopt(fd, level, name, (char *)&val, sizeof(val)) < 0){
+        SET_ERRNO();
+        return(-1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * ste_tune_clamp()
+ *
+ * 値を min 以上 max 以下に収める。
+ *****************************************************************************/
+static unsigned int
+ste_tune_clamp(ste_uint64_t value, unsigned int min, unsigned int max)
+{
+    if(value < min)
+        return(min);
+    if(value > max)
+        return(max);
+    return((unsigned int)value);
+}
+
+/*****************************************************************************
+ * ste_tune_differ()
+ *
+ * 新しい値が今の値と STE_TUNE_HYST_PCT % 以上違うかどうかを返す。
+ * 細かく設定し直さないため。
+ *****************************************************************************/
+static int
+ste_tune_differ(unsigned int target, unsigned int cur)
+{
+    ste_uint64_t diff = (target > cur) ? target - cur : cur - target;
+
+    return(diff * 100 >= (ste_uint64_t)cur * STE_TUNE_HYST_PCT);
+}
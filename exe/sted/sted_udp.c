@@ -0,0 +1,180 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/****************************************************************************
+ * sted_udp.c
+ *
+ * UDP トランスポートのデータグラムをまとめて送受信するルーチン。
+ * stehub から ..\sted\sted_udp.c としてコンパイルされる。
+ *
+ *  o Linux では recvmmsg()/sendmmsg() で STE_UDP_BATCH 個までのデータグラムを
+ *    1 回のシステムコールで送受信する。
+ *  o それ以外の OS では recvfrom()/sendto() を繰り返す。
+ *  o socket は non-blocking であること。
+ *****************************************************************************/
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* for recvmmsg(), sendmmsg() */
+#endif
+#ifdef STE_WINDOWS
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include "sted.h"
+#include "sted_udp.h"
+
+/*****************************************************************************
+ * ste_udp_put_connid()
+ *
+ * データグラムの先頭に conn id を書き込む。
+ *****************************************************************************/
+void
+ste_udp_put_connid(unsigned char *p, unsigned int connid)
+{
+    p[0] = (unsigned char)(connid >> 24);
+    p[1] = (unsigned char)(connid >> 16);
+    p[2] = (unsigned char)(connid >> 8);
+    p[3] = (unsigned char)connid;
+}
+
+/*****************************************************************************
+ * ste_udp_recv()
+ *
+ * 届いているデータグラムをまとめて受信する。
+ *
+ *  引数：
+ *           fd      : UDP の socket
+ *           v       : v->buf に受信バッファを設定しておく。len と addr を返す
+ *           bufsize : 受信バッファ 1 つのサイズ
+ * 戻り値：
+ *          正常時 : 受信したデータグラム数（届いていなければ 0）
+ *          障害時 : -1
+ *****************************************************************************/
+int
+ste_udp_recv(int fd, ste_udp_vec_t *v, int bufsize)
+{
+#if defined(__linux__)
+    struct mmsghdr msgs[STE_UDP_BATCH];
+    struct iovec   iov[STE_UDP_BATCH];
+    int            i, n;
+
+    memset(msgs, 0x0, sizeof(msgs));
+    for(i = 0 ; i < STE_UDP_BATCH ; i++){
+        iov[i].iov_base = v->buf[i];
+        iov[i].iov_len = bufsize;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &v->addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    if((n = recvmmsg(fd, msgs, STE_UDP_BATCH, MSG_DONTWAIT, NULL)) < 0){
+        if(errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN)
+            return(0);
+        return(-1);
+    }
+    for(i = 0 ; i < n ; i++)
+        v->len[i] = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? -1 : (int)msgs[i].msg_len;
+    return(n);
+#else
+    int n, ret;
+    int addrlen;
+
+    for(n = 0 ; n < STE_UDP_BATCH ; n++){
+        addrlen = sizeof(struct sockaddr_in);
+        ret = recvfrom(fd, (char *)v->buf[n], bufsize, 0, (struct sockaddr *)&v->addr[n], &addrlen);
+        if(ret < 0){
+            SET_ERRNO();
+            if(errno == EINTR || errno == EWOULDBLOCK)
+                break;
+#ifdef STE_WINDOWS
+            /* 送信先から ICMP port unreachable が返ってきただけ */
+            if(errno == WSAECONNRESET)
+                continue;
+#endif
+            return(n > 0 ? n : -1);
+        }
+        v->len[n] = ret;
+    }
+    return(n);
+#endif
+}
+
+/*****************************************************************************
+ * ste_udp_send()
+ *
+ * データグラムをまとめて送信する。EWOULDBLOCK 等で送れなかったものは
+ * 捨てる（UDP なので、失われたフレームは中の TCP が再送する）。
+ *
+ *  引数：
+ *           fd : UDP の socket
+ *           v  : 送信するデータグラムの表
+ *           n  : データグラム数
+ * 戻り値：
+ *          送信できたデータグラム数（先頭から）
+ *****************************************************************************/
+int
+ste_udp_send(int fd, ste_udp_vec_t *v, int n)
+{
+#if defined(__linux__)
+    struct mmsghdr msgs[STE_UDP_BATCH];
+    struct iovec   iov[STE_UDP_BATCH];
+    int            i, ret;
+    int            sent = 0;
+
+    memset(msgs, 0x0, sizeof(msgs));
+    for(i = 0 ; i < n ; i++){
+        iov[i].iov_base = v->buf[i];
+        iov[i].iov_len = v->len[i];
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &v->addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    /* 途中までしか送れなかった場合は残りを送り直す */
+    while(sent < n){
+        if((ret = sendmmsg(fd, msgs + sent, n - sent, MSG_DONTWAIT)) <= 0)
+            break;
+        sent += ret;
+    }
+    return(sent);
+#else
+    int sent;
+
+    for(sent = 0 ; sent < n ; sent++){
+        if(sendto(fd, (char *)v->buf[sent], v->len[sent], 0, (struct sockaddr *)&v->addr[sent],
+                  sizeof(struct sockaddr_in)) < 0)
+            break;
+    }
+    return(sent);
+#endif
+}
@@ -31,9 +31,12 @@
  * 仮想ハブ。仮想 NIC デーモンからの Ethernet フレームを受け取り、
  * 他の仮想 NIC デーモンへ転送する役割を持つユーザプロセス。
  *
- *  gcc stehub.c -o stehub -lsocket -lnsl
+ *  gcc stehub.c ../sted/sted_trace.c ../sted/sted_stats.c ../sted/sted_flight.c \
+ *      ../sted/sted_proto.c ../sted/sted_lz.c ../sted/sted_hc.c ../sted/sted_aead.c \
+ *      ../sted/sted_udp.c ../sted/sted_fec.c ../sted/sted_replay.c ../sted/sted_tune.c \
+ *      ../sted/sted_aqm.c -o stehub -lsocket -lnsl -lpthread
  *
- * Usage: stehub [ -I | -U ] [ -p port] [-d level]
+ * Usage: stehub [ -I | -U ] [ -p port] [-d level] [-t cat=rate,...] [-l usec] [-m mtu] [-k keyfile]
  *
  *       -I : サービスとして登録。
  *       -U : 登録解除
@@ -45,6 +48,59 @@
  *     引数:
  *        -p port  仮想 NIC デーモンからの接続を待ち受けるポート番号を指定する。
  *                 指定されなければ、デフォルトで 80 が使われる。
+ *        -t cat=rate,...
+ *                 トレースのカテゴリ毎のサンプリングレート。rate 回に 1 回
+ *                 だけトレースを記録する。0 なら記録しない。
+ *        -l usec  フレームの滞留時間（受信から送信まで）の閾値。これを超えた
+ *                 フレームがあると、直近のフレームのイベントを STEHUB_FLIGHT_FILE
+ *                 に書き出す。デフォルトは 20000(20ms)。0 なら書き出さない。
+ *        -m mtu   受け付けるフレームサイズ（ヘッダ込み）の上限。sted とは
+ *                 STE_MSG_HELLO で小さい方に合わせる。デフォルトは STE_FRAME_MAX。
+ *        -k keyfile
+ *                 sted との間のメッセージを ChaCha20-Poly1305 で暗号化・認証
+ *                 する。keyfile には sted と共有する 32 byte の鍵を 16 進数
+ *                 64 文字で書いておく。指定した場合、暗号化に合意しない sted
+ *                 とはフレームを送受信しない。
+ *
+ * 接続毎の統計情報（送受信のカウンタと TCP の RTT, cwnd, 再送数など）は
+ * STE_STATS_INTERVAL 秒毎に STEHUB_STAT_FILE に書き出す。
+ *
+ * 受信したデータはメッセージ（sted_proto.h 参照）に分解し、フレーム毎に
+ * 他の接続の送信キューに入れる。STE_MSG_AGG に対応した sted にはフレーム
+ * をまとめて送る。送信キューが一杯ならフレーム単位で捨てるので、途中まで
+ * 送ったフレームが残ってストリームが壊れることは無い。
+ * フレームは STE_MSG_HELLO で知らされた同じセグメントの sted にだけ転送する
+ * （STE_MSG_HELLO を送ってこない古い sted はセグメント 0）。
+ * 送信先と合意した MTU より大きいフレームはその送信先には転送しない。
+ *
+ * TCP と同じポート番号で UDP も待ち受ける（sted_udp.h 参照）。UDP の sted
+ * とはデータグラムの先頭の conn id でセッションを区別し、送信キューの
+ * データグラムは全てのセッションの分をまとめて送る。送れなかったものは捨てる。
+ * sted が要求すれば FEC のパリティも送り合う（sted_fec.h 参照）。送信キューが
+ * 空になる度にパリティを送ってグループを閉じる。
+ * 1 つの sted が複数のリンクを張ってきた場合（STE_CAP_STRIPE）、同じ bundle
+ * のリンクは 1 つのポートとして扱う。bundle の中では転送せず、bundle 宛ての
+ * フレームはフローのハッシュで選んだ 1 本のリンクにだけ送る。
+ * 1 つの sted が複数の ste デバイスを 1 つの接続に多重化している場合
+ * （STE_CAP_MUX）、その sted は STE_MSG_HELLO で知らせた全てのセグメントに
+ * 属する。フレームは STE_MSG_MUX のセグメント番号で転送先を決め、その
+ * セグメントに属する sted にだけ転送する。
+ * TCP の sted とは STE_CAP_RESUME でセッションを再開できるようにする
+ * （sted_replay.h 参照）。接続が切れたセッションは STE_RESUME_HOLD_SEC 秒の
+ * 間 conn_park_head のリストに取っておき、その sted 宛てのフレームは
+ * 送り直し用のリングに入れておく。同じトークンで再接続してきたら、
+ * 接続 ID と統計情報を引き継ぎ、sted が受け取っていないフレームを
+ * 送り直す。
+ * STE_CAP_PING を合意した sted からの STE_MSG_PING には、時刻をそのまま
+ * 入れた返事を返す。接続が生きているかどうかは sted が判断する
+ * （sted_hb.h 参照）。
+ * STE_CAP_CREDIT を合意した TCP の sted には、送ってよいフレーム数と
+ * バイト数の上限を STE_MSG_CREDIT で知らせる（sted_credit.h 参照）。上限は
+ * その sted から転送する先の送信キューの空きで決めるので、混んでいる間は
+ * sted がフレームを溜め、stehub の中で捨てずに済む。
+ * 送信キューには AQM（sted_aqm.h 参照）をかける。フレーム毎に送信キューに
+ * 入れた時刻を覚えておき、送った時の滞留時間が長い状態が続いたら、送信
+ * キューを多く使っているフローのフレームから捨てるか、ECN の CE を付ける。
  *
  * 変更履歴 :
  *    o recv() の バッファサイズを 500byte から 32K bytes に変更。
@@ -72,6 +128,40 @@
  *   o recv() のエラー処理が間違っていたので修正した。
  *  2011/12/30
  *   o Service として登録できるようにした。
+ *  2026/10/19
+ *   o 転送処理中のメッセージを print_err() からトレースに変更した。
+ *     EWOULDBLOCK 時のメッセージもサンプリングして記録できる。
+ *   o 接続毎の統計情報と TCP の状態を定期的に統計ファイルに書き出すようにした。
+ *   o STE_STAGE_ACCT 付きでビルドした場合、recv/転送/send の消費サイクルを計測する。
+ *   o フライトレコーダーを追加した（-l オプション）。
+ *   o フレームの境界を解析して転送するようにし、STE_MSG_AGG に対応した。
+ *     送信先毎に送信キューを持ち、EWOULDBLOCK でもデータを捨てないようにした。
+ *   o フレーミング v2（同期ワードと CRC32C 付きのヘッダ）に対応した。
+ *   o STE_MSG_HELLO によるハンドシェイクに対応し、セグメント毎に転送するようにした。
+ *   o 小さいフレーム向けの STE_MSG_CAGG に対応した。
+ *   o MTU を接続毎に合意するようにし、ジャンボフレームに対応した（-m オプション）。
+ *   o sted が要求した場合、STE_MSG_AGG を LZ4 で圧縮した STE_MSG_ZAGG で送受信するようにした。
+ *   o sted が対応していれば、TCP/IPv4 のフレームのヘッダを圧縮して送受信する
+ *     ようにした（STE_MSG_HAGG）。コンテキストは接続毎に持つ。
+ *   o 事前共有鍵を指定した場合、sted との間を ChaCha20-Poly1305 で暗号化・認証
+ *     するようにした（-k オプション、STE_MSG_SEAL）。
+ *   o UDP でも sted と送受信するようにした。Linux では recvmmsg()/sendmmsg() で
+ *     複数のデータグラムをまとめて送受信する。
+ *   o UDP のセッションで、sted が要求した場合は FEC のパリティを送り合い、失われた
+ *     データグラムを復元するようにした。
+ *   o 同じ sted からの複数のリンクを 1 つのポートとして扱い、フロー毎にリンクを
+ *     選んで送るようにした（STE_CAP_STRIPE）。
+ *   o 1 つの接続に多重化された複数のセグメントのフレームを転送するように
+ *     した（STE_CAP_MUX）。
+ *   o 接続が切れたセッションを取っておき、再接続してきた sted との間で
+ *     フレームを失わずに再開するようにした（STE_CAP_RESUME）。
+ *   o sted のハートビート（STE_MSG_PING）に返事をするようにした（STE_CAP_PING）。
+ *   o TCP の接続の Nagle を止め、socket バッファと TCP_NOTSENT_LOWAT を
+ *     帯域遅延積に合わせて調整するようにした（sted_tune.c）。
+ *   o 転送先の送信キューの空きに応じて、sted にクレジットを与えるようにした
+ *     （STE_CAP_CREDIT）。
+ *   o 送信キューに FQ-CoDel と同様の AQM をかけ、滞留時間が長くなったら大きな
+ *     フローのフレームを捨てるか ECN の CE を付けるようにした（sted_aqm.c）。
  ***********************************************************/
 
 #ifdef STE_WINDOWS
@@ -87,9 +177,12 @@
 #include <libgen.h>     
 #include <arpa/inet.h>  
 #include <sys/time.h>   
+#define  STEHUB_STAT_FILE "/var/tmp/stehub.stat" /* 統計ファイル */
+#define  STEHUB_FLIGHT_FILE "/var/tmp/stehub.flight" /* フライトレコーダーの出力先 */
 #endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <signal.h>
 #include <errno.h>
@@ -97,9 +190,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "sted.h"
+#include "sted_trace.h"
+#include "sted_probe.h"
+#include "sted_flight.h"
+#include "sted_udp.h"
+#include "sted_tune.h"
 
 #define PORT_NO        80     /* 接続を待ち受けるデフォルトのポート番号 */
 #define SOCKBUFSIZE    32768  /* recv(), send() 用のバッファのサイズ  */
+#define OBUFSIZE       65536  /* 接続毎の送信キューのサイズ */
+#define STEHUB_FEATURES (STE_CAP_AGG | STE_CAP_SYNC | STE_CAP_PCRC | STE_CAP_COMPACT | STE_CAP_LZ4 | STE_CAP_HC | STE_CAP_AEAD | STE_CAP_FEC | STE_CAP_STRIPE | STE_CAP_MUX | STE_CAP_RESUME | STE_CAP_PING | STE_CAP_CREDIT) /* 対応している機能 */
 
 #ifdef  FD_SETSIZE
 #undef  FD_SETSIZE
@@ -109,20 +209,89 @@
 struct conn_stat {
     struct conn_stat *next;
     int fd;
+    int id;               /* 接続 ID。プローブで接続を識別するのに使う */
     struct in_addr addr;
+    ste_connstat_t stats; /* 接続毎の統計情報 */
+    unsigned int caps;    /* sted と合意した機能(STE_CAP_XXX) */
+    int        tx_flags;  /* 送信するメッセージの形式(STE_TX_XXX) */
+    unsigned int segment; /* sted のセグメント番号。同じセグメントの間でだけ転送する */
+    int        mtu;       /* sted と合意した MTU */
+    char       client_id[STE_CLIENTID_MAX + 1]; /* sted の識別名 */
+    ste_rx_t  *rx;        /* 受信データからメッセージを取り出すための状態 */
+    ste_agg_t *agg;       /* 組み立て中の STE_MSG_AGG（caps に STE_CAP_AGG がある場合） */
+    ste_hcc_t *hcc;       /* ヘッダ圧縮の状態（caps に STE_CAP_HC がある場合） */
+    ste_hcd_t *hcd;       /* ヘッダ復元の状態（同上） */
+    ste_lzc_t *lzc;       /* 圧縮の状態（caps に STE_CAP_LZ4 がある場合） */
+    ste_lzd_t *lzd;       /* 展開の状態（同上） */
+    ste_aead_t *aead;     /* 暗号化の状態（caps に STE_CAP_AEAD がある場合） */
+    ste_fec_t  *fec;      /* FEC の状態（caps に STE_CAP_FEC がある場合） */
+    unsigned char *obuf;  /* 送信キュー */
+    int        olen;      /* 送信キューに溜まっているサイズ */
+    unsigned int oldest_seq;  /* 送信キューの中の最も古いフレームの通し番号 */
+    ste_uint64_t oldest_usec; /* 同フレームを受信した時刻 */
+    int        udp;       /* UDP のセッション（fd は udp_fd を共有する） */
+    unsigned int connid;  /* UDP の conn id */
+    struct sockaddr_in peer; /* UDP の送信先（最後に正しいメッセージが届いたアドレス） */
+    ste_uint64_t last_usec;  /* UDP で最後にデータグラムが届いた時刻 */
+    int        ndgram;    /* 送信キューに溜まっているデータグラムの数（UDP） */
+    int        dgram_len[STE_UDP_QMAX]; /* 同データグラムの長さ */
+    unsigned int bundle;  /* STE_CAP_STRIPE の bundle（0 ならリンクは 1 本） */
+    int        link;      /* sted が付けたリンクの番号 */
+    int        nlinks;    /* 同じ bundle で開いているリンクの数（update_bundles() が数える） */
+    int        rank;      /* その中での順番。フローのハッシュの剰余と比べる */
+    int        nsegs;     /* 属しているセグメントの数（caps に STE_CAP_MUX がある場合は 2 以上） */
+    unsigned int segs[STE_MUX_MAX]; /* 属しているセグメント。segs[0] は segment と同じ */
+    ste_replay_t *replay; /* 送り直し用のリング（caps に STE_CAP_RESUME がある場合） */
+    unsigned char token[STE_RESUME_TOKEN]; /* セッショントークン（同上） */
+    ste_uint64_t parked_usec; /* 接続が切れた時刻（conn_park_head のリストにある場合） */
+    int        nfanin;    /* この接続に転送してくる接続の数（update_bundles() が数える） */
+    unsigned int cr_frames;     /* STE_MSG_HELLO の後に受け取ったフレーム数（STE_CAP_CREDIT） */
+    unsigned int cr_bytes;      /* 同じくバイト数（STE_CREDIT_SIZE() で数える） */
+    unsigned int cr_lim_frames; /* sted に知らせたフレーム数の上限 */
+    unsigned int cr_lim_bytes;  /* sted に知らせたバイト数の上限 */
+    ste_aqm_queue_t *aqm; /* 送信キューの AQM の状態 */
 };
 
-void  add_conn_stat(int, struct in_addr);
+struct conn_stat *add_conn_stat(int, struct in_addr);
 void  delete_conn_stat(int);
+void  free_conn_stat(struct conn_stat *);
 struct conn_stat *find_conn_stat(int);
 int   become_daemon();
 void  print_err(int, char *, ...);
 void  print_usage(char *);
+int   write_conn_stats(void);
+void  update_bundles(void);
+int   has_segment(struct conn_stat *, unsigned int);
+void  forward_frame(struct conn_stat *, unsigned int, unsigned char *, int, unsigned int, ste_uint64_t);
+int   enqueue_frame(struct conn_stat *, unsigned int, unsigned char *, int);
+int   seal_agg(struct conn_stat *);
+int   flush_conn(struct conn_stat *);
+int   recv_msgs(struct conn_stat *, unsigned char *, int, unsigned int, ste_uint64_t);
+int   recv_dgram(struct conn_stat *, unsigned char *, int, unsigned int, ste_uint64_t);
+unsigned char *obuf_reserve(struct conn_stat *, int);
+void  obuf_commit(struct conn_stat *, int);
+void  obuf_parity(struct conn_stat *);
+int   open_udp(struct sockaddr_in *);
+void  read_udp(void);
+void  flush_udp(void);
+void  send_udp(ste_udp_vec_t *, struct conn_stat **, int);
+void  expire_udp(void);
+int   expire_fec(void);
+void  park_conn_stat(struct conn_stat *);
+int   resume_session(struct conn_stat *, unsigned char *);
+void  replay_session(struct conn_stat *, unsigned int);
+void  expire_parked(void);
+void  grant_credit(struct conn_stat *, int);
 extern char *basename(char *); /* for Interix */
 
 struct conn_stat   conn_stat_head[1];
+struct conn_stat   conn_park_head[1]; /* 再接続を待っているセッション（STE_CAP_RESUME） */
 int           use_log = 0;      /* メッセージを STDERR でなく、syslog に出力する */
-static int    debuglevel = 0;   /* デバッグレベル。 1 以上ならフォアグラウンドで実行 */
+int           debuglevel = 0;   /* デバッグレベル。 1 以上ならフォアグラウンドで実行 */
+int           hub_mtu = STE_FRAME_MAX; /* 受け付けるフレームサイズの上限 */
+int           hub_use_key = 0;  /* -k で鍵を指定された。暗号化しない sted とは送受信しない */
+unsigned char hub_psk[STE_AEAD_KEYLEN]; /* 事前共有鍵 */
+int           udp_fd = -1;      /* UDP の socket。全ての UDP のセッションで共有する */
 extern char  *optarg;
 extern int    optind;
 extern int    optopt;
@@ -140,9 +309,16 @@ main(int argc,char *argv[])
     int                 remotelen;
     int                 port = 0;
     int                 c, on;
+    char               *trace = NULL;
+    char               *keyfile = NULL;
+    unsigned int        flight_threshold = STE_FLIGHT_THRESHOLD;
     struct sockaddr_in  local_sin, remote_sin;
-    static              fd_set  fdset, fdset_saved;
-    struct conn_stat   *rconn, *wconn;
+    static              fd_set  fdset, fdset_saved, wfdset;
+    struct conn_stat   *rconn, *wconn, *nconn, *newconn;
+    struct timeval      timeout;
+    ste_uint64_t        stats_usec = 0;
+    int                 holding;     /* FEC でデータグラムを取っておいているセッション数 */
+    int                 udp_pending; /* 送信キューにデータグラムが残っている UDP のセッションがある */
 #ifdef STE_WINDOWS
     u_long              param = 0; /* FIONBIO コマンドのパラメータ Non-Blocking ON*/
     int                 nRtn;
@@ -152,7 +328,7 @@ main(int argc,char *argv[])
     nRtn = WSAStartup(MAKEWORD(1, 1), &wsaData);
 #endif
 
-    while ((c = getopt(argc, argv, "p:d:")) != EOF){
+    while ((c = getopt(argc, argv, "p:d:t:l:m:k:")) != EOF){
         switch (c) {
             case 'p':
                 port = atoi(optarg);
@@ -160,13 +336,36 @@ main(int argc,char *argv[])
             case 'd':
                 debuglevel = atoi(optarg);
                 break;
+            case 't':
+                trace = optarg;
+                break;
+            case 'l':
+                flight_threshold = atoi(optarg);
+                break;
+            case 'm':
+                hub_mtu = atoi(optarg);
+                if(hub_mtu < ETHERMAX || hub_mtu > STE_FRAME_MAX)
+                    print_usage(argv[0]);
+                break;
+            case 'k':
+                keyfile = optarg;
+                break;
             default:
                 print_usage(argv[0]);
         }
     }    
 
+    if(keyfile != NULL){
+        if(ste_aead_load_key(keyfile, hub_psk) < 0){
+            print_err(LOG_ERR, "cannot read key file %s (64 hex digits expected)\n", keyfile);
+            exit(1);
+        }
+        hub_use_key = 1;
+    }
+
     conn_stat_head->next = NULL;
     conn_stat_head->fd = 0;
+    conn_park_head->next = NULL;
 
     if(( listener_fd = socket( AF_INET, SOCK_STREAM,0 )) < 0 ) {
         SET_ERRNO();
@@ -217,19 +416,19 @@ main(int argc,char *argv[])
     FD_ZERO(&fdset_saved);
     FD_SET(listener_fd, &fdset_saved);
 
+    /*
+     * 同じポート番号で UDP も待ち受ける（sted_udp.h 参照）。使えなくても
+     * TCP だけで動かす。
+     */
+    if((udp_fd = open_udp(&local_sin)) >= 0)
+        FD_SET(udp_fd, &fdset_saved);
+
     /*
      * syslog のための設定。Facility は　LOG_USER とする
      * Windows の場合はログファイルをオープンする。
      */
 #ifdef STE_WINDOWS
-    hStedLog = CreateFile(STEHUB_LOG_FILE,
-                          GENERIC_READ|GENERIC_WRITE,
-                          FILE_SHARE_READ| FILE_SHARE_WRITE,
-                          NULL,
-                          CREATE_ALWAYS,
-                          FILE_ATTRIBUTE_NORMAL,
-                          NULL);
-    SetFilePointer(hStedLog, 0, NULL, FILE_END);
+    ste_log_open(STEHUB_LOG_FILE, STE_LOG_DEST_STDERR);
 
     if(isTerminal == FALSE){
         /* サービスとして呼ばれている（コマンドプロンプトから呼ばれていない）場合 */
@@ -282,8 +481,20 @@ main(int argc,char *argv[])
         }
 #else 
         use_log = 1;
+        ste_log_setdest(STE_LOG_DEST_FILE);
 #endif    
     }
+
+    /*
+     * トレースの drain スレッドを起動。fork() の後でないといけない。
+     */
+    if(trace != NULL && ste_trace_set_sample(trace) < 0){
+        print_err(LOG_ERR, "invalid trace sampling rate: %s\n", trace);
+    }
+    if(ste_trace_init() < 0){
+        print_err(LOG_ERR, "failed to start trace thread\n");
+    }
+    ste_flight_init(STEHUB_FLIGHT_FILE, flight_threshold);
     print_err(LOG_NOTICE,"Started\n");        
 
     /*
@@ -292,8 +503,39 @@ main(int argc,char *argv[])
      * からのデータを待つ。１つの仮想デーモンからのデータを他方に転送する。
      */
     for(;;){
+        /*
+         * STE_STATS_INTERVAL 秒毎に TCP の状態をサンプリングし、統計ファイルを
+         * 更新する。データが無くても更新できるよう select() はタイムアウトさせる。
+         */
+        if(ste_time_usec() - stats_usec >= STE_STATS_INTERVAL * 1000000){
+            write_conn_stats();
+            /* 数え損なっていても sted が合わせられるよう、上限を送り直す */
+            for( wconn = conn_stat_head->next ; wconn != NULL ; wconn = wconn->next)
+                grant_credit(wconn, 1);
+            ste_flight_flush();
+            expire_udp();
+            expire_parked();
+            stats_usec = ste_time_usec();
+        }
+
+        /*
+         * FEC で取っておいているデータグラムがあれば、時間切れを見るため早めに
+         * 戻る。時間切れで処理したフレームが UDP の送信キューに入ったら待たない。
+         */
+        holding = expire_fec();
         fdset = fdset_saved;
-        if( select(FD_SETSIZE, &fdset, NULL, NULL, NULL) < 0){
+        /* 送信キューにデータが残っている接続は書き込めるようになるのを待つ */
+        FD_ZERO(&wfdset);
+        udp_pending = 0;
+        for( wconn = conn_stat_head->next ; wconn != NULL ; wconn = wconn->next){
+            if(wconn->olen > 0 && !wconn->udp)
+                FD_SET(wconn->fd, &wfdset);
+            if(wconn->udp && (wconn->olen > 0 || wconn->agg->count > 0))
+                udp_pending = 1;
+        }
+        timeout.tv_sec = (holding || udp_pending) ? 0 : STE_STATS_INTERVAL;
+        timeout.tv_usec = udp_pending ? 0 : (holding ? STE_FEC_HOLD_USEC : 0);
+        if( select(FD_SETSIZE, &fdset, &wfdset, NULL, &timeout) < 0){
             SET_ERRNO();
             print_err(LOG_ERR,"select:%s\n", strerror(errno));
         }
@@ -313,7 +555,8 @@ main(int argc,char *argv[])
             
             FD_SET(new_fd, &fdset_saved);
             print_err(LOG_NOTICE,"fd%d: connection from %s\n",new_fd, inet_ntoa(remote_sin.sin_addr));
-            add_conn_stat(new_fd, remote_sin.sin_addr);
+            if((newconn = add_conn_stat(new_fd, remote_sin.sin_addr)) != NULL)
+                ste_tune_open(new_fd, 1, &newconn->stats);
             /*
              * recv() でブロックされるのを防ぐため、non-blocking mode に設定
              */
@@ -330,19 +573,28 @@ main(int argc,char *argv[])
                 continue;
             }
 
+            /* UDP のデータグラムはまとめて読み、conn id でセッションに振り分ける */
+            if(udp_fd >= 0 && FD_ISSET(udp_fd, &fdset))
+                read_udp();
+
             for( rconn = conn_stat_head->next ; rconn != NULL ; rconn = rconn->next){
-                int rfd, wfd;
+                int rfd;
 
                 rfd = rconn->fd;
+                if (rconn->udp)
+                    continue;
             
                 if (FD_ISSET(rfd, &fdset)){
-                    int   rsize;
-                    char  databuf[SOCKBUFSIZE];
-                    char *bufp;
-                    int   datalen;
+                    int            rsize;
+                    unsigned char  databuf[SOCKBUFSIZE];
+                    unsigned int   seq;
+                    ste_uint64_t   ingress_usec;
+                    STE_ACCT_VAR(acct_t)
+                    STE_ACCT_VAR(acct_fanout)
 
-                    bufp = (char *)databuf;
-                    rsize = recv(rfd, bufp, SOCKBUFSIZE,0);
+                    STE_ACCT_BEGIN(acct_t);
+                    rsize = recv(rfd, (char *)databuf, SOCKBUFSIZE,0);
+                    STE_ACCT_END(STE_STAGE_SOCK_RECV, acct_t);
                     if(rsize == 0){
                         /*
                          * コネクションが切断されたようだ。
@@ -361,7 +613,7 @@ main(int argc,char *argv[])
                          * 致命的でない error の場合は無視してループを継続
                          */
                         if(errno == EINTR || errno == EWOULDBLOCK){
-                            print_err(LOG_NOTICE, "fd%d: recv: %s\n", rfd, strerror(errno));
+                            STE_TRACE2(0, TRC_HUB_RECV_AGAIN, rfd, errno);
                             continue;
                         }
                         /*
@@ -375,40 +627,40 @@ main(int argc,char *argv[])
                         delete_conn_stat(rfd);
                         break;
                     }
-                    /*
-                     * 他の仮想 NIC にパケットを転送する。
-                     * 「待ち」が発生すると、パフォーマンスに影響があるので、EWOULDBLOCK
-                     *  の場合は配送をあきらめる。
-                     */
-                    for(wconn = conn_stat_head->next ; wconn != NULL ; wconn = wconn->next){
-                    
-                        wfd = wconn->fd;
-
-                        if (rfd == wfd)
-                            continue;
-
-                        if( debuglevel > 1){
-                            print_err(LOG_ERR,"fd%d(%s) ==> ", rfd, inet_ntoa(rconn->addr));
-                            print_err(LOG_ERR,"fd%d(%s)\n", wfd,inet_ntoa(wconn->addr));
-                        }
-                
-                        if ( send(wfd, bufp, rsize, 0) < 0){
-                            SET_ERRNO();                    
-                            if(errno == EINTR || errno == EWOULDBLOCK ){
-                                print_err(LOG_NOTICE,"fd%d: send: %s\n", wfd ,strerror(errno));
-                                continue;
-                            } else {
-                                print_err(LOG_ERR,"fd%d: send: %s (%d)\n",wfd,strerror(errno), errno);
-                                CLOSE(wfd);
-                                print_err(LOG_ERR,"fd%d: closed\n", wfd);
-                                FD_CLR(wfd, &fdset_saved);
-                                delete_conn_stat(wfd);
-                                break;                            
-                            }
-                        }                    
-                    } /* End of loop for send()ing */
+                    STE_PROBE_HUB_INGRESS(rconn->id, rsize);
+                    seq = ste_flight_ingress(rconn->id, rsize, &ingress_usec);
+                    rconn->stats.irecvs++;
+                    rconn->stats.ibytes += rsize;
+                    STE_ACCT_BEGIN(acct_fanout);
+                    recv_msgs(rconn, databuf, rsize, seq, ingress_usec);
+                    STE_ACCT_END(STE_STAGE_FANOUT, acct_fanout);
                 }
             } /* End of loop for each connection */
+
+            /*
+             * 送信キューに溜まったデータを送信する。
+             * 「待ち」が発生すると、パフォーマンスに影響があるので、EWOULDBLOCK
+             *  の場合は送信キューに残して次回に送る。
+             */
+            for( wconn = conn_stat_head->next ; wconn != NULL ; wconn = nconn){
+                int wfd = wconn->fd;
+
+                nconn = wconn->next;
+                if(wconn->udp)
+                    continue;
+                if(flush_conn(wconn) < 0){
+                    CLOSE(wfd);
+                    print_err(LOG_ERR,"fd%d: closed\n", wfd);
+                    FD_CLR(wfd, &fdset_saved);
+                    delete_conn_stat(wfd);
+                }
+            }
+            if(udp_fd >= 0)
+                flush_udp();
+
+            /* 送信キューの空きが変わったので、必要ならクレジットを増やす */
+            for( wconn = conn_stat_head->next ; wconn != NULL ; wconn = wconn->next)
+                grant_credit(wconn, 0);
         } /* End of main loop */
 }
 
@@ -606,12 +858,13 @@ stehub_svc_ctrl_handler(
  *          fd: 新規コネクションの socket 番号
  *          addr: 接続してきたホストのアドレス
  * 戻り値：
- *          無し
+ *          追加した conn_stat 構造体のポインタ
  *****************************************************************************/
-void
+struct conn_stat *
 add_conn_stat(int fd, struct in_addr addr)
 {
     struct conn_stat *conn, *conn_stat_new;
+    static int        conn_id = 0;
 
     int i = 0;
     
@@ -619,16 +872,63 @@ add_conn_stat(int fd, struct in_addr addr)
     
     conn_stat_new = (struct conn_stat *)malloc(sizeof(struct conn_stat));
     conn_stat_new->fd = fd;
+    conn_stat_new->id = ++conn_id;
     conn_stat_new->addr = addr;
     conn_stat_new->next = NULL;
+    conn_stat_new->caps = 0;
+    conn_stat_new->tx_flags = 0;
+    conn_stat_new->segment = 0;
+    conn_stat_new->mtu = ETHERMAX;
+    conn_stat_new->client_id[0] = '\0';
+    conn_stat_new->olen = 0;
+    conn_stat_new->rx = (ste_rx_t *)malloc(sizeof(ste_rx_t));
+    conn_stat_new->agg = (ste_agg_t *)malloc(sizeof(ste_agg_t));
+    conn_stat_new->obuf = (unsigned char *)malloc(OBUFSIZE);
+    conn_stat_new->aqm = (ste_aqm_queue_t *)malloc(sizeof(ste_aqm_queue_t));
+    conn_stat_new->hcc = NULL;
+    conn_stat_new->hcd = NULL;
+    conn_stat_new->lzc = NULL;
+    conn_stat_new->lzd = NULL;
+    conn_stat_new->aead = NULL;
+    conn_stat_new->fec = NULL;
+    conn_stat_new->udp = 0;
+    conn_stat_new->connid = 0;
+    conn_stat_new->ndgram = 0;
+    conn_stat_new->bundle = 0;
+    conn_stat_new->link = 0;
+    conn_stat_new->nlinks = 1;
+    conn_stat_new->rank = 0;
+    conn_stat_new->nsegs = 1;
+    conn_stat_new->segs[0] = 0;
+    conn_stat_new->replay = NULL;
+    memset(conn_stat_new->token, 0x0, STE_RESUME_TOKEN);
+    conn_stat_new->parked_usec = 0;
+    conn_stat_new->nfanin = 0;
+    conn_stat_new->cr_frames = 0;
+    conn_stat_new->cr_bytes = 0;
+    conn_stat_new->cr_lim_frames = 0;
+    conn_stat_new->cr_lim_bytes = 0;
+    conn_stat_new->last_usec = ste_time_usec();
+    ste_rx_reset(conn_stat_new->rx);
+    ste_agg_reset(conn_stat_new->agg);
+    ste_aqm_queue_reset(conn_stat_new->aqm);
+    conn_stat_new->agg->compact = 0;
+    conn_stat_new->agg->hc = NULL;
+    conn_stat_new->agg->maxbytes = STE_AGG_MAX_BYTES;
+    conn_stat_new->agg->mux = 0;
+    conn_stat_new->agg->chan = 0;
+    ste_stats_init(&conn_stat_new->stats);
 
     conn->next = conn_stat_new;
+    return(conn_stat_new);
 }
 
 /*****************************************************************************
  * delete_conn_stat()
  *
  * conn_stat 構造体のリンクリストから指定された conn_stat を削除する
+ * UDP のセッションは socket を共有しているので対象にしない（expire_udp() 参照）。
+ * STE_CAP_RESUME に合意していれば、解放せずに再接続を待つ（park_conn_stat()）。
  *
  *  引数：
  *          fd: 削除する conn_stat 構造体に含まれる socket 番号
@@ -643,16 +943,192 @@ delete_conn_stat(int fd)
 
     conn = conn_stat_head;
 
-    while( conn != NULL){
-        if(conn->next->fd == fd){
+    while( conn->next != NULL){
+        if(conn->next->fd == fd && !conn->next->udp){
             conn_stat_delete = conn->next;
             conn->next = conn_stat_delete->next;
-            free(conn_stat_delete);
+            if(conn_stat_delete->replay != NULL)
+                park_conn_stat(conn_stat_delete);
+            else
+                free_conn_stat(conn_stat_delete);
+            update_bundles();
             return;
         }
         conn = conn->next;
     }
 }
+
+/*****************************************************************************
+ * free_conn_stat()
+ *
+ * リンクリストから外した conn_stat 構造体を解放する。
+ *
+ *  引数：
+ *          conn: 解放する conn_stat 構造体
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+free_conn_stat(struct conn_stat *conn)
+{
+    free(conn->rx);
+    free(conn->agg);
+    free(conn->obuf);
+    free(conn->aqm);
+    free(conn->hcc);
+    free(conn->hcd);
+    free(conn->lzc);
+    free(conn->lzd);
+    free(conn->aead);
+    free(conn->fec);
+    free(conn->replay);
+    free(conn);
+}
+
+/*****************************************************************************
+ * park_conn_stat()
+ *
+ * 接続が切れたセッションを conn_park_head のリストに移し、再接続を待つ。
+ * 送信キューに残っていたフレームは送り直し用のリングに入っているので捨てる。
+ * 待っている間も、そのセッション宛てのフレームはリングに入れる
+ * （forward_frame() 参照）。
+ *
+ *  引数：
+ *          conn: リストから外したセッション
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+park_conn_stat(struct conn_stat *conn)
+{
+    print_err(LOG_NOTICE, "fd%d: session of %s is kept for %d seconds\n",
+              conn->fd, conn->client_id, STE_RESUME_HOLD_SEC);
+    conn->fd = -1;
+    conn->olen = 0;
+    ste_agg_reset(conn->agg);
+    ste_aqm_queue_reset(conn->aqm);
+    conn->nlinks = 1;
+    conn->rank = 0;
+    conn->parked_usec = ste_time_usec();
+    conn->next = conn_park_head->next;
+    conn_park_head->next = conn;
+}
+
+/*****************************************************************************
+ * resume_session()
+ *
+ * sted が STE_MSG_HELLO で送ってきたトークンのセッションを探し、見つかれば
+ * rconn に引き継ぐ。接続 ID と統計情報、送り直し用のリングを引き継ぐ。
+ * まだ前の接続が切れたことに気付いていなければ（sted の方が先に切断に
+ * 気付いて再接続してきた）、前の接続を閉じさせる。
+ *
+ *  引数：
+ *          rconn: STE_MSG_HELLO を受信した接続
+ *          token: sted が送ってきたトークン
+ *  戻り値：
+ *          再開した   : 1
+ *          見つからない : 0
+ *****************************************************************************/
+int
+resume_session(struct conn_stat *rconn, unsigned char *token)
+{
+    static unsigned char zero[STE_RESUME_TOKEN];
+    struct conn_stat *conn, *found;
+
+    if(memcmp(token, zero, STE_RESUME_TOKEN) == 0)
+        return(0);
+
+    for(conn = conn_park_head ; conn->next != NULL ; conn = conn->next){
+        found = conn->next;
+        if(memcmp(found->token, token, STE_RESUME_TOKEN) != 0)
+            continue;
+        conn->next = found->next;
+        rconn->id = found->id;
+        rconn->stats = found->stats;
+        rconn->replay = found->replay;
+        found->replay = NULL;
+        free_conn_stat(found);
+        return(1);
+    }
+
+    for(found = conn_stat_head->next ; found != NULL ; found = found->next){
+        if(found == rconn || found->replay == NULL || memcmp(found->token, token, STE_RESUME_TOKEN) != 0)
+            continue;
+        print_err(LOG_NOTICE, "fd%d: %s reconnected, closing the old connection\n", found->fd, found->client_id);
+        rconn->id = found->id;
+        rconn->stats = found->stats;
+        rconn->replay = found->replay;
+        found->replay = NULL;
+        found->caps &= ~STE_CAP_RESUME;
+        memset(found->token, 0x0, STE_RESUME_TOKEN);
+        /* 次の recv() が 0 を返すので、メインループが閉じる */
+        shutdown(found->fd, 2);
+        return(1);
+    }
+    return(0);
+}
+
+/*****************************************************************************
+ * replay_session()
+ *
+ * 再開したセッションで、sted がまだ受け取っていないフレームを送り直す。
+ * STE_MSG_HELLO の返事より後に呼ぶこと。
+ *
+ *  引数：
+ *          wconn  : 再開した接続
+ *          peer_rx: sted が受け取ったフレームの数
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+replay_session(struct conn_stat *wconn, unsigned int peer_rx)
+{
+    unsigned char *frame;
+    unsigned int   segment;
+    int            n, k, len;
+
+    n = ste_replay_start(wconn->replay, peer_rx);
+    for(k = 0 ; k < n ; k++){
+        frame = ste_replay_get(wconn->replay, n, k, &segment, &len);
+        if(enqueue_frame(wconn, segment, frame, len) < 0){
+            /* 送信キューが一杯なら送れるだけ送ってからやり直す */
+            if(flush_conn(wconn) < 0 || enqueue_frame(wconn, segment, frame, len) < 0){
+                wconn->stats.odrops += n - k;
+                break;
+            }
+        }
+        wconn->stats.oframes++;
+    }
+    print_err(LOG_NOTICE, "fd%d: resumed session of %s, resent %d frames\n", wconn->fd, wconn->client_id, k);
+}
+
+/*****************************************************************************
+ * expire_parked()
+ *
+ * STE_RESUME_HOLD_SEC 秒たっても再接続してこなかったセッションを解放する。
+ *
+ *  引数：
+ *          無し
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+expire_parked(void)
+{
+    struct conn_stat *conn, *dconn;
+    ste_uint64_t      now = ste_time_usec();
+
+    for(conn = conn_park_head ; conn->next != NULL ; ){
+        dconn = conn->next;
+        if(now - dconn->parked_usec >= (ste_uint64_t)STE_RESUME_HOLD_SEC * 1000000){
+            print_err(LOG_NOTICE, "session of %s expired\n", dconn->client_id);
+            conn->next = dconn->next;
+            free_conn_stat(dconn);
+            continue;
+        }
+        conn = dconn;
+    }
+}
 /*****************************************************************************
  * find_conn_stat()
  *
@@ -680,6 +1156,1186 @@ find_conn_stat(int fd)
     return((struct conn_stat *)NULL);
 }
 
+/*****************************************************************************
+ * write_conn_stats()
+ *
+ * 各接続の TCP の状態をサンプリングし、送受信のカウンタと一緒に
+ * STEHUB_STAT_FILE に書き出す。ファイルは毎回作り直す。
+ *
+ *  引数：
+ *          無し
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (統計ファイルをオープンできなかった)
+ *****************************************************************************/
+int
+write_conn_stats(void)
+{
+    struct conn_stat *conn;
+    FILE             *fp;
+
+    for( conn = conn_stat_head->next ; conn != NULL ; conn = conn->next)
+        if(!conn->udp){
+            ste_stats_sample(conn->fd, conn->id, &conn->stats);
+            ste_tune_update(conn->fd, &conn->stats);
+        }
+
+    if((fp = fopen(STEHUB_STAT_FILE, "w")) == NULL)
+        return(-1);
+    for( conn = conn_stat_head->next ; conn != NULL ; conn = conn->next)
+        ste_stats_print(fp, conn->id, inet_ntoa(conn->addr), &conn->stats);
+    STE_ACCT_PRINT(fp);
+    fclose(fp);
+
+    return(0);
+}
+
+/*****************************************************************************
+ * recv_msgs()
+ *
+ * 受信データからメッセージを取り出し、フレームを他の仮想 NIC の送信キューに
+ * 入れる。実際の send() はメインループの最後に行う。
+ *
+ *  引数：
+ *          rconn: データを受信した接続
+ *          readp: 受信データ
+ *          cnt  : 受信データのサイズ
+ *          seq  : フライトレコーダー用の通し番号
+ *          ingress_usec: データを受信した時刻
+ *  戻り値：
+ *          受け付けた（認証に成功した）メッセージの数
+ *****************************************************************************/
+int
+recv_msgs(struct conn_stat *rconn, unsigned char *readp, int cnt,
+          unsigned int seq, ste_uint64_t ingress_usec)
+{
+    int            rfd = rconn->fd;
+    int            ret;
+    int            nframes, i;
+    int            accepted = 0;
+    ste_msg_t      msg;
+    unsigned char *frames[STE_AGG_MAX_FRAMES];
+    int            lens[STE_AGG_MAX_FRAMES];
+    ste_hello_t    hello;
+    unsigned char  sted_nonce[STE_HELLO_NONCE];
+    ste_msg_t      inner;
+    unsigned char *p;
+    int            fec;
+    int            resumed;
+    unsigned int   peer_rx;
+    unsigned int   segment;
+    int            kind;
+    ste_uint64_t   stamp;
+    unsigned char  pingbuf[STE_SEAL_HEADROOM + sizeof(stehead2_t) + STE_PING_LEN + STE_SEAL_TAILROOM];
+    unsigned char *msgp;
+    int            msglen;
+
+    while(cnt > 0){
+        ret = ste_rx_next(rconn->rx, &readp, &cnt, &msg);
+        if(ret == 0)
+            break;
+        if(ret < 0){
+            /* 壊れた部分は ste_rx_next() が捨てている（v1 なら今回の残り全て） */
+            STE_TRACE3(1, TRC_HUB_BROKEN, rfd, rconn->rx->orglen, rconn->rx->discard);
+            STE_PROBE_HUB_DROP(rconn->id, rconn->rx->discard, STE_DROP_BROKEN);
+            ste_flight_record(STE_FLT_DROP, seq, rconn->id, rconn->rx->discard, STE_DROP_BROKEN);
+            continue;
+        }
+        /*
+         * 暗号化を合意していれば STE_MSG_SEAL を復号する。鍵を指定
+         * されている場合、STE_MSG_HELLO 以外の平文は転送しない。
+         */
+        if(msg.type == STE_MSG_SEAL){
+            if(rconn->aead == NULL || ste_aead_open(rconn->aead, &msg, &inner, &rconn->stats) < 0){
+                STE_TRACE3(1, TRC_HUB_AUTHERR, rfd, msg.type, msg.len);
+                STE_PROBE_HUB_DROP(rconn->id, msg.len, STE_DROP_AUTH);
+                ste_flight_record(STE_FLT_DROP, seq, rconn->id, msg.len, STE_DROP_AUTH);
+                continue;
+            }
+            msg = inner;
+        } else if(hub_use_key && msg.type != STE_MSG_HELLO){
+            rconn->stats.eauth++;
+            STE_TRACE3(1, TRC_HUB_AUTHERR, rfd, msg.type, msg.len);
+            STE_PROBE_HUB_DROP(rconn->id, msg.len, STE_DROP_AUTH);
+            ste_flight_record(STE_FLT_DROP, seq, rconn->id, msg.len, STE_DROP_AUTH);
+            continue;
+        }
+        /* 鍵を指定されている場合、平文の STE_MSG_HELLO は誰でも送れるので数えない */
+        if(!hub_use_key || msg.type != STE_MSG_HELLO)
+            accepted++;
+        if(msg.type == STE_MSG_ZAGG){
+            /* 辞書がずれていたら、sted が辞書をリセットするまで捨て続ける */
+            if(rconn->lzd == NULL || ste_lz_open(rconn->lzd, &msg, &inner, &rconn->stats) < 0){
+                STE_TRACE3(1, TRC_HUB_LZERR, rfd, msg.len,
+                           rconn->lzd != NULL ? rconn->lzd->broken : -1);
+                STE_PROBE_HUB_DROP(rconn->id, msg.len, STE_DROP_BROKEN);
+                ste_flight_record(STE_FLT_DROP, seq, rconn->id, msg.len, STE_DROP_BROKEN);
+                continue;
+            }
+            msg = inner;
+        }
+        /*
+         * 多重化されたフレームはセグメント番号で転送先を決める。sted が
+         * STE_MSG_HELLO で知らせなかったセグメントには送らせない。
+         */
+        segment = rconn->segment;
+        if(msg.type == STE_MSG_MUX){
+            if((rconn->caps & STE_CAP_MUX) == 0 || ste_mux_open(&msg, &inner, &segment) < 0 ||
+               !has_segment(rconn, segment)){
+                STE_TRACE3(1, TRC_HUB_BROKEN, rfd, msg.type, msg.len);
+                STE_PROBE_HUB_DROP(rconn->id, msg.len, STE_DROP_BROKEN);
+                ste_flight_record(STE_FLT_DROP, seq, rconn->id, msg.len, STE_DROP_BROKEN);
+                continue;
+            }
+            msg = inner;
+        }
+        switch(msg.type){
+            case STE_MSG_HELLO:
+                /* 他の sted には転送せず、合意したバージョンと機能を返す */
+                if(ste_msg_get_hello(&msg, &hello) < 0 || hello.role != STE_ROLE_STED)
+                    break;
+                rconn->caps = hello.features & STEHUB_FEATURES;
+                rconn->agg->compact = (rconn->caps & STE_CAP_COMPACT) ? 1 : 0;
+                rconn->segment = hello.segment;
+                rconn->mtu = (hello.mtu < hub_mtu) ? hello.mtu : hub_mtu;
+                rconn->rx->mtu = rconn->mtu;
+                if((rconn->caps & STE_CAP_AGG) && (rconn->caps & STE_CAP_HC)){
+                    if(rconn->hcc == NULL)
+                        rconn->hcc = (ste_hcc_t *)malloc(sizeof(ste_hcc_t));
+                    if(rconn->hcd == NULL)
+                        rconn->hcd = (ste_hcd_t *)malloc(sizeof(ste_hcd_t));
+                    if(rconn->hcc == NULL || rconn->hcd == NULL){
+                        rconn->caps &= ~STE_CAP_HC;
+                    } else {
+                        ste_hcc_reset(rconn->hcc, &rconn->stats);
+                        ste_hcd_reset(rconn->hcd);
+                        rconn->agg->hc = rconn->hcc;
+                    }
+                } else {
+                    rconn->caps &= ~STE_CAP_HC;
+                }
+                /* UDP ではメッセージが失われたり入れ替わったりするので、辞書を共有する LZ4 は使わない */
+                if(rconn->udp)
+                    rconn->caps &= ~STE_CAP_LZ4;
+                if(rconn->caps & STE_CAP_LZ4){
+                    if(rconn->lzc == NULL)
+                        rconn->lzc = (ste_lzc_t *)malloc(sizeof(ste_lzc_t));
+                    if(rconn->lzd == NULL)
+                        rconn->lzd = (ste_lzd_t *)malloc(sizeof(ste_lzd_t));
+                    if(rconn->lzc == NULL || rconn->lzd == NULL){
+                        /* メモリが足りなければ圧縮しないと返事する */
+                        rconn->caps &= ~STE_CAP_LZ4;
+                    } else {
+                        ste_lzc_reset(rconn->lzc);
+                        ste_lzd_reset(rconn->lzd);
+                    }
+                }
+                /*
+                 * 暗号化は自分も鍵を持っていて、STE_MSG_AGG で送り合う
+                 * 場合だけ合意する。セッション鍵は双方の nonce から作る。
+                 */
+                memcpy(sted_nonce, hello.nonce, STE_HELLO_NONCE);
+                memset(hello.nonce, 0x0, STE_HELLO_NONCE);
+                if(!hub_use_key || (rconn->caps & STE_CAP_AGG) == 0)
+                    rconn->caps &= ~STE_CAP_AEAD;
+                if(rconn->caps & STE_CAP_AEAD){
+                    if(rconn->aead == NULL)
+                        rconn->aead = (ste_aead_t *)malloc(sizeof(ste_aead_t));
+                    if(rconn->aead == NULL || ste_aead_random(hello.nonce, STE_HELLO_NONCE) < 0)
+                        rconn->caps &= ~STE_CAP_AEAD;
+                    else
+                        ste_aead_init(rconn->aead, hub_psk, sted_nonce, hello.nonce, STE_ROLE_HUB);
+                }
+                if((rconn->caps & STE_CAP_AEAD) == 0){
+                    free(rconn->aead);
+                    rconn->aead = NULL;
+                    if(hub_use_key)
+                        print_err(LOG_ERR, "fd%d: %s did not agree to encryption, frames are not forwarded\n",
+                                  rfd, hello.client_id);
+                }
+                /*
+                 * FEC は UDP のセッションでだけ合意する。sted は返事を受け取って
+                 * から FEC のヘッダを受け付けるので、返事には付けない。
+                 */
+                fec = 0;
+                if(rconn->udp && (rconn->caps & STE_CAP_FEC)){
+                    if(rconn->fec == NULL)
+                        rconn->fec = (ste_fec_t *)malloc(sizeof(ste_fec_t));
+                    if(rconn->fec != NULL){
+                        ste_fec_reset(rconn->fec);
+                        fec = STE_CAP_FEC;
+                    }
+                }
+                rconn->caps &= ~STE_CAP_FEC;
+                /* 多重化は STE_MSG_AGG で送り合う場合だけ合意する */
+                rconn->nsegs = 1;
+                rconn->segs[0] = rconn->segment;
+                if((rconn->caps & STE_CAP_MUX) && (rconn->caps & STE_CAP_AGG) && hello.nsegs > 1){
+                    rconn->nsegs = hello.nsegs;
+                    memcpy(rconn->segs, hello.segs, sizeof(rconn->segs));
+                } else {
+                    rconn->caps &= ~STE_CAP_MUX;
+                }
+                rconn->agg->mux = (rconn->caps & STE_CAP_MUX) ? 1 : 0;
+                /*
+                 * 同じ bundle のリンクは 1 つのポートとして扱う。鍵を指定されて
+                 * いる場合、暗号化に合意しないリンクは bundle に入れない。
+                 */
+                rconn->bundle = 0;
+                rconn->link = 0;
+                if((rconn->caps & STE_CAP_STRIPE) && hello.bundle != 0 &&
+                   (!hub_use_key || (rconn->caps & STE_CAP_AEAD))){
+                    rconn->bundle = hello.bundle;
+                    rconn->link = hello.link;
+                } else {
+                    rconn->caps &= ~STE_CAP_STRIPE;
+                }
+                update_bundles();
+                strcpy(rconn->client_id, hello.client_id);
+                print_err(LOG_NOTICE, "fd%d: hello from %s (version %d, features 0x%x, mtu %d, segment %u)\n",
+                          rfd, rconn->client_id, hello.version, rconn->caps | fec, rconn->mtu, rconn->segment);
+                if(rconn->bundle != 0)
+                    print_err(LOG_NOTICE, "fd%d: link %d/%d of bundle %08x\n",
+                              rfd, rconn->link, hello.nlinks, rconn->bundle);
+                for(i = 1 ; i < rconn->nsegs ; i++)
+                    print_err(LOG_NOTICE, "fd%d: also in segment %u\n", rfd, rconn->segs[i]);
+                /*
+                 * セッションの再開は TCP の接続でだけ合意する。トークンの
+                 * セッションが見つからなければ新しいセッションを始める。
+                 */
+                resumed = 0;
+                peer_rx = hello.rx_seq;
+                if(rconn->udp)
+                    rconn->caps &= ~STE_CAP_RESUME;
+                if((rconn->caps & STE_CAP_RESUME) == 0){
+                    free(rconn->replay);
+                    rconn->replay = NULL;
+                } else if(rconn->replay == NULL){
+                    resumed = resume_session(rconn, hello.token);
+                    if(resumed){
+                        memcpy(rconn->token, hello.token, STE_RESUME_TOKEN);
+                        /* 引き継いだ統計のバッファサイズは前の socket のもの */
+                        ste_tune_open(rconn->fd, 1, &rconn->stats);
+                    } else if((rconn->replay = (ste_replay_t *)malloc(sizeof(ste_replay_t))) == NULL ||
+                              ste_aead_random(rconn->token, STE_RESUME_TOKEN) < 0){
+                        free(rconn->replay);
+                        rconn->replay = NULL;
+                        rconn->caps &= ~STE_CAP_RESUME;
+                    } else {
+                        ste_replay_reset(rconn->replay);
+                    }
+                }
+                if(rconn->caps & STE_CAP_RESUME){
+                    memcpy(hello.token, rconn->token, STE_RESUME_TOKEN);
+                    hello.rx_seq = rconn->replay->rx_seq;
+                }
+                /* 鍵を指定されている場合、平文のハートビートには返事をしない */
+                if(hub_use_key && (rconn->caps & STE_CAP_AEAD) == 0)
+                    rconn->caps &= ~STE_CAP_PING;
+                /*
+                 * フロー制御は TCP の接続でだけ合意する。sted はこの STE_MSG_HELLO
+                 * の直後から数えているので、ここから数え直す。
+                 */
+                if(rconn->udp || (hub_use_key && (rconn->caps & STE_CAP_AEAD) == 0))
+                    rconn->caps &= ~STE_CAP_CREDIT;
+                rconn->cr_frames = 0;
+                rconn->cr_bytes = 0;
+                rconn->cr_lim_frames = 0;
+                rconn->cr_lim_bytes = 0;
+                if(hello.version > STE_PROTO_VERSION)
+                    hello.version = STE_PROTO_VERSION;
+                hello.role = STE_ROLE_HUB;
+                hello.features = rconn->caps | fec;
+                hello.mtu = rconn->mtu;
+                strcpy(hello.client_id, "stehub");
+                hello.nsegs = rconn->nsegs;
+                if((p = obuf_reserve(rconn, (int)sizeof(stehead_t) + STE_HELLO_MAX)) != NULL)
+                    obuf_commit(rconn, ste_msg_put_hello(p, &hello));
+                rconn->caps |= fec;
+                /* STE_MSG_HELLO の返信より後のメッセージから v2 にする */
+                if(rconn->caps & STE_CAP_SYNC){
+                    rconn->tx_flags = STE_TX_SYNC;
+                    if(rconn->caps & STE_CAP_PCRC)
+                        rconn->tx_flags |= STE_TX_PCRC;
+                }
+                /* 返信の後に最初のクレジットを知らせる */
+                grant_credit(rconn, 1);
+                /* 返信の後に、sted が受け取っていなかったフレームを送り直す */
+                if(resumed)
+                    replay_session(rconn, peer_rx);
+                break;
+            case STE_MSG_AGG:
+            case STE_MSG_CAGG:
+            case STE_MSG_HAGG:
+                if(msg.type == STE_MSG_HAGG)
+                    nframes = (rconn->hcd == NULL) ? -1 :
+                        ste_hc_parse(rconn->hcd, &msg, frames, lens, rconn->rx->mtu, &rconn->stats);
+                else
+                    nframes = ste_agg_parse(&msg, frames, lens, rconn->rx->mtu);
+                if(nframes < 0){
+                    STE_TRACE3(1, TRC_HUB_BROKEN, rfd, msg.type, msg.len);
+                    STE_PROBE_HUB_DROP(rconn->id, msg.len, STE_DROP_BROKEN);
+                    ste_flight_record(STE_FLT_DROP, seq, rconn->id, msg.len, STE_DROP_BROKEN);
+                    break;
+                }
+                for(i = 0 ; i < nframes ; i++)
+                    forward_frame(rconn, segment, frames[i], lens[i], seq, ingress_usec);
+                break;
+            case STE_MSG_PING:
+                /* 他の sted には転送せず、時刻をそのまま返す */
+                if((rconn->caps & STE_CAP_PING) == 0 ||
+                   ste_msg_get_ping(&msg, &kind, &stamp) < 0 || kind != STE_PING_REQUEST)
+                    break;
+                rconn->stats.hbpings++;
+                msgp = pingbuf + STE_SEAL_HEADROOM;
+                msglen = ste_msg_put_ping(msgp, STE_PING_REPLY, stamp, rconn->tx_flags);
+                if((p = obuf_reserve(rconn, msglen + (rconn->aead != NULL ? STE_SEAL_OVERHEAD : 0))) == NULL)
+                    break;
+                if(rconn->aead != NULL)
+                    msgp = ste_aead_seal(rconn->aead, msgp, &msglen, rconn->tx_flags, &rconn->stats);
+                memcpy(p, msgp, msglen);
+                obuf_commit(rconn, msglen);
+                rconn->stats.hbpongs++;
+                break;
+            default:
+                forward_frame(rconn, segment, msg.body, msg.len, seq, ingress_usec);
+                break;
+        }
+    }
+    return(accepted);
+}
+
+/*****************************************************************************
+ * recv_dgram()
+ *
+ * UDP のデータグラム 1 つ分のメッセージを処理する。メッセージはデータグラム
+ * をまたがないので、前のデータグラムの途中までのメッセージは捨てる。
+ *
+ *  引数：
+ *          rconn: データグラムを受信したセッション
+ *          readp: conn id（FEC のヘッダ）より後ろの先頭
+ *          cnt  : その長さ
+ *          seq  : フライトレコーダー用の通し番号
+ *          ingress_usec: データグラムを受信した時刻
+ *  戻り値：
+ *          受け付けた（認証に成功した）メッセージの数
+ *****************************************************************************/
+int
+recv_dgram(struct conn_stat *rconn, unsigned char *readp, int cnt,
+           unsigned int seq, ste_uint64_t ingress_usec)
+{
+    ste_rx_restart(rconn->rx);
+    return(recv_msgs(rconn, readp, cnt, seq, ingress_usec));
+}
+
+/*****************************************************************************
+ * update_bundles()
+ *
+ * bundle 毎に開いているリンクの数と、bundle の中での各リンクの順番を
+ * 数え直す。順番はリンクの番号順。接続毎に、その接続に転送してくる
+ * （セグメントが重なっていて、同じ bundle でない）接続の数も数え直す。
+ * 接続が増えたり減ったりした時（STE_MSG_HELLO を受け取った時と接続を
+ * 削除した時）に呼ぶ。
+ *
+ *  引数：
+ *          無し
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+update_bundles(void)
+{
+    struct conn_stat *conn, *peer;
+    int               i;
+
+    for(conn = conn_stat_head->next ; conn != NULL ; conn = conn->next){
+        conn->nfanin = 0;
+        for(peer = conn_stat_head->next ; peer != NULL ; peer = peer->next){
+            if(peer == conn || (peer->bundle != 0 && peer->bundle == conn->bundle))
+                continue;
+            for(i = 0 ; i < peer->nsegs ; i++){
+                if(has_segment(conn, peer->segs[i])){
+                    conn->nfanin++;
+                    break;
+                }
+            }
+        }
+        conn->nlinks = 1;
+        conn->rank = 0;
+        if(conn->bundle == 0)
+            continue;
+        conn->nlinks = 0;
+        for(peer = conn_stat_head->next ; peer != NULL ; peer = peer->next){
+            if(peer->bundle != conn->bundle || peer->segment != conn->segment)
+                continue;
+            if(peer->link < conn->link || (peer->link == conn->link && peer->id < conn->id))
+                conn->rank++;
+            conn->nlinks++;
+        }
+    }
+}
+
+/*****************************************************************************
+ * grant_credit()
+ *
+ * STE_CAP_CREDIT を合意した sted に、送ってよいフレーム数とバイト数の上限を
+ * STE_MSG_CREDIT で知らせる（sted_credit.h 参照）。ウィンドウは、この接続から
+ * 転送する先の送信キューの空き（AQM の STE_AQM_HEADROOM を除く）を、その
+ * 転送先に転送してくる接続の数で割ったものの最小値。上限は下げない。
+ * 残りのクレジットがウィンドウの上限の半分以上あれば何もしない。増やせる
+ * 量が少なければ、sted がクレジットを使い切るまで待ってまとめて送る。
+ *
+ *  引数：
+ *          conn : 接続
+ *          force: 上限が増えなくても送る（STE_MSG_HELLO の返事の後と、
+ *                 STE_STATS_INTERVAL 毎の送り直し）
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+grant_credit(struct conn_stat *conn, int force)
+{
+    struct conn_stat *wconn;
+    unsigned int      credit[4];
+    unsigned int      wframes = STE_CREDIT_FRAMES;
+    unsigned int      wbytes = STE_CREDIT_BYTES;
+    unsigned int      space, share, gframes, gbytes;
+    int               used, nfanin, blocked, i;
+    unsigned char     buf[STE_SEAL_HEADROOM + sizeof(stehead2_t) + STE_CREDIT_LEN + STE_SEAL_TAILROOM];
+    unsigned char    *msgp = buf + STE_SEAL_HEADROOM;
+    unsigned char    *p;
+    int               msglen;
+
+    if((conn->caps & STE_CAP_CREDIT) == 0)
+        return;
+    if(!force && (int)(conn->cr_lim_frames - conn->cr_frames) >= STE_CREDIT_FRAMES / 2 &&
+       (int)(conn->cr_lim_bytes - conn->cr_bytes) >= STE_CREDIT_BYTES / 2)
+        return;
+    blocked = (int)(conn->cr_lim_frames - conn->cr_frames) <= 0 ||
+              (int)(conn->cr_lim_bytes - conn->cr_bytes) <= 0;
+
+    /* 転送先の決め方は forward_frame() と同じ（bundle のハッシュは見ない） */
+    for(wconn = conn_stat_head->next ; wconn != NULL ; wconn = wconn->next){
+        if(wconn == conn || (conn->bundle != 0 && wconn->bundle == conn->bundle))
+            continue;
+        if(hub_use_key && wconn->aead == NULL)
+            continue;
+        for(i = 0 ; i < conn->nsegs && !has_segment(wconn, conn->segs[i]) ; i++)
+            ;
+        if(i == conn->nsegs)
+            continue;
+        /*
+         * 組み立て中の STE_MSG_AGG のヘッダ分と、AQM が対話的なフローのために
+         * 残しておく分（sted_aqm.h）も空けておく
+         */
+        used = wconn->olen + wconn->agg->datalen + (STE_MSG_MAX - STE_AGG_MAX_BYTES) + STE_AQM_HEADROOM;
+        space = (used < OBUFSIZE) ? (unsigned int)(OBUFSIZE - used) : 0;
+        nfanin = (wconn->nfanin > 0) ? wconn->nfanin : 1;
+        share = space / nfanin;
+        if(share < wbytes)
+            wbytes = share;
+        share = (unsigned int)((ste_uint64_t)STE_CREDIT_FRAMES * space / OBUFSIZE) / nfanin;
+        if(share < wframes)
+            wframes = share;
+    }
+
+    credit[0] = conn->cr_frames + wframes;
+    credit[1] = conn->cr_bytes + wbytes;
+    if((int)(credit[0] - conn->cr_lim_frames) < 0)
+        credit[0] = conn->cr_lim_frames;
+    if((int)(credit[1] - conn->cr_lim_bytes) < 0)
+        credit[1] = conn->cr_lim_bytes;
+    credit[2] = conn->cr_frames;
+    credit[3] = conn->cr_bytes;
+    if(!force){
+        gframes = credit[0] - conn->cr_lim_frames;
+        gbytes = credit[1] - conn->cr_lim_bytes;
+        if(gframes == 0 && gbytes == 0)
+            return;
+        if(blocked ? (gframes < wframes / 2 && gbytes < wbytes / 2) :
+           (gframes < STE_CREDIT_FRAMES / 4 && gbytes < STE_CREDIT_BYTES / 4))
+            return;
+    }
+
+    msglen = ste_msg_put_credit(msgp, credit, conn->tx_flags);
+    if((p = obuf_reserve(conn, msglen + (conn->aead != NULL ? STE_SEAL_OVERHEAD : 0))) == NULL)
+        return;
+    if(conn->aead != NULL)
+        msgp = ste_aead_seal(conn->aead, msgp, &msglen, conn->tx_flags, &conn->stats);
+    memcpy(p, msgp, msglen);
+    obuf_commit(conn, msglen);
+    conn->cr_lim_frames = credit[0];
+    conn->cr_lim_bytes = credit[1];
+    conn->stats.cgrants++;
+}
+
+/*****************************************************************************
+ * has_segment()
+ *
+ * 接続がセグメントに属しているかどうかを返す。STE_CAP_MUX で多重化して
+ * いなければ、属しているのは STE_MSG_HELLO の segment だけ。
+ *
+ *  引数：
+ *          conn   : 接続
+ *          segment: セグメント番号
+ *  戻り値：
+ *          属している   : 1
+ *          属していない : 0
+ *****************************************************************************/
+int
+has_segment(struct conn_stat *conn, unsigned int segment)
+{
+    int i;
+
+    for(i = 0 ; i < conn->nsegs ; i++)
+        if(conn->segs[i] == segment)
+            return(1);
+    return(0);
+}
+
+/*****************************************************************************
+ * forward_frame()
+ *
+ * フレームを送信元以外の、同じセグメントの全ての接続の送信キューに入れる。
+ * 送信元と同じ bundle のリンクには送らず、他の bundle にはフローのハッシュ
+ * で選んだ 1 本のリンクにだけ送る。STE_CAP_RESUME に合意した接続では、
+ * 送信キューに入れたフレームを送り直し用のリングにも入れる。
+ * 送信キューの AQM が捨てると決めたら捨て、CE を付けると決めたら、
+ * 他の送信先と共有している frame ではなくコピーに付けて送る。
+ *
+ *  引数：
+ *          rconn: フレームを受信した接続
+ *          segment: フレームのセグメント番号（STE_MSG_MUX で無ければ rconn の segment）
+ *          frame: Ethernet フレーム
+ *          len  : フレーム長
+ *          seq  : フライトレコーダー用の通し番号
+ *          ingress_usec: フレームを受信した時刻
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+forward_frame(struct conn_stat *rconn, unsigned int segment, unsigned char *frame, int len,
+              unsigned int seq, ste_uint64_t ingress_usec)
+{
+    struct conn_stat *wconn;
+    int               empty;
+    int               qlen;
+    unsigned int      hash = 0;
+    int               hashed = 0;
+    int               action;
+    unsigned char    *fp;
+    static unsigned char ce[STE_FRAME_MAX];
+
+    rconn->stats.iframes++;
+    rconn->cr_frames++;
+    rconn->cr_bytes += STE_CREDIT_SIZE(len);
+    if(rconn->replay != NULL)
+        rconn->replay->rx_seq++;
+    STE_ACCT_FRAME();
+
+    for(wconn = conn_stat_head->next ; wconn != NULL ; wconn = wconn->next){
+        if (wconn == rconn || !has_segment(wconn, segment))
+            continue;
+        /* 同じ sted の別のリンクには送り返さない */
+        if (rconn->bundle != 0 && wconn->bundle == rconn->bundle)
+            continue;
+        /* 鍵を指定されている場合、暗号化に合意していない sted には送らない */
+        if (hub_use_key && wconn->aead == NULL)
+            continue;
+        /* フローのハッシュはリンクの選択と AQM に使う。送信先がある時だけ求める */
+        if (!hashed){
+            hash = ste_flow_hash(frame, len);
+            hashed = 1;
+        }
+        /* bundle にはフローのハッシュで選んだリンクにだけ送る */
+        if (wconn->nlinks > 1 && hash % (unsigned int)wconn->nlinks != (unsigned int)wconn->rank)
+            continue;
+
+        if (len > wconn->mtu){
+            /* 送信先と合意した MTU より大きいフレームは送れない */
+            STE_TRACE3(1, TRC_HUB_TOOBIG, wconn->fd, len, wconn->mtu);
+            wconn->stats.odrops++;
+            STE_PROBE_HUB_DROP(wconn->id, len, STE_DROP_MTU);
+            ste_flight_record(STE_FLT_DROP, seq, wconn->id, len, STE_DROP_MTU);
+            continue;
+        }
+
+        STE_TRACE3(2, TRC_HUB_FORWARD, rconn->fd, wconn->fd, len);
+        STE_PROBE_HUB_FORWARD(rconn->id, wconn->id, len);
+        ste_flight_record(STE_FLT_DECIDE, seq, rconn->id, len, wconn->id);
+
+        action = ste_aqm_admit(&wconn->aqm->aqm, STE_AQM_FLOW(hash), frame, len,
+                               OBUFSIZE - (wconn->olen + wconn->agg->datalen), ingress_usec, &wconn->stats);
+        if(action == STE_AQM_DROP){
+            wconn->stats.odrops++;
+            STE_PROBE_HUB_DROP(wconn->id, len, STE_DROP_AQM);
+            ste_flight_record(STE_FLT_DROP, seq, wconn->id, len, STE_DROP_AQM);
+            continue;
+        }
+        fp = frame;
+        if(action == STE_AQM_MARK){
+            memcpy(ce, frame, len);
+            ste_aqm_mark(ce, len);
+            fp = ce;
+        }
+
+        empty = (wconn->olen == 0 && wconn->agg->count == 0);
+        if(enqueue_frame(wconn, segment, fp, len) < 0){
+            STE_TRACE3(0, TRC_HUB_QFULL, wconn->fd, wconn->olen, len);
+            wconn->stats.odrops++;
+            STE_PROBE_HUB_DROP(wconn->id, len, STE_DROP_QFULL);
+            ste_flight_record(STE_FLT_DROP, seq, wconn->id, len, STE_DROP_QFULL);
+            continue;
+        }
+        if(empty){
+            wconn->oldest_seq = seq;
+            wconn->oldest_usec = ingress_usec;
+        }
+        /* 組み立て中の STE_MSG_AGG に入れたなら、その先頭の 1 byte を送れば出たとみなす */
+        ste_aqm_queue_push(wconn->aqm, STE_AQM_FLOW(hash), len,
+                           wconn->olen + (wconn->agg->count > 0 ? 1 : 0), ingress_usec);
+        if(wconn->replay != NULL)
+            ste_replay_push(wconn->replay, segment, fp, len);
+        wconn->stats.oframes++;
+        wconn->stats.olegacy += STE_LEGACY_SIZE(len);
+        qlen = wconn->olen + wconn->agg->datalen;
+        STE_PROBE_HUB_ENQUEUE(wconn->id, len, qlen);
+        ste_flight_record(STE_FLT_ENQUEUE, seq, wconn->id, len, qlen);
+    }
+
+    /*
+     * 再接続を待っているセッションの分はリングに入れておき、再開した時に
+     * 送る。bundle のリンクは残りのリンクが受け取るので入れない。
+     */
+    for(wconn = conn_park_head->next ; wconn != NULL ; wconn = wconn->next){
+        if (wconn->bundle != 0 || !has_segment(wconn, segment) || len > wconn->mtu)
+            continue;
+        if (hub_use_key && (wconn->caps & STE_CAP_AEAD) == 0)
+            continue;
+        ste_replay_push(wconn->replay, segment, frame, len);
+    }
+}
+
+/*****************************************************************************
+ * enqueue_frame()
+ *
+ * フレームを送信キューに入れる。STE_MSG_AGG に対応した接続なら組み立て中の
+ * STE_MSG_AGG に詰め、そうでなければ stehead を付けて送信キューに入れる。
+ * 多重化している接続では、組み立て中の STE_MSG_MUX とセグメントが違えば
+ * 先に送信キューに入れてから詰め直す。
+ *
+ *  引数：
+ *          wconn: 送信先の接続
+ *          segment: フレームのセグメント番号
+ *          frame: Ethernet フレーム
+ *          len  : フレーム長
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (送信キューが一杯)
+ *****************************************************************************/
+int
+enqueue_frame(struct conn_stat *wconn, unsigned int segment, unsigned char *frame, int len)
+{
+    int            msglen;
+    unsigned char *p;
+
+    if(wconn->caps & STE_CAP_AGG){
+        if(wconn->agg->mux && wconn->agg->count > 0 && wconn->agg->chan != segment &&
+           seal_agg(wconn) < 0)
+            return(-1);
+        wconn->agg->chan = segment;
+        if(ste_agg_add(wconn->agg, frame, len) == 0)
+            return(0);
+        if(seal_agg(wconn) < 0)
+            return(-1);
+        return(ste_agg_add(wconn->agg, frame, len));
+    }
+
+    if((p = obuf_reserve(wconn, (int)STE_HEADSIZE(wconn->tx_flags) + (len < ETHERMIN ? ETHERMIN : len) + 3)) == NULL)
+        return(-1);
+    msglen = ste_msg_put_frame(p, frame, len, wconn->tx_flags);
+    obuf_commit(wconn, msglen);
+    wconn->stats.owire += msglen;
+    return(0);
+}
+
+/*****************************************************************************
+ * seal_agg()
+ *
+ * 組み立て中の STE_MSG_AGG を完成させて送信キューに移す。
+ *
+ *  引数：
+ *          wconn: 送信先の接続
+ *  戻り値：
+ *          正常時 : 0
+ *          障害時 : -1 (送信キューに空きが無い。STE_MSG_AGG はそのまま残す)
+ *****************************************************************************/
+int
+seal_agg(struct conn_stat *wconn)
+{
+    unsigned char *msgp;
+    unsigned char *p;
+    int            msglen;
+
+    if(wconn->agg->count == 0)
+        return(0);
+
+    msgp = ste_agg_seal(wconn->agg, &msglen, wconn->tx_flags);
+    if((p = obuf_reserve(wconn, msglen + (wconn->aead != NULL ? STE_SEAL_OVERHEAD : 0))) == NULL)
+        return(-1);
+    /*
+     * 圧縮すると辞書が進むので、送信キューに入ることを確かめてから
+     * 圧縮する（圧縮後は必ず元のサイズ以下）。
+     */
+    if(wconn->caps & STE_CAP_LZ4)
+        msgp = ste_lz_seal(wconn->lzc, wconn->agg, &msglen, wconn->tx_flags, &wconn->stats);
+    if(wconn->aead != NULL)
+        msgp = ste_aead_seal(wconn->aead, msgp, &msglen, wconn->tx_flags, &wconn->stats);
+    memcpy(p, msgp, msglen);
+    obuf_commit(wconn, msglen);
+    wconn->stats.owire += msglen;
+    ste_agg_reset(wconn->agg);
+    return(0);
+}
+
+/*****************************************************************************
+ * obuf_reserve()
+ *
+ * 送信キューにメッセージを書き込む場所を確保する。UDP のセッションでは
+ * メッセージ毎に 1 つのデータグラムにするので、先頭に conn id を書いておく
+ * （FEC を合意していれば、その後ろに FEC のヘッダの場所も空けておく）。
+ * 書き込んだら obuf_commit() を呼ぶこと。
+ *
+ *  引数：
+ *          wconn: 送信先の接続
+ *          need : 書き込むメッセージの最大長
+ *  戻り値：
+ *          正常時 : メッセージを書き込む位置
+ *          障害時 : NULL (送信キューに空きが無い)
+ *****************************************************************************/
+unsigned char *
+obuf_reserve(struct conn_stat *wconn, int need)
+{
+    unsigned char *p = wconn->obuf + wconn->olen;
+    int            hlen = STE_UDP_HDRSIZE;
+
+    if(!wconn->udp)
+        return((wconn->olen + need > OBUFSIZE) ? NULL : p);
+
+    if(wconn->caps & STE_CAP_FEC)
+        hlen += STE_FEC_HDRSIZE;
+    if(wconn->ndgram >= STE_UDP_QMAX || wconn->olen + hlen + need > OBUFSIZE)
+        return(NULL);
+    ste_udp_put_connid(p, wconn->connid);
+    return(p + hlen);
+}
+
+/*****************************************************************************
+ * obuf_commit()
+ *
+ * obuf_reserve() で確保した場所に書き込んだメッセージを送信キューに入れる。
+ * FEC を合意していれば FEC のヘッダを書き、グループが一杯になったら続けて
+ * パリティも入れる。
+ *
+ *  引数：
+ *          wconn : 送信先の接続
+ *          msglen: 書き込んだメッセージの長さ
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+obuf_commit(struct conn_stat *wconn, int msglen)
+{
+    unsigned char *hdr;
+    int            full = 0;
+
+    if(wconn->udp){
+        if(wconn->caps & STE_CAP_FEC){
+            hdr = wconn->obuf + wconn->olen + STE_UDP_HDRSIZE;
+            full = ste_fec_put_data(wconn->fec, hdr, hdr + STE_FEC_HDRSIZE, msglen);
+            msglen += STE_FEC_HDRSIZE;
+        }
+        msglen += STE_UDP_HDRSIZE;
+        wconn->dgram_len[wconn->ndgram++] = msglen;
+    }
+    wconn->olen += msglen;
+    if(full)
+        obuf_parity(wconn);
+}
+
+/*****************************************************************************
+ * obuf_parity()
+ *
+ * FEC のグループにパリティをまだ送っていないデータグラムがあれば、パリティ
+ * のデータグラムを送信キューに入れてグループを閉じる。
+ *
+ *  引数：
+ *          wconn : 送信先の接続
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+obuf_parity(struct conn_stat *wconn)
+{
+    unsigned char *p = wconn->obuf + wconn->olen;
+    unsigned char *parity;
+    int            len;
+
+    if((wconn->caps & STE_CAP_FEC) == 0 || wconn->fec->tx.n == 0)
+        return;
+    if(wconn->ndgram >= STE_UDP_QMAX ||
+       wconn->olen + STE_UDP_HDRSIZE + STE_FEC_HDRSIZE + wconn->fec->tx.maxlen > OBUFSIZE){
+        /* 送信キューに入らない。グループは閉じて、パリティは捨てる */
+        ste_fec_put_parity(wconn->fec, &len, &wconn->stats);
+        wconn->stats.odrops++;
+        return;
+    }
+    parity = ste_fec_put_parity(wconn->fec, &len, &wconn->stats);
+    ste_udp_put_connid(p, wconn->connid);
+    memcpy(p + STE_UDP_HDRSIZE, parity, len);
+    wconn->dgram_len[wconn->ndgram++] = STE_UDP_HDRSIZE + len;
+    wconn->olen += STE_UDP_HDRSIZE + len;
+}
+
+/*****************************************************************************
+ * flush_conn()
+ *
+ * 送信キューのデータを send() する。送りきれなかった分は送信キューに残す。
+ *
+ *  引数：
+ *          wconn: 送信先の接続
+ *  戻り値：
+ *          正常時 : 0 (EWOULDBLOCK で送れなかった場合も含む)
+ *          障害時 : -1 (socket にエラーが発生した。呼び出し元で close すること)
+ *****************************************************************************/
+int
+flush_conn(struct conn_stat *wconn)
+{
+    int ret;
+    STE_ACCT_VAR(acct_t)
+
+    seal_agg(wconn);
+    if(wconn->olen == 0)
+        return(0);
+
+    STE_ACCT_BEGIN(acct_t);
+    ret = send(wconn->fd, (char *)wconn->obuf, wconn->olen, 0);
+    STE_ACCT_END(STE_STAGE_SOCK_SEND, acct_t);
+    wconn->stats.osends++;
+    if (ret < 0){
+        SET_ERRNO();                    
+        STE_PROBE_HUB_EGRESS(wconn->id, wconn->olen, -errno);
+        if(errno == EINTR || errno == EWOULDBLOCK ){
+            STE_TRACE3(0, TRC_HUB_SEND_AGAIN, wconn->fd, errno, wconn->olen);
+            return(0);
+        }
+        STE_PROBE_HUB_DROP(wconn->id, wconn->olen, STE_DROP_SENDERR);
+        ste_flight_record(STE_FLT_DROP, wconn->oldest_seq, wconn->id, wconn->olen, STE_DROP_SENDERR);
+        print_err(LOG_ERR,"fd%d: send: %s (%d)\n",wconn->fd,strerror(errno), errno);
+        return(-1);
+    }
+    STE_PROBE_HUB_EGRESS(wconn->id, wconn->olen, ret);
+    ste_flight_egress(wconn->oldest_seq, wconn->id, wconn->olen, ret, wconn->oldest_usec);
+    wconn->stats.obytes += ret;
+    ste_aqm_queue_sent(wconn->aqm, ret, ste_time_usec(), &wconn->stats);
+
+    if(ret < wconn->olen)
+        memmove(wconn->obuf, wconn->obuf + ret, wconn->olen - ret);
+    wconn->olen -= ret;
+    return(0);
+}
+
+/*****************************************************************************
+ * open_udp()
+ *
+ * sted からの UDP のデータグラムを待ち受ける socket を作る。
+ *
+ *  引数：
+ *          sin: 待ち受けるアドレスとポート番号（TCP と同じ）
+ *  戻り値：
+ *          正常時 : socket 番号
+ *          障害時 : -1
+ *****************************************************************************/
+int
+open_udp(struct sockaddr_in *sin)
+{
+    int     fd;
+#ifdef STE_WINDOWS
+    u_long  param = 1; /* FIONBIO コマンドのパラメータ Non-Blocking ON */
+#endif
+
+    if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0){
+        SET_ERRNO();
+        print_err(LOG_ERR, "udp: socket: %s\n", strerror(errno));
+        return(-1);
+    }
+    if(bind(fd, (struct sockaddr *)sin, sizeof(struct sockaddr_in)) < 0){
+        SET_ERRNO();
+        print_err(LOG_ERR, "udp: bind: %s\n", strerror(errno));
+        CLOSE(fd);
+        return(-1);
+    }
+#ifndef STE_WINDOWS
+    if(fcntl(fd, F_SETFL, O_NONBLOCK) < 0){
+#else
+    if(ioctlsocket(fd, FIONBIO, &param) < 0){
+#endif
+        SET_ERRNO();
+        print_err(LOG_ERR, "udp: Failed to set nonblock: %s (%d)\n", strerror(errno), errno);
+        CLOSE(fd);
+        return(-1);
+    }
+    return(fd);
+}
+
+/*****************************************************************************
+ * read_udp()
+ *
+ * 届いている UDP のデータグラムをまとめて読み、先頭の conn id でセッション
+ * を探してメッセージを処理する。セッションが無ければ、v1 のヘッダの
+ * STE_MSG_HELLO で始まるデータグラムの場合だけ新しく作る。
+ * FEC のヘッダが付いていれば、ste_fec_next() が順番を揃えて（失われた
+ * ものは復元して）返すデータグラムを処理する。
+ * 送信先のアドレスは正しいメッセージが届く度に更新するので、sted の NAT の
+ * マッピングが変わってもセッションは続く。
+ *
+ *  引数：
+ *          無し
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+read_udp(void)
+{
+    static unsigned char  bufs[STE_UDP_BATCH][STE_UDP_DGRAM_MAX];
+    ste_udp_vec_t         v;
+    struct conn_stat     *rconn;
+    unsigned char        *p;
+    unsigned int          connid;
+    unsigned int          seq;
+    ste_uint64_t          ingress_usec;
+    int                   n, i, len;
+    int                   accepted;
+    unsigned char        *dp;
+    int                   dlen;
+    STE_ACCT_VAR(acct_t)
+    STE_ACCT_VAR(acct_fanout)
+
+    for(i = 0 ; i < STE_UDP_BATCH ; i++)
+        v.buf[i] = bufs[i];
+
+    STE_ACCT_BEGIN(acct_t);
+    n = ste_udp_recv(udp_fd, &v, STE_UDP_DGRAM_MAX);
+    STE_ACCT_END(STE_STAGE_SOCK_RECV, acct_t);
+    if(n < 0){
+        SET_ERRNO();
+        STE_TRACE2(0, TRC_HUB_RECV_AGAIN, udp_fd, errno);
+        return;
+    }
+
+    for(i = 0 ; i < n ; i++){
+        p = v.buf[i];
+        len = v.len[i];
+        /* 切り詰められたデータグラム（len が -1）も捨てる */
+        if(len < STE_UDP_HDRSIZE)
+            continue;
+        connid = STE_UDP_GET32(p);
+        for(rconn = conn_stat_head->next ; rconn != NULL ; rconn = rconn->next)
+            if(rconn->udp && rconn->connid == connid)
+                break;
+        if(rconn == NULL){
+            if(len < STE_UDP_HDRSIZE + (int)sizeof(stehead_t) ||
+               (int)STE_UDP_GET32(p + STE_UDP_HDRSIZE + 4) != STE_MSG_HELLO)
+                continue;
+            rconn = add_conn_stat(udp_fd, v.addr[i].sin_addr);
+            rconn->udp = 1;
+            rconn->connid = connid;
+            rconn->peer = v.addr[i];
+            rconn->agg->maxbytes = STE_UDP_PAYLOAD;
+            print_err(LOG_NOTICE, "udp: session %08x from %s\n", connid, inet_ntoa(rconn->addr));
+        }
+        STE_PROBE_HUB_INGRESS(rconn->id, len);
+        seq = ste_flight_ingress(rconn->id, len, &ingress_usec);
+        rconn->stats.irecvs++;
+        rconn->stats.ibytes += len;
+        rconn->last_usec = ingress_usec;
+        STE_ACCT_BEGIN(acct_fanout);
+        accepted = 0;
+        if(len > STE_UDP_HDRSIZE && p[STE_UDP_HDRSIZE] == STE_FEC_MAGIC){
+            /* FEC を合意する前に届いたものや、壊れたものは捨てる */
+            if((rconn->caps & STE_CAP_FEC) &&
+               ste_fec_input(rconn->fec, p + STE_UDP_HDRSIZE, len - STE_UDP_HDRSIZE, ingress_usec) == 0){
+                while(ste_fec_next(rconn->fec, &dp, &dlen, &rconn->stats))
+                    accepted += recv_dgram(rconn, dp, dlen, seq, ingress_usec);
+            }
+        } else {
+            accepted = recv_dgram(rconn, p + STE_UDP_HDRSIZE, len - STE_UDP_HDRSIZE, seq, ingress_usec);
+        }
+        if(accepted > 0){
+            rconn->peer = v.addr[i];
+            rconn->addr = v.addr[i].sin_addr;
+        }
+        STE_ACCT_END(STE_STAGE_FANOUT, acct_fanout);
+    }
+}
+
+/*****************************************************************************
+ * flush_udp()
+ *
+ * UDP の全てのセッションの送信キューのデータグラムを、STE_UDP_BATCH 個ずつ
+ * まとめて送る。TCP と違い、送れなかったデータグラムは残さずに捨てる。
+ * FEC のグループはここで閉じる（送信キューが空になるのでパリティを送る）。
+ *
+ *  引数：
+ *          無し
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+flush_udp(void)
+{
+    ste_udp_vec_t     v;
+    struct conn_stat *owner[STE_UDP_BATCH];
+    struct conn_stat *wconn;
+    int               n = 0;
+    int               i, off;
+    ste_uint64_t      now = ste_time_usec();
+
+    for(wconn = conn_stat_head->next ; wconn != NULL ; wconn = wconn->next){
+        if(!wconn->udp)
+            continue;
+        seal_agg(wconn);
+        obuf_parity(wconn);
+        /*
+         * 送信キューのデータは次に seal_agg() するまで書き換えられないので、
+         * 送る前に空にしてしまってよい。
+         */
+        for(i = 0, off = 0 ; i < wconn->ndgram ; off += wconn->dgram_len[i++]){
+            v.buf[n] = wconn->obuf + off;
+            v.len[n] = wconn->dgram_len[i];
+            v.addr[n] = wconn->peer;
+            owner[n++] = wconn;
+            if(n == STE_UDP_BATCH){
+                send_udp(&v, owner, n);
+                n = 0;
+            }
+        }
+        /* 送れなかったデータグラムも捨てるので、全てキューから出たことになる */
+        ste_aqm_queue_sent(wconn->aqm, wconn->olen, now, &wconn->stats);
+        wconn->olen = 0;
+        wconn->ndgram = 0;
+    }
+    if(n > 0)
+        send_udp(&v, owner, n);
+}
+
+/*****************************************************************************
+ * send_udp()
+ *
+ * データグラムをまとめて送り、セッション毎の統計情報を更新する。
+ *
+ *  引数：
+ *          v    : 送信するデータグラムの表
+ *          owner: データグラム毎の送信先のセッション
+ *          n    : データグラムの数
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+send_udp(ste_udp_vec_t *v, struct conn_stat **owner, int n)
+{
+    struct conn_stat *wconn;
+    int               sent, i;
+    STE_ACCT_VAR(acct_t)
+
+    STE_ACCT_BEGIN(acct_t);
+    sent = ste_udp_send(udp_fd, v, n);
+    STE_ACCT_END(STE_STAGE_SOCK_SEND, acct_t);
+    if(sent < n){
+        SET_ERRNO();
+        STE_TRACE3(0, TRC_HUB_SEND_AGAIN, udp_fd, errno, n - sent);
+    }
+
+    for(i = 0 ; i < n ; i++){
+        wconn = owner[i];
+        wconn->stats.osends++;
+        if(i < sent){
+            STE_PROBE_HUB_EGRESS(wconn->id, v->len[i], v->len[i]);
+            ste_flight_egress(wconn->oldest_seq, wconn->id, v->len[i], v->len[i], wconn->oldest_usec);
+            wconn->stats.obytes += v->len[i];
+        } else {
+            wconn->stats.odrops++;
+            STE_PROBE_HUB_DROP(wconn->id, v->len[i], STE_DROP_WOULDBLOCK);
+            ste_flight_record(STE_FLT_DROP, wconn->oldest_seq, wconn->id, v->len[i], STE_DROP_WOULDBLOCK);
+        }
+    }
+}
+
+/*****************************************************************************
+ * expire_udp()
+ *
+ * STE_UDP_IDLE_SEC の間データグラムが届かなかった UDP のセッションを捨てる。
+ * sted は何も送らなくても STE_UDP_KEEPALIVE_SEC 毎にキープアライブを送って
+ * くるので、捨てられるのは sted が止まったか、接続し直したセッション。
+ *
+ *  引数：
+ *          無し
+ *  戻り値：
+ *          無し
+ *****************************************************************************/
+void
+expire_udp(void)
+{
+    struct conn_stat *conn, *dconn;
+    ste_uint64_t      now = ste_time_usec();
+
+    for(conn = conn_stat_head ; conn->next != NULL ; ){
+        dconn = conn->next;
+        if(dconn->udp && now - dconn->last_usec >= (ste_uint64_t)STE_UDP_IDLE_SEC * 1000000){
+            print_err(LOG_NOTICE, "udp: session %08x from %s expired\n", dconn->connid, inet_ntoa(dconn->addr));
+            conn->next = dconn->next;
+            free_conn_stat(dconn);
+            update_bundles();
+            continue;
+        }
+        conn = dconn;
+    }
+}
+
+/*****************************************************************************
+ * expire_fec()
+ *
+ * FEC で抜けの後ろのデータグラムを STE_FEC_HOLD_USEC 以上取っておいている
+ * セッションは、復元をあきらめて取っておいたデータグラムを処理する。
+ * メインループの select() の前に毎回呼ぶ。
+ *
+ *  引数：
+ *          無し
+ *  戻り値：
+ *          まだデータグラムを取っておいているセッションの数
+ *****************************************************************************/
+int
+expire_fec(void)
+{
+    struct conn_stat *conn;
+    ste_uint64_t      now = ste_time_usec();
+    unsigned char    *dp;
+    int               dlen;
+    int               holding = 0;
+
+    for(conn = conn_stat_head->next ; conn != NULL ; conn = conn->next){
+        if((conn->caps & STE_CAP_FEC) == 0 || !STE_FEC_HOLDING(conn->fec))
+            continue;
+        if(ste_fec_expire(conn->fec, now, &conn->stats) > 0){
+            while(ste_fec_next(conn->fec, &dp, &dlen, &conn->stats))
+                recv_dgram(conn, dp, dlen, 0, now);
+        }
+        if(STE_FEC_HOLDING(conn->fec))
+            holding++;
+    }
+    return(holding);
+}
+
 #ifndef STE_WINDOWS
 /*****************************************************************************
  * become_daemon()
@@ -695,6 +2351,7 @@ become_daemon()
 
     if( fork() == 0){
         use_log = 1;
+        ste_log_setdest(STE_LOG_DEST_SYSLOG);
         close (0);
         close (1);
         close (2);
@@ -712,6 +2369,8 @@ become_daemon()
  * print_err()
  *
  * エラーメッセージを表示するルーチン。
+ * 同期的に書き出すので、転送処理中のメッセージには使わず、
+ * STE_TRACEn() を使うこと。
  * 
  ***********************************************************/
 void
@@ -722,18 +2381,14 @@ print_err(int level, char *format, ...)
     int length;    
     
     va_start(ap, format);
-    vsprintf(buf, format, ap);
+    length = STE_VSNPRINTF(buf, ERR_MSG_MAX - 1, format, ap);
     va_end(ap);
 
-    if(use_log){
-#ifdef STE_WINDOWS
-        WriteFile(hStedLog, buf, strlen(buf), &length, NULL);
-#else    
-        syslog(level, buf);
-#endif            
-    } else {
-        fprintf(stderr, buf);
-    }
+    if(length < 0)
+        length = ERR_MSG_MAX - 1;
+    buf[length] = '\0';
+
+    ste_log_write(level, buf, length);
 }
 /*****************************************************************************
  * print_usage()
@@ -744,9 +2399,13 @@ void
 print_usage(char *argv)
 {
     printf ("Usage: %s [-I|-U] [ -p port] [-d level]\n",argv);        
-    printf ("Usage: %s [ -p port] [-d level]\n",argv);    
+    printf ("Usage: %s [ -p port] [-d level] [-t cat=rate,...] [-l usec] [-m mtu] [-k keyfile]\n",argv);    
     printf ("\t-p port   : Port nubmer\n");
     printf ("\t-d level  : Debug level[0-2]\n");
+    printf ("\t-t cat=rate,... : Trace sampling rate (cat: sock,hub,dump,all)\n");
+    printf ("\t-l usec   : Latency threshold for flight recorder snapshot (0: off)\n");
+    printf ("\t-m mtu    : Maximum frame size including header (%d-%d)\n", ETHERMAX, STE_FRAME_MAX);
+    printf ("\t-k keyfile: Encrypt links with the pre-shared key in keyfile\n");
     printf ("\t-I        : Install Service\n");
     printf ("\t-U        : Uninstall Service\n");
     exit(1);
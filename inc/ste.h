@@ -30,11 +30,12 @@
  *
  *  REGSVC    仮想 NIC デーモンを登録する 
  *  UNREGSVC  仮想 NIC デーモンを登録解除する
+ *  GETFRAMESIZE  ヘッダ込みの最大フレームサイズ（ULONG）を得る
  *
  * Windows の IOCTL コマンドは METHOD_NEITHER を使っているので、
  * IRP は User-mode の仮想アドレス を提供する。
  * User-mode のアドレスは Parameters.DeviceIoControl.Type3InputBuffer
- * に入る。
+ * に入る。GETFRAMESIZE は値を返すだけなので METHOD_BUFFERED を使う。
  ********************************************************************/
 #ifndef __STE_H
 #define __STE_H
@@ -43,10 +44,12 @@
 /* Windows 用 */
 #define REGSVC   (ULONG) CTL_CODE(FILE_DEVICE_UNKNOWN, 2, METHOD_NEITHER, FILE_ANY_ACCESS)
 #define UNREGSVC (ULONG) CTL_CODE(FILE_DEVICE_UNKNOWN, 3, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define GETFRAMESIZE (ULONG) CTL_CODE(FILE_DEVICE_UNKNOWN, 4, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #else
 /* Solaris 用 */
 #define REGSVC   0xabcde0
 #define UNREGSVC 0xabcde1       
+#define GETFRAMESIZE 0xabcde2
 #endif /* End of #ifdef STE_WINDOWS */
 
 #ifdef _KERNEL
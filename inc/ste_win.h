@@ -44,6 +44,8 @@
 #define      ETHERMAX                 1514    // ヘッダ込みの Ethernet フレームの最大サイズ 
 #define      ETHERMTU                 1500    // ヘッダ無しの Ethernet フレームの最大サイズ 
 #define      ETHERMIN                 60      // ヘッダ無しの Ethernet フレームの最小サイズ
+#define      ETHERHEADER              (ETHERMAX - ETHERMTU) // Ethernet ヘッダのサイズ
+#define      STE_FRAMESIZE_MAX        9018    // レジストリで指定できる最大フレームサイズ（ジャンボフレーム）
 #define      ETHERADDRL               6       // Ethernet アドレス長
 #define      ETHERLINKSPEED           1000000 // リンク速度 100Mbps
 #define      MAX_MULTICAST            16      // 最大登録可能マルチキャストアドレス
@@ -138,6 +140,7 @@ typedef struct SteAdapter
     NDIS_SPIN_LOCK          SendSpinLock;         // 送信処理用のロック
     NDIS_SPIN_LOCK          RecvSpinLock;         // 送信処理用のロック
     ULONG                   Instance;             // アダプターのインスタンス番号
+    ULONG                   MaxFrameSize;         // ヘッダ込みの最大フレームサイズ（レジストリの MaxFrameSize）
     //
     // 統計情報
     //
@@ -243,6 +246,12 @@ SteDeleteAdapter(
     IN  STE_ADAPTER      *Adapter
     );
 
+VOID
+SteReadConfiguration(
+    IN  STE_ADAPTER      *Adapter,
+    IN  NDIS_HANDLE       WrapperConfigurationContext
+    );
+
 NDIS_STATUS
 SteRegisterDevice(
     IN STE_ADAPTER       *Adapter
@@ -335,6 +344,7 @@ SteFindAdapterByDeviceObject(
 
 NDIS_STATUS
 SteCopyPacketToIrp(    
+    IN     STE_ADAPTER  *Adapter,
     IN     NDIS_PACKET  *Packet,
     IN OUT PIRP          Irp
     );
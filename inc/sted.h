@@ -32,6 +32,8 @@
 #else
 #define STEPATH "/dev/ste"      /* ste デバイスのパス */
 #endif
+#include "sted_trace.h"
+#include "sted_stats.h"
 
 /*
  * Windows の場合 SAGetLastError() を使って errno にエラー番号をセットする
@@ -48,29 +50,35 @@
 /*******************************************************
  * o 仮想 NIC デーモンが利用する各種パラメータ
  *
- *  CONNECT_REQ_SIZE     proxy に対する CONNECT 要求の文字長 
  *  CONNECT_REQ_TIMEOUT  Proxy から CONNECT のレスポンスを受け取るタイムアウト
  *  STRBUFSIZE           getmsg(9F),putmsg(9F) 用のバッファのサイズ 
  *  PORT_NO              デフォルトの仮想ハブのポート番号
  *  SOCKBUFSIZE          recv(), send() 用のバッファのサイズ                
  *  ERR_MSG_MAX          syslog や、STDERR に出力するメッセージのサイズ   
- *  SENDBUF_THRESHOLD    送信一時バッファのデータを送信するしきい値。
+ *  SENDBUF_THRESHOLD    送信一時バッファのデータを送信するしきい値。HUB と
+ *                       合意した MTU の 2 フレーム分。
  *  SELECT_TIMEOUT       select() 用のタイムアウト（Solaris 用)
  *  HTTP_STAT_OK         HTTP のステータスコード OK
- *  MAXHOSTNAME          ホスト名（HUBやProxy）の最大長 
+ *  MAXHOSTNAME          ホスト名（HUBやProxy）の最大長。IPv6 のアドレスが入る長さ
+ *  MAXLINKS             HUB との間に張るリンク（接続）の数の上限（-l オプション）
  *  GETMSG_MAXWAIT       getmsg(9F) のタイムアウト値（Solaris 用)
+ *  STE_PEND_RETRY_MSEC  TCP で送りきれなかった残りを送り直すまでの待ち時間（ミリ秒）
+ *  STE_PEND_MAX         TCP で送りきれなかったメッセージを溜めておく送信待ちの
+ *                       サイズ。HUB の送信キュー（OBUFSIZE）と同じ
  ********************************************************/
-#define  CONNECT_REQ_SIZE         200    
 #define  CONNECT_REQ_TIMEOUT      10  
 #define  STRBUFSIZE               32768       
 #define  PORT_NO                  80            
 #define  SOCKBUFSIZE              32768     
 #define  ERR_MSG_MAX              300         
-#define  SENDBUF_THRESHOLD        3028    // ETHERMAX(1514) x 2
+#define  SENDBUF_THRESHOLD(mtu)   ((mtu) * 2)
 #define  SELECT_TIMEOUT           400000  // 400m sec = 0.4 sec
 #define  HTTP_STAT_OK             200        
-#define  MAXHOSTNAME              30          
+#define  MAXHOSTNAME              64          
+#define  MAXLINKS                 8
 #define  GETMSG_MAXWAIT           15
+#define  STE_PEND_RETRY_MSEC      10
+#define  STE_PEND_MAX             (SOCKBUFSIZE * 2)
 #define  STE_MAX_DEVICE_NAME      30
 
 /*
@@ -83,34 +91,100 @@ typedef struct stehead
     int           orglen; /* パディングする前のサイズ。*/
 } stehead_t;
 
+#include "sted_replay.h"
+#include "sted_proto.h"
+#include "sted_hc.h"
+#include "sted_lz.h"
+#include "sted_aead.h"
+#include "sted_fec.h"
+#include "sted_dial.h"
+#include "sted_http.h"
+#include "sted_hb.h"
+#include "sted_aqm.h"
+#include "sted_credit.h"
+
+/*
+ * sted が開いている ste デバイス（仮想 NIC）毎の情報。
+ * -i で複数のデバイスを指定した場合は、HUB との接続に STE_MSG_MUX で
+ * 多重化し、segment をチャネルの番号として使う。adapter[0] が最初に
+ * 指定したデバイスで、HUB が STE_CAP_MUX に合意しなければこれだけを使う。
+ */
+typedef struct sted_adapter
+{
+#ifdef STE_WINDOWS
+    HANDLE        ste_handle;              /* 仮想 NIC デバイスをオープンしたファイルハンドル */
+#else    
+    int           ste_fd;                  /* 仮想 NIC デバイスをオープンした FD */
+#endif    
+    int           instance;                /* インスタンス番号 */
+    unsigned int  segment;                 /* セグメント番号 */
+    int           ste_mtu;                 /* ste ドライバの最大フレームサイズ */
+} sted_adapter_t;
+
 /*
  * sted デーモンが使う sted の管理用構造体
  * HUB との通信の情報や、仮想 NIC ドライバの情報を持っている。
+ * -l で複数のリンクを張る場合はリンク毎に持ち、配列の先頭（リンク 0）の
+ * rdatabuf でドライバから読む。adapter は全てのリンクで同じ。
  */
 typedef struct sted_stat
 {
     /* Socket 通信用用情報 */
     int           sock_fd;                 /* HUB または Proxy との通信につかう FD  */
+    ste_dial_t    dial;                    /* HUB（または Proxy）への接続の状態 */
+    int           nhubs;                   /* -h に指定した HUB の数 */
+    int           hub_index;               /* 接続する（している）HUB の番号。0 がプライマリ */
+    ste_dial_t    probe;                   /* プライマリの HUB に接続できるかの確認（sted_hb.h 参照） */
+    ste_uint64_t  probe_usec;              /* 次にプライマリを確認する時刻 */
+    int           probe_ok;                /* 続けてプライマリに接続できた回数 */
+    ste_hb_t      hb;                      /* ハートビートの状態 */
+    int           conn_id;                 /* 接続 ID。接続（再接続）する度に増える */
     char          hub_name[MAXHOSTNAME];   /* 仮想ハブ名 */
     int           hub_port;                /* 仮想ハブのポート番号 */
     char          proxy_name[MAXHOSTNAME]; /* プロキシーサーバ名   */ 
     int           proxy_port;              /* プロキシーサーバのポート番号  */
+    char          proxy_auth[STE_HTTP_AUTH_MAX]; /* Proxy-Authorization の値。空なら付けない */
+    ste_tunnel_t  tunnel;                  /* Proxy 経由で確立中のトンネル（sted_http.h 参照） */
+    int           nstandby;                /* -w で指定した予備のトンネルの数 */
+    ste_dial_t    standby_dial[STE_TUNNEL_STANDBY_MAX]; /* 予備のトンネル用の Proxy への接続 */
+    ste_tunnel_t  standby[STE_TUNNEL_STANDBY_MAX];      /* 予備のトンネル */
     int           sendbuflen;              /* 送信バッファへの現在の書き込みサイズ  */
-    int           datalen;                 /* パッドを含む Ethernet フレームのサイズ*/
-    int           orgdatalen;              /* 元の Ethernet フレームのサイズ        */
-    int           dataleft;                /* 未受信の Ethernet フレームのサイズ    */
-    stehead_t     dummyhead;               /* 受信途中の stehead のコピー           */
-    int           dummyheadlen;            /* 受信済みの stehead のサイズ           */
+    int           pendlen;                 /* pendbuf に残っている送信待ちのサイズ */
+    ste_hello_t   hello;                   /* HUB に送る STE_MSG_HELLO の内容      */
+    unsigned int  peer_caps;               /* HUB と合意した機能(STE_CAP_XXX)      */
+    int           peer_mtu;                /* HUB と合意した MTU                   */
+    int           tx_flags;                /* 送信するメッセージの形式(STE_TX_XXX) */
+    ste_uint64_t  agg_usec;                /* agg に最初のフレームを詰めた時刻      */
     int           use_syslog;              /* メッセージを STDERR でなく、syslog に出力する */
+    ste_connstat_t stats;                  /* 接続毎の統計情報 */
+    ste_rx_t      rx;                      /* 受信途中のメッセージ */
+    ste_agg_t     agg;                     /* 組み立て中の STE_MSG_AGG */
+    ste_hcc_t     hcc;                     /* ヘッダ圧縮の状態（送信側） */
+    ste_hcd_t     hcd;                     /* ヘッダ圧縮の状態（受信側） */
+    ste_lzc_t    *lzc;                     /* 圧縮の状態（HUB と LZ4 を合意した時だけ） */
+    ste_lzd_t    *lzd;                     /* 展開の状態（同上） */
+    int           use_key;                 /* -k で鍵を指定された。暗号化せずには送受信しない */
+    unsigned char psk[STE_AEAD_KEYLEN];    /* 事前共有鍵 */
+    ste_aead_t   *aead;                    /* 暗号化の状態（HUB と暗号化を合意した時だけ） */
+    int           use_udp;                 /* -u で UDP を使う。HUB から返事が無ければ 0 に戻す */
+    int           udp;                     /* 今の接続が UDP（sted_udp.h 参照） */
+    unsigned int  udp_connid;              /* UDP の conn id。接続毎に乱数で選ぶ */
+    int           hello_ok;                /* HUB から STE_MSG_HELLO の返事が来た */
+    int           hello_tries;             /* STE_MSG_HELLO を送った回数 */
+    ste_uint64_t  hello_usec;              /* 最後に STE_MSG_HELLO を送った時刻 */
+    ste_uint64_t  tx_usec;                 /* 最後に送信した時刻 */
+    ste_fec_t    *fec;                     /* FEC の状態（UDP で HUB と FEC を合意した時だけ） */
+    ste_replay_t *replay;                  /* 送り直し用のリング（TCP の場合だけ。sted_replay.h 参照） */
+    unsigned char token[STE_RESUME_TOKEN]; /* HUB から受け取ったセッショントークン */
+    int           has_token;               /* token が有効（HUB と STE_CAP_RESUME を合意した） */
+    unsigned int  hello_frames;            /* STE_MSG_HELLO の返事を待つ間に送ったフレームの数 */
+    ste_credit_t *credit;                  /* クレジットの状態とキュー（TCP の場合だけ。sted_credit.h 参照） */
     unsigned char sendbuf[SOCKBUFSIZE];    /* Socket 送信用バッファ */
+    unsigned char pendbuf[STE_PEND_MAX];   /* TCP で送りきれなかったメッセージ（送信待ち） */
     unsigned char recvbuf[SOCKBUFSIZE];    /* Socket 受信用バッファ */
     /* ste ドライバ用情報 */
-#ifdef STE_WINDOWS
-    HANDLE        ste_handle;              /* 仮想 NIC デバイスをオープンしたファイルハンドル */
-#else    
-    int           ste_fd;                  /* 仮想 NIC デバイスをオープンした FD */
-#endif    
-    unsigned char wdatabuf[STRBUFSIZE]; /* ドライバへの書き込み用バッファ  */
+    int           nadapters;               /* 開いている ste デバイスの数 */
+    sted_adapter_t adapter[STE_MUX_MAX];   /* ste デバイス毎の情報 */
     unsigned char rdatabuf[STRBUFSIZE]; /* ドライバからの読み込み用バッファ*/    
 } stedstat_t;
 
@@ -119,14 +193,22 @@ typedef struct sted_stat
  */
 extern void     print_err(int, char *, ...);
 extern int      open_socket(stedstat_t *, char *, char *);
+extern void     close_socket(stedstat_t *);
+extern void     open_links(stedstat_t *, int, char *, char *);
+extern stedstat_t *select_link(stedstat_t *, int, unsigned char *, int);
+extern int      put_frame(stedstat_t *, int, unsigned char *, int, int);
+extern int      release_credit(stedstat_t *);
 extern int      read_socket(stedstat_t *);
 extern int      write_socket(stedstat_t *);
-extern u_char  *read_socket_header(stedstat_t *, int *, unsigned char *);
-extern int      send_connect_req(stedstat_t *);
+extern int      flush_parity(stedstat_t *);
+extern int      udp_timer(stedstat_t *);
+extern int      hb_timer(stedstat_t *);
+extern long     tunnel_wait_usec(stedstat_t *);
 extern char    *stat2string(int);
 extern void     print_usage(char *);
 extern int      open_ste(stedstat_t *, char *, int);
-extern int      write_ste(stedstat_t *);
-extern int      read_ste(stedstat_t *);
+extern int      write_ste(stedstat_t *, int, unsigned char *, int);
+extern int      read_ste(stedstat_t *, int);
+extern int      write_stat_file(stedstat_t *, int);
 
 #endif /* #ifndef __STED_H */
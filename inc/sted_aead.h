@@ -0,0 +1,108 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_aead.h
+ *
+ *  sted と stehub の間のリンクを ChaCha20-Poly1305（RFC 8439）で暗号化・
+ *  認証するためのヘッダファイル。
+ *
+ *  sted と stehub に同じ事前共有鍵（-k で指定する 32 byte の鍵ファイル）を
+ *  置いた場合だけ使う。TLS のようにフレーム毎に暗号化するのではなく、
+ *  STE_MSG_AGG（STE_MSG_CAGG, STE_MSG_HAGG, STE_MSG_ZAGG）をまとめて
+ *  1 回で暗号化し、STE_MSG_SEAL として送る。
+ *
+ *  暗号化・復号はメッセージを組み立てたバッファ（受信バッファ）の中で
+ *  その場で行い、ChaCha20 のキーストリームの XOR と Poly1305 を 64 byte
+ *  ずつ交互にかけるので、データを読み書きするのは 1 回だけで済む。
+ *
+ *  鍵の導出
+ *   接続毎に sted と stehub がそれぞれ STE_MSG_HELLO で 8 byte の乱数
+ *   (nonce) を送り合い、
+ *      セッション鍵 = HChaCha20(事前共有鍵, sted の nonce || stehub の nonce)
+ *   とする。どちらかが新しい乱数を選べば鍵が変わるので、接続をまたいで
+ *   同じ (鍵, nonce) の組が使われることは無い。
+ *
+ *  STE_MSG_SEAL の本体
+ *     +-----+--------+----------------------+-----+
+ *     | seq | orglen |  暗号化したメッセージ  | tag |
+ *     +-----+--------+----------------------+-----+
+ *        8      4                               16
+ *   seq    : 方向毎の通し番号（ネットワークバイトオーダー）。ChaCha20 の
+ *            nonce は 方向(4 byte) || seq(8 byte)
+ *   orglen : 暗号化したメッセージの種類(STE_MSG_XXX)
+ *   暗号化したメッセージ : 元のメッセージの本体（パディング込み）
+ *   tag    : Poly1305 の認証タグ。seq と orglen も認証する(AAD)
+ *
+ *  受信側は seq が直前 STE_AEAD_WINDOW 個の範囲にあり、まだ受け取って
+ *  いないものだけを受け付ける（リプレイウィンドウ）。
+ *************************************************/
+#ifndef __STED_AEAD_H
+#define __STED_AEAD_H
+
+/*******************************************************
+ * o 暗号化用の各種パラメータ
+ *
+ *  STE_AEAD_KEYLEN    鍵のサイズ
+ *  STE_AEAD_TAGLEN    認証タグのサイズ
+ *  STE_AEAD_HDRSIZE   STE_MSG_SEAL の本体の先頭（seq, orglen）のサイズ
+ *                     （STE_AEAD_HDRSIZE, STE_AEAD_TAGLEN は sted_proto.h の
+ *                      STE_SEAL_HEADROOM, STE_SEAL_TAILROOM と同じ）
+ *  STE_AEAD_WINDOW    リプレイウィンドウの大きさ(64 以下)
+ ********************************************************/
+#define  STE_AEAD_KEYLEN          32
+#define  STE_AEAD_TAGLEN          16
+#define  STE_AEAD_HDRSIZE         12
+#define  STE_AEAD_WINDOW          64
+
+/*
+ * 方向（nonce の先頭 4 byte）
+ */
+#define  STE_AEAD_DIR_STED        1   /* sted -> stehub */
+#define  STE_AEAD_DIR_HUB         2   /* stehub -> sted */
+
+/*
+ * 接続毎の暗号化の状態
+ */
+typedef struct ste_aead
+{
+    unsigned int    key[8];       /* セッション鍵（ChaCha20 の鍵のワード） */
+    unsigned int    tx_dir;       /* 送信の方向(STE_AEAD_DIR_XXX) */
+    unsigned int    rx_dir;       /* 受信の方向 */
+    ste_uint64_t    tx_seq;       /* 次に送る seq */
+    ste_uint64_t    rx_max;       /* 受け取った最大の seq */
+    ste_uint64_t    rx_bitmap;    /* rx_max から遡って受け取った seq のビットマップ */
+} ste_aead_t;
+
+/*
+ * 暗号化用の関数のプロトタイプ
+ */
+extern int             ste_aead_load_key(char *, unsigned char *);
+extern int             ste_aead_random(unsigned char *, int);
+extern void            ste_aead_init(ste_aead_t *, unsigned char *, unsigned char *, unsigned char *, int);
+extern unsigned char  *ste_aead_seal(ste_aead_t *, unsigned char *, int *, int, ste_connstat_t *);
+extern int             ste_aead_open(ste_aead_t *, ste_msg_t *, ste_msg_t *, ste_connstat_t *);
+
+#endif /* #ifndef __STED_AEAD_H */
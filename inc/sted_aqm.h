@@ -0,0 +1,151 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_aqm.h
+ *
+ *  sted と stehub の送信キューの AQM（Active Queue Management）の
+ *  ヘッダファイル。stehub からも ..\sted\sted_aqm.c としてコンパイルされる。
+ *
+ *  stehub の接続毎の送信キュー（obuf）と、sted のクレジットを待つキュー
+ *  （sted_credit.h）は、バルク転送が流れると一杯まで溜まったままになる。
+ *  同じ接続を通る対話的な通信（ssh や VoIP、DNS）もその後ろに並ぶので、
+ *  数百 msec の遅延が加わっていた。
+ *
+ *  FQ-CoDel と同じ考え方でキューを短く保つ。
+ *  o キューに入れた時刻を覚えておき、出る時に滞留時間（sojourn time）を
+ *    求める。滞留時間が STE_AQM_TARGET_USEC を STE_AQM_INTERVAL_USEC の間
+ *    下回らなければ捨てる状態に入り、CoDel の制御則（間隔を 1/sqrt(count)
+ *    で縮める）で捨てる。
+ *  o フレームは内側のヘッダのハッシュ（ste_flow_hash()）で STE_AQM_FLOWS
+ *    個のフローに分け、フロー毎にキューの中のバイト数を数える。
+ *    捨てる（印を付ける）のは、キューの中に公平な取り分（合計 / フロー数）
+ *    以上を持っているフローのフレームだけ。キューに少ししか持っていない
+ *    対話的なフローは捨てない。
+ *  o キューの空きが STE_AQM_HEADROOM を下回ったら、取り分以上のフローの
+ *    フレームは（CoDel とは関係なく）捨てる。一杯になって全てのフローが
+ *    捨てられる前に、対話的なフローの分の空きを残しておくため（FQ-CoDel が
+ *    キューが一杯になった時に最も大きいフローから捨てるのと同じ）。
+ *  o 内側が ECN に対応した（ECT の）IPv4/IPv6 のパケットなら、捨てる代わりに
+ *    CE を付けて送る（IPv4 はヘッダのチェックサムも直す）。
+ *  o どちらのキューも送る順番は変えられない（stehub の送信キューはメッセージ
+ *    に組み立てたバイト列、sted のキューはリング）ので、FQ-CoDel のように
+ *    フロー毎のキューから出す時に捨てるのではなく、捨てる状態の間に入って
+ *    きたフレームを捨てる。
+ *  o stehub の送信キューはバイト列なので、ste_aqm_queue_t でフレーム毎に
+ *    キューの中の位置を覚えておき、送ったバイト数から出た時刻を決める。
+ *    sted はキューの ste_credit_ent_t に入れた時刻とフローを覚えておく。
+ *  o 滞留時間と捨てた数・印を付けた数は統計情報（ste_connstat_t の sojourn_us,
+ *    sojourn_max_us, aqdrops, aqmarks）に入れて、統計ファイルに書き出す。
+ *************************************************/
+#ifndef __STED_AQM_H
+#define __STED_AQM_H
+
+/*******************************************************
+ * o AQM 用の各種パラメータ
+ *
+ *  STE_AQM_TARGET_USEC    許容する滞留時間(usec)
+ *  STE_AQM_INTERVAL_USEC  滞留時間がこの間 STE_AQM_TARGET_USEC を下回らな
+ *                         ければ捨て始める。捨てる間隔の初期値でもある(usec)
+ *  STE_AQM_FLOWS          フローを分ける数
+ *  STE_AQM_HEADROOM       キューの空きがこれ(bytes)を下回ったら、取り分以上の
+ *                         フローのフレームは捨てる
+ *  STE_AQM_QMAX           ste_aqm_queue_t で覚えておけるフレーム数の上限。
+ *                         超えた分のフレームは数えない
+ ********************************************************/
+#define  STE_AQM_TARGET_USEC      5000
+#define  STE_AQM_INTERVAL_USEC    100000
+#define  STE_AQM_FLOWS            64
+#define  STE_AQM_HEADROOM         16384
+#define  STE_AQM_QMAX             1024
+
+/*
+ * ste_aqm_admit() の戻り値
+ *
+ *  STE_AQM_PASS  そのままキューに入れる
+ *  STE_AQM_MARK  ste_aqm_mark() で CE を付けてからキューに入れる
+ *  STE_AQM_DROP  捨てる
+ */
+#define  STE_AQM_PASS             0
+#define  STE_AQM_MARK             1
+#define  STE_AQM_DROP             2
+
+/*
+ * フローのハッシュ（ste_flow_hash() の値）からフローの番号を求める
+ */
+#define  STE_AQM_FLOW(hash)       ((int)((hash) % STE_AQM_FLOWS))
+
+/*
+ * キュー毎の AQM の状態
+ */
+typedef struct ste_aqm
+{
+    ste_uint64_t    first_above_usec; /* 滞留時間が目標を超えたまま、この時刻になったら捨て始める。0 なら目標以下 */
+    ste_uint64_t    drop_next_usec;   /* 次に捨てる時刻 */
+    int             dropping;         /* 捨てる状態 */
+    unsigned int    count;            /* 捨てる状態に入ってから捨てた数 */
+    unsigned int    lastcount;        /* 前に捨てる状態に入った時の count */
+    unsigned int    total;            /* キューの中のフレームデータの合計 */
+    int             nflows;           /* キューにフレームがあるフローの数 */
+    unsigned int    backlog[STE_AQM_FLOWS]; /* フロー毎のキューの中のフレームデータの合計 */
+} ste_aqm_t;
+
+/*
+ * ste_aqm_queue_t で覚えておくフレーム。pos はキューに入れた時のキューの
+ * 末尾の位置（送ったバイト数の累計で数える）。
+ */
+typedef struct ste_aqm_ent
+{
+    ste_uint64_t    usec;         /* キューに入れた時刻 */
+    unsigned int    pos;
+    unsigned short  flow;
+    unsigned short  len;
+} ste_aqm_ent_t;
+
+/*
+ * バイト列の送信キュー（stehub の obuf）の AQM の状態
+ */
+typedef struct ste_aqm_queue
+{
+    ste_aqm_t       aqm;
+    unsigned int    sent;         /* 送ったバイト数の累計（32 bit で折り返す） */
+    int             head;         /* 最も古いフレームの ent の位置 */
+    int             count;        /* 覚えているフレーム数 */
+    ste_aqm_ent_t   ent[STE_AQM_QMAX];
+} ste_aqm_queue_t;
+
+/*
+ * AQM 用の関数のプロトタイプ
+ */
+extern void  ste_aqm_reset(ste_aqm_t *);
+extern int   ste_aqm_admit(ste_aqm_t *, int, unsigned char *, int, int, ste_uint64_t, ste_connstat_t *);
+extern void  ste_aqm_enqueue(ste_aqm_t *, int, int);
+extern void  ste_aqm_depart(ste_aqm_t *, int, int, ste_uint64_t, ste_uint64_t, ste_connstat_t *);
+extern void  ste_aqm_mark(unsigned char *, int);
+extern void  ste_aqm_queue_reset(ste_aqm_queue_t *);
+extern void  ste_aqm_queue_push(ste_aqm_queue_t *, int, int, int, ste_uint64_t);
+extern void  ste_aqm_queue_sent(ste_aqm_queue_t *, int, ste_uint64_t, ste_connstat_t *);
+
+#endif /* #ifndef __STED_AQM_H */
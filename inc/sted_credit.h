@@ -0,0 +1,162 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_credit.h
+ *
+ *  stehub と sted の間のクレジットによるフロー制御（STE_CAP_CREDIT）の
+ *  ヘッダファイル。
+ *
+ *  以前は転送先の送信キューが一杯になると、stehub は EWOULDBLOCK や
+ *  STE_DROP_QFULL でフレームを捨てるしか無く、sted は HUB が混んでいる
+ *  ことを知らないまま送り続けていた。捨てられるフレームは選べないので、
+ *  ARP や制御用のフレームもバルク転送のフレームと同じように失われる。
+ *
+ *  o TCP の接続で STE_CAP_CREDIT に合意すると、stehub は接続（ポート）毎に
+ *    送ってよいフレーム数とバイト数の上限を STE_MSG_CREDIT で知らせる。
+ *    上限は接続してから数えた累計なので、同じ上限を何度受け取っても、
+ *    後から届いた古い上限でも害は無い。
+ *  o stehub は受け取った数に、転送先の送信キューの空きから求めたウィンドウ
+ *    を足して上限にする。空きはその転送先に送ってくる接続の数で割る。
+ *    上限は下げない。
+ *  o sted はクレジットが無くなったら、フレームを送らずにリンク毎の優先度
+ *    付きのキューに溜める。クレジットを受け取ったら優先度の高い順に送る。
+ *    キューが一杯になったら sted が捨てる（cqdrops）ので、捨てるのは
+ *    stehub の中ではなく、スケジュールできる端になる。
+ *  o 優先度毎のキューには AQM（sted_aqm.h）をかけ、クレジットを待つ間に
+ *    バルク転送のフレームで溜まり続けないようにする。
+ *  o バイト数は ETHERMIN 未満のフレームを ETHERMIN として数える
+ *    （STE_MSG_CAGG でパディングを取り除いても数え方が変わらないように）。
+ *    上限に 1 byte でも届いていなければ 1 フレームは送れる。
+ *  o stehub は壊れたメッセージのフレームを数えられないので、数えた値が
+ *    sted とずれることがある。stehub は STE_STATS_INTERVAL 毎に受け取った
+ *    数も付けて上限を送り直し、sted は STE_CREDIT_RESYNC_USEC の間何も
+ *    送れずにいた場合は、送った数を stehub の数に合わせる。
+ *  o UDP ではメッセージが失われるので合意しない。
+ *
+ *  STE_MSG_CREDIT の本体（多バイトの値はネットワークバイトオーダー）
+ *
+ *    0                               4                               8
+ *   +-------------------------------+-------------------------------+
+ *   |      フレーム数の上限         |        バイト数の上限         |
+ *   +-------------------------------+-------------------------------+
+ *   |  stehub が受け取ったフレーム数|  stehub が受け取ったバイト数  |
+ *   +-------------------------------+-------------------------------+
+ *************************************************/
+#ifndef __STED_CREDIT_H
+#define __STED_CREDIT_H
+
+/*******************************************************
+ * o フロー制御用の各種パラメータ
+ *
+ *  STE_CREDIT_LEN          STE_MSG_CREDIT の本体のサイズ
+ *  STE_CREDIT_FRAMES       1 つの接続に与えるフレーム数のウィンドウの上限
+ *  STE_CREDIT_BYTES        同じくバイト数のウィンドウの上限。stehub の
+ *                          送信キュー（OBUFSIZE）と同じ大きさ
+ *  STE_CREDIT_BANDS        sted のキューの優先度の数
+ *  STE_CREDIT_QFRAMES      優先度毎に溜められるフレーム数の上限
+ *  STE_CREDIT_QBYTES       優先度毎に溜められるフレームデータの合計の上限
+ *  STE_CREDIT_RESYNC_USEC  何も送れないままこの時間が経ったら、送った数を
+ *                          stehub の数に合わせる(usec)
+ ********************************************************/
+#define  STE_CREDIT_LEN           16
+#define  STE_CREDIT_FRAMES        512
+#define  STE_CREDIT_BYTES         65536
+#define  STE_CREDIT_BANDS         3
+#define  STE_CREDIT_QFRAMES       256
+#define  STE_CREDIT_QBYTES        65536
+#define  STE_CREDIT_RESYNC_USEC   2000000
+
+/*
+ * クレジットを数える時のフレームのサイズ
+ */
+#define  STE_CREDIT_SIZE(len)     ((unsigned int)((len) < ETHERMIN ? ETHERMIN : (len)))
+
+/*
+ * 優先度（sted のキューの番号）。小さい方を先に送る。
+ *
+ *  STE_CREDIT_PRIO_HIGH   ARP, ICMP/ICMPv6, DSCP が EF/CS6/CS7, 802.1p が 6 以上
+ *  STE_CREDIT_PRIO_NORMAL その他
+ *  STE_CREDIT_PRIO_LOW    DSCP が CS1, 802.1p が 1（バックグラウンド）
+ */
+#define  STE_CREDIT_PRIO_HIGH     0
+#define  STE_CREDIT_PRIO_NORMAL   1
+#define  STE_CREDIT_PRIO_LOW      2
+
+/*
+ * キューの中のフレーム。chan は ste デバイスの番号。
+ */
+typedef struct ste_credit_ent
+{
+    int             off;          /* buf の中の位置 */
+    int             len;          /* フレーム長 */
+    unsigned int    chan;
+    int             flow;         /* AQM のフローの番号 */
+    ste_uint64_t    usec;         /* キューに入れた時刻 */
+} ste_credit_ent_t;
+
+/*
+ * 優先度毎のキュー。フレームデータは buf に先頭から詰め、末尾に
+ * 収まらなければ先頭に戻る（sted_replay.c のリングと同じ）。
+ */
+typedef struct ste_credit_band
+{
+    int              head;        /* 最も古いフレームの ent の位置 */
+    int              count;       /* キューの中のフレーム数 */
+    int              wpos;        /* 次のフレームを書き込む buf の位置 */
+    ste_aqm_t        aqm;         /* AQM の状態 */
+    ste_credit_ent_t ent[STE_CREDIT_QFRAMES];
+    unsigned char    buf[STE_CREDIT_QBYTES];
+} ste_credit_band_t;
+
+/*
+ * sted のリンク毎のクレジットの状態。送った数と上限は接続してからの
+ * 累計（32 bit で折り返す）。
+ */
+typedef struct ste_credit
+{
+    int               valid;      /* STE_MSG_CREDIT を受け取った。それまでは制限しない */
+    unsigned int      tx_frames;  /* 送ったフレーム数 */
+    unsigned int      tx_bytes;   /* 送ったバイト数（STE_CREDIT_SIZE() で数える） */
+    unsigned int      lim_frames; /* 送ってよいフレーム数の上限 */
+    unsigned int      lim_bytes;  /* 送ってよいバイト数の上限 */
+    ste_uint64_t      stall_usec; /* クレジットが無くなった時刻。送れていれば 0 */
+    int               held;       /* キューに溜めているフレーム数 */
+    ste_credit_band_t band[STE_CREDIT_BANDS];
+} ste_credit_t;
+
+/*
+ * フロー制御用の関数のプロトタイプ
+ */
+extern void            ste_credit_reset(ste_credit_t *);
+extern int             ste_credit_avail(ste_credit_t *);
+extern void            ste_credit_sent(ste_credit_t *, int);
+extern void            ste_credit_grant(ste_credit_t *, unsigned int *, ste_uint64_t, ste_connstat_t *);
+extern int             ste_credit_prio(unsigned char *, int);
+extern int             ste_credit_hold(ste_credit_t *, unsigned int, unsigned char *, int, ste_uint64_t, ste_connstat_t *);
+extern unsigned char  *ste_credit_head(ste_credit_t *, unsigned int *, int *);
+extern void            ste_credit_pop(ste_credit_t *, ste_uint64_t, ste_connstat_t *);
+
+#endif /* #ifndef __STED_CREDIT_H */
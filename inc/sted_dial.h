@@ -0,0 +1,128 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_dial.h
+ *
+ *  sted が HUB（または Proxy）に接続するためのヘッダファイル。
+ *
+ *  以前は gethostbyname() と connect() でブロックしていたので、名前解決や
+ *  TCP のハンドシェイクに時間がかかると、その間は他のリンクも ste デバイス
+ *  も止まっていた。また IPv4 にしか接続できなかった。
+ *
+ *  o 名前解決は別スレッドで getaddrinfo(AF_UNSPEC) を呼ぶ。メインループは
+ *    ste_dial_poll() で終わったかどうかを確認するだけで待たない。
+ *  o 得られたアドレスは RFC 8305（Happy Eyeballs v2）と同じく、最初の
+ *    アドレスのファミリーから始めて IPv6/IPv4 を交互に並べ、
+ *    STE_DIAL_STAGGER_USEC 毎に次のアドレスへの non-blocking connect() を
+ *    追加で始める。最初に接続できた socket を使い、残りは閉じる。
+ *  o UDP の場合は connect() がすぐ終わるので、最初に connect() できた
+ *    アドレスを使う。
+ *  o 全てのアドレスに失敗した場合と、接続が切れた場合は、指数的に伸びる
+ *    時間（STE_DIAL_BACKOFF_MIN_USEC から STE_DIAL_BACKOFF_MAX_USEC まで）に
+ *    揺らぎを加えただけ待ってからやり直す。複数の sted が同時に HUB に
+ *    殺到しないように、待ち時間は [delay/2, delay) の乱数にする。
+ *    HUB から STE_MSG_HELLO の返事が来たら ste_dial_established() で
+ *    待ち時間を元に戻す。
+ *  o 名前解決中に ste_dial_cancel() した場合、解決中の要求はスレッドに任せ、
+ *    スレッドが終わった時に解放する。
+ *  o struct sockaddr や struct addrinfo を使わないので sted.h から include する。
+ *************************************************/
+#ifndef __STED_DIAL_H
+#define __STED_DIAL_H
+
+/*******************************************************
+ * o 接続用の各種パラメータ
+ *
+ *  STE_DIAL_HOSTMAX           ホスト名の最大長
+ *  STE_DIAL_MAXADDR           接続を試すアドレスの数の上限
+ *  STE_DIAL_ADDRLEN           アドレスを保存する領域のサイズ（sockaddr_in6 が入る大きさ）
+ *  STE_DIAL_STAGGER_USEC      次のアドレスへの接続を始めるまでの時間(usec)。
+ *                             RFC 8305 の Connection Attempt Delay
+ *  STE_DIAL_TIMEOUT_USEC      1 回の接続（名前解決を含む）をあきらめるまでの時間(usec)
+ *  STE_DIAL_POLL_USEC         名前解決中・接続中に ste_dial_poll() を呼ぶ間隔(usec)
+ *  STE_DIAL_BACKOFF_MIN_USEC  最初に失敗した後に待つ時間の上限(usec)
+ *  STE_DIAL_BACKOFF_MAX_USEC  続けて失敗した場合に待つ時間の上限(usec)
+ ********************************************************/
+#define  STE_DIAL_HOSTMAX            256
+#define  STE_DIAL_MAXADDR            8
+#define  STE_DIAL_ADDRLEN            28
+#define  STE_DIAL_STAGGER_USEC       250000
+#define  STE_DIAL_TIMEOUT_USEC       10000000
+#define  STE_DIAL_POLL_USEC          20000
+#define  STE_DIAL_BACKOFF_MIN_USEC   500000
+#define  STE_DIAL_BACKOFF_MAX_USEC   30000000
+
+/*
+ * ste_dial_t の state
+ *
+ *  STE_DIAL_IDLE       何もしていない（接続済みか、まだ始めていない）
+ *  STE_DIAL_RESOLVING  名前解決中
+ *  STE_DIAL_CONNECTING 接続中
+ *  STE_DIAL_BACKOFF    失敗したので、retry_usec まで待っている
+ */
+#define  STE_DIAL_IDLE               0
+#define  STE_DIAL_RESOLVING          1
+#define  STE_DIAL_CONNECTING         2
+#define  STE_DIAL_BACKOFF            3
+
+/* ste_dial_poll() の戻り値。接続中なので、後でもう一度呼ぶ */
+#define  STE_DIAL_AGAIN              (-2)
+
+struct ste_dial_req;
+
+/*
+ * 接続の状態。リンク毎に持つ。
+ */
+typedef struct ste_dial
+{
+    int                  state;                   /* STE_DIAL_XXX */
+    struct ste_dial_req *req;                     /* 名前解決中の要求（スレッドと共有） */
+    int                  naddrs;                  /* 名前解決で得たアドレスの数 */
+    int                  next;                    /* 次に接続を試すアドレス */
+    int                  addrlen[STE_DIAL_MAXADDR];
+    unsigned char        addr[STE_DIAL_MAXADDR][STE_DIAL_ADDRLEN];
+    int                  fds[STE_DIAL_MAXADDR];   /* 接続中の socket。-1 は未使用 */
+    int                  nfds;                    /* 接続中の socket の数 */
+    ste_uint64_t         start_usec;              /* 今回の接続を始めた時刻 */
+    ste_uint64_t         next_usec;               /* 次のアドレスへの接続を始める時刻 */
+    ste_uint64_t         retry_usec;              /* STE_DIAL_BACKOFF の場合、やり直す時刻 */
+    int                  failures;                /* 続けて失敗した回数 */
+    int                  quiet;                   /* 失敗してもログを出さない（フェイルバックの確認用） */
+} ste_dial_t;
+
+/*
+ * 接続用の関数のプロトタイプ
+ */
+extern void  ste_dial_init(ste_dial_t *);
+extern int   ste_dial_parse(char *, char *, int, int *);
+extern int   ste_dial_pick(char *, int, char *, int);
+extern int   ste_dial_poll(ste_dial_t *, char *, int, int, ste_uint64_t);
+extern void  ste_dial_cancel(ste_dial_t *);
+extern void  ste_dial_backoff(ste_dial_t *, ste_uint64_t);
+extern void  ste_dial_established(ste_dial_t *);
+extern long  ste_dial_wait_usec(ste_dial_t *, ste_uint64_t);
+
+#endif /* #ifndef __STED_DIAL_H */
@@ -0,0 +1,170 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_fec.h
+ *
+ *  UDP トランスポートで、データグラムのグループ毎に XOR のパリティを
+ *  送って失われたデータグラムを復元する（前方誤り訂正, FEC）ための
+ *  ヘッダファイル。
+ *
+ *  1〜3% のランダムな損失のある回線では、中の TCP が損失の度に cwnd を
+ *  縮めて再送するので、スループットが大きく落ちる。グループの k 個の
+ *  データグラムの後に、それらの XOR を 1 つ送っておけば、グループの中で
+ *  1 つ失われただけなら受信側で復元できる。
+ *
+ *  FEC を使う場合、データグラムの conn id の後に以下のヘッダを付ける
+ *  （先頭の STE_FEC_MAGIC で、メッセージで始まるデータグラムと区別する）。
+ *
+ *    0       1       2       3       4               6               8
+ *   +-------+-------+-------+-------+---------------+---------------+
+ *   | magic |  idx  |   k   | loss  |      seq      |      len      |
+ *   +-------+-------+-------+-------+---------------+---------------+
+ *
+ *   データ（idx < k）: 後ろにメッセージが続く。
+ *     idx  グループの中の番号
+ *     k    グループの大きさ。0 ならパリティを送らない（損失が無い間）
+ *     seq  データグラムの通し番号。グループの最初のデータグラムの seq は
+ *          seq - idx
+ *     len  0
+ *   パリティ（idx が STE_FEC_PARITY）: 後ろにグループのデータグラムの
+ *   ヘッダより後ろを、最長のものに合わせて 0 を詰めて XOR したものが続く。
+ *     k    グループのデータグラム数。送信が途切れたら k 個に満たなくても
+ *          パリティを送ってグループを閉じる
+ *     seq  グループの最初のデータグラムの seq
+ *     len  データグラムの（ヘッダより後ろの）長さの XOR
+ *   STE_FEC_NOSEQ: k より大きいデータグラムなど、グループに入れずに送る
+ *   もの（seq も使わない）。
+ *
+ *   loss はどちらも、送信側が受信しているデータグラムの損失率（seq の
+ *   抜けから数える。単位は 1/1024）。相手はこれを見てグループの大きさを
+ *   決める（損失が多いほど小さくする）ので、冗長度は回線の状態に合わせて
+ *   変わる。
+ *
+ *  o 受信側はグループの途中が抜けていたら、後ろのデータグラムを
+ *    STE_FEC_HOLD_USEC まで取っておき、復元してから順番通りに渡す
+ *    （ヘッダ圧縮のコンテキストは順番が入れ替わるとずれるため）。
+ *    パリティが届いて復元できないとわかるか、次のグループが届くか、
+ *    時間切れになったら、抜けを飛ばして渡す。
+ *  o 暗号化を合意していれば、復元したメッセージも STE_MSG_SEAL のまま
+ *    なので、復元を誤っても認証で捨てられる。
+ *  o Reed-Solomon で複数の損失を復元することもできるが、1〜3% の損失では
+ *    グループの中で 2 つ失われることは少ないので、XOR 1 つで十分。
+ *************************************************/
+#ifndef __STED_FEC_H
+#define __STED_FEC_H
+
+/*******************************************************
+ * o FEC 用の各種パラメータ
+ *
+ *  STE_FEC_HDRSIZE      FEC のヘッダのサイズ
+ *  STE_FEC_KMAX         グループの大きさの上限(32 以下)
+ *  STE_FEC_DATA_MAX     グループに入れるデータグラムの（ヘッダより後ろの）
+ *                       最大長。UDP では STE_UDP_PAYLOAD を超えるフレームは
+ *                       1 つだけで送るので、最大のフレーム 1 つ分
+ *  STE_FEC_HOLD_USEC    抜けの後ろのデータグラムを取っておく時間の上限(usec)
+ *  STE_FEC_LOSS_WINDOW  損失率を計算し直すデータグラム数
+ ********************************************************/
+#define  STE_FEC_HDRSIZE          8
+#define  STE_FEC_KMAX             16
+#define  STE_FEC_DATA_MAX         (STE_AGG_HDRMAX + STE_FRAME_MAX + 4 + STE_SEAL_OVERHEAD)
+#define  STE_FEC_HOLD_USEC        30000
+#define  STE_FEC_LOSS_WINDOW      128
+
+#define  STE_FEC_MAGIC            0xfe
+#define  STE_FEC_PARITY           0xff
+#define  STE_FEC_NOSEQ            0xfe
+
+/* 抜けの後ろのデータグラムを取っておいている（ste_fec_expire() を呼ぶ必要がある） */
+#define  STE_FEC_HOLDING(fec)     ((fec)->rx.nheld > 0)
+
+/*
+ * 送信側の状態
+ */
+typedef struct ste_fec_tx
+{
+    unsigned int    seq;          /* 次に送るデータグラムの seq */
+    unsigned int    base;         /* 組み立て中のグループの最初の seq */
+    int             k;            /* 組み立て中のグループの大きさ */
+    int             n;            /* グループに入れたデータグラム数 */
+    int             maxlen;       /* グループの最長のデータグラムの長さ */
+    unsigned int    lenxor;       /* グループのデータグラムの長さの XOR */
+    unsigned int    peer_loss;    /* 相手が報告してきた損失率 */
+    unsigned char   parity[STE_FEC_HDRSIZE + STE_FEC_DATA_MAX]; /* パリティのデータグラム */
+} ste_fec_tx_t;
+
+/*
+ * 受信側の状態。held は抜けの後ろに届いたデータグラムと復元したデータ
+ * グラムを idx の位置に置く。
+ */
+typedef struct ste_fec_rx
+{
+    int             started;      /* seq を受け取ったことがある */
+    unsigned int    max_seq;      /* 受け取った最大の seq */
+    unsigned int    expected;     /* 計測中に届くはずだったデータグラム数 */
+    unsigned int    received;     /* 計測中に届いたデータグラム数 */
+    unsigned int    loss;         /* 損失率（単位は 1/1024） */
+    int             active;       /* 組み立て中のグループがある */
+    unsigned int    base;         /* 組み立て中のグループの最初の seq */
+    int             k;            /* データグラムのヘッダの k */
+    int             n;            /* パリティのヘッダの k（パリティが届くまで 0） */
+    unsigned int    have;         /* 届いた（復元した）データグラムのビットマップ */
+    int             next;         /* 次に渡すデータグラムの idx */
+    int             nheld;        /* held に取っておいている数 */
+    ste_uint64_t    held_usec;    /* 最初に取っておいた時刻 */
+    int             acclen;       /* acc の有効な長さ */
+    unsigned int    lenxor;       /* 届いたデータグラムとパリティの len の XOR */
+    unsigned char   acc[STE_FEC_DATA_MAX];  /* 届いたデータグラムとパリティの XOR */
+    int             hlen[STE_FEC_KMAX];
+    unsigned char   held[STE_FEC_KMAX][STE_FEC_DATA_MAX];
+    int             prev_valid;   /* 1 つ前のグループ（遅れて届いたデータグラム用） */
+    unsigned int    prev_base;
+    unsigned int    prev_have;
+    unsigned char  *pend;         /* まだ処理していない受信したデータグラム */
+    int             pend_len;
+    ste_uint64_t    pend_usec;
+    int             nout;         /* 渡すデータグラムの表 */
+    int             iout;
+    unsigned char  *out[STE_FEC_KMAX + 1];
+    int             outlen[STE_FEC_KMAX + 1];
+} ste_fec_rx_t;
+
+typedef struct ste_fec
+{
+    ste_fec_tx_t    tx;
+    ste_fec_rx_t    rx;
+} ste_fec_t;
+
+/*
+ * FEC 用の関数のプロトタイプ
+ */
+extern void            ste_fec_reset(ste_fec_t *);
+extern int             ste_fec_put_data(ste_fec_t *, unsigned char *, unsigned char *, int);
+extern unsigned char  *ste_fec_put_parity(ste_fec_t *, int *, ste_connstat_t *);
+extern int             ste_fec_input(ste_fec_t *, unsigned char *, int, ste_uint64_t);
+extern int             ste_fec_next(ste_fec_t *, unsigned char **, int *, ste_connstat_t *);
+extern int             ste_fec_expire(ste_fec_t *, ste_uint64_t, ste_connstat_t *);
+
+#endif /* #ifndef __STED_FEC_H */
@@ -0,0 +1,109 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_flight.h
+ *
+ *  フライトレコーダー用のヘッダファイル。
+ *
+ *  直近のフレームのイベント（受信・転送先の決定・キューイング・送信）
+ *  を時刻と一緒にスレッド毎の固定長のリングバッファに常に記録しておく。
+ *  あるフレームの滞留時間（受信から送信まで）が閾値を超えたら、その
+ *  前後のイベントをスナップショットとしてファイルに書き出す。
+ *  数分に一度しか起きない遅延のスパイクの原因（どの接続、どのキュー、
+ *  どのシステムコールか）を後から調べるためのもの。
+ *************************************************/
+#ifndef __STED_FLIGHT_H
+#define __STED_FLIGHT_H
+
+/*******************************************************
+ * o フライトレコーダー用の各種パラメータ
+ *
+ *  STE_FLIGHT_RINGSIZE     スレッド毎に記録するイベント数(2 のべき乗)
+ *  STE_FLIGHT_BEFORE       スナップショットに含める閾値超過前のイベント数
+ *  STE_FLIGHT_AFTER        スナップショットに含める閾値超過後のイベント数
+ *  STE_FLIGHT_HOLDOFF_USEC スナップショットを書き出す最短の間隔(usec)
+ *  STE_FLIGHT_THRESHOLD    滞留時間の閾値のデフォルト(usec)
+ ********************************************************/
+#define  STE_FLIGHT_RINGSIZE      1024
+#define  STE_FLIGHT_BEFORE        192
+#define  STE_FLIGHT_AFTER         64
+#define  STE_FLIGHT_HOLDOFF_USEC  1000000
+#define  STE_FLIGHT_THRESHOLD     20000
+
+/*
+ * イベントの種類
+ *
+ *  STE_FLT_INGRESS  フレームを受信した     (conn, len)
+ *  STE_FLT_DECIDE   転送先を決めた         (conn=送信元, arg=送信先)
+ *  STE_FLT_ENQUEUE  送信キューに入れた     (conn, len, arg=キューの深さ)
+ *  STE_FLT_EGRESS   send() した            (conn, len, arg=send() の戻り値)
+ *  STE_FLT_DROP     転送をあきらめた       (conn, len, arg=STE_DROP_XXX)
+ */
+#define  STE_FLT_INGRESS          1
+#define  STE_FLT_DECIDE           2
+#define  STE_FLT_ENQUEUE          3
+#define  STE_FLT_EGRESS           4
+#define  STE_FLT_DROP             5
+
+/*
+ * リングバッファに記録するイベント
+ */
+typedef struct ste_flight_ev
+{
+    ste_uint64_t    usec;     /* 記録した時刻(usec) */
+    unsigned int    seq;      /* フレームの通し番号（受信時に振る） */
+    unsigned short  type;     /* イベントの種類(STE_FLT_XXX) */
+    unsigned short  conn;     /* 接続 ID */
+    int             len;      /* フレーム（データ）長 */
+    int             arg;      /* イベント毎の引数 */
+} ste_flight_ev_t;
+
+/*
+ * スレッド毎のリングバッファ。古いイベントは上書きする。
+ */
+typedef struct ste_flight_ring
+{
+    unsigned int    head;          /* 次に書き込む位置(単調増加) */
+    unsigned int    seq;           /* 最後に振ったフレームの通し番号 */
+    unsigned int    tid;           /* 書き込むスレッドの ID */
+    unsigned int    trigger;       /* 閾値を超えたイベントの位置 */
+    unsigned int    trigger_seq;   /* 閾値を超えたフレームの通し番号 */
+    unsigned int    trigger_usec;  /* 閾値を超えたフレームの滞留時間 */
+    int             pending;       /* スナップショットの書き出し待ち */
+    ste_uint64_t    last_snap;     /* 前回スナップショットを書き出した時刻 */
+    ste_flight_ev_t ev[STE_FLIGHT_RINGSIZE];
+} ste_flight_ring_t;
+
+/*
+ * フライトレコーダーの関数のプロトタイプ
+ */
+extern void         ste_flight_init(char *, unsigned int);
+extern unsigned int ste_flight_ingress(int, int, ste_uint64_t *);
+extern void         ste_flight_record(int, unsigned int, int, int, int);
+extern void         ste_flight_egress(unsigned int, int, int, int, ste_uint64_t);
+extern void         ste_flight_flush(void);
+
+#endif /* #ifndef __STED_FLIGHT_H */
@@ -0,0 +1,93 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_hb.h
+ *
+ *  sted が HUB の死活を監視し（ハートビート）、複数の HUB の間で
+ *  フェイルオーバーするためのヘッダファイル。
+ *
+ *  以前は HUB が落ちたり途中の経路が切れたりしても（half-open の TCP）、
+ *  send() がエラーになるまで気付かなかった。TCP の再送がタイムアウト
+ *  するまで数分かかることもある。また -h には HUB を 1 つしか指定でき
+ *  なかった。
+ *
+ *  o HUB と STE_CAP_PING を合意したら、-b で指定した間隔で STE_MSG_PING を
+ *    送り、返事の stamp から RTT を測る（平滑化は RFC 6298 と同じ）。
+ *  o HUB から何も受信しない時間が、間隔の STE_HB_MISSES 倍（RTT が大きい
+ *    経路では RTO の 2 倍）を超えたら、HUB が応答しないとみなして接続を
+ *    閉じる。
+ *  o -h にカンマで区切って複数の HUB を指定した場合、先頭がプライマリ。
+ *    接続が切れるか接続に失敗したら、待たずに次の HUB に接続する。
+ *    一巡して全ての HUB に失敗した場合だけバックオフする。
+ *  o プライマリ以外の HUB に接続している間は、STE_FAILBACK_USEC 毎に
+ *    プライマリに TCP で接続してみて、STE_FAILBACK_PROBES 回続けて接続
+ *    できたらプライマリに戻る（フェイルバック）。Proxy 経由の場合は
+ *    確かめられないので、今の HUB が切れた時にだけ戻る。
+ *************************************************/
+#ifndef __STED_HB_H
+#define __STED_HB_H
+
+/*******************************************************
+ * o ハートビートとフェイルオーバー用の各種パラメータ
+ *
+ *  STE_HB_INTERVAL_MSEC  STE_MSG_PING を送る間隔(msec)のデフォルト。-b で変える
+ *  STE_HB_MISSES         この回数分の間隔の間 HUB から何も受信しなければ
+ *                        応答しないとみなす
+ *  STE_HB_DEAD_MAX_USEC  応答しないとみなすまでの時間の上限(usec)
+ *  STE_HUB_MAX           -h に指定できる HUB の数
+ *  STE_FAILBACK_USEC     プライマリの HUB に接続できるか確かめる間隔(usec)
+ *  STE_FAILBACK_PROBES   続けて接続できたらプライマリに戻る回数
+ ********************************************************/
+#define  STE_HB_INTERVAL_MSEC     250
+#define  STE_HB_MISSES            4
+#define  STE_HB_DEAD_MAX_USEC     10000000
+#define  STE_HUB_MAX              4
+#define  STE_FAILBACK_USEC        5000000
+#define  STE_FAILBACK_PROBES      3
+
+/*
+ * ハートビートの状態。リンク毎に持つ。RTT と送受信した数は統計情報
+ * （ste_connstat_t の hbXXX）に入れる。
+ */
+typedef struct ste_hb
+{
+    ste_uint64_t    interval_usec;  /* STE_MSG_PING を送る間隔。0 なら送らない */
+    ste_uint64_t    next_usec;      /* 次に STE_MSG_PING を送る時刻 */
+    ste_uint64_t    rx_usec;        /* 最後に HUB から受信した時刻 */
+} ste_hb_t;
+
+/*
+ * ハートビート用の関数のプロトタイプ
+ */
+extern void  ste_hb_init(ste_hb_t *, int);
+extern void  ste_hb_reset(ste_hb_t *, ste_uint64_t);
+extern void  ste_hb_rx(ste_hb_t *, ste_uint64_t);
+extern int   ste_hb_due(ste_hb_t *, ste_uint64_t);
+extern void  ste_hb_reply(ste_hb_t *, ste_uint64_t, ste_uint64_t, ste_connstat_t *);
+extern int   ste_hb_dead(ste_hb_t *, ste_uint64_t, ste_connstat_t *);
+extern long  ste_hb_wait_usec(ste_hb_t *, ste_uint64_t);
+
+#endif /* #ifndef __STED_HB_H */
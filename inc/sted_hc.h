@@ -0,0 +1,144 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_hc.h
+ *
+ *  sted と stehub の間のリンクで、TCP/IPv4 のフレームのヘッダを圧縮する
+ *  ためのヘッダファイル。
+ *
+ *  リンクを流れるフレームの大半は少数の長く続く TCP のフローのもので、
+ *  Ethernet + IPv4 + TCP のヘッダ（オプション無しで 54 byte）は前の
+ *  フレームとほとんど変わらない。そこで ROHC の U-mode に似た方法で、
+ *  リンク毎にフローのコンテキスト（直前のヘッダ）を送信側と受信側で
+ *  持ち、既知のフローは変わった部分（シーケンス番号や ACK の増分、
+ *  フラグ等）だけを送る。
+ *
+ *   o コンテキストはフローのハッシュで決まる STE_HC_CTX_MAX 個の固定の
+ *     テーブル（ダイレクトマップ）。衝突したら新しいフローで上書きする。
+ *   o 受信側は差分毎の通し番号(msn)でフレームの取りこぼしを検出し、
+ *     そのコンテキストの差分は次のフルヘッダまで捨てる。フィードバックは
+ *     無いので、送信側はコンテキスト毎に STE_HC_REFRESH フレームに 1 回は
+ *     フルヘッダを送る。
+ *   o IP のチェックサムは受信側で計算し直す。TCP のチェックサムは
+ *     そのまま送るので、万一復元を誤っても相手の TCP が捨てる。
+ *
+ *  STE_MSG_HAGG の本体は以下のエントリの繰り返し。len は STE_MSG_CAGG と
+ *  同じ 7 bit ずつの可変長。code 0 は末尾のパディング。
+ *
+ *   STE_HC_RAW   | code | len | frame |
+ *                  圧縮しないフレーム（TCP/IPv4 以外など）
+ *   STE_HC_FULL  | code | ctx | msn | len | frame |
+ *                  フルヘッダ。受信側はヘッダを ctx 番のコンテキストにする
+ *   STE_HC_DELTA | code | ctx | msn | mask | 変わったフィールド | csum | len | payload |
+ *                  差分。変わったフィールドは mask の STE_HC_F_XXX の順に並ぶ
+ *                  csum は TCP のチェックサム(2 byte)、len はペイロード長
+ *************************************************/
+#ifndef __STED_HC_H
+#define __STED_HC_H
+
+/*******************************************************
+ * o ヘッダ圧縮用の各種パラメータ
+ *
+ *  STE_HC_CTX_MAX   リンク毎のコンテキストの数(2 のべき乗, 256 以下)
+ *  STE_HC_REFRESH   コンテキスト毎にフルヘッダを送る間隔(フレーム数)
+ *  STE_HC_HDRMAX    コンテキストに覚えるヘッダの最大長
+ *                   (Ethernet 14 + IPv4 20 + TCP 60)
+ *  STE_HC_OUTSIZE   受信側でフレームを復元するバッファのサイズ
+ ********************************************************/
+#define  STE_HC_CTX_MAX           32
+#define  STE_HC_REFRESH           64
+#define  STE_HC_HDRMAX            (14 + 20 + 60)
+#define  STE_HC_OUTSIZE           (STE_MSG_MAX + STE_AGG_MAX_FRAMES * STE_HC_HDRMAX)
+
+/*
+ * エントリの種類（code）
+ */
+#define  STE_HC_PAD               0
+#define  STE_HC_RAW               1
+#define  STE_HC_FULL              2
+#define  STE_HC_DELTA             3
+
+/*
+ * STE_HC_DELTA の mask
+ *
+ *  STE_HC_F_IPID   IP の ID (2 byte)。無ければ直前 + 1
+ *  STE_HC_F_SEQ    シーケンス番号の直前からの増分(可変長)。
+ *                  無ければ直前 + 直前のペイロード長
+ *  STE_HC_F_ACK    ACK 番号の直前からの増分(可変長)
+ *  STE_HC_F_WIN    ウィンドウ(2 byte)
+ *  STE_HC_F_FLAGS  TCP のフラグ(1 byte)
+ *  STE_HC_F_TS     タイムスタンプオプションの TSval, TSecr の増分(可変長 x 2)
+ *  STE_HC_F_OPTS   TCP のオプション全体（長さは直前と同じ）
+ */
+#define  STE_HC_F_IPID            0x01
+#define  STE_HC_F_SEQ             0x02
+#define  STE_HC_F_ACK             0x04
+#define  STE_HC_F_WIN             0x08
+#define  STE_HC_F_FLAGS           0x10
+#define  STE_HC_F_TS              0x20
+#define  STE_HC_F_OPTS            0x40
+
+/*
+ * フローのコンテキスト。hdr は直前のフレームのヘッダ。
+ */
+typedef struct ste_hc_ctx
+{
+    int             valid;      /* hdr が有効 */
+    int             msn;        /* 直前のフレームの通し番号(8 bit) */
+    int             count;      /* 直前のフルヘッダから送ったフレーム数（送信側） */
+    int             hlen;       /* hdr の長さ */
+    int             paylen;     /* 直前のフレームのペイロード長 */
+    unsigned char   hdr[STE_HC_HDRMAX];
+} ste_hc_ctx_t;
+
+/*
+ * 送信側（圧縮）の状態。ste_agg_t の hc に設定すると ste_agg_add() が
+ * STE_MSG_HAGG を組み立てる。
+ */
+typedef struct ste_hcc
+{
+    ste_connstat_t *cs;         /* 統計情報を数える接続毎の統計情報 */
+    ste_hc_ctx_t    ctx[STE_HC_CTX_MAX];
+} ste_hcc_t;
+
+/*
+ * 受信側（復元）の状態。復元したフレームは out に置く。
+ */
+typedef struct ste_hcd
+{
+    ste_hc_ctx_t    ctx[STE_HC_CTX_MAX];
+    unsigned char   out[STE_HC_OUTSIZE];
+} ste_hcd_t;
+
+/*
+ * ヘッダ圧縮用の関数のプロトタイプ
+ */
+extern void  ste_hcc_reset(ste_hcc_t *, ste_connstat_t *);
+extern void  ste_hcd_reset(ste_hcd_t *);
+extern int   ste_hc_put(ste_hcc_t *, unsigned char *, int, unsigned char *, int);
+extern int   ste_hc_parse(ste_hcd_t *, ste_msg_t *, unsigned char **, int *, int, ste_connstat_t *);
+
+#endif /* #ifndef __STED_HC_H */
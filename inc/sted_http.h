@@ -0,0 +1,140 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_http.h
+ *
+ *  sted が Proxy サーバ経由で HUB に接続する（HTTP の CONNECT メソッドで
+ *  トンネルを作る）ためのヘッダファイル。
+ *
+ *  以前は CONNECT を送った後に 1 回だけ recv() し、ステータスラインを
+ *  strtok() で切り出していた。レスポンスが複数のセグメントに分かれて
+ *  届くと読み違え、レスポンスの後ろに HUB からのデータが続いていると
+ *  捨ててしまっていた。また、レスポンスを待つ間はブロックしていた。
+ *
+ *  o レスポンスは ste_http_feed() で 1 バイトずつ読み進める。途中までしか
+ *    届いていなければ続きを待ち、ヘッダの終わり（空行）の後ろのデータは
+ *    トンネルのデータとして HUB からの受信データの先頭に回す。
+ *  o 1xx のレスポンス（RFC 7231）は読み飛ばして、最終的なレスポンスを待つ。
+ *  o -p に「user:password@proxy:port」の形で指定すると、Proxy-Authorization
+ *    ヘッダ（Basic 認証）を付ける。
+ *  o トンネル（ste_tunnel_t）の確立はブロックせず、メインループから
+ *    ste_tunnel_poll() で進める。
+ *  o -w で指定した数のトンネルを、使われていない予備（standby）として
+ *    Proxy 経由で HUB まで張っておく。接続が切れたら、Proxy への接続と
+ *    CONNECT を待たずに予備のトンネルに切り替える。予備のトンネルは
+ *    Proxy に切られないように STE_TUNNEL_REFRESH_USEC 毎に張り直す。
+ *************************************************/
+#ifndef __STED_HTTP_H
+#define __STED_HTTP_H
+
+/*******************************************************
+ * o Proxy 経由の接続用の各種パラメータ
+ *
+ *  STE_HTTP_HEAD_MAX        CONNECT のレスポンスのヘッダの最大長
+ *  STE_HTTP_LINE_MAX        ステータスラインとして保存する最大長
+ *  STE_HTTP_AUTH_MAX        Proxy-Authorization の値の最大長
+ *  STE_HTTP_REQ_MAX         CONNECT リクエストの最大長
+ *  STE_TUNNEL_TIMEOUT_USEC  CONNECT のレスポンスを待つ時間(usec)
+ *  STE_TUNNEL_STANDBY_MAX   -w で指定できる予備のトンネルの数
+ *  STE_TUNNEL_REFRESH_USEC  予備のトンネルを張り直す間隔(usec)
+ ********************************************************/
+#define  STE_HTTP_HEAD_MAX          8192
+#define  STE_HTTP_LINE_MAX          128
+#define  STE_HTTP_AUTH_MAX          512
+#define  STE_HTTP_REQ_MAX           (STE_DIAL_HOSTMAX * 2 + STE_HTTP_AUTH_MAX + 128)
+#define  STE_TUNNEL_TIMEOUT_USEC    (CONNECT_REQ_TIMEOUT * 1000000)
+#define  STE_TUNNEL_STANDBY_MAX     4
+#define  STE_TUNNEL_REFRESH_USEC    60000000
+
+/*
+ * ste_http_t の state
+ *
+ *  STE_HTTP_STATUS  ステータスラインを読んでいる
+ *  STE_HTTP_HEADER  ヘッダを読んでいる
+ *  STE_HTTP_DONE    ヘッダの終わり（空行）まで読んだ
+ *  STE_HTTP_ERROR   レスポンスが壊れていた
+ */
+#define  STE_HTTP_STATUS            0
+#define  STE_HTTP_HEADER            1
+#define  STE_HTTP_DONE              2
+#define  STE_HTTP_ERROR             3
+
+/*
+ * ste_tunnel_t の state
+ *
+ *  STE_TUNNEL_IDLE     使っていない
+ *  STE_TUNNEL_WAITING  CONNECT を送って、レスポンスを待っている
+ *  STE_TUNNEL_READY    トンネルができた
+ */
+#define  STE_TUNNEL_IDLE            0
+#define  STE_TUNNEL_WAITING         1
+#define  STE_TUNNEL_READY           2
+
+/*
+ * CONNECT のレスポンスを読み進めている状態。
+ */
+typedef struct ste_http
+{
+    int            state;                     /* STE_HTTP_XXX */
+    int            status;                    /* ステータスコード */
+    int            total;                     /* 読んだヘッダの長さ */
+    int            linelen;                   /* 読みかけの行の長さ */
+    char           line[STE_HTTP_LINE_MAX];   /* 読みかけのステータスライン */
+} ste_http_t;
+
+/*
+ * Proxy 経由で HUB に張るトンネル。Proxy への接続は ste_dial_t で行い、
+ * 接続できた socket を ste_tunnel_start() に渡す。
+ */
+typedef struct ste_tunnel
+{
+    int            state;                     /* STE_TUNNEL_XXX */
+    int            fd;                        /* Proxy との socket。無ければ -1 */
+    int            hub_index;                 /* トンネルの先の HUB の番号 */
+    int            quiet;                     /* 失敗してもログを出さない（予備のトンネル用） */
+    ste_uint64_t   start_usec;                /* CONNECT を送った（READY なら、できた）時刻 */
+    int            reqlen;                    /* CONNECT リクエストの長さ */
+    int            reqsent;                   /* 送った長さ */
+    char           req[STE_HTTP_REQ_MAX];     /* CONNECT リクエスト */
+    ste_http_t     http;                      /* レスポンスを読み進めている状態 */
+    int            restlen;                   /* rest の長さ */
+    unsigned char  rest[STE_HTTP_HEAD_MAX];   /* レスポンスの後ろに続いていたデータ */
+} ste_tunnel_t;
+
+/*
+ * Proxy 経由の接続用の関数のプロトタイプ
+ */
+extern void  ste_http_reset(ste_http_t *);
+extern int   ste_http_feed(ste_http_t *, unsigned char *, int);
+extern int   ste_http_basic(char *, int, char *);
+extern int   ste_http_connect_req(char *, int, char *, int, char *);
+extern void  ste_tunnel_init(ste_tunnel_t *);
+extern int   ste_tunnel_start(ste_tunnel_t *, int, char *, int, char *, int, ste_uint64_t);
+extern int   ste_tunnel_poll(ste_tunnel_t *, ste_uint64_t);
+extern void  ste_tunnel_close(ste_tunnel_t *);
+extern long  ste_tunnel_wait_usec(ste_tunnel_t *, ste_uint64_t);
+
+#endif /* #ifndef __STED_HTTP_H */
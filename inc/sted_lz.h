@@ -0,0 +1,125 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_lz.h
+ *
+ *  sted と stehub の間のリンクで、まとめたフレームを LZ4 で圧縮する
+ *  ためのヘッダファイル。
+ *
+ *  WAN やプロキシ経由の細いリンクでは帯域が律速になるので、STE_MSG_AGG
+ *  （STE_MSG_CAGG）の本体を LZ4 のブロック形式で圧縮し、STE_MSG_ZAGG と
+ *  して送る。直前までに送ったデータ（最大 STE_LZ_WINDOW byte）を辞書
+ *  として使うので、似たフレームが続けば 1 メッセージの中だけで圧縮する
+ *  よりよく縮む。
+ *
+ *  圧縮するかどうかはメッセージ毎に決める。
+ *   o 縮まなかった（1/STE_LZ_MIN_SAVING 以上減らなかった）場合はそのまま
+ *     送り、辞書にも入れない。次の数メッセージは圧縮を試さない。試さない
+ *     数は続けて縮まなければ STE_LZ_BACKOFF_MAX まで倍々に増やす。
+ *   o STE_LZ_CPU_WINDOW_USEC の間に圧縮にかけた時間が
+ *     STE_LZ_CPU_BUDGET_USEC を超えたら、次の区間まで圧縮しない。
+ *  圧縮は sted の -z で要求した場合だけ使うので、LAN のリンクでは
+ *  何もしない。
+ *
+ *  STE_MSG_ZAGG の本体
+ *     +------+-------+--------+--------+-----------+-----+
+ *     | type | flags | rawlen | offset | LZ4 block | pad |
+ *     +------+-------+--------+--------+-----------+-----+
+ *        1      1       2        4
+ *   type   : 圧縮前のメッセージの種類の符号を反転したもの
+ *   flags  : STE_LZ_F_RESET なら辞書を捨ててから展開する
+ *   rawlen : 圧縮前の本体のサイズ（ネットワークバイトオーダー）
+ *   offset : 辞書をリセットしてからのストリーム上の位置（同上）。受信側の
+ *            位置と合わなければ（途中のメッセージが壊れて捨てられた）、
+ *            次の STE_LZ_F_RESET までは展開できないので捨てる。送信側は
+ *            STE_LZ_RESET_BYTES 毎に辞書をリセットする。
+ *************************************************/
+#ifndef __STED_LZ_H
+#define __STED_LZ_H
+
+/*******************************************************
+ * o 圧縮用の各種パラメータ
+ *
+ *  STE_LZ_WINDOW           辞書として使う直前のデータのサイズ
+ *  STE_LZ_HASHLOG          一致を探すハッシュテーブルのサイズ(2 のべき乗)
+ *  STE_LZ_HDRSIZE          STE_MSG_ZAGG の本体の先頭のヘッダのサイズ
+ *  STE_LZ_MIN_BYTES        これより小さいメッセージは圧縮しない
+ *  STE_LZ_MIN_SAVING       1/STE_LZ_MIN_SAVING 以上減らなければ圧縮しない
+ *  STE_LZ_BACKOFF_MAX      縮まなかった後に圧縮を試さないメッセージ数の上限
+ *  STE_LZ_RESET_BYTES      辞書をリセットする間隔(byte)
+ *  STE_LZ_CPU_WINDOW_USEC  圧縮にかけた時間を数える区間(usec)
+ *  STE_LZ_CPU_BUDGET_USEC  1 区間の間に圧縮にかけてよい時間(usec)
+ ********************************************************/
+#define  STE_LZ_WINDOW            65536
+#define  STE_LZ_HASHLOG           12
+#define  STE_LZ_HDRSIZE           8
+#define  STE_LZ_MIN_BYTES         256
+#define  STE_LZ_MIN_SAVING        8
+#define  STE_LZ_BACKOFF_MAX       64
+#define  STE_LZ_RESET_BYTES       (256 * 1024)
+#define  STE_LZ_CPU_WINDOW_USEC   1000000
+#define  STE_LZ_CPU_BUDGET_USEC   100000
+#define  STE_LZ_BUFSIZE           (STE_LZ_WINDOW + STE_MSG_MAX)
+
+#define  STE_LZ_F_RESET           0x01
+
+/*
+ * 送信側（圧縮）の状態。buf には辞書と圧縮中のデータが続けて入る。
+ */
+typedef struct ste_lzc
+{
+    int             pos;        /* buf に入っているデータのサイズ */
+    unsigned int    offset;     /* 辞書をリセットしてからのストリーム上の位置 */
+    int             reset;      /* 次のメッセージに STE_LZ_F_RESET を付ける */
+    int             skip;       /* 圧縮を試さない残りのメッセージ数 */
+    int             backoff;    /* 次に縮まなかった時に skip にセットする数 */
+    ste_uint64_t    cpu_start;  /* 圧縮にかけた時間を数えている区間の開始時刻 */
+    unsigned int    cpu_usec;   /* 同区間に圧縮にかけた時間(usec) */
+    unsigned int    hash[1 << STE_LZ_HASHLOG]; /* 4 byte のハッシュ -> buf 上の位置 */
+    unsigned char   buf[STE_LZ_BUFSIZE];
+    unsigned char   out[STE_SEAL_HEADROOM + sizeof(stehead2_t) + STE_MSG_MAX]; /* 組み立てた STE_MSG_ZAGG */
+} ste_lzc_t;
+
+/*
+ * 受信側（展開）の状態。展開したデータは buf の辞書の後ろに置く。
+ */
+typedef struct ste_lzd
+{
+    int             pos;        /* buf に入っているデータのサイズ */
+    unsigned int    offset;     /* 辞書をリセットしてからのストリーム上の位置 */
+    int             broken;     /* 辞書が送信側とずれている。STE_LZ_F_RESET を待つ */
+    unsigned char   buf[STE_LZ_BUFSIZE];
+} ste_lzd_t;
+
+/*
+ * 圧縮用の関数のプロトタイプ
+ */
+extern void            ste_lzc_reset(ste_lzc_t *);
+extern void            ste_lzd_reset(ste_lzd_t *);
+extern unsigned char  *ste_lz_seal(ste_lzc_t *, ste_agg_t *, int *, int, ste_connstat_t *);
+extern int             ste_lz_open(ste_lzd_t *, ste_msg_t *, ste_msg_t *, ste_connstat_t *);
+
+#endif /* #ifndef __STED_LZ_H */
@@ -0,0 +1,178 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_probe.h
+ *
+ *  sted と stehub のデータパスに埋め込む静的トレースポイント（プローブ）。
+ *  デバッグビルドにしなくても、稼働中のデーモンの振る舞いを外から観測
+ *  するためのもの。
+ *
+ *  o Solaris/Linux で STE_USDT を define した場合
+ *    sys/sdt.h の USDT プローブ（provider 名は ste）になる。無効時のコストは
+ *    nop 1 命令。dtrace や bpftrace, perf から参照できる。
+ *      dtrace  -n 'ste*:::hub-drop { @[arg2] = count(); }'
+ *      bpftrace -e 'usdt:./stehub:ste:hub__drop { @[arg2] = count(); }'
+ *  o Windows で STE_ETW を define した場合
+ *    TraceLogging（ETW）のイベントになる。provider 名は "Ste"。
+ *    セッションが無い時のコストは provider の有効フラグの確認のみ。
+ *  o どちらも define されていなければ何もコンパイルされない。
+ *
+ *  プローブの引数は外部のスクリプトから参照されるので、順番と意味を
+ *  変えないこと。追加する場合は末尾に足すこと。
+ *
+ *  sted
+ *   frame-rx      (len, dst, src)          仮想 NIC ドライバからフレームを読んだ
+ *                   len : フレーム長
+ *                   dst : 宛先 MAC アドレス(6 byte)へのポインタ
+ *                   src : 送信元 MAC アドレス(6 byte)へのポインタ
+ *   frame-encap   (conn, len, qlen)        フレームを送信バッファに詰めた
+ *                   conn: 接続 ID
+ *                   len : ヘッダ・パディング込みのサイズ
+ *                   qlen: 送信バッファに溜まっているサイズ(キューの深さ)
+ *   sock-flush    (conn, len, result)      送信バッファを send() した
+ *                   result : send() の戻り値（エラー時は -errno）
+ *   resync        (conn, orglen, discard)  ヘッダが壊れていたので受信データを捨てた
+ *                   orglen : 壊れたヘッダの orglen
+ *                   discard: 捨てたバイト数
+ *  stehub
+ *   hub-ingress   (conn, len)              sted からデータを recv() した
+ *   hub-forward   (src, dst, len)          src から dst へ転送すると決めた
+ *   hub-egress    (conn, len, result)      dst へ send() した
+ *                   result : send() の戻り値（エラー時は -errno）
+ *   hub-drop      (conn, len, reason)      転送をあきらめた
+ *                   reason : STE_DROP_XXX
+ *   hub-enqueue   (conn, len, qlen)        フレームを dst の送信キューに入れた
+ *                   qlen   : 送信キューに溜まっているサイズ
+ *************************************************/
+#ifndef __STED_PROBE_H
+#define __STED_PROBE_H
+
+/*
+ * hub-drop の reason
+ *
+ *  STE_DROP_WOULDBLOCK  送信先の socket バッファが一杯だった
+ *  STE_DROP_SENDERR     送信先の socket でエラーが発生した
+ *  STE_DROP_BROKEN      ヘッダが壊れていた
+ *  STE_DROP_QFULL       送信先の送信キューが一杯だった
+ *  STE_DROP_MTU         フレームが送信先と合意した MTU より大きかった
+ *  STE_DROP_AUTH        認証に失敗したか、暗号化されていなかった
+ *  STE_DROP_AQM         送信先の送信キューの AQM が捨てた（sted_aqm.h 参照）
+ */
+#define STE_DROP_WOULDBLOCK   1
+#define STE_DROP_SENDERR      2
+#define STE_DROP_BROKEN       3
+#define STE_DROP_QFULL        4
+#define STE_DROP_MTU          5
+#define STE_DROP_AUTH         6
+#define STE_DROP_AQM          7
+
+#if defined(STE_USDT) && !defined(STE_WINDOWS)
+#include <sys/sdt.h>
+
+#define STE_PROBE_FRAME_RX(len, dst, src) \
+    DTRACE_PROBE3(ste, frame__rx, (int)(len), (void *)(dst), (void *)(src))
+#define STE_PROBE_FRAME_ENCAP(conn, len, qlen) \
+    DTRACE_PROBE3(ste, frame__encap, (int)(conn), (int)(len), (int)(qlen))
+#define STE_PROBE_SOCK_FLUSH(conn, len, result) \
+    DTRACE_PROBE3(ste, sock__flush, (int)(conn), (int)(len), (int)(result))
+#define STE_PROBE_RESYNC(conn, orglen, discard) \
+    DTRACE_PROBE3(ste, resync, (int)(conn), (int)(orglen), (int)(discard))
+#define STE_PROBE_HUB_INGRESS(conn, len) \
+    DTRACE_PROBE2(ste, hub__ingress, (int)(conn), (int)(len))
+#define STE_PROBE_HUB_FORWARD(src, dst, len) \
+    DTRACE_PROBE3(ste, hub__forward, (int)(src), (int)(dst), (int)(len))
+#define STE_PROBE_HUB_EGRESS(conn, len, result) \
+    DTRACE_PROBE3(ste, hub__egress, (int)(conn), (int)(len), (int)(result))
+#define STE_PROBE_HUB_DROP(conn, len, reason) \
+    DTRACE_PROBE3(ste, hub__drop, (int)(conn), (int)(len), (int)(reason))
+#define STE_PROBE_HUB_ENQUEUE(conn, len, qlen) \
+    DTRACE_PROBE3(ste, hub__enqueue, (int)(conn), (int)(len), (int)(qlen))
+
+#elif defined(STE_ETW) && defined(STE_WINDOWS)
+#include <TraceLoggingProvider.h>
+
+TRACELOGGING_DECLARE_PROVIDER(ste_etw_provider);
+
+#define STE_PROBE_FRAME_RX(len, dst, src) \
+    TraceLoggingWrite(ste_etw_provider, "frame-rx", \
+                      TraceLoggingInt32((int)(len), "len"), \
+                      TraceLoggingBinary((dst), 6, "dst"), \
+                      TraceLoggingBinary((src), 6, "src"))
+#define STE_PROBE_FRAME_ENCAP(conn, len, qlen) \
+    TraceLoggingWrite(ste_etw_provider, "frame-encap", \
+                      TraceLoggingInt32((int)(conn), "conn"), \
+                      TraceLoggingInt32((int)(len), "len"), \
+                      TraceLoggingInt32((int)(qlen), "qlen"))
+#define STE_PROBE_SOCK_FLUSH(conn, len, result) \
+    TraceLoggingWrite(ste_etw_provider, "sock-flush", \
+                      TraceLoggingInt32((int)(conn), "conn"), \
+                      TraceLoggingInt32((int)(len), "len"), \
+                      TraceLoggingInt32((int)(result), "result"))
+#define STE_PROBE_RESYNC(conn, orglen, discard) \
+    TraceLoggingWrite(ste_etw_provider, "resync", \
+                      TraceLoggingInt32((int)(conn), "conn"), \
+                      TraceLoggingInt32((int)(orglen), "orglen"), \
+                      TraceLoggingInt32((int)(discard), "discard"))
+#define STE_PROBE_HUB_INGRESS(conn, len) \
+    TraceLoggingWrite(ste_etw_provider, "hub-ingress", \
+                      TraceLoggingInt32((int)(conn), "conn"), \
+                      TraceLoggingInt32((int)(len), "len"))
+#define STE_PROBE_HUB_FORWARD(src, dst, len) \
+    TraceLoggingWrite(ste_etw_provider, "hub-forward", \
+                      TraceLoggingInt32((int)(src), "src"), \
+                      TraceLoggingInt32((int)(dst), "dst"), \
+                      TraceLoggingInt32((int)(len), "len"))
+#define STE_PROBE_HUB_EGRESS(conn, len, result) \
+    TraceLoggingWrite(ste_etw_provider, "hub-egress", \
+                      TraceLoggingInt32((int)(conn), "conn"), \
+                      TraceLoggingInt32((int)(len), "len"), \
+                      TraceLoggingInt32((int)(result), "result"))
+#define STE_PROBE_HUB_DROP(conn, len, reason) \
+    TraceLoggingWrite(ste_etw_provider, "hub-drop", \
+                      TraceLoggingInt32((int)(conn), "conn"), \
+                      TraceLoggingInt32((int)(len), "len"), \
+                      TraceLoggingInt32((int)(reason), "reason"))
+#define STE_PROBE_HUB_ENQUEUE(conn, len, qlen) \
+    TraceLoggingWrite(ste_etw_provider, "hub-enqueue", \
+                      TraceLoggingInt32((int)(conn), "conn"), \
+                      TraceLoggingInt32((int)(len), "len"), \
+                      TraceLoggingInt32((int)(qlen), "qlen"))
+
+#else
+
+#define STE_PROBE_FRAME_RX(len, dst, src)
+#define STE_PROBE_FRAME_ENCAP(conn, len, qlen)
+#define STE_PROBE_SOCK_FLUSH(conn, len, result)
+#define STE_PROBE_RESYNC(conn, orglen, discard)
+#define STE_PROBE_HUB_INGRESS(conn, len)
+#define STE_PROBE_HUB_FORWARD(src, dst, len)
+#define STE_PROBE_HUB_EGRESS(conn, len, result)
+#define STE_PROBE_HUB_DROP(conn, len, reason)
+#define STE_PROBE_HUB_ENQUEUE(conn, len, qlen)
+
+#endif
+
+#endif /* #ifndef __STED_PROBE_H */
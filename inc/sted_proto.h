@@ -0,0 +1,419 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_proto.h
+ *
+ *  sted と stehub の間のプロトコル（メッセージの組み立てと解析）の
+ *  ヘッダファイル。
+ *
+ *  メッセージは全て stehead_t で始まる。
+ *
+ *   stehead.orglen > 0  : Ethernet フレーム 1 つ（従来の形式）
+ *                         stehead.len はパディング込みのフレーム長
+ *   stehead.orglen < 0  : 制御メッセージ（STE_MSG_XXX）
+ *                         stehead.len はパディング込みの本体の長さ
+ *
+ *  ヘッダと本体を合わせたサイズは常に 4 の倍数になるようパディングする。
+ *  制御メッセージは相手が対応していることを STE_MSG_HELLO で確認して
+ *  から送る。古い sted/stehub には送らない。
+ *
+ *  相手が STE_CAP_SYNC に対応していれば、stehead_t の代わりに同期ワードと
+ *  CRC32C 付きの stehead2_t（フレーミング v2）を使う。ヘッダが壊れていても
+ *  次の同期ワードを探して CRC の合うヘッダから受信を再開するので、失うのは
+ *  壊れたメッセージだけで済む。受信側はヘッダの先頭 byte で v1 と v2 を
+ *  見分ける（v1 の stehead.len の先頭 byte は必ず 0）。一度 v2 のヘッダを
+ *  受信したら、以降 v1 のヘッダは壊れたヘッダとして扱う。
+ *
+ *  STE_MSG_HELLO 接続直後のハンドシェイク。本体は ste_hello_t 参照。
+ *                sted は接続直後に送り、返事を待たずに従来の形式でフレームを
+ *                送り始める。stehub は合意したバージョンと機能を入れて送り
+ *                返し、sted はそれを受け取った時点で新しい形式に切り替える。
+ *                返事が来なければ（古い stehub）従来の形式のまま。
+ *  STE_MSG_AGG   複数の Ethernet フレームをまとめたもの。本体の形式は
+ *                  +--------+--------+--------+-----+--------+--------+-----+-----+
+ *                  | count  | len[0] | len[1] | ... | frame0 | frame1 | ... | pad |
+ *                  +--------+--------+--------+-----+--------+--------+-----+-----+
+ *                count と len は 2 byte（ネットワークバイトオーダー）。フレーム
+ *                毎のパディングは無い。
+ *  STE_MSG_CAGG  STE_MSG_AGG の小さいフレーム向けの形式（STE_CAP_COMPACT）。
+ *                  +-----+--------+-----+--------+-----+-----+
+ *                  | len | frame0 | len | frame1 | ... | pad |
+ *                  +-----+--------+-----+--------+-----+-----+
+ *                len は 7 bit ずつの可変長（128 未満なら 1 byte）。長さ 0 は
+ *                末尾のパディング。ste ドライバが ETHERMIN までパディング
+ *                したフレームは、パディングを取り除いて送る。受信側は ste
+ *                ドライバに渡す直前に ETHERMIN まで 0 を詰めて元に戻す。
+ *  STE_MSG_ZAGG  STE_MSG_AGG（STE_MSG_CAGG, STE_MSG_HAGG）の本体を LZ4 で
+ *                圧縮したもの（STE_CAP_LZ4）。形式は sted_lz.h 参照。
+ *  STE_MSG_HAGG  STE_MSG_CAGG の TCP/IPv4 のヘッダを圧縮したもの（STE_CAP_HC）。
+ *                形式は sted_hc.h 参照。
+ *  STE_MSG_SEAL  上記のまとめたメッセージを ChaCha20-Poly1305 で暗号化・
+ *                認証したもの（STE_CAP_AEAD）。形式は sted_aead.h 参照。
+ *  STE_MSG_MUX   1 つの接続に複数の ste デバイス（セグメント）を多重化する
+ *                場合の、セグメント番号付きの STE_MSG_AGG（STE_MSG_CAGG,
+ *                STE_MSG_HAGG）（STE_CAP_MUX）。
+ *                  +-------+-----------+-----------+-------------+
+ *                  | type  | (reserved)|  segment  | AGG の本体 |
+ *                  +-------+-----------+-----------+-------------+
+ *                type は中のメッセージの -STE_MSG_XXX（1 byte）、segment は
+ *                4 byte（ネットワークバイトオーダー）。STE_MSG_ZAGG と
+ *                STE_MSG_SEAL は STE_MSG_AGG と同様に STE_MSG_MUX を包む。
+ *  STE_MSG_PING  HUB との間の死活監視と RTT の計測（STE_CAP_PING）。
+ *                  +-------+-----------+-------------------------------+
+ *                  | kind  | (reserved)|             stamp             |
+ *                  +-------+-----------+-------------------------------+
+ *                kind は STE_PING_XXX（1 byte）。sted が STE_PING_REQUEST を
+ *                送り、stehub は stamp（8 byte, sted が送った時刻）をそのまま
+ *                入れた STE_PING_REPLY を返す。暗号化を合意していれば
+ *                STE_MSG_SEAL に包む。
+ *  STE_MSG_CREDIT stehub から sted へ、送ってよいフレーム数とバイト数の
+ *                上限を知らせる（STE_CAP_CREDIT）。本体の形式は sted_credit.h
+ *                参照。暗号化を合意していれば STE_MSG_SEAL に包む。
+ *************************************************/
+#ifndef __STED_PROTO_H
+#define __STED_PROTO_H
+
+/*
+ * sys/ethernet.h の無い環境（Windows, Linux の stehub）のため
+ */
+#ifndef ETHERMAX
+#define  ETHERMAX                 1514
+#endif
+#ifndef ETHERMIN
+#define  ETHERMIN                 60
+#endif
+
+/*
+ * ジャンボフレームの最大長（ヘッダ・VLAN タグ込み）。リンク毎の MTU は
+ * STE_MSG_HELLO で ETHERMIN からこの値の間で合意する。STE_MSG_HELLO を
+ * 送ってこない古い sted とは ETHERMAX のまま。
+ */
+#define  STE_FRAME_MAX            9018
+
+/*
+ * 制御メッセージの種類（stehead.orglen に入れる）
+ */
+#define  STE_MSG_HELLO            (-1)
+#define  STE_MSG_AGG              (-2)
+#define  STE_MSG_CAGG             (-3)
+#define  STE_MSG_ZAGG             (-4)
+#define  STE_MSG_HAGG             (-5)
+#define  STE_MSG_SEAL             (-6)
+#define  STE_MSG_MUX              (-7)
+#define  STE_MSG_PING             (-8)
+#define  STE_MSG_CREDIT           (-9)
+
+/*
+ * STE_MSG_PING の kind と本体のサイズ
+ */
+#define  STE_PING_REQUEST         0
+#define  STE_PING_REPLY           1
+#define  STE_PING_LEN             12
+
+/*
+ * 機能ビット（ste_hello_t の features）
+ *
+ *  STE_CAP_AGG   STE_MSG_AGG を受け取れる
+ *  STE_CAP_SYNC  stehead2_t（フレーミング v2）を受け取れる
+ *  STE_CAP_PCRC  本体の CRC32C も付けて送ってほしい（STE_CAP_SYNC と一緒に使う）
+ *  STE_CAP_COMPACT  STE_MSG_AGG の代わりに STE_MSG_CAGG を受け取れる
+ *  STE_CAP_LZ4   STE_MSG_ZAGG を受け取れる。sted は -z を指定した場合だけ要求する
+ *  STE_CAP_HC    STE_MSG_AGG の代わりに STE_MSG_HAGG を受け取れる
+ *  STE_CAP_AEAD  STE_MSG_HELLO 以外を STE_MSG_SEAL で送り合う。sted は -k を
+ *                指定した場合だけ要求し、stehub は自分も -k で鍵を持っている
+ *                場合だけ合意する
+ *  STE_CAP_FEC   UDP のデータグラムに FEC のヘッダを付け、パリティを送り合う
+ *                （sted_fec.h 参照）。sted は -u と -f を指定した場合だけ要求し、
+ *                stehub は UDP のセッションでだけ合意する
+ *  STE_CAP_STRIPE 同じ sted からの複数の接続（リンク）を 1 つのポートとして
+ *                扱う。sted は -l で 2 本以上のリンクを張る場合だけ要求する。
+ *                stehub は bundle が同じ接続の間では転送せず、bundle 宛ての
+ *                フレームはフローのハッシュ(ste_flow_hash())で選んだ 1 本の
+ *                リンクにだけ送る
+ *  STE_CAP_MUX   STE_MSG_HELLO の segs のセグメントを 1 つの接続で送受信する。
+ *                各セグメントのフレームは STE_MSG_MUX で送る。sted は -i で
+ *                複数の ste デバイスを指定した場合だけ要求し、stehub は
+ *                STE_CAP_AGG に合意した場合だけ合意する
+ *  STE_CAP_RESUME 接続が切れた時にセッションを取っておき、再接続した時に
+ *                STE_MSG_HELLO の token で再開する（sted_replay.h 参照）。
+ *                sted は TCP の場合だけ要求し、stehub も TCP の接続でだけ
+ *                合意する
+ *  STE_CAP_PING  STE_MSG_PING に返事をする。sted は -b でハートビートを
+ *                止めなければ要求する。stehub は鍵を指定されていれば、
+ *                暗号化に合意した場合だけ合意する
+ *  STE_CAP_CREDIT stehub からのクレジットの範囲でだけフレームを送る
+ *                （sted_credit.h 参照）。sted はキューを用意できれば TCP の
+ *                場合だけ要求し、stehub も TCP の接続でだけ合意する。鍵を
+ *                指定されていれば、STE_CAP_PING と同じく暗号化に合意した
+ *                場合だけ合意する
+ */
+#define  STE_CAP_AGG              0x00000001
+#define  STE_CAP_SYNC             0x00000002
+#define  STE_CAP_PCRC             0x00000004
+#define  STE_CAP_COMPACT          0x00000008
+#define  STE_CAP_LZ4              0x00000010
+#define  STE_CAP_HC               0x00000020
+#define  STE_CAP_AEAD             0x00000040
+#define  STE_CAP_FEC              0x00000080
+#define  STE_CAP_STRIPE           0x00000100
+#define  STE_CAP_MUX              0x00000200
+#define  STE_CAP_RESUME           0x00000400
+#define  STE_CAP_PING             0x00000800
+#define  STE_CAP_CREDIT           0x00001000
+
+/*
+ * STE_MSG_HELLO の中身。送受信時は下記の固定のレイアウトに変換する
+ * （多バイトの値はネットワークバイトオーダー）。
+ *
+ *    0       1       2               4                               8
+ *   +-------+-------+---------------+-------------------------------+
+ *   |version| role  |      mtu      |           features            |
+ *   +-------+-------+---------------+-------------------------------+
+ *   |            segment            |  client_id (16 byte, NUL 詰め) ...
+ *   +-------------------------------+-------------------------------
+ *   ... |        nonce (8 byte)         |            bundle             |
+ *   ----+-------------------------------+-------------------------------+
+ *   | link  |nlinks | nsegs |  (rsv)|   segs[1] ... segs[nsegs - 1]
+ *   +-------+-------+-------+-------+-------------------------------
+ *   ... |         token (8 byte)        |            rx_seq             |
+ *   ----+-------------------------------+-------------------------------+
+ *
+ *  version   プロトコルのバージョン(STE_PROTO_VERSION)。stehub は自分と
+ *            相手の小さい方を返す
+ *  role      STE_ROLE_XXX。古い stehub は他の sted の STE_MSG_HELLO を
+ *            そのまま転送してくるので、それと区別するため
+ *  mtu       送受信できる最大の Ethernet フレーム長（ヘッダ込み）。
+ *            stehub は自分と相手の小さい方を返す
+ *  features  機能ビット(STE_CAP_XXX)。stehub は合意したもの（両方が
+ *            対応しているもの）を返す
+ *  segment   セグメント番号。stehub は同じセグメントの sted の間でだけ
+ *            フレームを転送する
+ *  client_id sted の識別名（ログ用）
+ *  nonce     乱数。STE_CAP_AEAD のセッション鍵を作るのに使う。nonce の無い
+ *            古い STE_MSG_HELLO では 0 とみなす
+ *  bundle    STE_CAP_STRIPE の識別子。sted が起動時に乱数で選び、全てのリンク
+ *            で同じ値を送る。0 ならリンクは 1 本だけ
+ *  link      リンクの番号(0 から nlinks - 1)
+ *  nlinks    sted が張るリンクの数
+ *  nsegs     STE_CAP_MUX で多重化するセグメントの数（segment を含む）。
+ *            0 は 1 とみなす
+ *  segs      segment 以外に多重化するセグメント番号（4 byte ずつ）。
+ *            ste_hello_t の segs[0] は segment と同じ
+ *  token     STE_CAP_RESUME のセッショントークン。features に STE_CAP_RESUME
+ *            がある場合だけ付ける。sted は再開したいセッションのトークン
+ *            （無ければ 0）を送り、stehub は再開した（新しい）セッションの
+ *            トークンを返す
+ *  rx_seq    そのセッションで受け取ったフレームの数（token と一緒に付ける）
+ *
+ *  本体が STE_HELLO_SIZE より長ければ、後ろは将来の拡張として無視する。
+ *  セグメントは STE_HELLO_MAX に収まる STE_MUX_MAX 個まで。
+ */
+#define  STE_PROTO_VERSION        1
+#define  STE_ROLE_STED            1
+#define  STE_ROLE_HUB             2
+#define  STE_CLIENTID_MAX         16
+#define  STE_HELLO_SIZE           (12 + STE_CLIENTID_MAX)
+#define  STE_HELLO_NONCE          8
+#define  STE_HELLO_BUNDLE         8
+#define  STE_HELLO_LEN            (STE_HELLO_SIZE + STE_HELLO_NONCE + STE_HELLO_BUNDLE)
+#define  STE_MUX_MAX              6
+#define  STE_MUX_HDRSIZE          8
+#define  STE_HELLO_RESUME         12
+
+typedef struct ste_hello
+{
+    int             version;
+    int             role;
+    int             mtu;
+    unsigned int    features;
+    unsigned int    segment;
+    char            client_id[STE_CLIENTID_MAX + 1];
+    unsigned char   nonce[STE_HELLO_NONCE];
+    unsigned int    bundle;
+    int             link;
+    int             nlinks;
+    int             nsegs;
+    unsigned int    segs[STE_MUX_MAX];
+    unsigned char   token[STE_RESUME_TOKEN];
+    unsigned int    rx_seq;
+} ste_hello_t;
+
+/*
+ * フレーミング v2 のヘッダ。magic は 'S','T','E' の 3 byte。hcrc は先頭から
+ * pcrc までの 16 byte の CRC32C。pcrc は flags に STE_HF_PCRC が立っている
+ * 場合だけ有効で、パディングを含む本体の CRC32C。
+ */
+typedef struct stehead2
+{
+    unsigned char  magic[3];   /* 同期ワード(STE_SYNC_M0..M2) */
+    unsigned char  flags;      /* STE_HF_XXX */
+    int            len;        /* stehead.len と同じ */
+    int            orglen;     /* stehead.orglen と同じ */
+    unsigned int   pcrc;       /* 本体の CRC32C */
+    unsigned int   hcrc;       /* ヘッダの CRC32C */
+} stehead2_t;
+
+#define  STE_SYNC_M0              'S'
+#define  STE_SYNC_M1              'T'
+#define  STE_SYNC_M2              'E'
+#define  STE_HF_PCRC              0x01
+
+/*
+ * 送信するメッセージの形式（ste_msg_put_frame(), ste_agg_seal() の txflags）
+ *
+ *  STE_TX_SYNC   stehead2_t を使う
+ *  STE_TX_PCRC   本体の CRC32C も付ける
+ */
+#define  STE_TX_SYNC              0x01
+#define  STE_TX_PCRC              0x02
+#define  STE_HEADSIZE(txflags)    (((txflags) & STE_TX_SYNC) ? sizeof(stehead2_t) : sizeof(stehead_t))
+
+/*
+ * 従来の形式（フレーム毎に stehead とパディング）で送った場合のサイズ。
+ * 統計情報で実際に送ったサイズと比べるためのもの。
+ */
+#define  STE_LEGACY_SIZE(len)     (sizeof(stehead_t) + ((((len) < ETHERMIN ? ETHERMIN : (len)) + 3) & ~3))
+
+/*******************************************************
+ * o メッセージ用の各種パラメータ
+ *
+ *  STE_AGG_MAX_FRAMES   STE_MSG_AGG にまとめるフレーム数の上限
+ *  STE_AGG_MAX_BYTES    STE_MSG_AGG にまとめるフレームデータの合計の上限
+ *  STE_AGG_MAX_USEC     sted が最初のフレームを溜めてから送信するまでの上限
+ *  STE_AGG_HDRMAX       STE_MSG_AGG のヘッダ（stehead2, STE_MSG_MUX のヘッダ,
+ *                       count, len の表）の最大長
+ *  STE_SEAL_HEADROOM    組み立てたメッセージの前に空けておくサイズ。STE_MSG_SEAL
+ *                       にする時に seq, orglen をその場で書き足すためのもの
+ *  STE_SEAL_TAILROOM    同じく後ろに空けておくサイズ（tag 用）
+ *  STE_SEAL_OVERHEAD    STE_MSG_SEAL で増えるサイズ
+ *  STE_AGG_DATA         ste_agg_t の buf の中でフレームを詰め始める位置
+ *  STE_MSG_MAX          1 メッセージの最大長（ヘッダ込み）
+ *  STE_HELLO_MAX        STE_MSG_HELLO の本体の最大長（将来の拡張用）
+ ********************************************************/
+#define  STE_AGG_MAX_FRAMES       64
+#define  STE_AGG_MAX_BYTES        16384
+#define  STE_AGG_MAX_USEC         500
+#define  STE_AGG_HDRMAX           (((sizeof(stehead2_t) + STE_MUX_HDRSIZE + 2 + 2 * STE_AGG_MAX_FRAMES) + 3) & ~3)
+#define  STE_SEAL_HEADROOM        12
+#define  STE_SEAL_TAILROOM        16
+#define  STE_SEAL_OVERHEAD        (STE_SEAL_HEADROOM + STE_SEAL_TAILROOM)
+#define  STE_AGG_DATA             (STE_SEAL_HEADROOM + STE_AGG_HDRMAX)
+#define  STE_MSG_MAX              (STE_AGG_HDRMAX + STE_AGG_MAX_BYTES + 4 + STE_SEAL_OVERHEAD)
+#define  STE_HELLO_MAX            (STE_HELLO_LEN + 4 * (STE_MUX_MAX - 1) + STE_HELLO_RESUME)
+
+/*
+ * 受信したメッセージ。ste_rx_next() が返す。
+ *   type : フレームならフレーム長(> 0)、制御メッセージなら STE_MSG_XXX
+ *   body : 本体の先頭。受信バッファか、ste_rx_t の buf を指す
+ *   len  : 本体の長さ。フレームならパディングを含まない
+ */
+typedef struct ste_msg
+{
+    int             type;
+    unsigned char  *body;
+    int             len;
+} ste_msg_t;
+
+/*
+ * 受信したデータからメッセージを取り出すための状態。
+ * メッセージが recv() の境界をまたいだ場合だけ buf にコピーする。
+ *
+ *  STE_RX_HEAD     ヘッダを受信中
+ *  STE_RX_BODY     本体を受信中
+ *  STE_RX_RESYNC   同期ワードを探している（v2 でヘッダが壊れていた）
+ */
+#define  STE_RX_HEAD              0
+#define  STE_RX_BODY              1
+#define  STE_RX_RESYNC            2
+
+typedef struct ste_rx
+{
+    int             state;      /* STE_RX_XXX */
+    int             sync;       /* v2 のヘッダを受信したことがある */
+    unsigned char   hbuf[sizeof(stehead2_t)]; /* 受信途中のヘッダのコピー */
+    int             headlen;    /* 受信済みのヘッダのサイズ */
+    int             flags;      /* stehead2.flags（v1 なら 0） */
+    unsigned int    pcrc;       /* stehead2.pcrc */
+    int             datalen;    /* パディングを含む本体のサイズ */
+    int             orglen;     /* stehead.orglen（フレーム長もしくは STE_MSG_XXX） */
+    int             dataleft;   /* 未受信の本体のサイズ */
+    int             discard;    /* 直前の ste_rx_next() で捨てたサイズ */
+    int             mtu;        /* 受け付けるフレーム長の上限（合意した MTU） */
+    unsigned char   buf[STE_MSG_MAX];
+} ste_rx_t;
+
+/*
+ * STE_MSG_AGG の組み立て用。buf の先頭 STE_AGG_DATA byte はヘッダ用に
+ * 空けておき、フレームはその後ろに詰める。ste_agg_seal() でヘッダを
+ * フレームの直前に書くので、フレームのデータはコピーし直さない。
+ * 前後には STE_MSG_SEAL にするための STE_SEAL_HEADROOM, STE_SEAL_TAILROOM
+ * の空きが必ず残る。
+ * compact が立っていれば STE_MSG_CAGG を、hc が設定されていれば
+ * STE_MSG_HAGG を組み立てる。
+ * maxbytes は STE_AGG_MAX_BYTES 以下の詰めるデータの上限。UDP では 1 つの
+ * データグラムに収まるよう小さくする。
+ * mux が立っていれば、chan のセグメント番号を付けた STE_MSG_MUX にする。
+ * 1 つの STE_MSG_MUX には同じセグメントのフレームしか詰められないので、
+ * chan を変える前に ste_agg_seal() すること。
+ */
+typedef struct ste_agg
+{
+    int             compact;                         /* STE_MSG_CAGG にする */
+    struct ste_hcc *hc;                              /* STE_MSG_HAGG にする（sted_hc.h） */
+    int             count;                           /* 詰めたフレーム数 */
+    int             datalen;                         /* 詰めたデータの合計 */
+    int             maxbytes;                        /* datalen の上限（最初のフレームは除く） */
+    int             mux;                             /* STE_MSG_MUX にする */
+    unsigned int    chan;                            /* 詰めているフレームのセグメント番号 */
+    unsigned short  lens[STE_AGG_MAX_FRAMES];        /* フレーム長の表 */
+    unsigned char   buf[STE_AGG_DATA + STE_AGG_MAX_BYTES + 4 + STE_SEAL_TAILROOM];
+} ste_agg_t;
+
+/*
+ * プロトコル用の関数のプロトタイプ
+ */
+extern void            ste_rx_reset(ste_rx_t *);
+extern void            ste_rx_restart(ste_rx_t *);
+extern int             ste_rx_next(ste_rx_t *, unsigned char **, int *, ste_msg_t *);
+extern int             ste_put_head(unsigned char *, int, int, int);
+extern int             ste_get_head(unsigned char *, int, int *);
+extern int             ste_msg_put_frame(unsigned char *, unsigned char *, int, int);
+extern int             ste_msg_put_hello(unsigned char *, ste_hello_t *);
+extern int             ste_msg_get_hello(ste_msg_t *, ste_hello_t *);
+extern int             ste_msg_put_ping(unsigned char *, int, ste_uint64_t, int);
+extern int             ste_msg_get_ping(ste_msg_t *, int *, ste_uint64_t *);
+extern int             ste_msg_put_credit(unsigned char *, unsigned int *, int);
+extern int             ste_msg_get_credit(ste_msg_t *, unsigned int *);
+extern int             ste_agg_parse(ste_msg_t *, unsigned char **, int *, int);
+extern void            ste_agg_reset(ste_agg_t *);
+extern int             ste_agg_add(ste_agg_t *, unsigned char *, int);
+extern unsigned char  *ste_agg_seal(ste_agg_t *, int *, int);
+extern int             ste_mux_open(ste_msg_t *, ste_msg_t *, unsigned int *);
+extern unsigned int    ste_crc32c(unsigned int, unsigned char *, int);
+extern int             ste_frame_trim(unsigned char *, int);
+extern unsigned int    ste_flow_hash(unsigned char *, int);
+
+#endif /* #ifndef __STED_PROTO_H */
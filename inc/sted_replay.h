@@ -0,0 +1,103 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_replay.h
+ *
+ *  sted と stehub の間の接続が切れても、フレームを失わずに再接続する
+ *  （セッションの再開, STE_CAP_RESUME）ためのヘッダファイル。
+ *
+ *  以前は接続が切れると、送信バッファや送信キューに残っていたフレームと、
+ *  socket のバッファやネットワークの中にあったフレームは全て失われ、
+ *  stehub はその sted の情報を全て捨てていた。
+ *
+ *  o TCP の接続で STE_CAP_RESUME に合意すると、stehub はセッション
+ *    トークン（乱数）を STE_MSG_HELLO の返事で知らせる。
+ *  o 双方とも、送ったフレームを数え（tx_seq）、直近のフレームをリング
+ *    （ste_replay_t）に取っておく。受け取ったフレームも数える（rx_seq）。
+ *  o 接続が切れると、stehub はセッションを STE_RESUME_HOLD_SEC 秒の間
+ *    取っておき、その間にその sted 宛てに転送するはずだったフレームも
+ *    リングに入れておく。sted は再接続するまでの間、ste デバイスから
+ *    読んだフレームをリンク 0 のリングに入れておく。
+ *  o 再接続した sted は STE_MSG_HELLO でトークンと rx_seq を送る。stehub は
+ *    取っておいたセッションを再開し、返事で自分の rx_seq を返す。双方とも
+ *    相手の rx_seq より後のフレームをリングから送り直す。トークンが
+ *    見つからなければ新しいセッションになる。
+ *  o リングから溢れたフレームは送り直せない。その場合は送り直せる分だけ
+ *    送り、tx_seq を相手の数え方に合わせる。
+ *  o UDP ではフレームが失われても送り直さないので、合意しない。
+ *************************************************/
+#ifndef __STED_REPLAY_H
+#define __STED_REPLAY_H
+
+/*******************************************************
+ * o セッションの再開用の各種パラメータ
+ *
+ *  STE_RESUME_TOKEN     セッショントークンのサイズ
+ *  STE_RESUME_HOLD_SEC  stehub が切れたセッションを取っておく時間(秒)
+ *  STE_REPLAY_FRAMES    リングに取っておくフレーム数の上限
+ *  STE_REPLAY_BYTES     リングに取っておくフレームデータの合計の上限。
+ *                       stehub の送信キュー（OBUFSIZE）に収まる大きさ
+ ********************************************************/
+#define  STE_RESUME_TOKEN         8
+#define  STE_RESUME_HOLD_SEC      60
+#define  STE_REPLAY_FRAMES        512
+#define  STE_REPLAY_BYTES         65536
+
+/*
+ * リングの中のフレーム。chan は sted では ste デバイスの番号、stehub では
+ * セグメント番号。
+ */
+typedef struct ste_replay_ent
+{
+    int             off;          /* buf の中の位置 */
+    int             len;          /* フレーム長 */
+    unsigned int    chan;
+} ste_replay_ent_t;
+
+/*
+ * 送り直すためのリング。最後のフレームの通し番号が tx_seq で、
+ * その前のフレームは tx_seq - 1, tx_seq - 2, ... になる。
+ */
+typedef struct ste_replay
+{
+    unsigned int     tx_seq;      /* 送ったフレームの数 */
+    unsigned int     rx_seq;      /* 受け取ったフレームの数 */
+    int              head;        /* 最も古いフレームの ent の位置 */
+    int              count;       /* リングの中のフレーム数 */
+    int              wpos;        /* 次のフレームを書き込む buf の位置 */
+    ste_replay_ent_t ent[STE_REPLAY_FRAMES];
+    unsigned char    buf[STE_REPLAY_BYTES];
+} ste_replay_t;
+
+/*
+ * セッションの再開用の関数のプロトタイプ
+ */
+extern void            ste_replay_reset(ste_replay_t *);
+extern void            ste_replay_push(ste_replay_t *, unsigned int, unsigned char *, int);
+extern int             ste_replay_start(ste_replay_t *, unsigned int);
+extern unsigned char  *ste_replay_get(ste_replay_t *, int, int, unsigned int *, int *);
+
+#endif /* #ifndef __STED_REPLAY_H */
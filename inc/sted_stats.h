@@ -0,0 +1,245 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_stats.h
+ *
+ *  sted と stehub が共通で使う接続毎の統計情報のヘッダファイル。
+ *
+ *  フレーム数・バイト数のカウンタに加えて、カーネルの TCP の状態
+ *  （TCP_INFO）を定期的にサンプリングして保持する。TCP の上で TCP を
+ *  運ぶので、HUB との間の TCP で再送や cwnd の縮小が起きると、中の
+ *  TCP も再送を始めて遅延が一気に悪化する。それを外から見えるように
+ *  するためのもの。
+ *
+ *  統計情報は STE_STATS_INTERVAL 秒毎に統計ファイル（sted は
+ *  STED_STAT_FILE、stehub は STEHUB_STAT_FILE）に書き出す。
+ *
+ *  STE_STAGE_ACCT を define してビルドした場合は、データパスのステージ
+ *  毎の消費サイクルも計測し、スレッド毎に統計ファイルに書き出す。
+ *  define しなければ計測のコードは一切コンパイルされない。
+ *************************************************/
+#ifndef __STED_STATS_H
+#define __STED_STATS_H
+
+/*******************************************************
+ * o 統計情報用の各種パラメータ
+ *
+ *  STE_STATS_INTERVAL        TCP_INFO をサンプリングし、統計ファイルを
+ *                            書き出す間隔(秒)
+ *  STE_DEGRADE_RTT_USEC      RTT がこれを超えたら劣化とみなす(usec)
+ *  STE_DEGRADE_RETRANS       1 回のサンプリング間隔の再送セグメント数が
+ *                            これを超えたら劣化とみなす
+ *  STE_DEGRADE_CWND_SEGS     データが流れているのに cwnd がこれ（MSS 単位）
+ *                            以下なら劣化とみなす（RTO 後の cwnd の縮小）
+ ********************************************************/
+#define  STE_STATS_INTERVAL       5
+#define  STE_DEGRADE_RTT_USEC     300000
+#define  STE_DEGRADE_RETRANS      10
+#define  STE_DEGRADE_CWND_SEGS    2
+
+/*
+ * 劣化と判定した理由（ste_connstat_t の degraded のビット）
+ */
+#define  STE_DEGRADED_RTT         0x01
+#define  STE_DEGRADED_RETRANS     0x02
+#define  STE_DEGRADED_CWND        0x04
+
+/*
+ * TCP_INFO から取り出した値。OS 毎に取れる値や単位が違うので、ここで
+ * 揃える。取れない値は 0 のまま。
+ */
+typedef struct ste_tcpinfo
+{
+    unsigned int  rtt_us;        /* smoothed RTT(usec) */
+    unsigned int  rttvar_us;     /* RTT のばらつき(usec) */
+    unsigned int  cwnd;          /* 輻輳ウィンドウ(bytes) */
+    unsigned int  mss;           /* 送信 MSS(bytes) */
+    unsigned int  unacked;       /* 送信済みで ACK されていないサイズ(bytes) */
+    unsigned int  retrans;       /* 累計の再送セグメント数 */
+    ste_uint64_t  delivery_rate; /* 相手に届いた速度(bytes/sec) */
+} ste_tcpinfo_t;
+
+/*
+ * 接続毎の統計情報。i は HUB（sted）から受信した方向、o は送信した方向。
+ * STE_MSG_AGG にまとめられたフレームも 1 つずつ数える。
+ */
+typedef struct ste_connstat
+{
+    ste_uint64_t  iframes;       /* 受信したフレーム数 */
+    ste_uint64_t  oframes;       /* 送信したフレーム数 */
+    ste_uint64_t  ibytes;        /* recv() したバイト数 */
+    ste_uint64_t  obytes;        /* send() したバイト数 */
+    ste_uint64_t  irecvs;        /* recv() の呼び出し回数 */
+    ste_uint64_t  osends;        /* send() の呼び出し回数 */
+    ste_uint64_t  owire;         /* フレームを運んだメッセージのサイズの合計 */
+    ste_uint64_t  olegacy;       /* 同じフレームを従来の形式で送った場合のサイズ */
+    ste_uint64_t  odrops;        /* EWOULDBLOCK や送信キューが一杯で送信をあきらめた回数 */
+    ste_uint64_t  zmsgs;         /* 圧縮して送った STE_MSG_ZAGG の数 */
+    ste_uint64_t  zskips;        /* 縮まない・予算切れで圧縮せずに送ったメッセージ数 */
+    ste_uint64_t  zin;           /* 圧縮する前のサイズの合計 */
+    ste_uint64_t  zout;          /* 圧縮した後のサイズの合計 */
+    ste_uint64_t  zusec;         /* 圧縮にかけた時間(usec) */
+    ste_uint64_t  dmsgs;         /* 展開した STE_MSG_ZAGG の数 */
+    ste_uint64_t  dusec;         /* 展開にかけた時間(usec) */
+    ste_uint64_t  zerrors;       /* 壊れていたか辞書がずれていて捨てた STE_MSG_ZAGG の数 */
+    ste_uint64_t  hfull;         /* ヘッダ圧縮でフルヘッダを送ったフレーム数 */
+    ste_uint64_t  hdelta;        /* ヘッダ圧縮で差分だけを送ったフレーム数 */
+    ste_uint64_t  hsaved;        /* ヘッダ圧縮で減ったサイズの合計 */
+    ste_uint64_t  herrors;       /* コンテキストがずれていて復元できずに捨てたフレーム数 */
+    ste_uint64_t  eseals;        /* 暗号化して送った STE_MSG_SEAL の数 */
+    ste_uint64_t  eopens;        /* 認証・復号できた STE_MSG_SEAL の数 */
+    ste_uint64_t  eauth;         /* 認証に失敗したか、暗号化されていなくて捨てたメッセージ数 */
+    ste_uint64_t  ereplays;      /* 受け取り済みか古すぎる seq で捨てた STE_MSG_SEAL の数 */
+    ste_uint64_t  fparity;       /* FEC のパリティを送ったデータグラム数 */
+    ste_uint64_t  frecover;      /* FEC のパリティで復元したデータグラム数 */
+    ste_uint64_t  flost;         /* 失われて復元できなかったデータグラム数 */
+    ste_uint64_t  hbpings;       /* 送った（返した）STE_MSG_PING の数 */
+    ste_uint64_t  hbpongs;       /* 受け取った STE_MSG_PING の返事の数 */
+    unsigned int  hbrtt_us;      /* STE_MSG_PING で測った smoothed RTT(usec) */
+    unsigned int  hbrttvar_us;   /* 同じく RTT のばらつき(usec) */
+    unsigned int  sndbuf;        /* 設定した SO_SNDBUF(bytes。sted_tune.h 参照) */
+    unsigned int  rcvbuf;        /* 設定した SO_RCVBUF(bytes) */
+    unsigned int  lowat;         /* 設定した TCP_NOTSENT_LOWAT(bytes)。設定していなければ 0 */
+    unsigned int  bdp;           /* 最後に求めた BDP(bytes) */
+    ste_uint64_t  tune_usec;     /* 前回 ste_tune_update() を呼んだ時刻(usec) */
+    ste_uint64_t  tune_ibytes;   /* 前回 ste_tune_update() を呼んだ時の ibytes */
+    ste_uint64_t  tune_odrops;   /* 前回 ste_tune_update() を呼んだ時の odrops */
+    ste_uint64_t  cgrants;       /* 送った（受け取った）STE_MSG_CREDIT の数（sted_credit.h 参照） */
+    ste_uint64_t  cstalls;       /* クレジットが無くなった回数 */
+    ste_uint64_t  cqdrops;       /* クレジットを待つキューが一杯で捨てたフレーム数 */
+    ste_uint64_t  cresyncs;      /* 送った数を stehub の数に合わせた回数 */
+    unsigned int  cheld;         /* クレジットを待ってキューに溜めているフレーム数 */
+    ste_uint64_t  aqsamples;     /* AQM のキューから出たフレーム数（sted_aqm.h 参照） */
+    ste_uint64_t  aqdrops;       /* AQM が捨てたフレーム数 */
+    ste_uint64_t  aqmarks;       /* AQM が捨てる代わりに ECN の CE を付けたフレーム数 */
+    unsigned int  sojourn_us;    /* キューでの滞留時間の平滑値(usec) */
+    unsigned int  sojourn_max_us;/* 前回統計ファイルに書き出してからの最大の滞留時間(usec) */
+    ste_tcpinfo_t tcpi;          /* 最後にサンプリングした TCP_INFO */
+    int           tcpi_valid;    /* tcpi が取得できているか */
+    int           degraded;      /* 劣化と判定した理由(STE_DEGRADED_XXX) */
+    unsigned int  retrans_delta; /* 前回のサンプリングからの再送セグメント数 */
+    ste_uint64_t  sample_usec;   /* 前回サンプリングした時刻(usec) */
+    ste_uint64_t  sample_obytes; /* 前回サンプリングした時の obytes */
+    unsigned int  sample_unacked;/* 前回サンプリングした時の unacked */
+    ste_uint64_t  start_usec;    /* 接続した時刻(usec) */
+} ste_connstat_t;
+
+/*
+ * データパスのステージ。ステージ毎に消費したサイクルと呼び出し回数を数える。
+ * SOCK_RECV, SOCK_SEND, STE_READ, STE_WRITE はシステムコール 1 回が 1 呼び出し。
+ *
+ *  STE_STAGE_SOCK_RECV   recv()
+ *  STE_STAGE_PARSE       stehead を解析してフレームを取り出す(write_ste を含む)
+ *  STE_STAGE_DECIDE      転送先を決める
+ *  STE_STAGE_FANOUT      他の接続への配送ループ(send() を含む)
+ *  STE_STAGE_SOCK_SEND   send()
+ *  STE_STAGE_STE_READ    仮想 NIC ドライバからの読み込み(ReadFile)
+ *  STE_STAGE_ENCAP       フレームに stehead を付けて送信バッファに詰める
+ *  STE_STAGE_STE_WRITE   仮想 NIC ドライバへの書き込み(WriteFile)
+ */
+#define  STE_STAGE_SOCK_RECV      0
+#define  STE_STAGE_PARSE          1
+#define  STE_STAGE_DECIDE         2
+#define  STE_STAGE_FANOUT         3
+#define  STE_STAGE_SOCK_SEND      4
+#define  STE_STAGE_STE_READ       5
+#define  STE_STAGE_ENCAP          6
+#define  STE_STAGE_STE_WRITE      7
+#define  STE_STAGE_MAX            8
+
+#define  STE_ACCT_MAX_THREADS     8  /* 計測できるスレッドの最大数 */
+
+#ifdef STE_STAGE_ACCT
+/*
+ * 時刻の取得には TSC を使う。x86 以外では usec 単位の時刻で代用する。
+ */
+#if defined(STE_WINDOWS)
+#include <intrin.h>
+#define  STE_ACCT_NOW()           __rdtsc()
+#define  STE_ACCT_UNIT            "tsc"
+#elif defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define  STE_ACCT_NOW()           __rdtsc()
+#define  STE_ACCT_UNIT            "tsc"
+#else
+#define  STE_ACCT_NOW()           ste_time_usec()
+#define  STE_ACCT_UNIT            "usec"
+#endif
+
+/*
+ * スレッド毎の計測結果。書き込むのは所有するスレッドだけなのでロックは
+ * 使わない。統計ファイルに書き出す時に多少ずれた値を読むのは許容する。
+ */
+typedef struct ste_acct
+{
+    unsigned int  tid;                       /* スレッドの ID */
+    ste_uint64_t  frames;                    /* 処理したフレーム数 */
+    ste_uint64_t  cycles[STE_STAGE_MAX];     /* ステージ毎の消費サイクル */
+    ste_uint64_t  calls[STE_STAGE_MAX];      /* ステージ毎の呼び出し回数 */
+} ste_acct_t;
+
+extern ste_acct_t *ste_acct_self(void);
+extern void        ste_acct_print(FILE *);
+
+static __inline void
+ste_acct_add(int stage, ste_uint64_t cycles)
+{
+    ste_acct_t *acct = ste_acct_self();
+
+    acct->cycles[stage] += cycles;
+    acct->calls[stage]++;
+}
+
+/*
+ * 計測用のマクロ。STE_ACCT_VAR は変数の宣言になるので、宣言部に
+ * セミコロン無しで書くこと。
+ *   STE_ACCT_VAR(t)
+ *   ...
+ *   STE_ACCT_BEGIN(t);
+ *   n = recv(...);
+ *   STE_ACCT_END(STE_STAGE_SOCK_RECV, t);
+ */
+#define STE_ACCT_VAR(t)           ste_uint64_t t;
+#define STE_ACCT_BEGIN(t)         ((t) = STE_ACCT_NOW())
+#define STE_ACCT_END(stage, t)    ste_acct_add((stage), STE_ACCT_NOW() - (t))
+#define STE_ACCT_FRAME()          (ste_acct_self()->frames++)
+#define STE_ACCT_PRINT(fp)        ste_acct_print(fp)
+#else
+#define STE_ACCT_VAR(t)
+#define STE_ACCT_BEGIN(t)         ((void)0)
+#define STE_ACCT_END(stage, t)    ((void)0)
+#define STE_ACCT_FRAME()          ((void)0)
+#define STE_ACCT_PRINT(fp)        ((void)0)
+#endif /* #ifdef STE_STAGE_ACCT */
+
+/*
+ * 統計情報用の関数のプロトタイプ
+ */
+extern void     ste_stats_init(ste_connstat_t *);
+extern int      ste_stats_sample(int, int, ste_connstat_t *);
+extern void     ste_stats_print(FILE *, int, char *, ste_connstat_t *);
+
+#endif /* #ifndef __STED_STATS_H */
@@ -0,0 +1,210 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_trace.h
+ *
+ *  sted と stehub が共通で使うトレース（非同期バイナリログ）用の
+ *  ヘッダファイル。
+ *
+ *  データパス上のデバッグメッセージは print_err() で同期的に書き出すの
+ *  ではなく、フォーマット ID と引数だけをスレッド毎のリングバッファに
+ *  書き込む。フォーマットとログファイルへの書き出しは drain スレッドが
+ *  バックグラウンドで行う。
+ *************************************************/
+#ifndef __STED_TRACE_H
+#define __STED_TRACE_H
+
+/*
+ * 64bit 整数型。古い VC には stdint.h が無いのでここで定義する。
+ */
+#ifdef STE_WINDOWS
+typedef unsigned __int64    ste_uint64_t;
+#define STE_THREAD_LOCAL    __declspec(thread)
+#define STE_SNPRINTF        _snprintf
+#define STE_VSNPRINTF       _vsnprintf
+#else
+typedef unsigned long long  ste_uint64_t;
+#define STE_THREAD_LOCAL    __thread
+#define STE_SNPRINTF        snprintf
+#define STE_VSNPRINTF       vsnprintf
+#endif
+
+/*******************************************************
+ * o トレース用の各種パラメータ
+ *
+ *  STE_TRACE_RINGSIZE   スレッド毎のリングバッファのサイズ(2 のべき乗)
+ *  STE_TRACE_MAX_RINGS  登録可能なリングバッファ(スレッド)の最大数
+ *  STE_TRACE_RECALIGN   レコードの境界。リングバッファのサイズはこの倍数
+ *  STE_TRACE_MAX_BLOB   1 レコードに含められるダンプデータの最大長
+ *  STE_TRACE_DRAIN_MSEC drain スレッドがリングバッファを確認する間隔
+ *  STE_TRACE_OUTBUFSIZE drain スレッドがフォーマットに使うバッファのサイズ
+ *  STE_LOG_ROTATE_SIZE  ログファイルをローテートするサイズ
+ *  STE_LOG_GENERATIONS  ローテート後に残す古いログファイルの数
+ *  STE_LOG_PATH_MAX     ログファイルのパスの最大長
+ ********************************************************/
+#define  STE_TRACE_RINGSIZE       262144
+#define  STE_TRACE_MAX_RINGS      8
+#define  STE_TRACE_RECALIGN       32
+#define  STE_TRACE_MAX_BLOB       2048
+#define  STE_TRACE_DRAIN_MSEC     50
+#define  STE_TRACE_OUTBUFSIZE     65536
+#define  STE_LOG_ROTATE_SIZE      (10 * 1024 * 1024)
+#define  STE_LOG_GENERATIONS      3
+#define  STE_LOG_PATH_MAX         260
+
+/*
+ * ログの出力先
+ */
+#define  STE_LOG_DEST_STDOUT      0
+#define  STE_LOG_DEST_STDERR      1
+#define  STE_LOG_DEST_FILE        2
+#define  STE_LOG_DEST_SYSLOG      3
+
+/*
+ * トレースのカテゴリ。カテゴリ毎にサンプリングレートを設定できる。
+ * （-t オプションで "sock=100,dump=0" の様に指定する）
+ *
+ *  ste   仮想 NIC ドライバとの入出力
+ *  sock  HUB（もしくは sted）との socket 入出力
+ *  hub   仮想ハブの転送処理
+ *  dump  フレームの 16 進ダンプ
+ */
+#define  STE_TRC_CAT_STE          0
+#define  STE_TRC_CAT_SOCK         1
+#define  STE_TRC_CAT_HUB          2
+#define  STE_TRC_CAT_DUMP         3
+#define  STE_TRC_CAT_MAX          4
+
+/*
+ * トレースのフォーマット一覧。
+ * TRCFMT(フォーマット ID, カテゴリ, printf() のフォーマット)
+ * 引数は unsigned int で最大 4 つまで。%s は使えない。
+ */
+#define STE_TRACE_FORMATS \
+    TRCFMT(TRC_WRITE_STE_CALLED,   STE,  "write_ste called\n") \
+    TRCFMT(TRC_WRITE_STE_RETURNED, STE,  "write_ste returned\n") \
+    TRCFMT(TRC_WRITE_STE_WROTE,    STE,  "wite_ste: WriteFile Succeeded. Wrote %d bytes\n") \
+    TRCFMT(TRC_READ_STE_CALLED,    STE,  "read_ste called\n") \
+    TRCFMT(TRC_READ_STE_RETURNED,  STE,  "read_ste returned\n") \
+    TRCFMT(TRC_READ_STE_FALSE,     STE,  "read_ste: ReadFile returns with FALSE\n") \
+    TRCFMT(TRC_READ_STE_READ,      STE,  "read_ste: read %d bytes\n") \
+    TRCFMT(TRC_READ_STE_FROM,      STE,  "========= from ste %d bytes ==================\n") \
+    TRCFMT(TRC_READ_STE_AGG,       STE,  "read_ste: %d frames (%d bytes) in aggregate\n") \
+    TRCFMT(TRC_READ_STE_FLUSH,     STE,  "readsize = %d, sendbuflen = %d\n") \
+    TRCFMT(TRC_READ_STE_TOOBIG,    STE,  "read_ste: %d bytes frame exceeds mtu %d, dropped\n") \
+    TRCFMT(TRC_READ_SOCK_CALLED,   SOCK, "read_socket called\n") \
+    TRCFMT(TRC_READ_SOCK_RETURNED, SOCK, "read_socket returned\n") \
+    TRCFMT(TRC_READ_SOCK_AGAIN,    SOCK, "read_socket: recv errno=%d\n") \
+    TRCFMT(TRC_READ_SOCK_FROM,     SOCK, "========= from hub %d bytes ===================\n" \
+                                         "dataleft(needed to complete message)  = %d\n") \
+    TRCFMT(TRC_READ_SOCK_BROKEN,   SOCK, "read_socket: header is broken (orglen=%d, discarded %d bytes)\n") \
+    TRCFMT(TRC_READ_SOCK_MSG,      SOCK, "read_socket: message type=%d len=%d (%d bytes of unread data)\n") \
+    TRCFMT(TRC_READ_SOCK_AGG,      SOCK, "read_socket: aggregate message with %d frames\n") \
+    TRCFMT(TRC_READ_SOCK_LZERR,    SOCK, "read_socket: cannot decompress message (len=%d, broken=%d)\n") \
+    TRCFMT(TRC_READ_SOCK_AUTHERR,  SOCK, "read_socket: message type=%d len=%d failed authentication\n") \
+    TRCFMT(TRC_READ_SOCK_NEEDMORE, SOCK, "Need more %d bytes to complete a message.\n") \
+    TRCFMT(TRC_WRITE_SOCK_CALLED,  SOCK, "write_socket called\n") \
+    TRCFMT(TRC_WRITE_SOCK_RETURNED,SOCK, "write_socket returned\n") \
+    TRCFMT(TRC_WRITE_SOCK_EMPTY,   SOCK, "sendbuflen == 0\n") \
+    TRCFMT(TRC_WRITE_SOCK_AGAIN,   SOCK, "write_socket: send errno=%d\n") \
+    TRCFMT(TRC_HUB_FORWARD,        HUB,  "fd%d ==> fd%d (%d bytes)\n") \
+    TRCFMT(TRC_HUB_RECV_AGAIN,     HUB,  "fd%d: recv: errno=%d\n") \
+    TRCFMT(TRC_HUB_SEND_AGAIN,     HUB,  "fd%d: send: errno=%d (%d bytes pending)\n") \
+    TRCFMT(TRC_HUB_QFULL,          HUB,  "fd%d: egress queue is full (%d bytes queued, %d bytes dropped)\n") \
+    TRCFMT(TRC_HUB_BROKEN,         HUB,  "fd%d: header is broken (orglen=%d, discarded %d bytes)\n") \
+    TRCFMT(TRC_HUB_TOOBIG,         HUB,  "fd%d: %d bytes frame exceeds mtu %d, dropped\n") \
+    TRCFMT(TRC_HUB_LZERR,          HUB,  "fd%d: cannot decompress message (len=%d, broken=%d)\n") \
+    TRCFMT(TRC_HUB_AUTHERR,        HUB,  "fd%d: message type=%d len=%d failed authentication\n") \
+    TRCFMT(TRC_DUMP,               DUMP, "")
+
+#define TRCFMT(id, cat, fmt) id,
+enum ste_trace_id {
+    TRC_NONE = 0,       /* リングバッファ末尾の詰め物 */
+    STE_TRACE_FORMATS
+    TRC_MAX
+};
+#undef TRCFMT
+
+/*
+ * リングバッファに書き込まれるレコードのヘッダ。
+ * ダンプ用のレコードでは args の後ろにダンプデータが続く。
+ */
+typedef struct ste_trace_rec
+{
+    unsigned short  id;       /* フォーマット ID (TRC_XXX) */
+    unsigned short  reclen;   /* ヘッダを含むレコード長(STE_TRACE_RECALIGN の倍数) */
+    unsigned short  bloblen;  /* args の後ろに続くダンプデータの長さ */
+    unsigned short  reserved;
+    ste_uint64_t    usec;     /* 記録した時刻(usec) */
+    unsigned int    args[4];  /* フォーマットに渡す引数 */
+} ste_trace_rec_t;
+
+/*
+ * スレッド毎のリングバッファ。書き込むスレッドと drain スレッドの 1 対 1
+ * でしか使わないので、ロックは使わない。head, tail は単調増加させ、
+ * リングバッファのサイズでマスクして使う。
+ */
+typedef struct ste_trace_ring
+{
+    volatile unsigned int head;        /* 書き込み位置(書き込むスレッドだけが更新) */
+    volatile unsigned int tail;        /* 読み込み位置(drain スレッドだけが更新)   */
+    volatile unsigned int dropped;     /* 空きが無く捨てたレコード数 */
+    unsigned int          reported;    /* drain スレッドが報告済みの dropped */
+    unsigned int          tid;         /* 書き込むスレッドの ID */
+    unsigned int          sample_cnt[STE_TRC_CAT_MAX]; /* カテゴリ毎のサンプリング用カウンタ */
+    unsigned char         buf[STE_TRACE_RINGSIZE];
+} ste_trace_ring_t;
+
+/*
+ * トレースを記録するマクロ。ste.sys の DEBUG_PRINTn と同じように使う。
+ * debuglevel が level 以上の場合だけ記録する。
+ */
+#define STE_TRACE0(level, id) \
+    ((debuglevel >= (level)) ? ste_trace_write(id, 0, 0, 0, 0) : (void)0)
+#define STE_TRACE1(level, id, a0) \
+    ((debuglevel >= (level)) ? ste_trace_write(id, (unsigned int)(a0), 0, 0, 0) : (void)0)
+#define STE_TRACE2(level, id, a0, a1) \
+    ((debuglevel >= (level)) ? ste_trace_write(id, (unsigned int)(a0), (unsigned int)(a1), 0, 0) : (void)0)
+#define STE_TRACE3(level, id, a0, a1, a2) \
+    ((debuglevel >= (level)) ? ste_trace_write(id, (unsigned int)(a0), (unsigned int)(a1), (unsigned int)(a2), 0) : (void)0)
+#define STE_TRACE4(level, id, a0, a1, a2, a3) \
+    ((debuglevel >= (level)) ? ste_trace_write(id, (unsigned int)(a0), (unsigned int)(a1), (unsigned int)(a2), (unsigned int)(a3)) : (void)0)
+#define STE_TRACE_DUMP(level, data, len) \
+    ((debuglevel >= (level)) ? ste_trace_dump((unsigned char *)(data), (len)) : (void)0)
+
+extern int   debuglevel;
+
+extern int           ste_trace_init(void);
+extern void          ste_trace_fini(void);
+extern int           ste_trace_set_sample(char *);
+extern void          ste_trace_write(int, unsigned int, unsigned int, unsigned int, unsigned int);
+extern void          ste_trace_dump(unsigned char *, int);
+extern ste_uint64_t  ste_time_usec(void);
+extern int           ste_log_open(char *, int);
+extern void          ste_log_setdest(int);
+extern void          ste_log_write(int, char *, int);
+
+#endif /* #ifndef __STED_TRACE_H */
@@ -0,0 +1,82 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_tune.h
+ *
+ *  sted と stehub が HUB との TCP の接続の socket バッファを帯域と RTT に
+ *  合わせて調整する（トランスポートのチューニング）ためのヘッダファイル。
+ *  stehub からも ..\sted\sted_tune.c としてコンパイルされる。
+ *
+ *  以前はどちらも OS のデフォルトのままだった。
+ *  o 自分で STE_MSG_AGG にまとめて送っているのに Nagle が効いていて、
+ *    write_socket() の小さな送信が ACK を待たされていた。
+ *  o RTT が大きい拠点では socket バッファが BDP（帯域 x RTT）に足りず、
+ *    ウィンドウで速度が頭打ちになっていた。
+ *  o LAN の拠点では逆に socket バッファに送信待ちのデータが溜まり、
+ *    その分だけ遅延が増えていた（bufferbloat）。
+ *
+ *  o 接続したら TCP_NODELAY を設定する。stehub は送りきれなかった分を
+ *    自分の送信キューに残せるので、TCP_NOTSENT_LOWAT も設定して socket
+ *    の中の未送信のデータを抑える（設定できる OS だけ）。
+ *  o STE_STATS_INTERVAL 秒毎の ste_stats_sample() の後に ste_tune_update()
+ *    を呼び、delivery rate と RTT から求めた BDP の STE_TUNE_GAIN 倍に
+ *    SO_SNDBUF を合わせる。送信をあきらめた（odrops が増えた）か ACK 待ち
+ *    が SO_SNDBUF に近ければ、ウィンドウで頭打ちになっているとみなして
+ *    2 倍にする。小さくする場合は 1 回に半分まで。
+ *  o SO_RCVBUF は受信の速度から求めた BDP に足りなければ大きくする
+ *    （小さくはしない。OS の自動調整より小さくしないため）。
+ *  o Windows では SIO_IDEAL_SEND_BACKLOG_QUERY（ISB）が返す値より
+ *    SO_SNDBUF を小さくしない。
+ *  o 選んだ値は統計情報（ste_connstat_t の sndbuf, rcvbuf, lowat, bdp）に
+ *    入れて、統計ファイルに書き出す。
+ *************************************************/
+#ifndef __STED_TUNE_H
+#define __STED_TUNE_H
+
+/*******************************************************
+ * o トランスポートのチューニング用の各種パラメータ
+ *
+ *  STE_TUNE_GAIN         SO_SNDBUF, SO_RCVBUF を BDP の何倍にするか
+ *  STE_TUNE_BUF_MIN      SO_SNDBUF, SO_RCVBUF の下限(bytes)
+ *  STE_TUNE_BUF_MAX      SO_SNDBUF, SO_RCVBUF の上限(bytes)
+ *  STE_TUNE_LOWAT_MIN    TCP_NOTSENT_LOWAT の下限(bytes)
+ *  STE_TUNE_LOWAT_MAX    TCP_NOTSENT_LOWAT の上限(bytes)
+ *  STE_TUNE_HYST_PCT     今の値とこれ(%)以上違う場合だけ設定し直す
+ ********************************************************/
+#define  STE_TUNE_GAIN            2
+#define  STE_TUNE_BUF_MIN         65536
+#define  STE_TUNE_BUF_MAX         16777216
+#define  STE_TUNE_LOWAT_MIN       16384
+#define  STE_TUNE_LOWAT_MAX       1048576
+#define  STE_TUNE_HYST_PCT        25
+
+/*
+ * トランスポートのチューニング用の関数のプロトタイプ
+ */
+extern void  ste_tune_open(int, int, ste_connstat_t *);
+extern void  ste_tune_update(int, ste_connstat_t *);
+
+#endif /* #ifndef __STED_TUNE_H */
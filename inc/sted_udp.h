@@ -0,0 +1,113 @@
+﻿/*
+ * Copyright (C) 2004-2010 Kazuyoshi Aizawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*************************************************
+ *  sted_udp.h
+ *
+ *  sted と stehub の間の UDP トランスポート用のヘッダファイル。
+ *
+ *  TCP の上で TCP を運ぶと、外側の TCP の再送で中の全てのフローが止まる
+ *  （head-of-line blocking）うえ、双方の再送タイマーが干渉して遅延が
+ *  一気に悪化する。UDP トランスポートではデータグラムが 1 つ失われても
+ *  そこに入っていたフレームが失われるだけで、中の TCP が自分で再送する。
+ *
+ *  データグラムの形式
+ *     +---------+----------+----------+-----+
+ *     | conn id | メッセージ | メッセージ | ... |
+ *     +---------+----------+----------+-----+
+ *         4
+ *   conn id  : sted が接続毎に乱数で選ぶ接続 ID（ネットワークバイトオーダー）。
+ *              stehub は送信元のアドレスではなく conn id でセッションを
+ *              探すので、NAT のマッピングが変わっても（NAT rebinding）
+ *              セッションはそのまま続く
+ *   メッセージ : TCP の場合と同じ（sted_proto.h 参照）。メッセージは
+ *              データグラムをまたがない。メッセージの無いデータグラムは
+ *              NAT のマッピングを保つためのキープアライブ
+ *
+ *  o sted は -u を指定した場合に UDP で STE_MSG_HELLO を送る。返事が無ければ
+ *    STE_UDP_HELLO_TRIES 回再送した後、TCP に切り替える（プロキシ経由の
+ *    場合は常に TCP）。
+ *  o UDP ではメッセージが失われたり順番が入れ替わったりするので、LZ4 の
+ *    圧縮（STE_CAP_LZ4）は合意しない。ヘッダ圧縮は取りこぼしに対応して
+ *    いるのでそのまま使える。
+ *  o STE_CAP_FEC を合意していれば、conn id の後に FEC のヘッダを付けて
+ *    送る（sted_fec.h 参照）。
+ *  o struct sockaddr_in を使うので sted.h からは include しない。
+ *  o stehub は TCP と同じポート番号で UDP も待ち受け、Linux では
+ *    recvmmsg()/sendmmsg() で 1 回のシステムコールで複数のデータグラムを
+ *    送受信する。
+ *************************************************/
+#ifndef __STED_UDP_H
+#define __STED_UDP_H
+
+/*******************************************************
+ * o UDP トランスポート用の各種パラメータ
+ *
+ *  STE_UDP_HDRSIZE        データグラムの先頭（conn id）のサイズ
+ *  STE_UDP_PAYLOAD        1 データグラムにまとめるフレームデータの上限。
+ *                         ヘッダと STE_MSG_SEAL の分を足しても 1500 byte の
+ *                         経路で IP フラグメントされない大きさ。これより
+ *                         大きいフレームは 1 つだけで送る（フラグメントされる）
+ *  STE_UDP_DGRAM_MAX      データグラムの最大長
+ *  STE_UDP_BATCH          recvmmsg()/sendmmsg() 1 回で扱うデータグラム数
+ *  STE_UDP_QMAX           stehub のセッション毎に溜めておけるデータグラム数
+ *  STE_UDP_HELLO_USEC     sted が STE_MSG_HELLO を再送する間隔(usec)
+ *  STE_UDP_HELLO_TRIES    返事が無いまま STE_MSG_HELLO を送る回数
+ *  STE_UDP_KEEPALIVE_SEC  sted が何も送らなかった場合にキープアライブを送る間隔(秒)
+ *  STE_UDP_IDLE_SEC       stehub が何も受信しないセッションを捨てるまでの時間(秒)
+ ********************************************************/
+#define  STE_UDP_HDRSIZE          4
+#define  STE_UDP_PAYLOAD          1280
+#define  STE_UDP_DGRAM_MAX        (STE_UDP_HDRSIZE + sizeof(stehead2_t) + STE_MSG_MAX)
+#define  STE_UDP_BATCH            32
+#define  STE_UDP_QMAX             64
+#define  STE_UDP_HELLO_USEC       1000000
+#define  STE_UDP_HELLO_TRIES      3
+#define  STE_UDP_KEEPALIVE_SEC    20
+#define  STE_UDP_IDLE_SEC         120
+
+/* ネットワークバイトオーダーの 32bit 値（conn id や stehead.orglen）を読む */
+#define  STE_UDP_GET32(p)         (((unsigned int)(p)[0] << 24) | ((unsigned int)(p)[1] << 16) | \
+                                   ((unsigned int)(p)[2] << 8) | (unsigned int)(p)[3])
+
+/*
+ * まとめて送受信するデータグラムの表。buf はデータグラムの先頭、len は
+ * その長さ、addr は送信先（受信した場合は送信元）。
+ */
+typedef struct ste_udp_vec
+{
+    unsigned char      *buf[STE_UDP_BATCH];
+    int                 len[STE_UDP_BATCH];
+    struct sockaddr_in  addr[STE_UDP_BATCH];
+} ste_udp_vec_t;
+
+/*
+ * UDP トランスポート用の関数のプロトタイプ
+ */
+extern void  ste_udp_put_connid(unsigned char *, unsigned int);
+extern int   ste_udp_recv(int, ste_udp_vec_t *, int);
+extern int   ste_udp_send(int, ste_udp_vec_t *, int);
+
+#endif /* #ifndef __STED_UDP_H */
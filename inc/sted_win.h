@@ -32,6 +32,7 @@
 #define __STED_WIN_H
 
 #define STED_LOG_FILE     "C:\\sted.log" // Ot@C
+#define STED_STAT_FILE    "C:\\sted.stat" // vt@C
 
 /*
  *  syslog p header t@C include 
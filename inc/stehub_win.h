@@ -47,13 +47,14 @@ DWORD WINAPI stehub_svc_ctrl_handler(DWORD ,DWORD,LPVOID, LPVOID);
 BOOL stehub_delete_svc();
 BOOL stehub_install_svc();
 
-HANDLE  hStedLog;          /* fobOOp̃t@Cnh */
 SERVICE_STATUS            stehubServiceStatus;
 SERVICE_STATUS_HANDLE     stehubServiceStatusHandle;
 BOOL isTerminal;    // R\[NꂽǂH
 GUID InterfaceGuid; // = GUID_NDIS_LAN_CLASS;
 
 #define STEHUB_LOG_FILE   "C:\\stehub.log" /* Ot@C */
+#define STEHUB_STAT_FILE  "C:\\stehub.stat" /* vt@C */
+#define STEHUB_FLIGHT_FILE "C:\\stehub.flight" /* tCgR[_[̏o͐ */
 
 
 /*
@@ -250,9 +250,10 @@ SteMiniportInitialize(
         Adapter->MiniportAdapterHandle = MiniportAdapterHandle;
 
         //
-        // Registory を読む処理。...省略。
-        //    NdisOpenConfiguration();
-        //    NdisReadConfiguration();
+        // Registory を読み、最大フレームサイズなどの設定を得る。
+        //
+        SteReadConfiguration(Adapter, WrapperConfigurationContext);
+
         //
         // NIC のためのハードウェアリソースのリストを得る。...省略。
         //    NdisMQueryAdapterResources()
@@ -399,7 +400,7 @@ SteMiniportQueryInformation(
             
         case OID_GEN_MAXIMUM_LOOKAHEAD:     // NIC が lookahead データとして提供できる最大バイト数
         case OID_GEN_MAXIMUM_FRAME_SIZE:    // NIC がサポートする、ヘッダを抜いたネットワークパケットサイズ
-            SET_INFORMATION_BY_VALUE(sizeof(ULONG), ETHERMTU);
+            SET_INFORMATION_BY_VALUE(sizeof(ULONG), Adapter->MaxFrameSize - ETHERHEADER);
             
         case OID_GEN_LINK_SPEED:            //NIC がサポートする最大スピード
             SET_INFORMATION_BY_VALUE(sizeof(ULONG), ETHERLINKSPEED);
@@ -413,10 +414,10 @@ SteMiniportQueryInformation(
             SET_INFORMATION_BY_VALUE(sizeof(ULONG), ETHERMTU);            
             
         case OID_GEN_TRANSMIT_BLOCK_SIZE:   // NIC がサポートする送信用のネットワークパケットサイズ
-            SET_INFORMATION_BY_VALUE(sizeof(ULONG), ETHERMAX);                        
+            SET_INFORMATION_BY_VALUE(sizeof(ULONG), Adapter->MaxFrameSize);                        
 
         case OID_GEN_RECEIVE_BLOCK_SIZE:    // NIC がサポートする受信用のネットワークパケットサイズ
-            SET_INFORMATION_BY_VALUE(sizeof(ULONG), ETHERMAX);                                    
+            SET_INFORMATION_BY_VALUE(sizeof(ULONG), Adapter->MaxFrameSize);                                    
 
         case OID_GEN_VENDOR_ID:             // IEEE に登録してあるベンダーコード
             SET_INFORMATION_BY_VALUE(sizeof(ULONG), 0xFFFFFF);            
@@ -431,13 +432,13 @@ SteMiniportQueryInformation(
             SET_INFORMATION_BY_VALUE(sizeof(ULONG), Adapter->PacketFilter);
             
         case OID_GEN_CURRENT_LOOKAHEAD:     // 現在の lookahead のバイト数
-            SET_INFORMATION_BY_VALUE(sizeof(ULONG), ETHERMTU);
+            SET_INFORMATION_BY_VALUE(sizeof(ULONG), Adapter->MaxFrameSize - ETHERHEADER);
             
         case OID_GEN_DRIVER_VERSION:        // NDIS のバージョン
             SET_INFORMATION_BY_VALUE(sizeof(USHORT), STE_NDIS_VERSION);
             
         case OID_GEN_MAXIMUM_TOTAL_SIZE:    // NIC がサポートするネットワークパケットサイズ
-            SET_INFORMATION_BY_VALUE(sizeof(ULONG), ETHERMAX);
+            SET_INFORMATION_BY_VALUE(sizeof(ULONG), Adapter->MaxFrameSize);
             
        // case OID_GEN_PROTOCOL_OPTIONS:      // オプションのプロトコルフラグ。Set のみ必須
                     
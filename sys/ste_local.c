@@ -31,6 +31,8 @@
  *  ύX:
  *    2006/05/05
  *      o MAC AhXhCo[̃CXg[ɓIɐ悤ɂB
+ *      o őt[TCYWXg MaxFrameSize ŕς悤ɂB
+ *        W{t[(STE_FRAMESIZE_MAX ܂)ɑΉB
  *
  *****************************************************************************/
 #include "ste.h"
@@ -125,6 +127,9 @@ SteCreateAdapter(
         NdisAllocateSpinLock(&Adapter->SendSpinLock);
         NdisAllocateSpinLock(&Adapter->RecvSpinLock);                        
 
+        // őt[TCY̏lBSteReadConfiguration() ŕύXB
+        Adapter->MaxFrameSize = ETHERMAX;
+
         // pPbgtB^[̏lZbg
         // svȂ悤ȋCB
         Adapter->PacketFilter |=
@@ -182,6 +187,67 @@ SteCreateAdapter(
     return(Status);
 }
 
+/****************************************************************************
+ * SteReadConfiguration()
+ * 
+ *   WXgA_v^[̐ݒǂށB
+ *   ̂Ƃǂނ̂ MaxFrameSizeiwb_݂̍őt[TCYjB
+ *   ͈͊Ȍꍇ ETHERMAX ̂܂܂ɂB
+ *
+ * :
+ *
+ *    Adapter                     : STE_ADAPTER \
+ *    WrapperConfigurationContext : SteMiniportInitialize() ɓnꂽnh
+ *
+ * ߂l:
+ *
+ *    
+ *
+***************************************************************************/
+VOID
+SteReadConfiguration(
+    IN  STE_ADAPTER      *Adapter,
+    IN  NDIS_HANDLE       WrapperConfigurationContext
+    )
+{
+    NDIS_STATUS                      Status;
+    NDIS_HANDLE                      ConfigHandle;
+    PNDIS_CONFIGURATION_PARAMETER    Param;
+    NDIS_STRING                      MaxFrameSizeKey = NDIS_STRING_CONST("MaxFrameSize");
+
+    DEBUG_PRINT0(3, "SteReadConfiguration called\n");
+
+    NdisOpenConfiguration(
+        &Status,                       //OUT PNDIS_STATUS
+        &ConfigHandle,                 //OUT PNDIS_HANDLE
+        WrapperConfigurationContext    //IN NDIS_HANDLE
+        );
+    if (Status != NDIS_STATUS_SUCCESS){
+        DEBUG_PRINT1(2, "SteReadConfiguration: NdisOpenConfiguration Failed (0x%x)\n", Status);
+        return;
+    }
+
+    NdisReadConfiguration(
+        &Status,                       //OUT PNDIS_STATUS
+        &Param,                        //OUT PNDIS_CONFIGURATION_PARAMETER *
+        ConfigHandle,                  //IN NDIS_HANDLE
+        &MaxFrameSizeKey,              //IN PNDIS_STRING
+        NdisParameterInteger           //IN NDIS_PARAMETER_TYPE
+        );
+    if (Status == NDIS_STATUS_SUCCESS){
+        if (Param->ParameterData.IntegerData >= ETHERMAX &&
+            Param->ParameterData.IntegerData <= STE_FRAMESIZE_MAX){
+            Adapter->MaxFrameSize = Param->ParameterData.IntegerData;
+        } else {
+            DEBUG_PRINT1(1, "SteReadConfiguration: MaxFrameSize(%d) is out of range\n",
+                            Param->ParameterData.IntegerData);
+        }
+    }
+    DEBUG_PRINT1(3, "SteReadConfiguration: MaxFrameSize = %d\n", Adapter->MaxFrameSize);
+
+    NdisCloseConfiguration(ConfigHandle);
+}
+
 /****************************************************************************
  * SteDeleteAdapter()
  * 
@@ -570,7 +636,7 @@ SteDispatchRead(
             StePrintPacket(Packet);                
         
         // f[^ Irp ɃRs[
-        Status = SteCopyPacketToIrp(Packet, Irp);
+        Status = SteCopyPacketToIrp(Adapter, Packet, Irp);
         if(Status != NDIS_STATUS_SUCCESS){
             DEBUG_PRINT0(1, "SteDispatchRead: SteCopyPacketToIrp failed\n");  
             break;
@@ -739,9 +805,9 @@ SteDispatchWrite(
             NormalPagePriority    //IN MM_PAGE_PRIORITY
             );
 
-        // NdisBuffer ɂ ETHERMAX(1514bytes)ȏ̓Rs[łȂ
-        if ( IrpRecvBufferLen > ETHERMAX){
-            IrpRecvBufferLen = ETHERMAX;
+        // NdisBuffer ɂ MaxFrameSize ȏ̓Rs[łȂ
+        if ( IrpRecvBufferLen > Adapter->MaxFrameSize){
+            IrpRecvBufferLen = Adapter->MaxFrameSize;
         }
 
         //
@@ -836,6 +902,7 @@ SteDispatchIoctl(
     STE_ADAPTER         *Adapter  = NULL; // Packet ̑Ms Adapter     
     IO_STACK_LOCATION   *irpStack = NULL;
     HANDLE               hEvent;          // sted.exe nCxgnh
+    ULONG_PTR            Information = 0; // sted.exe ɕԂf[^̃TCY
 
     DEBUG_PRINT0(3, "SteDispatchIoctl called\n");
         
@@ -926,6 +993,19 @@ SteDispatchIoctl(
                 }
                 NdisReleaseSpinLock(&Adapter->AdapterSpinLock);                
                 break;
+            //
+            // őt[TCYԂBMETHOD_BUFFERED Ȃ̂ SystemBuffer ɏB
+            //
+            case GETFRAMESIZE:
+                DEBUG_PRINT0(3, "SteDispatchIoctl: Received GETFRAMESIZE IOCTL\n");
+                if(irpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(ULONG) ||
+                   Irp->AssociatedIrp.SystemBuffer == NULL){
+                    Status = NDIS_STATUS_FAILURE;
+                    break;
+                }
+                *(ULONG *)Irp->AssociatedIrp.SystemBuffer = Adapter->MaxFrameSize;
+                Information = sizeof(ULONG);
+                break;
             default:
                 DEBUG_PRINT1(3, "SteDispatchIoctl: Received Unknown(0x%x)IOCTL\n",
                                 irpStack->Parameters.DeviceIoControl.IoControlCode);             
@@ -937,8 +1017,9 @@ SteDispatchIoctl(
     if(Status != NDIS_STATUS_SUCCESS){
         // G[̏ꍇ
         NtStatus = STATUS_UNSUCCESSFUL;
+        Information = 0;
     }    
-    Irp->IoStatus.Information = 0;    
+    Irp->IoStatus.Information = Information;    
     Irp->IoStatus.Status = NtStatus; 
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
     
@@ -1040,21 +1121,21 @@ SteAllocateRecvPacket(
         if (Status != NDIS_STATUS_SUCCESS)
             break;
 
-        NDIS_SET_PACKET_HEADER_SIZE(*pPacket, ETHERMAX-ETHERMTU);        
+        NDIS_SET_PACKET_HEADER_SIZE(*pPacket, ETHERHEADER);        
         
         //
         // Ethernet t[̊i[pm
         //
         Status = NdisAllocateMemoryWithTag(
             (PVOID)&VirtualAddress,   //OUT PVOID  *
-            ETHERMAX,                 //IN UINT    
+            Adapter->MaxFrameSize,    //IN UINT    
             (ULONG)'AlcE'             //IN ULONG   
             );
         if (Status != NDIS_STATUS_SUCCESS){
             NdisFreePacket(*pPacket);
             break;
         }
-        NdisZeroMemory(VirtualAddress, ETHERMAX);
+        NdisZeroMemory(VirtualAddress, Adapter->MaxFrameSize);
 
         // obt@[v[Aobt@[o
         NdisAllocateBuffer(
@@ -1062,11 +1143,11 @@ SteAllocateRecvPacket(
             &Buffer,                      //OUT PNDIS_BUFFER
             Adapter->RxBufferPoolHandle,  //IN NDIS_HANDLE
             VirtualAddress,               //IN PVOID
-            ETHERMAX                      //IN UINT
+            Adapter->MaxFrameSize         //IN UINT
             );
         if (Status != NDIS_STATUS_SUCCESS){
             NdisFreePacket(*pPacket);
-            NdisFreeMemory(VirtualAddress, ETHERMAX, 0);
+            NdisFreeMemory(VirtualAddress, Adapter->MaxFrameSize, 0);
             break;
         }
         //
@@ -1123,7 +1204,7 @@ SteFreeRecvPacket(
         );
         
     // Ethernet t[̊i[pJ
-    NdisFreeMemory(VirtualAddress, ETHERMAX, 0);
+    NdisFreeMemory(VirtualAddress, Adapter->MaxFrameSize, 0);
         
     // obt@[v[Ƀobt@[߂
     NdisFreeBuffer(Buffer);
@@ -1397,6 +1478,7 @@ SteFindAdapterByDeviceObject(
  *        
  * :
  *
+ *     Adapter   : STE_ADAPTER \̂̃|C^
  *     Packet    : pPbg
  *     Irp       : z NIC f[󂯎 IRP
  *
@@ -1407,6 +1489,7 @@ SteFindAdapterByDeviceObject(
  ********************************************************************/
 NDIS_STATUS
 SteCopyPacketToIrp(    
+    IN     STE_ADAPTER  *Adapter,
     IN     NDIS_PACKET  *Packet,
     IN OUT PIRP          Irp
     )
@@ -1455,9 +1538,9 @@ SteCopyPacketToIrp(
         &TotalPacketLength   //OUT PUINT OPTIONAL        
         );
 
-    if( TotalPacketLength > ETHERMAX){
-        // 傫BW{t[H
-        DEBUG_PRINT0(1, "SteCopyPacketToIrp: Packet size too BIG > ETHERMAX\n");
+    if( TotalPacketLength > Adapter->MaxFrameSize){
+        // 傫BMaxFrameSize 𒴂W{t[H
+        DEBUG_PRINT0(1, "SteCopyPacketToIrp: Packet size too BIG > MaxFrameSize\n");
         Status = NDIS_STATUS_FAILURE;
         Irp->IoStatus.Information  = 0;        
         return(Status);
@@ -1473,7 +1556,7 @@ SteCopyPacketToIrp(
 
         //
         // c IRP obt@[ʂ`FbNB
-        // z NIC f[ ReadFile() ɂ ETHERMAX ̃obt@[TCY
+        // z NIC f[ ReadFile() ɂ MaxFrameSize ̃obt@[TCY
         // w肵Ăꍇ́AIRP ̃obt@[ȂȂ\B
         //
         if (Length > IrpBufferLeft){